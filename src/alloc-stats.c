@@ -0,0 +1,133 @@
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc-stats.h"
+
+static const char *tag_names[ALLOC_TAGS] = {
+		[ALLOC_GAMES] = "games",
+		[ALLOC_LEGALITY] = "legality",
+		[ALLOC_PLYS] = "plys",
+		[ALLOC_CHANNELS] = "channels",
+		[ALLOC_SCANNERS] = "scanners",
+		[ALLOC_UCI] = "uci"
+};
+
+/* Updated with atomic adds rather than a lock: the legality checks
+ * allocate from several threads for every move they try */
+static alloc_counters counters[ALLOC_TAGS];
+
+/* Only ever switched on at startup, before anything is allocated, so that
+ * every tracked free matches a tracked allocation */
+static bool enabled = false;
+
+void alloc_stats_enable(void) {
+	enabled = true;
+}
+
+bool alloc_stats_enabled(void) {
+	return enabled;
+}
+
+static void count_alloc(alloc_tag tag, void *ptr) {
+	alloc_counters *c = &counters[tag];
+	long long size = (long long) malloc_usable_size(ptr);
+	__sync_fetch_and_add(&c->allocs, 1);
+	__sync_fetch_and_add(&c->bytes, size);
+	long long live = __sync_add_and_fetch(&c->live, size);
+	long long peak = c->peak;
+	while (live > peak) {
+		long long seen = __sync_val_compare_and_swap(&c->peak, peak, live);
+		if (seen == peak) {
+			break;
+		}
+		peak = seen;
+	}
+}
+
+static void count_free(alloc_tag tag, void *ptr) {
+	alloc_counters *c = &counters[tag];
+	__sync_fetch_and_add(&c->frees, 1);
+	__sync_fetch_and_sub(&c->live, (long long) malloc_usable_size(ptr));
+}
+
+void *tracked_malloc(alloc_tag tag, size_t size) {
+	void *ptr = malloc(size);
+	if (enabled && ptr != NULL) {
+		count_alloc(tag, ptr);
+	}
+	return ptr;
+}
+
+void *tracked_calloc(alloc_tag tag, size_t n, size_t size) {
+	void *ptr = calloc(n, size);
+	if (enabled && ptr != NULL) {
+		count_alloc(tag, ptr);
+	}
+	return ptr;
+}
+
+/* Counted as a free of the old block and an allocation of the new one */
+void *tracked_realloc(alloc_tag tag, void *ptr, size_t size) {
+	if (!enabled) {
+		return realloc(ptr, size);
+	}
+	size_t old_size = ptr != NULL ? malloc_usable_size(ptr) : 0;
+	void *new_ptr = realloc(ptr, size);
+	if (new_ptr == NULL) {
+		return NULL;
+	}
+	alloc_counters *c = &counters[tag];
+	if (ptr != NULL) {
+		__sync_fetch_and_add(&c->frees, 1);
+		__sync_fetch_and_sub(&c->live, (long long) old_size);
+	}
+	count_alloc(tag, new_ptr);
+	return new_ptr;
+}
+
+char *tracked_strdup(alloc_tag tag, const char *s) {
+	size_t len = strlen(s) + 1;
+	char *copy = tracked_malloc(tag, len);
+	if (copy != NULL) {
+		memcpy(copy, s, len);
+	}
+	return copy;
+}
+
+void tracked_free(alloc_tag tag, void *ptr) {
+	if (enabled && ptr != NULL) {
+		count_free(tag, ptr);
+	}
+	free(ptr);
+}
+
+/* Counters are read one by one, a snapshot taken while other threads
+ * allocate can be off by the allocations in flight */
+void alloc_stats_snapshot(alloc_counters snapshot[ALLOC_TAGS]) {
+	for (int i = 0; i < ALLOC_TAGS; i++) {
+		alloc_counters *c = &counters[i];
+		snapshot[i].allocs = __sync_fetch_and_add(&c->allocs, 0);
+		snapshot[i].frees = __sync_fetch_and_add(&c->frees, 0);
+		snapshot[i].bytes = __sync_fetch_and_add(&c->bytes, 0);
+		snapshot[i].live = __sync_fetch_and_add(&c->live, 0);
+		snapshot[i].peak = __sync_fetch_and_add(&c->peak, 0);
+	}
+}
+
+void alloc_stats_report(FILE *out) {
+	if (!enabled) {
+		fprintf(out, "Allocation tracking is off, start with -allocstats\n");
+		return;
+	}
+	alloc_counters snapshot[ALLOC_TAGS];
+	alloc_stats_snapshot(snapshot);
+
+	fprintf(out, "Allocations:\n");
+	fprintf(out, "%-10s %12s %12s %14s %12s %12s\n", "subsystem", "allocs", "frees", "bytes", "live", "peak");
+	for (int i = 0; i < ALLOC_TAGS; i++) {
+		fprintf(out, "%-10s %12lu %12lu %14llu %12lld %12lld\n", tag_names[i], snapshot[i].allocs,
+		        snapshot[i].frees, snapshot[i].bytes, snapshot[i].live, snapshot[i].peak);
+	}
+	fflush(out);
+}
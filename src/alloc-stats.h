@@ -0,0 +1,40 @@
+#ifndef CAIRO_BOARD_ALLOC_STATS_H
+#define CAIRO_BOARD_ALLOC_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Who allocates. Unlike the memory budget this counts every allocation
+ * made through the tracked_*() wrappers, short lived ones included */
+typedef enum {
+	ALLOC_GAMES = 0,  // games replayed or played, moves list strings
+	ALLOC_LEGALITY,   // transient game clones of the legality checks
+	ALLOC_PLYS,       // moves list plys
+	ALLOC_CHANNELS,   // channel tabs, messages and commands
+	ALLOC_SCANNERS,   // flex scanner buffers and states
+	ALLOC_UCI,        // engines and best line conversions
+	ALLOC_TAGS
+} alloc_tag;
+
+typedef struct {
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long long bytes; // allocated since the start, never decreases
+	long long live;
+	long long peak;
+} alloc_counters;
+
+void alloc_stats_enable(void);
+bool alloc_stats_enabled(void);
+
+void *tracked_malloc(alloc_tag tag, size_t size);
+void *tracked_calloc(alloc_tag tag, size_t n, size_t size);
+void *tracked_realloc(alloc_tag tag, void *ptr, size_t size);
+char *tracked_strdup(alloc_tag tag, const char *s);
+void tracked_free(alloc_tag tag, void *ptr);
+
+void alloc_stats_snapshot(alloc_counters counters[ALLOC_TAGS]);
+void alloc_stats_report(FILE *out);
+
+#endif //CAIRO_BOARD_ALLOC_STATS_H
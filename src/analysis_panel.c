@@ -1,12 +1,43 @@
 #include <gtk/gtk.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
 
 #include "analysis_panel.h"
 
-static GtkWidget* score_label;
-static GtkWidget* line_label;
-static GtkWidget* depth_label;
-static GtkWidget* nps_label;
-static GtkWidget* engine_name_label;
+enum {
+	DIRTY_SCORE = 1 << 0,
+	DIRTY_LINE = 1 << 1,
+	DIRTY_DEPTH = 1 << 2,
+	DIRTY_NPS = 1 << 3,
+	DIRTY_ENGINE_NAME = 1 << 4
+};
+
+/* One column per engine. Engine threads only write the pending_* strings,
+ * the labels are updated from the main loop at most once per frame */
+typedef struct {
+	GtkWidget *score_label;
+	GtkWidget *line_label;
+	GtkWidget *depth_label;
+	GtkWidget *nps_label;
+	GtkWidget *engine_name_label;
+
+	unsigned int dirty;
+	char pending_score[32];
+	char *pending_line;
+	char pending_depth[32];
+	char pending_nps[32];
+	char pending_engine_name[256];
+} analysis_column;
+
+static GtkWidget *columns_box;
+static analysis_column columns[MAX_ANALYSIS_COLUMNS];
+static int n_columns = 0;
+
+static bool flush_scheduled = false;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static gboolean schedule_analysis_panel_flush(gpointer data);
 
 void add_class(GtkWidget *widget, const char* class) {
 	GtkStyleContext *context = gtk_widget_get_style_context(widget);
@@ -14,81 +45,198 @@ void add_class(GtkWidget *widget, const char* class) {
 }
 
 GtkWidget *create_analysis_panel(void) {
-	score_label = gtk_label_new("0");
-	add_class(score_label, "score-label");
-	gtk_widget_set_size_request(score_label, 150, -1);
-	gtk_label_set_xalign(GTK_LABEL(score_label), 0.5);
-	gtk_widget_set_hexpand(GTK_WIDGET(score_label), FALSE);
-
-	depth_label = gtk_label_new("");
-	add_class(depth_label, "depth-label");
-	gtk_label_set_xalign(GTK_LABEL(depth_label), 0);
-	gtk_widget_set_size_request(depth_label, 100, -1);
-
-	nps_label = gtk_label_new("0 kN/s");
-	add_class(nps_label, "nps-label");
-	gtk_label_set_xalign(GTK_LABEL(nps_label), 0);
-
-	engine_name_label = gtk_label_new("Stockfish 8");
-	add_class(engine_name_label, "engine-name-label");
-	gtk_label_set_xalign(GTK_LABEL(engine_name_label), 0);
-
-	line_label = gtk_label_new("");
-	add_class(line_label, "best-line-label");
-	gtk_label_set_xalign(GTK_LABEL(line_label), 0);
-	gtk_label_set_max_width_chars(GTK_LABEL(line_label), 1);
-	gtk_label_set_ellipsize(GTK_LABEL(line_label), PANGO_ELLIPSIZE_END);
-	gtk_widget_set_hexpand(GTK_WIDGET(line_label), TRUE);
+	columns_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+	gtk_box_set_homogeneous(GTK_BOX(columns_box), TRUE);
+	add_class(columns_box, "analysis-panel");
+	return columns_box;
+}
+
+static GtkWidget *create_analysis_column(analysis_column *column) {
+	column->score_label = gtk_label_new("0");
+	add_class(column->score_label, "score-label");
+	gtk_widget_set_size_request(column->score_label, 150, -1);
+	gtk_label_set_xalign(GTK_LABEL(column->score_label), 0.5);
+	gtk_widget_set_hexpand(GTK_WIDGET(column->score_label), FALSE);
+
+	column->depth_label = gtk_label_new("");
+	add_class(column->depth_label, "depth-label");
+	gtk_label_set_xalign(GTK_LABEL(column->depth_label), 0);
+	gtk_widget_set_size_request(column->depth_label, 100, -1);
+
+	column->nps_label = gtk_label_new("0 kN/s");
+	add_class(column->nps_label, "nps-label");
+	gtk_label_set_xalign(GTK_LABEL(column->nps_label), 0);
+
+	column->engine_name_label = gtk_label_new("");
+	add_class(column->engine_name_label, "engine-name-label");
+	gtk_label_set_xalign(GTK_LABEL(column->engine_name_label), 0);
+
+	column->line_label = gtk_label_new("");
+	add_class(column->line_label, "best-line-label");
+	gtk_label_set_xalign(GTK_LABEL(column->line_label), 0);
+	gtk_label_set_max_width_chars(GTK_LABEL(column->line_label), 1);
+	gtk_label_set_ellipsize(GTK_LABEL(column->line_label), PANGO_ELLIPSIZE_END);
+	gtk_widget_set_hexpand(GTK_WIDGET(column->line_label), TRUE);
 
 	GtkWidget *depth_speed_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
 	add_class(depth_speed_box, "depth-speed-box");
-	gtk_box_pack_start(GTK_BOX(depth_speed_box), depth_label, FALSE, FALSE, 0);
-	gtk_box_pack_start(GTK_BOX(depth_speed_box), nps_label, TRUE, TRUE, 0);
+	gtk_box_pack_start(GTK_BOX(depth_speed_box), column->depth_label, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(depth_speed_box), column->nps_label, TRUE, TRUE, 0);
 
 	GtkWidget *details_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
 	add_class(details_box, "details-box");
-	gtk_box_pack_start(GTK_BOX(details_box), engine_name_label, TRUE, TRUE, 0);
+	gtk_box_pack_start(GTK_BOX(details_box), column->engine_name_label, TRUE, TRUE, 0);
 	gtk_box_pack_start(GTK_BOX(details_box), depth_speed_box, TRUE, TRUE, 0);
 
 	GtkWidget *top_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
 	add_class(top_box, "top-box");
-	gtk_box_pack_start(GTK_BOX(top_box), score_label, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(top_box), column->score_label, FALSE, FALSE, 0);
 	gtk_box_pack_start(GTK_BOX(top_box), details_box, TRUE, TRUE, 0);
 
 	GtkWidget *wrapper_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
 	add_class(wrapper_box, "analysis-panel-contents");
 	gtk_box_pack_start(GTK_BOX(wrapper_box), top_box, FALSE, FALSE, 0);
-	gtk_box_pack_start(GTK_BOX(wrapper_box), line_label, TRUE, TRUE, 0);
+	gtk_box_pack_start(GTK_BOX(wrapper_box), column->line_label, TRUE, TRUE, 0);
 
 	return wrapper_box;
 }
 
-void set_analysis_score(const char *score_value) {
+/* Adds a column to the panel and returns its index, or -1 if full.
+ * NB: takes the GDK lock, don't call while holding it */
+int add_analysis_column(void) {
+	if (n_columns == MAX_ANALYSIS_COLUMNS) {
+		fprintf(stderr, "Analysis panel is full, can't show more than %d engines\n", MAX_ANALYSIS_COLUMNS);
+		return -1;
+	}
+
 	gdk_threads_enter();
-	gtk_label_set_text(GTK_LABEL(score_label), score_value);
+	int index = n_columns;
+	GtkWidget *column_widget = create_analysis_column(&columns[index]);
+	gtk_box_pack_start(GTK_BOX(columns_box), column_widget, TRUE, TRUE, 0);
+	gtk_widget_show_all(column_widget);
+	pthread_mutex_lock(&pending_lock);
+	n_columns++;
+	// anything set before the column existed gets shown now
+	if (columns[index].dirty && !flush_scheduled) {
+		flush_scheduled = true;
+		gdk_threads_add_idle(schedule_analysis_panel_flush, NULL);
+	}
+	pthread_mutex_unlock(&pending_lock);
 	gdk_threads_leave();
+
+	return index;
 }
 
-void set_analysis_best_line(const char *best_line) {
-	gdk_threads_enter();
-	gtk_label_set_text(GTK_LABEL(line_label), best_line);
-	gdk_threads_leave();
+static void flush_analysis_panel(void) {
+	pthread_mutex_lock(&pending_lock);
+	flush_scheduled = false;
+	for (int i = 0; i < n_columns; i++) {
+		analysis_column *column = &columns[i];
+		if (column->dirty & DIRTY_SCORE) {
+			gtk_label_set_text(GTK_LABEL(column->score_label), column->pending_score);
+		}
+		if (column->dirty & DIRTY_LINE) {
+			gtk_label_set_text(GTK_LABEL(column->line_label), column->pending_line);
+		}
+		if (column->dirty & DIRTY_DEPTH) {
+			gtk_label_set_text(GTK_LABEL(column->depth_label), column->pending_depth);
+		}
+		if (column->dirty & DIRTY_NPS) {
+			gtk_label_set_text(GTK_LABEL(column->nps_label), column->pending_nps);
+		}
+		if (column->dirty & DIRTY_ENGINE_NAME) {
+			gtk_label_set_text(GTK_LABEL(column->engine_name_label), column->pending_engine_name);
+		}
+		column->dirty = 0;
+	}
+	pthread_mutex_unlock(&pending_lock);
 }
 
-void set_analysis_depth(const char *depth) {
-	gdk_threads_enter();
-	gtk_label_set_text(GTK_LABEL(depth_label), depth);
-	gdk_threads_leave();
+static gboolean flush_analysis_panel_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer user_data) {
+	flush_analysis_panel();
+	return G_SOURCE_REMOVE;
 }
 
-void set_analysis_nodes_per_second(const char *nps) {
-	gdk_threads_enter();
-	gtk_label_set_text(GTK_LABEL(nps_label), nps);
-	gdk_threads_leave();
+/* Runs in the main loop with the GDK lock held: all updates received
+ * until the next frame are applied together */
+static gboolean schedule_analysis_panel_flush(gpointer data) {
+	if (gtk_widget_get_mapped(columns_box)) {
+		gtk_widget_add_tick_callback(columns_box, flush_analysis_panel_tick, NULL, NULL);
+	}
+	else {
+		// collapsed panel: no frames, just keep the labels current
+		flush_analysis_panel();
+	}
+	return FALSE;
 }
 
-void set_analysis_engine_name(const char *engine_name) {
-	gdk_threads_enter();
-	gtk_label_set_text(GTK_LABEL(engine_name_label), engine_name);
-	gdk_threads_leave();
-}
\ No newline at end of file
+/* Must be called with pending_lock held */
+static void mark_dirty(int index, unsigned int what) {
+	columns[index].dirty |= what;
+	if (!flush_scheduled) {
+		flush_scheduled = true;
+		gdk_threads_add_idle(schedule_analysis_panel_flush, NULL);
+	}
+}
+
+void set_analysis_score(int index, const char *score_value) {
+	if (index < 0 || index >= MAX_ANALYSIS_COLUMNS) {
+		return;
+	}
+	pthread_mutex_lock(&pending_lock);
+	snprintf(columns[index].pending_score, sizeof(columns[index].pending_score), "%s", score_value);
+	mark_dirty(index, DIRTY_SCORE);
+	pthread_mutex_unlock(&pending_lock);
+}
+
+/* Copies the last score set on the column, empty string if none */
+void get_analysis_score(int index, char *score_value, size_t size) {
+	if (index < 0 || index >= MAX_ANALYSIS_COLUMNS) {
+		score_value[0] = '\0';
+		return;
+	}
+	pthread_mutex_lock(&pending_lock);
+	snprintf(score_value, size, "%s", columns[index].pending_score);
+	pthread_mutex_unlock(&pending_lock);
+}
+
+void set_analysis_best_line(int index, const char *best_line) {
+	if (index < 0 || index >= MAX_ANALYSIS_COLUMNS) {
+		return;
+	}
+	pthread_mutex_lock(&pending_lock);
+	g_free(columns[index].pending_line);
+	columns[index].pending_line = g_strdup(best_line);
+	mark_dirty(index, DIRTY_LINE);
+	pthread_mutex_unlock(&pending_lock);
+}
+
+void set_analysis_depth(int index, const char *depth) {
+	if (index < 0 || index >= MAX_ANALYSIS_COLUMNS) {
+		return;
+	}
+	pthread_mutex_lock(&pending_lock);
+	snprintf(columns[index].pending_depth, sizeof(columns[index].pending_depth), "%s", depth);
+	mark_dirty(index, DIRTY_DEPTH);
+	pthread_mutex_unlock(&pending_lock);
+}
+
+void set_analysis_nodes_per_second(int index, const char *nps) {
+	if (index < 0 || index >= MAX_ANALYSIS_COLUMNS) {
+		return;
+	}
+	pthread_mutex_lock(&pending_lock);
+	snprintf(columns[index].pending_nps, sizeof(columns[index].pending_nps), "%s", nps);
+	mark_dirty(index, DIRTY_NPS);
+	pthread_mutex_unlock(&pending_lock);
+}
+
+void set_analysis_engine_name(int index, const char *engine_name) {
+	if (index < 0 || index >= MAX_ANALYSIS_COLUMNS) {
+		return;
+	}
+	pthread_mutex_lock(&pending_lock);
+	snprintf(columns[index].pending_engine_name, sizeof(columns[index].pending_engine_name), "%s", engine_name);
+	mark_dirty(index, DIRTY_ENGINE_NAME);
+	pthread_mutex_unlock(&pending_lock);
+}
@@ -1,16 +1,22 @@
 #ifndef CAIRO_BOARD_ANALYSIS_PANEL_H
 #define CAIRO_BOARD_ANALYSIS_PANEL_H
 
+#define MAX_ANALYSIS_COLUMNS 4
+
 GtkWidget *create_analysis_panel(void);
 
-void set_analysis_score(const char *);
+int add_analysis_column(void);
+
+void set_analysis_score(int column, const char *);
+
+void get_analysis_score(int column, char *, size_t);
 
-void set_analysis_best_line(const char *);
+void set_analysis_best_line(int column, const char *);
 
-void set_analysis_depth(const char *);
+void set_analysis_depth(int column, const char *);
 
-void set_analysis_nodes_per_second(const char *);
+void set_analysis_nodes_per_second(int column, const char *);
 
-void set_analysis_engine_name(const char *);
+void set_analysis_engine_name(int column, const char *);
 
 #endif //CAIRO_BOARD_ANALYSIS_PANEL_H
@@ -0,0 +1,350 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "attack-map.h"
+#include "task-pool.h"
+
+/* Directions 0 to 3 go up the square numbering, 4 to 7 down */
+enum {
+	NORTH = 0,
+	NORTH_EAST,
+	EAST,
+	NORTH_WEST,
+	SOUTH,
+	SOUTH_WEST,
+	WEST,
+	SOUTH_EAST,
+	N_DIRECTIONS
+};
+
+static const int direction_cols[N_DIRECTIONS] = {0, 1, 1, -1, 0, -1, -1, 1};
+static const int direction_rows[N_DIRECTIONS] = {1, 1, 0, 1, -1, -1, 0, -1};
+
+static const int piece_values[6] = {100, 9, 5, 3, 3, 1}; // same order as W_KING..W_PAWN
+
+static uint64_t rays[N_DIRECTIONS][64];
+static uint64_t knight_attacks[64];
+static uint64_t king_attacks[64];
+static uint64_t pawn_attacks[2][64];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/* What the worker keeps from one position to the next */
+typedef struct {
+	int board[64];
+	uint64_t attacks[64]; // squares attacked by the piece on each square
+	attack_map map;
+	bool valid;
+} attack_state;
+
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool enabled = false;
+static bool position_pending = false;
+static bool reset_pending = false;
+static bool job_queued = false;
+static attack_map published;
+static uint64_t changed_squares = 0;
+static bool notify_queued = false;
+static void (*listener)(uint64_t squares) = NULL;
+
+static attack_state worker_state; // only touched by the one job in flight
+static task_group *attack_group = NULL;
+
+static void add_step(uint64_t *board, int col, int row) {
+	if (col >= 0 && col < 8 && row >= 0 && row < 8) {
+		*board |= 1ULL << ATTACK_MAP_SQUARE(col, row);
+	}
+}
+
+static void init_tables(void) {
+	static const int knight_steps[8][2] = {{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}};
+
+	for (int row = 0; row < 8; row++) {
+		for (int col = 0; col < 8; col++) {
+			int sq = ATTACK_MAP_SQUARE(col, row);
+			for (int d = 0; d < N_DIRECTIONS; d++) {
+				for (int c = col + direction_cols[d], r = row + direction_rows[d];
+				     c >= 0 && c < 8 && r >= 0 && r < 8; c += direction_cols[d], r += direction_rows[d]) {
+					rays[d][sq] |= 1ULL << ATTACK_MAP_SQUARE(c, r);
+				}
+				add_step(&king_attacks[sq], col + direction_cols[d], row + direction_rows[d]);
+			}
+			for (int k = 0; k < 8; k++) {
+				add_step(&knight_attacks[sq], col + knight_steps[k][0], row + knight_steps[k][1]);
+			}
+			add_step(&pawn_attacks[0][sq], col - 1, row + 1);
+			add_step(&pawn_attacks[0][sq], col + 1, row + 1);
+			add_step(&pawn_attacks[1][sq], col - 1, row - 1);
+			add_step(&pawn_attacks[1][sq], col + 1, row - 1);
+		}
+	}
+	attack_group = task_group_new();
+}
+
+static inline int piece_colour(int type) {
+	return type >= B_KING;
+}
+
+static inline int piece_kind(int type) {
+	return type >= B_KING ? type - B_KING : type;
+}
+
+static inline bool is_slider(int type) {
+	int kind = piece_kind(type);
+	return kind == W_QUEEN || kind == W_ROOK || kind == W_BISHOP;
+}
+
+/* The ray stops at the first blocker, which is attacked */
+static inline uint64_t ray_attacks(int direction, int sq, uint64_t occupied) {
+	uint64_t attacks = rays[direction][sq];
+	uint64_t blockers = attacks & occupied;
+	if (blockers) {
+		int first = direction < SOUTH ? __builtin_ctzll(blockers) : 63 - __builtin_clzll(blockers);
+		attacks ^= rays[direction][first];
+	}
+	return attacks;
+}
+
+static uint64_t piece_attacks(int type, int sq, uint64_t occupied) {
+	uint64_t attacks = 0;
+	switch (piece_kind(type)) {
+		case W_KING:
+			return king_attacks[sq];
+		case W_KNIGHT:
+			return knight_attacks[sq];
+		case W_PAWN:
+			return pawn_attacks[piece_colour(type)][sq];
+		case W_QUEEN:
+			for (int d = 0; d < N_DIRECTIONS; d++) {
+				attacks |= ray_attacks(d, sq, occupied);
+			}
+			return attacks;
+		case W_ROOK:
+			return ray_attacks(NORTH, sq, occupied) | ray_attacks(EAST, sq, occupied) |
+			       ray_attacks(SOUTH, sq, occupied) | ray_attacks(WEST, sq, occupied);
+		case W_BISHOP:
+			return ray_attacks(NORTH_EAST, sq, occupied) | ray_attacks(NORTH_WEST, sq, occupied) |
+			       ray_attacks(SOUTH_EAST, sq, occupied) | ray_attacks(SOUTH_WEST, sq, occupied);
+		default:
+			return 0;
+	}
+}
+
+static void count_attacks(attack_map *map, int colour, uint64_t attacks, int delta) {
+	while (attacks) {
+		int sq = __builtin_ctzll(attacks);
+		map->attackers[colour][sq] += delta;
+		attacks &= attacks - 1;
+	}
+}
+
+static void find_hanging(attack_state *state) {
+	attack_map *map = &state->map;
+	map->hanging = 0;
+	for (int sq = 0; sq < 64; sq++) {
+		int type = state->board[sq];
+		if (type == ATTACK_MAP_EMPTY || piece_kind(type) == W_KING) {
+			continue;
+		}
+		int colour = piece_colour(type);
+		if (!map->attackers[!colour][sq]) {
+			continue;
+		}
+		if (!map->attackers[colour][sq]) {
+			map->hanging |= 1ULL << sq;
+			continue;
+		}
+		for (int other = 0; other < 64; other++) {
+			int attacker = state->board[other];
+			if (attacker != ATTACK_MAP_EMPTY && piece_colour(attacker) != colour &&
+			    (state->attacks[other] & (1ULL << sq)) &&
+			    piece_values[piece_kind(attacker)] < piece_values[piece_kind(type)]) {
+				map->hanging |= 1ULL << sq;
+				break;
+			}
+		}
+	}
+}
+
+/* Only the pieces that moved, and the sliders whose lines went through a
+ * square that changed, get their attacks generated again */
+static void update_state(attack_state *state, const int board[64]) {
+	if (!state->valid) {
+		for (int sq = 0; sq < 64; sq++) {
+			state->board[sq] = ATTACK_MAP_EMPTY;
+		}
+		memset(state->attacks, 0, sizeof(state->attacks));
+		memset(&state->map, 0, sizeof(state->map));
+		state->valid = true;
+	}
+
+	uint64_t occupied = 0;
+	uint64_t changed = 0;
+	for (int sq = 0; sq < 64; sq++) {
+		if (board[sq] != ATTACK_MAP_EMPTY) {
+			occupied |= 1ULL << sq;
+		}
+		if (board[sq] != state->board[sq]) {
+			changed |= 1ULL << sq;
+		}
+	}
+	if (!changed) {
+		return;
+	}
+
+	for (int sq = 0; sq < 64; sq++) {
+		int old_type = state->board[sq];
+		int new_type = board[sq];
+		if (!(changed & (1ULL << sq)) &&
+		    (new_type == ATTACK_MAP_EMPTY || !is_slider(new_type) || !(state->attacks[sq] & changed))) {
+			continue;
+		}
+		if (old_type != ATTACK_MAP_EMPTY) {
+			count_attacks(&state->map, piece_colour(old_type), state->attacks[sq], -1);
+		}
+		state->attacks[sq] = new_type != ATTACK_MAP_EMPTY ? piece_attacks(new_type, sq, occupied) : 0;
+		if (new_type != ATTACK_MAP_EMPTY) {
+			count_attacks(&state->map, piece_colour(new_type), state->attacks[sq], 1);
+		}
+	}
+	memcpy(state->board, board, sizeof(state->board));
+	find_hanging(state);
+}
+
+void attack_map_board_from_snapshot(const position_snapshot *snapshot, int board[64]) {
+	for (int col = 0; col < 8; col++) {
+		for (int row = 0; row < 8; row++) {
+			int type = snapshot->squares[col][row];
+			board[ATTACK_MAP_SQUARE(col, row)] = type != SNAPSHOT_EMPTY_SQUARE ? type : ATTACK_MAP_EMPTY;
+		}
+	}
+}
+
+/* From scratch, without touching the incremental state */
+void attack_map_compute(const int board[64], attack_map *map) {
+	pthread_once(&tables_once, init_tables);
+	attack_state state;
+	state.valid = false;
+	update_state(&state, board);
+	*map = state.map;
+}
+
+static uint64_t changed_between(const attack_map *a, const attack_map *b) {
+	uint64_t changed = a->hanging ^ b->hanging;
+	for (int sq = 0; sq < 64; sq++) {
+		if (a->attackers[0][sq] != b->attackers[0][sq] || a->attackers[1][sq] != b->attackers[1][sq]) {
+			changed |= 1ULL << sq;
+		}
+	}
+	return changed;
+}
+
+/* Runs with the GDK lock held */
+static gboolean notify_listener(gpointer data) {
+	pthread_mutex_lock(&map_lock);
+	uint64_t changed = changed_squares;
+	changed_squares = 0;
+	notify_queued = false;
+	void (*changed_listener)(uint64_t) = listener;
+	pthread_mutex_unlock(&map_lock);
+
+	if (changed && changed_listener != NULL) {
+		changed_listener(changed);
+	}
+	return FALSE;
+}
+
+/* Worker side: works on the newest position published until none is left,
+ * positions published meanwhile are skipped */
+static void attack_map_job(void *data, task_group *group) {
+	position_snapshot snapshot;
+	int board[64];
+
+	pthread_mutex_lock(&map_lock);
+	while (position_pending) {
+		position_pending = false;
+		if (reset_pending) {
+			worker_state.valid = false;
+			reset_pending = false;
+		}
+		pthread_mutex_unlock(&map_lock);
+
+		position_snapshot_read(&snapshot);
+		attack_map_board_from_snapshot(&snapshot, board);
+		update_state(&worker_state, board);
+
+		if (debug_flag) {
+			attack_map check;
+			attack_map_compute(board, &check);
+			if (changed_between(&check, &worker_state.map)) {
+				fprintf(stderr, "Attack map out of step with the board, recomputing\n");
+				worker_state.valid = false;
+				update_state(&worker_state, board);
+			}
+		}
+
+		pthread_mutex_lock(&map_lock);
+		changed_squares |= changed_between(&published, &worker_state.map);
+		published = worker_state.map;
+	}
+	job_queued = false;
+	bool notify = changed_squares && !notify_queued;
+	notify_queued |= notify;
+	pthread_mutex_unlock(&map_lock);
+
+	if (notify) {
+		gdk_threads_add_idle(notify_listener, NULL);
+	}
+}
+
+/* To be called once a new position has been published. The attacks are
+ * worked out on the task pool and the listener is then called from the main
+ * loop with the squares whose figures changed */
+void attack_map_update(void) {
+	pthread_once(&tables_once, init_tables);
+
+	pthread_mutex_lock(&map_lock);
+	if (!enabled) {
+		pthread_mutex_unlock(&map_lock);
+		return;
+	}
+	position_pending = true;
+	bool submit = !job_queued;
+	job_queued = true;
+	pthread_mutex_unlock(&map_lock);
+
+	if (submit) {
+		task_pool_submit(attack_group, TASK_PRIORITY_HIGH, attack_map_job, NULL);
+	}
+}
+
+/* Turning it on starts from an empty map, the next update repaints every
+ * square that is attacked */
+void attack_map_set_enabled(bool on) {
+	pthread_mutex_lock(&map_lock);
+	if (on && !enabled) {
+		memset(&published, 0, sizeof(published));
+		reset_pending = true;
+	}
+	enabled = on;
+	pthread_mutex_unlock(&map_lock);
+}
+
+bool attack_map_enabled(void) {
+	pthread_mutex_lock(&map_lock);
+	bool on = enabled;
+	pthread_mutex_unlock(&map_lock);
+	return on;
+}
+
+void attack_map_set_listener(void (*changed)(uint64_t squares)) {
+	pthread_mutex_lock(&map_lock);
+	listener = changed;
+	pthread_mutex_unlock(&map_lock);
+}
+
+/* Copy of the latest map worked out */
+void attack_map_get(attack_map *map) {
+	pthread_mutex_lock(&map_lock);
+	*map = published;
+	pthread_mutex_unlock(&map_lock);
+}
@@ -0,0 +1,30 @@
+#ifndef CAIRO_BOARD_ATTACK_MAP_H
+#define CAIRO_BOARD_ATTACK_MAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "position-snapshot.h"
+
+/* Bit of a square in the bitboards, as in pattern-search */
+#define ATTACK_MAP_SQUARE(col, row) ((row) * 8 + (col))
+
+#define ATTACK_MAP_EMPTY (-1)
+
+typedef struct {
+	uint8_t attackers[2][64]; // [colour][square]: how many pieces of that side attack the square
+	uint64_t hanging;         // pieces attacked and undefended, or attacked by a cheaper piece
+} attack_map;
+
+/* Board as piece types indexed by ATTACK_MAP_SQUARE(), ATTACK_MAP_EMPTY
+ * for empty squares */
+void attack_map_board_from_snapshot(const position_snapshot *snapshot, int board[64]);
+void attack_map_compute(const int board[64], attack_map *map);
+
+void attack_map_set_enabled(bool enabled);
+bool attack_map_enabled(void);
+void attack_map_set_listener(void (*changed)(uint64_t squares));
+void attack_map_update(void);
+void attack_map_get(attack_map *map);
+
+#endif //CAIRO_BOARD_ATTACK_MAP_H
@@ -13,6 +13,7 @@
 #include <wchar.h>
 
 #include "clocks.h"
+#include "alloc-stats.h"
 
 /* debug macro */
 #ifndef debug
@@ -39,6 +40,20 @@ void debug(format, ...) { if (debug_flag) fprintf(stdout, "%s:\033[31m%d\033[0m
 #define ICS_TEST_HANDLE1	13
 #define ICS_TEST_HANDLE2	14
 #define ICS_TEST_PLAYER1	15
+#define LATENCY_BENCH_ARG	16
+#define ENGINE_PATH_ARG		17
+#define EXPORT_ARG		18
+#define EXPORT_SIZE_ARG		19
+#define IPC_PATH_ARG		20
+#define MEM_BUDGET_ARG		21
+#define PGN_CHECK_ARG		22
+#define MATERIAL_QUERY_ARG	23
+#define PATTERN_SEARCH_ARG	24
+#define CLOCK_CHECK_ARG		25
+#define RENDER_CHECK_ARG	26
+#define ROUND_TRIP_ARG		27
+#define ALLOC_STATS_ARG		28
+#define LIST_GAMES_ARG		29
 
 // base unicode char for chess fonts
 #define BASE_CHESS_UNICODE_CHAR 0x2654
@@ -109,6 +124,7 @@ typedef struct {
 	char black_rating[32];
 
 	char *moves_list; // String of the current moves list in SAN notation
+	alloc_tag allocated_for;
 
 	unsigned int ply_num;
 
@@ -163,6 +179,7 @@ struct anim_data {
 	int promo_type;
 	int move_source;
 	int killed_by;
+	int64_t last_step_time; // when the previous step was painted, for render-quality
 };
 
 enum {
@@ -280,6 +297,7 @@ extern double w_ratio;
 extern double h_ratio;
 
 extern int game_mode;
+extern int preset_promotion_type;
 extern bool play_vs_machine;
 extern bool playing;
 
@@ -332,6 +350,7 @@ int char_to_type(int whose_turn, char c);
 char type_to_char(int);
 char type_to_fen_char(int type);
 int move_piece(chess_piece *piece, int col, int row, int check_legality, int move_source, char san_move[SAN_MOVE_SIZE], chess_game *game, bool logical_only);
+void main_game_changed(void);
 void send_to_ics(char *s);
 void send_to_uci(char *s);
 void insert_san_move(const char*, bool should_lock_threads);
@@ -347,6 +366,10 @@ void end_game(void);
 void update_eco_tag(bool should_lock_threads);
 void popup_join_channel_dialog(bool lock_threads);
 int resolve_move(chess_game *game, int t, char *move, int resolved_move[4]);
+void init_game_position(chess_game *game);
+int load_pieces_theme(const char *dir);
+void compute_highlight_colours(void);
+void load_game(const char* file_path, int game_num, void (*loaded)(const char *error, void *data), void *data);
 void add_class(GtkWidget *, const char *);
 void insert_text_moves_list_view(const gchar *text, bool should_lock_threads);
 void refresh_moves_list_view(plys_list *list);
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "cairo-board.h"
+#include "memory-budget.h"
 
 #define CHANNEL_BUFFER_MAX_LINES 256
 
@@ -106,6 +107,9 @@ typedef struct {
 	GtkTextBuffer *text_view_buffer;
 	GtkWidget *text_entry;
 	GtkWidget *scroll_lock;
+	GtkTextTag *handle_tag;
+	size_t text_size; // characters held in the buffer, as accounted to MEM_CHANNELS
+	gint64 last_used;
 } channel;
 
 void free_channel_function(gpointer key, gpointer value, gpointer data);
@@ -116,6 +120,7 @@ void join_channel_function(gpointer key, gpointer value);
 
 channel *get_channel(int channel_number);
 channel *get_active_channel(void);
+static bool evict_least_recent_channel(void);
 
 
 GtkWidget *create_append_image_menu_item(GtkWidget *menu, const gchar *stock_id, const gchar *str) {
@@ -133,12 +138,14 @@ gint chan_compare_func(gconstpointer a, gconstpointer b) {
 static GtkWidget *switch_to_channel_menu(channel *chan) {
 	GSList *group = NULL;
 	GtkWidget *switch_to_channel_menu = gtk_menu_new();
-	int active = get_active_channel()->num;
+	// the active page may be the console which is not a channel
+	channel *active_chan = get_active_channel();
+	int active = active_chan ? active_chan->num : -1;
 	GSList *chans = my_channels;
 	while(chans) {
 		int next_chan = GPOINTER_TO_INT(chans->data);
 		gboolean activated = (g_hash_table_lookup(channel_map, &next_chan) != NULL);
-		char *str = calloc(256, sizeof(char));
+		char *str = tracked_calloc(ALLOC_CHANNELS, 256, sizeof(char));
 		if (next_chan < 101 && strcmp("", channel_descriptions[next_chan])) {
 			sprintf(str, "%d: %s", next_chan, channel_descriptions[next_chan]);
 		}
@@ -155,7 +162,7 @@ static GtkWidget *switch_to_channel_menu(channel *chan) {
 			g_free(markup);
 		}
 
-		free(str);
+		tracked_free(ALLOC_CHANNELS, str);
 
 		group = gtk_radio_menu_item_get_group(GTK_RADIO_MENU_ITEM(item));
 		gtk_menu_shell_append(GTK_MENU_SHELL(switch_to_channel_menu), item);
@@ -237,10 +244,10 @@ gboolean channel_entry_callback(GtkWidget *entry, channel *channel) {
 	const char *text = gtk_entry_get_text(GTK_ENTRY(entry));
 	int length = strlen(text);
 	if (length > 0) {
-		char *command = calloc(length+11, sizeof(char));
+		char *command = tracked_calloc(ALLOC_CHANNELS, length+11, sizeof(char));
 		sprintf(command, "tell %d %s\n", channel->num, text);
 		send_to_ics(command);
-		free(command);
+		tracked_free(ALLOC_CHANNELS, command);
 		gtk_entry_set_text(GTK_ENTRY(entry), "");
 	}
 	return FALSE;
@@ -269,10 +276,11 @@ channel *get_active_channel(void) {
 
 /* removes the channel from the tabbed pane and frees up associated resources */
 void free_channel(channel *channel) {
+	mem_budget_account(MEM_CHANNELS, -(long) channel->text_size);
 	gtk_notebook_remove_page(GTK_NOTEBOOK(channels_notebook), get_channel_index(channel));
 	g_hash_table_remove(channel_map, &(channel->num));
 	g_hash_table_remove(reverse_channel_map, channel->top_vbox);
-	free(channel);
+	tracked_free(ALLOC_CHANNELS, channel);
 	if (!gtk_notebook_get_n_pages(GTK_NOTEBOOK(channels_notebook))) {
 		gtk_widget_hide(channels_notebook);
 	}
@@ -288,10 +296,10 @@ void join_channel_function(gpointer key, gpointer value) {
 
 void leave_channel_function(gpointer key, gpointer value, gpointer data) {
 	channel *chan = (channel*)value;
-	char *command = calloc(128, sizeof(char));
+	char *command = tracked_calloc(ALLOC_CHANNELS, 128, sizeof(char));
 	snprintf(command, 128, "-chan %d\n", chan->num);
 	send_to_ics(command);
-	free(command);
+	tracked_free(ALLOC_CHANNELS, command);
 }
 
 gint sort_ints(gconstpointer a, gconstpointer b) {
@@ -397,6 +405,14 @@ void radio_callback(GtkWidget *item, gpointer value) {
 	}
 }
 
+void init_channels(void) {
+	/* Channels Hashmap: we use this to quickly map a channel number to its index */
+	channel_map = g_hash_table_new(g_int_hash, g_int_equal);
+	reverse_channel_map = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	mem_budget_set_evictor(MEM_CHANNELS, evict_least_recent_channel);
+}
+
 void free_all_channels(void) {
 	g_hash_table_foreach(channel_map, free_channel_function, NULL);
 }
@@ -409,7 +425,7 @@ channel* create_channel(int channel_num) {
 		gtk_widget_show(channels_notebook);
 	}
 
-	channel *new_channel = malloc(sizeof(channel));
+	channel *new_channel = tracked_malloc(ALLOC_CHANNELS, sizeof(channel));
 	new_channel->num = channel_num;
 	/* create channel window */
 	new_channel->text_view = create_channel_view();
@@ -459,6 +475,11 @@ channel* create_channel(int channel_num) {
 
 	/* Link tag table */
 	gtk_text_buffer_create_tag(new_channel->text_view_buffer, "blue_fg", "foreground", "blue", NULL);
+	// shared by all the messages, a tag per message would never be freed
+	new_channel->handle_tag = gtk_text_buffer_create_tag(new_channel->text_view_buffer, "handle", "foreground-rgba", &chat_handle_colour, NULL);
+
+	new_channel->text_size = 0;
+	new_channel->last_used = g_get_monotonic_time();
 
 	char lab_text[16];
 	snprintf(lab_text, 16, "Chan %d", channel_num);
@@ -495,7 +516,7 @@ channel* create_channel(int channel_num) {
 
 	gtk_widget_show_all(new_channel->top_vbox);
 
-	char *extended_description = calloc(256, sizeof(char));;
+	char *extended_description = tracked_calloc(ALLOC_CHANNELS, 256, sizeof(char));
 	if (channel_num < 101 && strcmp("", channel_descriptions[channel_num])) {
 		sprintf(extended_description, "%d: %s", channel_num, channel_descriptions[channel_num]);
 	}
@@ -504,7 +525,7 @@ channel* create_channel(int channel_num) {
 	}
 	GtkWidget *tab_menu_label = gtk_label_new(extended_description);
 	gtk_widget_set_tooltip_text(tab_event_box, extended_description);
-	free(extended_description);
+	tracked_free(ALLOC_CHANNELS, extended_description);
 
 	/* Find the insertion point comparing channel_numbers */
 	gint insertion_index = G_MAXINT;
@@ -546,6 +567,49 @@ channel *get_channel(int channel_number) {
 	return channel;
 }
 
+/* Re-reads the size of the channel buffer after it changed */
+static void update_channel_usage(channel *chan) {
+	size_t text_size = (size_t) gtk_text_buffer_get_char_count(chan->text_view_buffer);
+	mem_budget_account(MEM_CHANNELS, (long) text_size - (long) chan->text_size);
+	chan->text_size = text_size;
+}
+
+/* Drops the oldest half of the channel scroll-back */
+static void trim_channel(channel *chan) {
+	int line_count = gtk_text_buffer_get_line_count(chan->text_view_buffer);
+	GtkTextIter start, end;
+	gtk_text_buffer_get_start_iter(chan->text_view_buffer, &start);
+	if (line_count > 2) {
+		gtk_text_buffer_get_iter_at_line(chan->text_view_buffer, &end, line_count / 2);
+	}
+	else {
+		gtk_text_buffer_get_end_iter(chan->text_view_buffer, &end);
+	}
+	gtk_text_buffer_delete(chan->text_view_buffer, &start, &end);
+	update_channel_usage(chan);
+}
+
+/* MEM_CHANNELS evictor: trims the channel that was written to least recently.
+ * Called from insert_text_channel_view() so the GDK lock is held */
+static bool evict_least_recent_channel(void) {
+	channel *oldest = NULL;
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, channel_map);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		channel *chan = (channel *) value;
+		if (chan->text_size > 0 && (oldest == NULL || chan->last_used < oldest->last_used)) {
+			oldest = chan;
+		}
+	}
+	if (oldest == NULL) {
+		return false;
+	}
+	debug("Trimming channel %d to fit the memory budget\n", oldest->num);
+	trim_channel(oldest);
+	return true;
+}
+
 /* Append message at the end of the sample channel buffer
  * NB: message must be NULL terminated*/
 void insert_text_channel_view(int channel_num, char *username, char *message, gboolean should_lock_threads) {
@@ -561,6 +625,9 @@ void insert_text_channel_view(int channel_num, char *username, char *message, gb
 
 	if (!GTK_IS_TEXT_VIEW(channel->text_view)) {
 		// Killed? tough!
+		if (should_lock_threads) {
+			gdk_threads_leave();
+		}
 		return;
 	}
 
@@ -568,18 +635,20 @@ void insert_text_channel_view(int channel_num, char *username, char *message, gb
 	GtkTextMark *end_mark = gtk_text_buffer_get_mark(channel->text_view_buffer, "end_bookmark");
 	if (!end_mark) {
 		fprintf(stderr, "Failed to get the mark at the end of the channel buffer!\n");
+		if (should_lock_threads) {
+			gdk_threads_leave();
+		}
 		return;
 	}
 
-	final_username = calloc(strlen(username)+2, sizeof(char));
-	final_message = calloc(strlen(message)+3, sizeof(char));
+	final_username = tracked_calloc(ALLOC_CHANNELS, strlen(username)+2, sizeof(char));
+	final_message = tracked_calloc(ALLOC_CHANNELS, strlen(message)+3, sizeof(char));
 	sprintf(final_username, "%s:", username);
 	sprintf(final_message, " %s\n", message);
 
 	GtkTextIter mark_it;
 	gtk_text_buffer_get_iter_at_mark(channel->text_view_buffer, &mark_it, end_mark);
-	GtkTextTag *handle_tag = gtk_text_buffer_create_tag(channel->text_view_buffer, NULL, "foreground-rgba", &chat_handle_colour, NULL);
-	gtk_text_buffer_insert_with_tags(channel->text_view_buffer, &mark_it, final_username, -1, handle_tag, NULL);
+	gtk_text_buffer_insert_with_tags(channel->text_view_buffer, &mark_it, final_username, -1, channel->handle_tag, NULL);
 
 	gtk_text_buffer_get_iter_at_mark(channel->text_view_buffer, &mark_it, end_mark);
 	gtk_text_buffer_insert(channel->text_view_buffer, &mark_it, final_message, -1);
@@ -593,6 +662,10 @@ void insert_text_channel_view(int channel_num, char *username, char *message, gb
 		gtk_text_buffer_delete(channel->text_view_buffer, &start, &end);
 	}
 
+	channel->last_used = g_get_monotonic_time();
+	update_channel_usage(channel);
+	mem_budget_enforce(MEM_CHANNELS);
+
 	if (!gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(channel->scroll_lock))) {
 		/* autoscroll to the end by making our end mark visible */
 		gtk_text_view_scroll_to_mark(GTK_TEXT_VIEW(channel->text_view), end_mark, 0, 0, 0, 0);
@@ -605,6 +678,6 @@ void insert_text_channel_view(int channel_num, char *username, char *message, gb
 		gdk_threads_leave();
 	}
 
-	free(final_username);
-	free(final_message);
+	tracked_free(ALLOC_CHANNELS, final_username);
+	tracked_free(ALLOC_CHANNELS, final_message);
 }
@@ -19,6 +19,7 @@ extern GtkTextTag *blue_fg_tag;
 extern const char *channel_descriptions[];
 
 void insert_text_channel_view(int channel_num, char *username, char *message, gboolean should_lock_threads);
+void init_channels(void);
 void free_all_channels(void);
 void sort_my_channels(void);
 int count_my_channels(void);
@@ -3,6 +3,7 @@
 
 #include "chess-backend.h"
 #include "cairo-board.h"
+#include "memory-budget.h"
 
 /* Returns the colour of the square[col][row]
  * 0 -> white
@@ -201,7 +202,7 @@ int can_castle(int colour, int side, chess_game *game) {
 	if (is_king_checked(game, colour)) {
 		return 0;
 	}
-	chess_game *trans_game = game_new();
+	chess_game *trans_game = game_new(ALLOC_LEGALITY);
 	clone_game(game, trans_game);
 
 	chess_piece *king = get_king(colour, trans_game->squares);
@@ -209,10 +210,12 @@ int can_castle(int colour, int side, chess_game *game) {
 	// Do the proposed move on the transient set of pieces
 	raw_move(trans_game, king, king->pos.column+(side?1:-1), king->pos.row, 0);
 	if (is_king_checked(trans_game, colour)) {
+		game_free(trans_game);
 		return 0;
 	}
 	raw_move(trans_game, king, king->pos.column+(side?1:-1), king->pos.row, 0);
 	if (is_king_checked(trans_game, colour)) {
+		game_free(trans_game);
 		return 0;
 	}
 
@@ -550,7 +553,7 @@ bool is_move_legal(chess_game *game, chess_piece *piece, int col, int row) {
 	// First make a transient copy of the pieces' state
 	// We'll apply changes to this transient copy and do our checks
 
-	chess_game *trans_game = game_new();
+	chess_game *trans_game = game_new(ALLOC_LEGALITY);
 	clone_game(game, trans_game);
 
 	// get equivalent of selected piece from transient squares
@@ -575,14 +578,13 @@ bool is_move_legal(chess_game *game, chess_piece *piece, int col, int row) {
 
 	// Check that the proposed move does not leave or put our king in check
 	int would_check = is_king_checked(trans_game, colour);
+	game_free(trans_game);
 	if (would_check) {
 		// Move not possible as would put/leave our king in check
 		//printf("Proposed move would check our king\n");
 		return false;
 	}
 
-	game_free(trans_game);
-
 	return true;
 }
 
@@ -1483,21 +1485,35 @@ void init_hash(chess_game *game) {
 	game->current_hash = generate_zobrist_hash(game);
 }
 
-chess_game *game_new() {
-	chess_game *new_game = malloc(sizeof(chess_game));
+/* Only games that outlive the call creating them count towards the budget:
+ * the legality and engine line clones come and go on every move and would
+ * take the budget lock each time */
+static bool game_is_budgeted(const chess_game *game) {
+	return game->allocated_for != ALLOC_LEGALITY && game->allocated_for != ALLOC_UCI;
+}
+
+chess_game *game_new(alloc_tag tag) {
+	chess_game *new_game = tracked_malloc(tag, sizeof(chess_game));
 	if (!new_game) {
 		perror("Malloc new_game failed");
 		return NULL;
 	}
 	new_game->ply_num = 1;
 	new_game->hash_history_index = 0;
-	new_game->moves_list = calloc(256, SAN_MOVE_SIZE);
+	new_game->allocated_for = tag;
+	new_game->moves_list = tracked_calloc(tag, 256, SAN_MOVE_SIZE);
+	if (game_is_budgeted(new_game)) {
+		mem_budget_account(MEM_GAME_HISTORY, (long) malloc_usable_size(new_game->moves_list));
+	}
 	return new_game;
 }
 
 void game_free(chess_game *game) {
-	free(game->moves_list);
-	free(game);
+	if (game_is_budgeted(game)) {
+		mem_budget_account(MEM_GAME_HISTORY, -(long) malloc_usable_size(game->moves_list));
+	}
+	tracked_free(game->allocated_for, game->moves_list);
+	tracked_free(game->allocated_for, game);
 }
 
 void append_san_move(chess_game *game, const char *san_move) {
@@ -1517,12 +1533,20 @@ void append_san_move(chess_game *game, const char *san_move) {
 	size_t cur_len = strlen(game->moves_list);
 	size_t append_len = strlen(append);
 	size_t available = malloc_usable_size(game->moves_list);
-	size_t required = cur_len + append_len;
-	while (available < required) {
-		game->moves_list = (char *) realloc(game->moves_list, malloc_usable_size(game->moves_list) * 2);
+	size_t required = cur_len + append_len + 1;
+	if (available < required) {
+		size_t old_size = available;
+		while (available < required) {
+			available *= 2;
+		}
+		game->moves_list = (char *) tracked_realloc(game->allocated_for, game->moves_list, available);
 		available = malloc_usable_size(game->moves_list);
+		if (game_is_budgeted(game)) {
+			mem_budget_account(MEM_GAME_HISTORY, (long) available - (long) old_size);
+		}
 	}
-	memcpy(game->moves_list + cur_len, append, append_len);
+	// realloc'ed memory isn't zeroed, copy the terminator too
+	memcpy(game->moves_list + cur_len, append, append_len + 1);
 	free(append);
 }
 
@@ -1608,7 +1632,7 @@ void generate_fen_no_enpassant(char fen_string[128], chess_square sq[8][8], int
 		is_castle++;
 		fen_string[offset++] = 'k';
 	}
-	if (castle_state[1][1]) {
+	if (castle_state[1][0]) {
 		is_castle++;
 		fen_string[offset++] = 'q';
 	}
@@ -1671,7 +1695,7 @@ void generate_fen(char fen_string[128], chess_square sq[8][8], int castle_state[
 		is_castle++;
 		fen_string[offset++] = 'k';
 	}
-	if (castle_state[1][1]) {
+	if (castle_state[1][0]) {
 		is_castle++;
 		fen_string[offset++] = 'q';
 	}
@@ -1701,5 +1725,5 @@ void generate_full_fen(char fen_string[128], chess_square sq[8][8], int castle_s
 
 	generate_fen(temp_string, sq, castle_state, en_passant, whose_turn);
 
-	snprintf(fen_string, 128, "%s %d %d", temp_string, 99-fifty_move_counter, full_move_number);
+	snprintf(fen_string, 128, "%s %d %d", temp_string, 100-fifty_move_counter, full_move_number);
 }
@@ -9,7 +9,7 @@ static uint64_t zobrist_keys_en_passant[8];
 static uint64_t zobrist_keys_blacks_turn;
 static uint64_t zobrist_keys_castle[2][2];
 
-chess_game *game_new();
+chess_game *game_new(alloc_tag tag);
 
 void game_free(chess_game *game);
 
@@ -63,6 +63,8 @@ void persist_hash(chess_game *game);
 
 void init_hash(chess_game *game);
 
+uint64_t generate_zobrist_hash(chess_game *game);
+
 int check_hash_triplet(chess_game *game);
 
 void init_zobrist_hash_history(chess_game *game);
@@ -71,5 +73,7 @@ void generate_fen_no_enpassant(char fen_string[128], chess_square sq[8][8], int
 
 void generate_fen(char fen_string[128], chess_square sq[8][8], int castle_state[2][2], int en_passant[8], int whose_turn);
 
+void generate_full_fen(char fen_string[128], chess_square sq[8][8], int castle_state[2][2], int en_passant[8], int whose_turn, int fifty_move_counter, int full_move_number);
+
 #endif
 
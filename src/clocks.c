@@ -8,6 +8,7 @@
 #include "clocks.h"
 #include "clock-widget.h"
 #include "chess-backend.h"
+#include "time-source.h"
 
 #define CLOCK_INTERVAL 100000 // 100ms
 
@@ -22,31 +23,39 @@ void debug(format, ...) { if (debug_flag) fprintf(stdout, "%s:\033[31m%d\033[0m
 
 void send_to_ics(char*);
 
-static struct timeval zero_tv = {0, -250000}; // allow 250ms margin
+static struct timeval zero_tv = {-1, 750000}; // allow 250ms margin, normalised like timersub() results
+
+/* Charges the time elapsed since the last update to color and moves the
+ * update timestamp to now. Called with the update mutex held */
+static void account_elapsed_time(chess_clock *clock, int color, struct timeval *now) {
+	struct timeval diff;
+
+	// check the clock has not just resumed from pause
+	if (clock->last_modified_time[color].tv_sec) {
+		// measure exactly how long elapsed since last_update
+		timersub(now, &clock->last_modified_time[color], &diff);
+		timersub(&clock->remaining_time[color], &diff, &clock->remaining_time[color]);
+	}
+	clock->last_modified_time[color] = *now;
+}
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wmissing-noreturn"
 void *black_clock_runner_function(void *_clock) {
 	chess_clock *clock = (chess_clock*)_clock;
-	struct timeval now, diff;
+	struct timeval now;
 
 	for (;;) {
 		sem_wait(&clock->sem_black);
 		sem_post(&clock->sem_black);
 
 		// get the current time
-		gettimeofday(&now, NULL);
+		time_now_tv(&now);
 
-		// check the clock has not just resumed from pause
-		if (clock->last_modified_time[1].tv_sec) {
-			// measure exactly how long elapsed since last_update
-			timersub(&now, &clock->last_modified_time[1], &diff);
-
-			// thread safe update of the remaining time
-			pthread_mutex_lock(&clock->update_mutex);
-			timersub(&clock->remaining_time[1], &diff, &clock->remaining_time[1]);
-			pthread_mutex_unlock(&clock->update_mutex);
-		}
+		// thread safe update of the remaining time
+		pthread_mutex_lock(&clock->update_mutex);
+		account_elapsed_time(clock, 1, &now);
+		pthread_mutex_unlock(&clock->update_mutex);
 
 		gdk_threads_enter();
 		if (clock->parent != NULL) {
@@ -54,11 +63,8 @@ void *black_clock_runner_function(void *_clock) {
 		}
 		gdk_threads_leave();
 
-		// update last modified timestamp
-		clock->last_modified_time[1] = now;
-
 		// sleep approx 100ms
-		usleep(CLOCK_INTERVAL);
+		time_sleep_us(CLOCK_INTERVAL);
 	}
 }
 #pragma clang diagnostic pop
@@ -68,25 +74,19 @@ void *black_clock_runner_function(void *_clock) {
 #pragma clang diagnostic ignored "-Wmissing-noreturn"
 void *white_clock_runner_function(void *_clock) {
 	chess_clock *clock = (chess_clock*)_clock;
-	struct timeval now, diff;
+	struct timeval now;
 
 	for (;;) {
 		sem_wait(&(clock->sem_white));
 		sem_post(&clock->sem_white);
 
 		// get the current time
-		gettimeofday(&now, NULL);
+		time_now_tv(&now);
 
-		// check the clock has not just resumed from pause
-		if (clock->last_modified_time[0].tv_sec) {
-			// measure exactly how long elapsed since last_update
-			timersub(&now, &clock->last_modified_time[0], &diff);
-
-			// thread safe update of the remaining time
-			pthread_mutex_lock(&clock->update_mutex);
-			timersub(&clock->remaining_time[0], &diff, &clock->remaining_time[0]);
-			pthread_mutex_unlock(&clock->update_mutex);
-		}
+		// thread safe update of the remaining time
+		pthread_mutex_lock(&clock->update_mutex);
+		account_elapsed_time(clock, 0, &now);
+		pthread_mutex_unlock(&clock->update_mutex);
 
 		gdk_threads_enter();
 		if (clock->parent != NULL) {
@@ -94,11 +94,8 @@ void *white_clock_runner_function(void *_clock) {
 		}
 		gdk_threads_leave();
 
-		// update last modified timestamp
-		clock->last_modified_time[0] = now;
-
 		// sleep approx 100ms
-		usleep(CLOCK_INTERVAL);
+		time_sleep_us(CLOCK_INTERVAL);
 	}
 }
 #pragma clang diagnostic pop
@@ -111,6 +108,9 @@ chess_clock *clock_new(int initial_time_s, int incerement_s, int relation) {
 		return NULL;
 	}
 	clock->relation = relation;
+	clock->initial_time = initial_time_s;
+	clock->increment = incerement_s;
+	clock->parent = NULL;
 
 	// Set initial values into the clock
 	clock->remaining_time[0].tv_sec = initial_time_s;
@@ -192,7 +192,11 @@ void stop_one_clock(chess_clock *clock, int color, bool should_lock) {
 
 	sem_wait(color ? &clock->sem_black : &clock->sem_white);
 
+	// the runner only updates every CLOCK_INTERVAL: charge what is left
+	struct timeval now;
+	time_now_tv(&now);
 	pthread_mutex_lock(&clock->update_mutex);
+	account_elapsed_time(clock, color, &now);
 	clock->last_modified_time[color].tv_sec = 0;
 	pthread_mutex_unlock(&clock->update_mutex);
 
@@ -201,6 +205,13 @@ void stop_one_clock(chess_clock *clock, int color, bool should_lock) {
 
 // unlocks the associated runner funtion
 void start_one_clock(chess_clock *clock, int color) {
+	// the runner may still be asleep from its last round before the stop,
+	// whenever it wakes up it charges from now
+	struct timeval now;
+	time_now_tv(&now);
+	pthread_mutex_lock(&clock->update_mutex);
+	clock->last_modified_time[color] = now;
+	pthread_mutex_unlock(&clock->update_mutex);
 	sem_post(color ? &clock->sem_black : &clock->sem_white);
 }
 
@@ -238,8 +249,24 @@ void start_one_stop_other_clock(chess_clock *clock, int color_to_start, bool sho
 	}
 }
 
+/* The runners only update every CLOCK_INTERVAL, the running clock is also
+ * charged what elapsed since then */
+static void current_remaining_time(chess_clock *clock, int color, struct timeval *remaining) {
+	pthread_mutex_lock(&clock->update_mutex);
+	*remaining = clock->remaining_time[color];
+	if (clock->last_modified_time[color].tv_sec && is_active(clock, color)) {
+		struct timeval now, diff;
+		time_now_tv(&now);
+		timersub(&now, &clock->last_modified_time[color], &diff);
+		timersub(remaining, &diff, remaining);
+	}
+	pthread_mutex_unlock(&clock->update_mutex);
+}
+
 long get_remaining_time(chess_clock *clock, int color) {
-	long millis = tv_to_ms(&clock->remaining_time[color]);
+	struct timeval remaining;
+	current_remaining_time(clock, color, &remaining);
+	long millis = tv_to_ms(&remaining);
 	if (millis < 0) {
 		millis = 0;
 	}
@@ -348,7 +375,9 @@ void clock_to_string(chess_clock *clock, int color, char clock_string[], char gh
 }
 
 int is_clock_expired(chess_clock *clock, int color) {
-	return timercmp( &clock->remaining_time[color], &zero_tv, < );
+	struct timeval remaining;
+	current_remaining_time(clock, color, &remaining);
+	return timercmp( &remaining, &zero_tv, < );
 }
 
 int am_low_on_time(chess_clock *clock) {
@@ -15,8 +15,6 @@ int crafty_in;
 int crafty_out;
 int crafty_err;
 
-int crafty_scanner__scan_bytes(const char*, int length);
-
 void write_to_crafty(char *message) {
 	if (write(crafty_in, message, strlen(message)) == -1) {
 		perror(NULL);
@@ -72,7 +70,7 @@ void parse_crafty_buffer(void) {
 	if (nread < 1) {
 		fprintf(stderr, "ERROR: failed to read data from Crafty pipe\n");
 	}
-	crafty_scanner__scan_bytes(raw_buff, nread);
+	crafty_scanner_feed(raw_buff, nread);
 	int i = 0;
 	while (i > -1) {
 		i = crafty_scanner_lex();
@@ -112,5 +110,8 @@ void *parse_crafty_function(void *ptr) {
 	}
 
 	fprintf(stdout, "[parse Crafty thread] - Closing Crafty parser\n");
+	if (debug_flag) {
+		crafty_scanner_print_stats();
+	}
 	return 0;
 }
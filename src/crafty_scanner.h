@@ -18,6 +18,9 @@ void crafty_scanner_restart (FILE *input_file);
 typedef unsigned int yy_size_t;
 #endif
 
+void crafty_scanner_feed(const char *bytes, int len);
+void crafty_scanner_print_stats(void);
+
 extern int crafty_scanner_leng;
 extern char *crafty_scanner_text;
 
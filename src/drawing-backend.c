@@ -18,6 +18,9 @@
 #include "cairo-board.h"
 #include "chess-backend.h"
 #include "crafty-adapter.h"
+#include "time-source.h"
+#include "render-quality.h"
+#include "attack-map.h"
 
 /* Prototypes */
 static void clean_last_drag_step(cairo_t *cdc, double wi, double hi);
@@ -31,12 +34,15 @@ static void highlight_check_square(cairo_t *dc, int col, int row, double r, doub
 static void update_dragging_background(chess_piece *piece, int wi, int hi);
 static void restore_dragging_background(chess_piece *piece, int move_result, int wi, int hi);
 static void logical_promote(int last_promote);
+static bool attacks_layer_source(cairo_t *dc);
+static void present_cache_layer(cairo_t *cdr, cairo_operator_t op);
 
 static const char *FONT_FACE = "Sans";
 
 enum layer_id {
 	BOARD_LAYER = 0,
 	HIGHLIGHT_UNDER_LAYER,
+	ATTACKS_LAYER,
 	COORDINATES_LAYER,
 	PIECES_LAYER,
 	HIGHLIGHT_OVER_LAYER,
@@ -47,6 +53,7 @@ enum layer_id {
 
 cairo_surface_t *board_layer = NULL;
 cairo_surface_t *highlight_under_layer = NULL;
+cairo_surface_t *attacks_layer = NULL;
 cairo_surface_t *coordinates_layer = NULL;
 cairo_surface_t *pieces_layer = NULL;
 cairo_surface_t *highlight_over_layer = NULL;
@@ -100,147 +107,187 @@ void apply_surface_at(cairo_t *cdc, cairo_surface_t *surf, double x, double y, d
 	cairo_fill(cdc);
 }
 
-void draw_board_surface(int width, int height) {
-
-	int j,k;
-	double tx = width / 8.0;
-	double ty = height / 8.0;
-
-	bool flipped = is_board_flipped();
-
-	// Create a "memory-buffer" surface to draw on
-	cairo_surface_destroy(board_layer);
-	board_layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-	cairo_t *cr = cairo_create(board_layer);
-
-	cairo_surface_destroy(coordinates_layer);
-	coordinates_layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-	cairo_t *coordinates_cr = cairo_create(coordinates_layer);
-
-	cairo_pattern_t *dark_square_pattern = cairo_pattern_create_rgb(dr, dg, db);
-	cairo_pattern_t *light_square_pattern = cairo_pattern_create_rgb(lr, lg, lb);
+/* Renders one light and one dark square, side by side and staggered over
+ * two ranks: the whole board is that tile repeated 4 times in each direction.
+ * The tile has whole pixel dimensions, the pattern matrix scales it back
+ * to exactly two squares so the repeat never drifts from the squares grid */
+static cairo_pattern_t *create_board_tile_pattern(double tx, double ty) {
+	int tile_w = (int) ceil(2 * tx);
+	int tile_h = (int) ceil(2 * ty);
+	double sx = tile_w / (2 * tx);
+	double sy = tile_h / (2 * ty);
+	double stx = tile_w / 2.0;
+	double sty = tile_h / 2.0;
+
+	cairo_surface_t *tile = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, tile_w, tile_h);
+	cairo_t *cr = cairo_create(tile);
 
 	// Shading on light squares
-	cairo_pattern_t *light_gradient_pattern = cairo_pattern_create_radial(.0, .0, .0, .0, .0, (tx + ty) / 3.0f);
+	cairo_pattern_t *light_gradient_pattern = cairo_pattern_create_radial(.0, .0, .0, .0, .0, (stx + sty) / 3.0f);
 	cairo_pattern_add_color_stop_rgba(light_gradient_pattern, 0.0f, dr, dg, db, 0.25f);
 	cairo_pattern_add_color_stop_rgba(light_gradient_pattern, 1.0f, dr, dg, db, 0.0f);
 
 	// Highlight on dark squares
-	cairo_pattern_t *dark_gradient_pattern = cairo_pattern_create_radial(tx, ty, .0, tx, ty, (tx + ty) / 3.0f);
+	cairo_pattern_t *dark_gradient_pattern = cairo_pattern_create_radial(stx, sty, .0, stx, sty, (stx + sty) / 3.0f);
 	cairo_pattern_add_color_stop_rgba(dark_gradient_pattern, 0.0f, lr, lg, lb, 0.25f);
 	cairo_pattern_add_color_stop_rgba(dark_gradient_pattern, 1.0f, 1, 1, 1, 0.0f);
 
-	// Draw Dark Squares
-	cairo_set_source(cr, dark_square_pattern);
-	for (j = 0; j < 8; j++) {
-		for (k = 0; k < 8; k++) {
-			if (get_square_colour(j, k)) {
-				cairo_rectangle(cr, j*tx, k*ty, tx, ty);
-				cairo_fill(cr);
-
-				// Inner shadow effect
-				cairo_save(cr);
-				cairo_translate(cr, j*tx, k*ty);
-				cairo_set_source (cr, dark_gradient_pattern);
-				cairo_rectangle(cr, 0, 0, tx, ty);
-				cairo_fill(cr);
-				cairo_restore(cr);
-
-			}
-		}
-	}
-
-	// Draw Light Squares
-	cairo_set_source(cr, light_square_pattern);
-	for (j = 0; j < 8; j++) {
-		for (k = 0; k < 8; k++) {
-			if (!get_square_colour(j, k)) {
-				cairo_rectangle(cr, j*tx, k*ty, tx, ty);
-				cairo_fill(cr);
-
-				cairo_save(cr);
-				cairo_translate(cr, j*tx, k*ty);
-				cairo_set_source (cr, light_gradient_pattern);
-				cairo_rectangle(cr, 0, 0, tx, ty);
-				cairo_fill(cr);
-				cairo_restore(cr);
+	int j, k;
+	for (j = 0; j < 2; j++) {
+		for (k = 0; k < 2; k++) {
+			bool dark = get_square_colour(j, k);
+			cairo_save(cr);
+			cairo_translate(cr, j * stx, k * sty);
+			cairo_rectangle(cr, 0, 0, stx, sty);
+			if (dark) {
+				cairo_set_source_rgb(cr, dr, dg, db);
+			} else {
+				cairo_set_source_rgb(cr, lr, lg, lb);
 			}
+			cairo_fill_preserve(cr);
+			cairo_set_source(cr, dark ? dark_gradient_pattern : light_gradient_pattern);
+			cairo_fill(cr);
+			cairo_restore(cr);
 		}
 	}
 
-	// Draw smoothing lines between squares
-	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+	// Smoothing lines between squares, the half lines on the tile edges
+	// meet the other halves from the neighbouring tiles once repeated
 	cairo_set_source_rgb(cr, (dr + lr) / 2.0f, (dg + lg) / 2.0f, (db + lb) / 2.0f);
 	cairo_set_line_width(cr, 1.0f);
+	for (j = 0; j <= 2; j++) {
+		cairo_move_to(cr, j * stx, 0);
+		cairo_line_to(cr, j * stx, tile_h);
+		cairo_move_to(cr, 0, j * sty);
+		cairo_line_to(cr, tile_w, j * sty);
+	}
+	cairo_stroke(cr);
 
-	// Vertical lines
-	for (j = 0; j <= 8; j++) {
-		cairo_move_to (cr, j * tx, 0);
-		cairo_line_to(cr, j * tx, height);
+	cairo_destroy(cr);
+	cairo_pattern_destroy(dark_gradient_pattern);
+	cairo_pattern_destroy(light_gradient_pattern);
+
+	cairo_pattern_t *pattern = cairo_pattern_create_for_surface(tile);
+	cairo_surface_destroy(tile);
+	cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+	cairo_matrix_t matrix;
+	cairo_matrix_init_scale(&matrix, sx, sy);
+	cairo_pattern_set_matrix(pattern, &matrix);
+	return pattern;
+}
+
+#define COORD_GLYPH_PADDING 2
+
+/* Coordinate glyphs as alpha masks, rendered once per font size:
+ * files 'a' to 'h' then ranks '1' to '8' */
+static cairo_surface_t *coord_glyphs[16];
+static int coord_glyph_sizes[16][2];
+static char coord_glyphs_font[32];
+
+static int coord_glyph_index(char coord) {
+	return coord >= 'a' ? coord - 'a' : 8 + coord - '1';
+}
+
+static void update_coord_glyphs(const char *font_str) {
+	if (coord_glyphs[0] != NULL && !strcmp(font_str, coord_glyphs_font)) {
+		return;
+	}
+	strncpy(coord_glyphs_font, font_str, sizeof(coord_glyphs_font) - 1);
+
+	cairo_surface_t *scratch = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+	cairo_t *scratch_cr = cairo_create(scratch);
+	PangoLayout *layout = pango_cairo_create_layout(scratch_cr);
+	PangoFontDescription *desc = pango_font_description_from_string(font_str);
+	pango_font_description_set_weight(desc, PANGO_WEIGHT_SEMIBOLD);
+	pango_layout_set_font_description(layout, desc);
+	pango_font_description_free(desc);
+
+	for (int i = 0; i < 16; i++) {
+		char coord = (char) (i < 8 ? 'a' + i : '1' + i - 8);
+		pango_layout_set_text(layout, &coord, 1);
+		pango_layout_get_pixel_size(layout, &coord_glyph_sizes[i][0], &coord_glyph_sizes[i][1]);
+
+		cairo_surface_destroy(coord_glyphs[i]);
+		coord_glyphs[i] = cairo_image_surface_create(CAIRO_FORMAT_A8,
+		                                             coord_glyph_sizes[i][0] + 2 * COORD_GLYPH_PADDING,
+		                                             coord_glyph_sizes[i][1] + 2 * COORD_GLYPH_PADDING);
+		cairo_t *glyph_cr = cairo_create(coord_glyphs[i]);
+		cairo_translate(glyph_cr, COORD_GLYPH_PADDING, COORD_GLYPH_PADDING);
+		pango_cairo_update_layout(glyph_cr, layout);
+		pango_cairo_show_layout(glyph_cr, layout);
+		cairo_destroy(glyph_cr);
+	}
+
+	g_object_unref(layout);
+	cairo_destroy(scratch_cr);
+	cairo_surface_destroy(scratch);
+}
+
+static void show_coord_glyph(cairo_t *cr, char coord, double x, double y, bool light) {
+	if (light) {
+		cairo_set_source_rgb(cr, lr, lg, lb);
+	} else {
+		cairo_set_source_rgb(cr, dr, dg, db);
 	}
-	// Horizontal lines
-	for (j = 0; j <= 8; j++) {
-		cairo_move_to (cr, 0, j * ty);
-		cairo_line_to(cr, width, j * ty);
+	cairo_mask_surface(cr, coord_glyphs[coord_glyph_index(coord)], x - COORD_GLYPH_PADDING, y - COORD_GLYPH_PADDING);
+}
+
+void draw_board_surface(int width, int height) {
+
+	int j;
+	double tx = width / 8.0;
+	double ty = height / 8.0;
+
+	bool flipped = is_board_flipped();
+
+	// The squares don't depend on orientation, flipping only redraws the coordinates
+	if (board_layer == NULL || cairo_image_surface_get_width(board_layer) != width ||
+	    cairo_image_surface_get_height(board_layer) != height) {
+		cairo_surface_destroy(board_layer);
+		board_layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+		cairo_t *cr = cairo_create(board_layer);
+		cairo_pattern_t *tile_pattern = create_board_tile_pattern(tx, ty);
+		cairo_set_source(cr, tile_pattern);
+		cairo_paint(cr);
+		cairo_pattern_destroy(tile_pattern);
+		cairo_destroy(cr);
 	}
-	cairo_stroke (cr);
+
+	cairo_surface_destroy(coordinates_layer);
+	coordinates_layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	cairo_t *coordinates_cr = cairo_create(coordinates_layer);
 
 	// Draw coordinates
-	PangoFontDescription *desc;
-	PangoLayout *layout;
-	layout = pango_cairo_create_layout(coordinates_cr);
 	char font_str[32];
 	float font_size = (float) (10 * tx / 100.0f);
 	sprintf(font_str, "%s %.1f", FONT_FACE, font_size);
-	desc = pango_font_description_from_string(font_str);
-	pango_font_description_set_weight(desc, PANGO_WEIGHT_SEMIBOLD);
-	pango_layout_set_font_description(layout, desc);
-	pango_font_description_free(desc);
+	update_coord_glyphs(font_str);
 
 	double padding = tx / 60.0;
-	char coord[1];
-	bool light;
 
 	// Column names
-	light = true;
-	for (j = 0; j <= 8; j++) {
-		cairo_save(coordinates_cr);
-		cairo_set_source(coordinates_cr, light ? light_square_pattern : dark_square_pattern);
-		coord[0] = (char) (flipped ? 'h' - j : 'a' + j);
-		pango_layout_set_text(layout, coord, 1);
-		int pix_width;
-		int pix_height;
-		pango_layout_get_pixel_size(layout, &pix_width, &pix_height);
-		cairo_translate(coordinates_cr, (j * tx) + padding, height - pix_height - padding);
-		pango_cairo_show_layout(coordinates_cr, layout);
-		cairo_restore(coordinates_cr);
-		light = !light;
+	for (j = 0; j < 8; j++) {
+		char coord = (char) (flipped ? 'h' - j : 'a' + j);
+		int *size = coord_glyph_sizes[coord_glyph_index(coord)];
+		show_coord_glyph(coordinates_cr, coord, (j * tx) + padding, height - size[1] - padding, !(j % 2));
 	}
 
 	// Rank numbers
-	light = true;
-	for (j = 0; j <= 8; j++) {
-		cairo_save(coordinates_cr);
-		cairo_set_source(coordinates_cr, light ? light_square_pattern : dark_square_pattern);
-		coord[0] = (char) (flipped ? '1' + j : '8' - j);
-		pango_layout_set_text(layout, coord, 1);
-		int pix_width;
-		int pix_height;
-		pango_layout_get_pixel_size(layout, &pix_width, &pix_height);
-		cairo_translate(coordinates_cr, width - pix_width - padding, (j * tx) + padding);
-		pango_cairo_show_layout(coordinates_cr, layout);
-		cairo_restore(coordinates_cr);
-		light = !light;
+	for (j = 0; j < 8; j++) {
+		char coord = (char) (flipped ? '1' + j : '8' - j);
+		int *size = coord_glyph_sizes[coord_glyph_index(coord)];
+		show_coord_glyph(coordinates_cr, coord, width - size[0] - padding, (j * tx) + padding, !(j % 2));
 	}
 
-	cairo_destroy(cr);
 	cairo_destroy(coordinates_cr);
-	cairo_pattern_destroy(dark_square_pattern);
-	cairo_pattern_destroy(light_square_pattern);
-	cairo_pattern_destroy(dark_gradient_pattern);
-	cairo_pattern_destroy(light_gradient_pattern);
 }
 
+/* Makes the next draw_board_surface() repaint the squares, after the board
+ * colours have changed */
+void invalidate_board_layer(void) {
+	cairo_surface_destroy(board_layer);
+	board_layer = NULL;
+}
 
 void rebuild_surfaces(int swi, int shi) {
 	// re-render source surfaces only if size has changed
@@ -404,6 +451,11 @@ void paint_layers(cairo_t *cdc) {
 	cairo_set_source_surface(cdc, highlight_under_layer, 0.0f, 0.0f);
 	cairo_paint(cdc);
 
+	// Attack map
+	if (attacks_layer_source(cdc)) {
+		cairo_paint(cdc);
+	}
+
 	// Coordinates
 	cairo_set_source_surface(cdc, coordinates_layer, 0.0f, 0.0f);
 	cairo_paint(cdc);
@@ -427,6 +479,160 @@ void init_highlight_over_surface(int wi, int hi) {
 	highlight_over_layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, wi, hi);
 }
 
+/* Tints a square with the side that controls it, writes how many times
+ * White (bottom right) and Black (top left) attack it and frames hanging pieces */
+static void paint_attack_square(cairo_t *dc, const attack_map *map, int col, int row, int wi, int hi) {
+	int sq = ATTACK_MAP_SQUARE(col, row);
+	double ww = wi / 8.0f;
+	double hh = hi / 8.0f;
+	double xy[2];
+	loc_to_xy(col, row, xy, wi, hi);
+	double x0 = xy[0] - ww / 2.0f;
+	double y0 = xy[1] - hh / 2.0f;
+
+	cairo_save(dc);
+	cairo_rectangle(dc, x0, y0, ww, hh);
+	cairo_clip(dc);
+	cairo_set_operator(dc, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(dc);
+	cairo_set_operator(dc, CAIRO_OPERATOR_OVER);
+
+	int white = map->attackers[0][sq];
+	int black = map->attackers[1][sq];
+	int balance = white - black;
+	if (balance) {
+		double alpha = .12f * MIN(abs(balance), 3);
+		if (balance > 0) {
+			cairo_set_source_rgba(dc, .2f, .45f, 1.0f, alpha);
+		} else {
+			cairo_set_source_rgba(dc, 1.0f, .3f, .2f, alpha);
+		}
+		cairo_paint(dc);
+	}
+
+	if (map->hanging & (1ULL << sq)) {
+		cairo_set_line_width(dc, ww / 16.0f);
+		cairo_set_source_rgba(dc, 1.0f, .55f, 0.0f, .9f);
+		cairo_rectangle(dc, x0 + ww / 32.0f, y0 + hh / 32.0f, ww - ww / 16.0f, hh - hh / 16.0f);
+		cairo_stroke(dc);
+	}
+
+	char count[4];
+	cairo_text_extents_t extents;
+	cairo_select_font_face(dc, FONT_FACE, CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+	cairo_set_font_size(dc, hh / 6.0f);
+	if (white) {
+		snprintf(count, sizeof(count), "%d", white);
+		cairo_text_extents(dc, count, &extents);
+		cairo_move_to(dc, x0 + ww - ww / 16.0f - extents.x_advance, y0 + hh - hh / 16.0f);
+		cairo_set_source_rgba(dc, .1f, .25f, .8f, .9f);
+		cairo_show_text(dc, count);
+	}
+	if (black) {
+		snprintf(count, sizeof(count), "%d", black);
+		cairo_text_extents(dc, count, &extents);
+		cairo_move_to(dc, x0 + ww / 16.0f, y0 + hh / 16.0f - extents.y_bearing);
+		cairo_set_source_rgba(dc, .8f, .15f, .1f, .9f);
+		cairo_show_text(dc, count);
+	}
+	cairo_restore(dc);
+}
+
+/* Sets the attack map as source, for the code that stacks layers by hand.
+ * Returns false when the overlay is off */
+static bool attacks_layer_source(cairo_t *dc) {
+	if (attacks_layer == NULL || !attack_map_enabled()) {
+		return false;
+	}
+	cairo_set_source_surface(dc, attacks_layer, 0.0f, 0.0f);
+	return true;
+}
+
+/* Paints all the squares from the latest map worked out */
+void init_attacks_surface(int wi, int hi) {
+	cairo_surface_destroy(attacks_layer);
+	attacks_layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, wi, hi);
+	if (!attack_map_enabled()) {
+		return;
+	}
+	attack_map map;
+	attack_map_get(&map);
+	cairo_t *attacks_cr = cairo_create(attacks_layer);
+	for (int col = 0; col < 8; col++) {
+		for (int row = 0; row < 8; row++) {
+			paint_attack_square(attacks_cr, &map, col, row, wi, hi);
+		}
+	}
+	cairo_destroy(attacks_cr);
+}
+
+/* Attack map listener, runs with the GDK lock held: only the squares whose
+ * figures changed are painted again, on the overlay, the cache layer, the
+ * dragging background and the window */
+static void on_attacks_changed(uint64_t squares) {
+	if (!attack_map_enabled() || attacks_layer == NULL || cache_layer == NULL) {
+		return;
+	}
+	int wi = old_wi;
+	int hi = old_hi;
+	attack_map map;
+	attack_map_get(&map);
+
+	cairo_t *attacks_cr = cairo_create(attacks_layer);
+	cairo_t *cache_dc = cairo_create(cache_layer);
+	cairo_t *drag_dc = cairo_create(dragging_background);
+	for (uint64_t left = squares; left; left &= left - 1) {
+		int sq = __builtin_ctzll(left);
+		int col = sq % 8;
+		int row = sq / 8;
+		paint_attack_square(attacks_cr, &map, col, row, wi, hi);
+		square_to_rectangle(cache_dc, col, row, wi, hi);
+		square_to_rectangle(drag_dc, col, row, wi, hi);
+	}
+	cairo_destroy(attacks_cr);
+
+	cairo_clip(cache_dc);
+	paint_layers(cache_dc);
+	if (mouse_dragged_piece != NULL && is_moveit_flag()) {
+		double dragged_x, dragged_y;
+		get_dragging_prev_xy(&dragged_x, &dragged_y);
+		cairo_set_source_surface(cache_dc, mouse_dragged_piece->surf, dragged_x - wi / 16.0f, dragged_y - hi / 16.0f);
+		cairo_set_operator(cache_dc, CAIRO_OPERATOR_OVER);
+		cairo_paint(cache_dc);
+	}
+	cairo_destroy(cache_dc);
+
+	// the dragging background holds everything but the dragged piece
+	cairo_clip(drag_dc);
+	paint_layers(drag_dc);
+	cairo_destroy(drag_dc);
+
+	if (is_scaled) {
+		gtk_widget_queue_draw(board);
+		return;
+	}
+	cairo_t *cdr = gdk_cairo_create(gtk_widget_get_window(board));
+	for (uint64_t left = squares; left; left &= left - 1) {
+		int sq = __builtin_ctzll(left);
+		square_to_rectangle(cdr, sq % 8, sq / 8, wi, hi);
+	}
+	cairo_clip(cdr);
+	present_cache_layer(cdr, CAIRO_OPERATOR_SOURCE);
+	cairo_destroy(cdr);
+}
+
+/* Shows or hides the attack map, runs with the GDK lock held */
+void set_attack_overlay(bool on) {
+	attack_map_set_listener(on_attacks_changed);
+	attack_map_set_enabled(on);
+	if (old_wi > 0) {
+		init_attacks_surface(old_wi, old_hi);
+		init_dragging_background(old_wi, old_hi);
+		gtk_widget_queue_draw(board);
+	}
+	attack_map_update();
+}
+
 void draw_full_update(cairo_t *cdr, int wi, int hi) {
 
 	rebuild_surfaces(wi, hi);
@@ -457,6 +663,8 @@ void draw_full_update(cairo_t *cdr, int wi, int hi) {
 		highlight_pre_move(prev_highlighted_pre_move, wi, hi);
 	}
 
+	init_attacks_surface(wi, hi);
+
 	// FIXME: is this the best place for this?
 	init_dragging_background(wi, hi);
 	old_wi = wi;
@@ -643,7 +851,21 @@ void clean_highlight_surface(int col, int row, int wi, int hi) {
 	cairo_destroy(highlight);
 }
 
-static gboolean animate_one_step(gpointer data) {
+/* Copies the clipped region of the cache layer to the window, or under
+ * heavy load leaves it to the next frame, merged with the other repaints */
+static void present_cache_layer(cairo_t *cdr, cairo_operator_t op) {
+	if (render_quality_coalesce()) {
+		double x1, y1, x2, y2;
+		cairo_clip_extents(cdr, &x1, &y1, &x2, &y2);
+		gtk_widget_queue_draw_area(board, (int) floor(x1), (int) floor(y1), (int) ceil(x2 - x1) + 1, (int) ceil(y2 - y1) + 1);
+		return;
+	}
+	cairo_set_operator(cdr, op);
+	cairo_set_source_surface(cdr, cache_layer, 0.0f, 0.0f);
+	cairo_paint(cdr);
+}
+
+static gboolean paint_animation_step(gpointer data) {
 
 	if (!is_running_flag()) {
 		return FALSE;
@@ -721,6 +943,9 @@ static gboolean animate_one_step(gpointer data) {
 			cairo_set_operator(cdr, CAIRO_OPERATOR_OVER);
 			cairo_set_source_surface(dragging_dc, highlight_under_layer, 0.0f, 0.0f);
 			cairo_paint(dragging_dc);
+			if (attacks_layer_source(dragging_dc)) {
+				cairo_paint(dragging_dc);
+			}
 			cairo_set_source_surface(dragging_dc, coordinates_layer, 0.0f, 0.0f);
 			cairo_paint(dragging_dc);
 			cairo_set_source_surface(dragging_dc, anim->piece->surf, killed_xy[0] - wi / 16, killed_xy[1] - hi / 16);
@@ -846,9 +1071,7 @@ static gboolean animate_one_step(gpointer data) {
 	cairo_clip(cdr);
 
 	// apply buffered surface to cr (NB: cr is clipped)
-	cairo_set_operator(cdr, CAIRO_OPERATOR_SOURCE);
-	cairo_set_source_surface(cdr, cache_layer, 0.0f, 0.0f);
-	cairo_paint(cdr);
+	present_cache_layer(cdr, CAIRO_OPERATOR_SOURCE);
 
 	// debug
 //	cairo_set_operator (cdr, CAIRO_OPERATOR_OVER);
@@ -881,6 +1104,9 @@ static gboolean animate_one_step(gpointer data) {
 		cairo_set_operator (cache_dc, CAIRO_OPERATOR_OVER);
 		cairo_set_source_surface(cache_dc, highlight_under_layer, 0.0f, 0.0f);
 		cairo_fill_preserve(cache_dc);
+		if (attacks_layer_source(cache_dc)) {
+			cairo_fill_preserve(cache_dc);
+		}
 		cairo_set_source_surface(cache_dc, coordinates_layer, 0.0f, 0.0f);
 		cairo_fill_preserve(cache_dc);
 		cairo_set_source_surface(cache_dc, pieces_layer, 0.0f, 0.0f);
@@ -942,6 +1168,9 @@ static gboolean animate_one_step(gpointer data) {
 			cairo_set_source_surface(cache_dc, board_layer, 0.0f, 0.0f);
 			cairo_fill_preserve(cache_dc);
 			cairo_set_operator (cache_dc, CAIRO_OPERATOR_OVER);
+			if (attacks_layer_source(cache_dc)) {
+				cairo_fill_preserve(cache_dc);
+			}
 			cairo_set_source_surface(cache_dc, coordinates_layer, 0.0f, 0.0f);
 			//cairo_fill(cache_dc);
 			// If a piece is being dragged and overlaps with the animation final step
@@ -966,6 +1195,9 @@ static gboolean animate_one_step(gpointer data) {
 			cairo_set_source_surface(cache_dc, board_layer, 0.0f, 0.0f);
 			cairo_fill_preserve(cache_dc);
 			cairo_set_operator (cache_dc, CAIRO_OPERATOR_OVER);
+			if (attacks_layer_source(cache_dc)) {
+				cairo_fill_preserve(cache_dc);
+			}
 			cairo_set_source_surface(cache_dc, coordinates_layer, 0.0f, 0.0f);
 			cairo_fill_preserve(cache_dc);
 			cairo_set_source_surface(cache_dc, pieces_layer, 0.0f, 0.0f);
@@ -1039,10 +1271,7 @@ static gboolean animate_one_step(gpointer data) {
 		// Actual clip
 		cairo_clip(cdr);
 
-		cairo_set_source_surface(cdr, cache_layer, 0.0f, 0.0f);
-		cairo_set_operator (cdr, CAIRO_OPERATOR_OVER);
-		//cairo_set_operator (cdr, CAIRO_OPERATOR_SOURCE);
-		cairo_paint(cdr);
+		present_cache_layer(cdr, CAIRO_OPERATOR_OVER);
 
 		// debug : uncomment the following to highlight repainted areas
 //		cairo_set_source_rgba (cdr, 0.0f, 1.0f, 0.0f, .75f);
@@ -1067,6 +1296,26 @@ static gboolean animate_one_step(gpointer data) {
 
 }
 
+#define ANIM_STEP_INTERVAL 8 // ms
+
+/* Times every step for the render quality controller: painting, waiting
+ * for the GDK lock and how late the main loop ran us */
+static gboolean animate_one_step(gpointer data) {
+	struct anim_data *anim = (struct anim_data *) data;
+	int64_t start = time_now_us();
+	int64_t late = anim->last_step_time ? start - anim->last_step_time - ANIM_STEP_INTERVAL * 1000 : 0;
+
+	gboolean more = paint_animation_step(anim);
+
+	int64_t end = time_now_us();
+	render_quality_frame(end - start, late);
+	if (more) {
+		// anim is freed on the last step
+		anim->last_step_time = end;
+	}
+	return more;
+}
+
 void highlight_pre_move(int pre_move[4], int wi, int hi) {
 	for (int i = 0; i < 4; ++i) {
 		prev_highlighted_pre_move[i] = pre_move[i];
@@ -1284,9 +1533,7 @@ gboolean auto_move(chess_piece *piece, int new_col, int new_row, int check_legal
 		cairo_destroy(cache_dc);
 
 		cairo_clip(cdr);
-		cairo_set_source_surface(cdr, cache_layer, 0.0f, 0.0f);
-		cairo_set_operator(cdr, CAIRO_OPERATOR_SOURCE);
-		cairo_paint(cdr);
+		present_cache_layer(cdr, CAIRO_OPERATOR_SOURCE);
 		cairo_destroy(cdr);
 		if (lock_threads) {
 			gdk_threads_leave();
@@ -1298,49 +1545,19 @@ gboolean auto_move(chess_piece *piece, int new_col, int new_row, int check_legal
 		loc_to_xy(old_col, old_row, o_xy, wi, hi);
 		loc_to_xy(new_col, new_row, n_xy, wi, hi);
 
-		double points_to_plot = sqrt( pow(abs(n_xy[0]-o_xy[0]), 2) + pow(abs(n_xy[1]-o_xy[1]), 2));
-		points_to_plot *= 5.0f * 16.0f / (wi + hi);
-		//points_to_plot *= 10.0f*5.0f*16.0f/(wi+hi);
-		//printf("POINTS TO PLOT == %f, wi %d, hi %d\n", points_to_plot, wi, hi);
-		if (points_to_plot < 12) {
-			points_to_plot = 12;
-		} else if (points_to_plot < 16) {
-			points_to_plot = 16;
-		} else if (points_to_plot > 22) {
-			points_to_plot = 22;
-		}
-
-		double mid[2];
-		if (piece->type != W_KNIGHT && piece->type != B_KNIGHT) {
-			mid[0] = (n_xy[0] + o_xy[0]) / 2.0;
-			mid[1] = (n_xy[1] + o_xy[1]) / 2.0;
-		} else {
-			points_to_plot = 14;
-			if (abs(n_xy[0] - o_xy[0]) > abs(n_xy[1] - o_xy[1])) {
-				// long step along X axis
-				mid[0] = n_xy[0] + (n_xy[0] > o_xy[0] ? -1 : 1) * wi / 8.0;
-				mid[1] = o_xy[1];
-			} else {
-				// long step along Y axis
-				mid[0] = o_xy[0];
-				mid[1] = n_xy[1] + (n_xy[1] > o_xy[1] ? -1 : 1) * hi / 8.0;
-			}
-		}
-
-		points_to_plot *= 2.0f;
-//		points_to_plot /= 3.0f;
-
 		double **anim_steps;
 		// this will be freed when we free the anim structure!
 
-		anim_steps = malloc(ANIM_SIZE*sizeof(int*));
+		anim_steps = malloc(ANIM_SIZE*sizeof(double*));
 		int i;
 		for (i=0; i<ANIM_SIZE; i++) {
-			anim_steps[i] = malloc(2*sizeof(int));
+			anim_steps[i] = malloc(2*sizeof(double));
 		}
-		int n_anim_steps;
+		int n_anim_steps = plot_move_path(piece->type, o_xy, n_xy, wi, hi, anim_steps);
 
-		plot_coords(o_xy, mid, n_xy, (int) points_to_plot, anim_steps, &n_anim_steps);
+		// moves still being animated means we are falling behind
+		render_quality_backlog((int) g_hash_table_size(anims_map));
+		n_anim_steps = render_quality_thin_path(anim_steps, n_anim_steps);
 
 		struct anim_data *animation = malloc(sizeof(struct anim_data));
 		animation->old_col = old_col;
@@ -1361,6 +1578,7 @@ gboolean auto_move(chess_piece *piece, int new_col, int new_row, int check_legal
 		animation->step_index = 1;
 		animation->move_source = move_source;
 		animation->killed_by = KILLED_BY_NONE;
+		animation->last_step_time = 0;
 
 		struct anim_data *old_anim = get_anim_for_piece(animation->piece);
 		if (old_anim) {
@@ -1378,7 +1596,7 @@ gboolean auto_move(chess_piece *piece, int new_col, int new_row, int check_legal
 
 //		g_timeout_add(1000/240, animate_one_step, animation);
 //		g_timeout_add(1000/60, animate_one_step, animation);
-		g_timeout_add(8, animate_one_step, animation);
+		g_timeout_add(ANIM_STEP_INTERVAL, animate_one_step, animation);
 		return TRUE;
 	}
 
@@ -1421,6 +1639,9 @@ static void update_dragging_background(chess_piece *piece, int wi, int hi) {
 	cairo_set_operator(drag_dc, CAIRO_OPERATOR_OVER);
 	cairo_set_source_surface(drag_dc, highlight_under_layer, 0.0f, 0.0f);
 	cairo_fill_preserve(drag_dc);
+	if (attacks_layer_source(drag_dc)) {
+		cairo_fill_preserve(drag_dc);
+	}
 	cairo_set_source_surface(drag_dc, coordinates_layer, 0.0f, 0.0f);
 //	cairo_fill_preserve(drag_dc);
 //	cairo_set_source_surface(drag_dc, highlight_over_layer, 0.0f, 0.0f);
@@ -1731,6 +1952,9 @@ void handle_left_mouse_up(void) {
 			cairo_set_source_surface(cache_dc, board_layer, 0.0f, 0.0f);
 			cairo_fill_preserve(cache_dc);
 			cairo_set_operator (cache_dc, CAIRO_OPERATOR_OVER);
+			if (attacks_layer_source(cache_dc)) {
+				cairo_fill_preserve(cache_dc);
+			}
 			cairo_set_source_surface(cache_dc, coordinates_layer, 0.0f, 0.0f);
 			cairo_fill(cache_dc);
 
@@ -1741,6 +1965,9 @@ void handle_left_mouse_up(void) {
 			cairo_set_source_surface(cache_dc, board_layer, 0.0f, 0.0f);
 			cairo_fill_preserve(cache_dc);
 			cairo_set_operator (cache_dc, CAIRO_OPERATOR_OVER);
+			if (attacks_layer_source(cache_dc)) {
+				cairo_fill_preserve(cache_dc);
+			}
 			cairo_set_source_surface(cache_dc, coordinates_layer, 0.0f, 0.0f);
 			cairo_fill_preserve(cache_dc);
 			cairo_set_source_surface(cache_dc, pieces_layer, 0.0f, 0.0f);
@@ -2195,6 +2422,7 @@ void *process_moves(void *ptr) {
 
 		if (is_moveit_flag() && is_more_events_flag()) {
 
+			int64_t frame_start = time_now_us();
 			gdk_threads_enter();
 
 			int wi = gtk_widget_get_allocated_width(board);
@@ -2286,15 +2514,57 @@ void *process_moves(void *ptr) {
 			set_dragging_prev_xy(new_x, new_y);
 
 			gdk_threads_leave();
+			render_quality_frame(time_now_us() - frame_start, 0);
 
 		}
 //		usleep(1000000/120);
 //		usleep(1000000/60);
-		usleep(3000);
+		// motion events coming in meanwhile are collapsed into the last one
+		time_sleep_us(render_quality_drag_interval_us());
 	}
 	return 0;
 }
 
+/* Eased path of a piece moving from o_xy to n_xy: straight for most pieces,
+ * knights take their long step first. Returns the number of points in plots */
+int plot_move_path(int piece_type, double o_xy[2], double n_xy[2], int wi, int hi, double **plots) {
+	double points_to_plot = sqrt( pow(fabs(n_xy[0]-o_xy[0]), 2) + pow(fabs(n_xy[1]-o_xy[1]), 2));
+	points_to_plot *= 5.0f * 16.0f / (wi + hi);
+	//points_to_plot *= 10.0f*5.0f*16.0f/(wi+hi);
+	//printf("POINTS TO PLOT == %f, wi %d, hi %d\n", points_to_plot, wi, hi);
+	if (points_to_plot < 12) {
+		points_to_plot = 12;
+	} else if (points_to_plot < 16) {
+		points_to_plot = 16;
+	} else if (points_to_plot > 22) {
+		points_to_plot = 22;
+	}
+
+	double mid[2];
+	if (piece_type != W_KNIGHT && piece_type != B_KNIGHT) {
+		mid[0] = (n_xy[0] + o_xy[0]) / 2.0;
+		mid[1] = (n_xy[1] + o_xy[1]) / 2.0;
+	} else {
+		points_to_plot = 14;
+		if (fabs(n_xy[0] - o_xy[0]) > fabs(n_xy[1] - o_xy[1])) {
+			// long step along X axis
+			mid[0] = n_xy[0] + (n_xy[0] > o_xy[0] ? -1 : 1) * wi / 8.0;
+			mid[1] = o_xy[1];
+		} else {
+			// long step along Y axis
+			mid[0] = o_xy[0];
+			mid[1] = n_xy[1] + (n_xy[1] > o_xy[1] ? -1 : 1) * hi / 8.0;
+		}
+	}
+
+	points_to_plot *= 2.0f;
+//	points_to_plot /= 3.0f;
+
+	int n_plots;
+	plot_coords(o_xy, mid, n_xy, (int) points_to_plot, plots, &n_plots);
+	return n_plots;
+}
+
 /* Generate an array of xy coordinates to animate a move from start->mid->end. */
 // FIXME: review this
 static void plot_coords(double start[2], double mid[2], double end[2], int points_to_plot, double **plots, int *nPlots) {
@@ -2445,6 +2715,7 @@ void choose_promote(int last_promote, bool only_surfaces, bool only_logical, int
 
 	if (!only_surfaces) {
 		logical_promote(last_promote);
+		main_game_changed();
 	}
 
 	if (!only_logical) {
@@ -2548,13 +2819,18 @@ void choose_promote_handler(void *GtkWidget, gpointer value) {
 	choose_promote(GPOINTER_TO_INT(value), false, false, p_old_col, p_old_row, to_promote->pos.column, to_promote->pos.row);
 }
 
-void reset_board(void) {
-	set_board_flipped(false);
+/* Forgets the selection, check and last move highlights */
+void reset_highlights(void) {
 	mouse_clicked[0] = -1;
 	mouse_clicked[1] = -1;
 	king_in_check_piece = NULL;
 	mouse_clicked_piece = NULL;
 	prev_highlighted_move[0] = -1;
+}
+
+void reset_board(void) {
+	set_board_flipped(false);
+	reset_highlights();
 	// Need to reassign surfaces in case of promotions during previous game
 	assign_surfaces();
 	init_highlight_under_surface(old_wi, old_hi);
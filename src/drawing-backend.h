@@ -15,6 +15,7 @@
 
 void *process_moves(void *ptr);
 void reset_board(void);
+void reset_highlights(void);
 void draw_full_update(cairo_t *cdr, int wi, int hi);
 void draw_scaled(cairo_t *cdr, int wi, int hi);
 void draw_cheap_repaint(cairo_t *cdr, int wi, int hi);
@@ -26,7 +27,10 @@ void handle_flip_board(GtkWidget *pWidget, bool lock_threads);
 void init_dragging_background(int wi, int hi);
 void init_highlight_under_surface(int wi, int hi);
 void init_highlight_over_surface(int wi, int hi);
+void init_attacks_surface(int wi, int hi);
+void set_attack_overlay(bool on);
 void draw_board_surface(int wi, int hi);
+void invalidate_board_layer(void);
 void draw_pieces_surface(int wi, int hi);
 void highlight_move(int source_col, int source_row, int dest_col, int dest_row, int wi, int hi);
 void highlight_pre_move(int pre_move[4], int wi, int hi);
@@ -38,6 +42,10 @@ void choose_promote_handler(void *GtkWidget, gpointer value);
 void choose_promote_deactivate_handler(void *GtkWidget, gpointer value, gboolean only_surfaces);
 
 void init_anims_map(void);
+struct anim_data *get_anim_for_piece(chess_piece *piece);
+int plot_move_path(int piece_type, double o_xy[2], double n_xy[2], int wi, int hi, double **plots);
+void update_pieces_surfaces(int wi, int hi);
+void apply_surface_at(cairo_t *cdc, cairo_surface_t *surf, double x, double y, double w, double h);
 
 // TEST
 gboolean test_animate_random_step(gpointer data);
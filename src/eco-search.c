@@ -0,0 +1,313 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <gtk/gtk.h>
+
+#include "cairo-board.h"
+#include "memory-budget.h"
+#include "eco-search.h"
+
+#define ECO_SEARCH_MAX_RESULTS 50
+#define ECO_SEARCH_MIN_KEY_LENGTH 2
+// shorter queries only match the start of the ECO codes, e.g. "B9"
+#define ECO_SEARCH_MIN_NAME_KEY_LENGTH 3
+
+enum {
+	ECO_COLUMN_DESCRIPTION = 0,
+	ECO_COLUMN_LINE,
+	ECO_N_COLUMNS
+};
+
+/* Names are folded to lower case ASCII so "tubingen" finds "Tübingen".
+ * Every trigram of a folded name maps to the ascending ids of the
+ * entries containing it: a query only looks at the entries of its
+ * rarest trigram and confirms them with strstr(). The trigrams are the
+ * MEM_CACHES evictor's to drop, searches then check every name */
+typedef struct {
+	const char *san_line;
+	const char *description;
+	char *folded;
+	size_t line_len;
+} eco_entry;
+
+typedef struct {
+	const eco_entry *entry;
+	int rank;
+} eco_candidate;
+
+/* The best matches found so far, as a heap with the worst of them on top:
+ * a common trigram has tens of thousands of entries, only the few shown
+ * are kept and sorted */
+typedef struct {
+	eco_candidate *items;
+	int len;
+	int size;
+} eco_best;
+
+static GArray *entries = NULL;
+static GHashTable *trigrams = NULL;
+static long trigram_bytes = 0;
+
+static char *fold_text(const char *text) {
+	gchar *ascii = g_str_to_ascii(text, "C");
+	gchar *folded = g_ascii_strdown(ascii, -1);
+	g_free(ascii);
+	return folded;
+}
+
+static inline guint trigram_key(const char *s) {
+	return (guint) (unsigned char) s[0] | (guint) (unsigned char) s[1] << 8 | (guint) (unsigned char) s[2] << 16;
+}
+
+static void free_postings(gpointer data) {
+	g_array_free(data, TRUE);
+}
+
+/* The strings are kept, not copied: they belong to the ECO table */
+/* MEM_CACHES evictor */
+static bool drop_trigrams(void) {
+	if (trigrams == NULL) {
+		return false;
+	}
+	debug("Dropping the ECO search trigrams to fit the memory budget\n");
+	g_hash_table_destroy(trigrams);
+	trigrams = NULL;
+	mem_budget_account(MEM_CACHES, -trigram_bytes);
+	trigram_bytes = 0;
+	return true;
+}
+
+void eco_search_add(const char *san_line, const char *description) {
+	if (entries == NULL) {
+		entries = g_array_new(FALSE, FALSE, sizeof(eco_entry));
+		trigrams = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free_postings);
+		mem_budget_set_evictor(MEM_CACHES, drop_trigrams);
+	}
+	eco_entry entry = {san_line, description, fold_text(description), strlen(san_line)};
+	guint32 id = entries->len;
+	g_array_append_val(entries, entry);
+
+	size_t len = strlen(entry.folded);
+	mem_budget_account(MEM_CACHES, (long) (sizeof(eco_entry) + len + 1));
+	long bytes = 0;
+	for (size_t i = 0; trigrams != NULL && i + 3 <= len; i++) {
+		gpointer key = GUINT_TO_POINTER(trigram_key(entry.folded + i));
+		GArray *postings = g_hash_table_lookup(trigrams, key);
+		if (postings == NULL) {
+			postings = g_array_new(FALSE, FALSE, sizeof(guint32));
+			g_hash_table_insert(trigrams, key, postings);
+		}
+		// a name repeating a trigram is listed once
+		if (postings->len == 0 || g_array_index(postings, guint32, postings->len - 1) != id) {
+			g_array_append_val(postings, id);
+			bytes += sizeof(guint32);
+		}
+	}
+	trigram_bytes += bytes;
+	mem_budget_account(MEM_CACHES, bytes);
+}
+
+/* Matches at the start of the name first, then at the start of a word,
+ * then the shortest lines, i.e. the main variations */
+static int rank_match(const eco_entry *entry, const char *found) {
+	// skip the "B90 " code
+	const char *name = strlen(entry->folded) > 4 ? entry->folded + 4 : entry->folded;
+	if (found == name) {
+		return 0;
+	}
+	if (found == entry->folded || !g_ascii_isalnum(found[-1])) {
+		return 1;
+	}
+	return 2;
+}
+
+static int compare_candidates(const void *a, const void *b) {
+	const eco_candidate *ca = a;
+	const eco_candidate *cb = b;
+	if (ca->rank != cb->rank) {
+		return ca->rank - cb->rank;
+	}
+	size_t la = ca->entry->line_len;
+	size_t lb = cb->entry->line_len;
+	if (la != lb) {
+		return la < lb ? -1 : 1;
+	}
+	return ca->entry < cb->entry ? -1 : ca->entry > cb->entry;
+}
+
+static void best_sift_up(eco_best *best, int i) {
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (compare_candidates(&best->items[parent], &best->items[i]) >= 0) {
+			break;
+		}
+		eco_candidate tmp = best->items[parent];
+		best->items[parent] = best->items[i];
+		best->items[i] = tmp;
+		i = parent;
+	}
+}
+
+static void best_sift_down(eco_best *best, int i) {
+	for (;;) {
+		int worst = i;
+		for (int child = 2 * i + 1; child <= 2 * i + 2 && child < best->len; child++) {
+			if (compare_candidates(&best->items[child], &best->items[worst]) > 0) {
+				worst = child;
+			}
+		}
+		if (worst == i) {
+			break;
+		}
+		eco_candidate tmp = best->items[worst];
+		best->items[worst] = best->items[i];
+		best->items[i] = tmp;
+		i = worst;
+	}
+}
+
+/* Returns whether the name had to be searched */
+static bool consider(eco_best *best, const eco_entry *entry, const char *folded_query, size_t len) {
+	bool full = best->len == best->size;
+	// not even a match at the start of the name would make it
+	eco_candidate candidate = {entry, 0};
+	if (full && compare_candidates(&candidate, &best->items[0]) >= 0) {
+		return false;
+	}
+	const char *found = len >= ECO_SEARCH_MIN_NAME_KEY_LENGTH ? strstr(entry->folded, folded_query) :
+	                    !strncmp(entry->folded, folded_query, len) ? entry->folded : NULL;
+	if (found == NULL) {
+		return true;
+	}
+	candidate.rank = rank_match(entry, found);
+	if (!full) {
+		best->items[best->len++] = candidate;
+		best_sift_up(best, best->len - 1);
+	}
+	else if (compare_candidates(&candidate, &best->items[0]) < 0) {
+		best->items[0] = candidate;
+		best_sift_down(best, 0);
+	}
+	return true;
+}
+
+/* Substring search of the opening names and codes, e.g. "Najdorf" or
+ * "B90", or with fewer than ECO_SEARCH_MIN_NAME_KEY_LENGTH characters a
+ * prefix of the codes, e.g. "B9". Returns the number of matches stored,
+ * best first */
+int eco_search(const char *query, eco_match *matches, int max_matches) {
+	if (entries == NULL || max_matches <= 0) {
+		return 0;
+	}
+	struct timeval start, end, diff;
+	gettimeofday(&start, NULL);
+
+	char *folded_query = fold_text(query);
+	size_t len = strlen(folded_query);
+	eco_best best = {calloc((size_t) max_matches, sizeof(eco_candidate)), 0, max_matches};
+	guint checked = 0;
+
+	if (len >= ECO_SEARCH_MIN_KEY_LENGTH && (len < ECO_SEARCH_MIN_NAME_KEY_LENGTH || trigrams == NULL)) {
+		// too short for the trigrams, or they were dropped
+		for (guint i = 0; i < entries->len; i++) {
+			checked += consider(&best, &g_array_index(entries, eco_entry, i), folded_query, len);
+		}
+	}
+	GArray *rarest = NULL;
+	for (size_t i = 0; trigrams != NULL && len >= ECO_SEARCH_MIN_NAME_KEY_LENGTH && i + 3 <= len; i++) {
+		GArray *postings = g_hash_table_lookup(trigrams, GUINT_TO_POINTER(trigram_key(folded_query + i)));
+		if (postings == NULL) {
+			rarest = NULL;
+			break;
+		}
+		if (rarest == NULL || postings->len < rarest->len) {
+			rarest = postings;
+		}
+	}
+	for (guint i = 0; rarest != NULL && i < rarest->len; i++) {
+		checked += consider(&best, &g_array_index(entries, eco_entry, g_array_index(rarest, guint32, i)), folded_query, len);
+	}
+	qsort(best.items, (size_t) best.len, sizeof(eco_candidate), compare_candidates);
+
+	for (int i = 0; i < best.len; i++) {
+		matches[i].san_line = best.items[i].entry->san_line;
+		matches[i].description = best.items[i].entry->description;
+	}
+
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+	debug("ECO search '%s': %d matches shown, %u names checked in %ldus\n", query, best.len, checked,
+	      diff.tv_sec * 1000000 + diff.tv_usec);
+	int n = best.len;
+	free(best.items);
+	g_free(folded_query);
+	return n;
+}
+
+/* <Search entry> */
+static gboolean match_everything(GtkEntryCompletion *completion, const gchar *key, GtkTreeIter *iter, gpointer data) {
+	// the model only ever holds the results of the current text
+	return TRUE;
+}
+
+static void on_search_changed(GtkEditable *editable, gpointer data) {
+	GtkListStore *store = data;
+	eco_match matches[ECO_SEARCH_MAX_RESULTS];
+	const char *text = gtk_entry_get_text(GTK_ENTRY(editable));
+
+	gtk_list_store_clear(store);
+	if (strlen(text) < ECO_SEARCH_MIN_KEY_LENGTH) {
+		return;
+	}
+	int n = eco_search(text, matches, ECO_SEARCH_MAX_RESULTS);
+	for (int i = 0; i < n; i++) {
+		GtkTreeIter iter;
+		gtk_list_store_append(store, &iter);
+		gtk_list_store_set(store, &iter, ECO_COLUMN_DESCRIPTION, matches[i].description,
+		                   ECO_COLUMN_LINE, matches[i].san_line, -1);
+	}
+}
+
+static gboolean on_match_selected(GtkEntryCompletion *completion, GtkTreeModel *model, GtkTreeIter *iter, gpointer data) {
+	eco_select_function on_select = (eco_select_function) data;
+	gchar *san_line;
+	gtk_tree_model_get(model, iter, ECO_COLUMN_LINE, &san_line, -1);
+	on_select(san_line);
+	g_free(san_line);
+	return FALSE;
+}
+
+/* Enter picks the best match */
+static void on_search_activate(GtkEntry *entry, gpointer data) {
+	eco_select_function on_select = (eco_select_function) data;
+	eco_match match;
+	if (strlen(gtk_entry_get_text(entry)) >= ECO_SEARCH_MIN_KEY_LENGTH &&
+	    eco_search(gtk_entry_get_text(entry), &match, 1) == 1) {
+		gtk_entry_set_text(entry, match.description);
+		on_select(match.san_line);
+	}
+}
+
+GtkWidget *eco_search_entry_new(eco_select_function on_select) {
+	GtkWidget *entry = gtk_search_entry_new();
+	gtk_entry_set_placeholder_text(GTK_ENTRY(entry), "Search openings");
+
+	GtkListStore *store = gtk_list_store_new(ECO_N_COLUMNS, G_TYPE_STRING, G_TYPE_STRING);
+	// connected before the completion's own handler so it sees the new results
+	g_signal_connect(entry, "changed", G_CALLBACK(on_search_changed), store);
+	g_signal_connect(entry, "activate", G_CALLBACK(on_search_activate), on_select);
+
+	GtkEntryCompletion *completion = gtk_entry_completion_new();
+	gtk_entry_completion_set_model(completion, GTK_TREE_MODEL(store));
+	gtk_entry_completion_set_text_column(completion, ECO_COLUMN_DESCRIPTION);
+	gtk_entry_completion_set_match_func(completion, match_everything, NULL, NULL);
+	gtk_entry_completion_set_minimum_key_length(completion, ECO_SEARCH_MIN_KEY_LENGTH);
+	g_signal_connect(completion, "match-selected", G_CALLBACK(on_match_selected), on_select);
+	gtk_entry_set_completion(GTK_ENTRY(entry), completion);
+	g_object_unref(completion);
+	g_object_unref(store);
+
+	return entry;
+}
+/* </Search entry> */
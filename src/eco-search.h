@@ -0,0 +1,17 @@
+#ifndef CAIRO_BOARD_ECO_SEARCH_H
+#define CAIRO_BOARD_ECO_SEARCH_H
+
+#include <gtk/gtk.h>
+
+typedef struct {
+	const char *san_line;
+	const char *description;
+} eco_match;
+
+typedef void (*eco_select_function)(const char *san_line);
+
+void eco_search_add(const char *san_line, const char *description);
+int eco_search(const char *query, eco_match *matches, int max_matches);
+GtkWidget *eco_search_entry_new(eco_select_function on_select);
+
+#endif //CAIRO_BOARD_ECO_SEARCH_H
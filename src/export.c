@@ -0,0 +1,634 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <gtk/gtk.h>
+
+#include "cairo-board.h"
+#include "chess-backend.h"
+#include "drawing-backend.h"
+#include "san_scanner.h"
+#include "pgn-tokenizer.h"
+#include "export.h"
+#include "task-pool.h"
+
+#define EXPORT_STEP_DELAY_MS 20
+#define EXPORT_FINAL_DELAY_MS 3000
+#define EXPORT_EMPTY_SQUARE -1
+#define EXPORT_TOKEN_BATCH 256
+
+extern cairo_surface_t *board_layer;
+extern cairo_surface_t *coordinates_layer;
+extern cairo_surface_t *piece_surfaces[12];
+
+/* Piece type for each square, indexed by [column * 8 + row] */
+typedef struct {
+	signed char squares[64];
+} export_position;
+
+/* ply -1 is the initial position, step -1 is a ply's final position */
+typedef struct {
+	int ply;
+	int step;
+} export_frame;
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	size_t alloc;
+} png_buff;
+
+typedef struct export_job export_job;
+
+typedef struct {
+	export_job *job;
+	int index;
+	png_buff png;
+	bool ready;
+} export_slot;
+
+/* Pool tasks render frames in any order but only ever window frames ahead
+ * of the writer, which consumes them in order: memory use doesn't depend on
+ * the game length beyond the small per-ply positions */
+struct export_job {
+	int size;
+	unsigned int hold_delay;
+
+	export_position *positions; // positions[p] is before ply p, positions[n_plys] is final
+	int (*moves)[4];
+	int n_plys;
+	int plys_allocated;
+
+	export_frame *frames;
+	int n_frames;
+
+	export_slot *slots;
+	int window;
+	int next_write;
+	bool failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// scratch surface and plots per pool worker, the last one for the caller
+	cairo_surface_t **surfaces;
+	double ***plots;
+	int n_scratch;
+};
+
+typedef struct {
+	FILE *out;
+	uint32_t sequence;
+	uint32_t n_frames;
+	uint32_t frames_written;
+	uint32_t width;
+	uint32_t height;
+} apng_encoder;
+
+static uint32_t crc_table[256];
+
+static void snapshot_position(chess_game *game, export_position *position) {
+	for (int col = 0; col < 8; col++) {
+		for (int row = 0; row < 8; row++) {
+			chess_piece *piece = game->squares[col][row].piece;
+			position->squares[col * 8 + row] = (signed char) (piece ? piece->type : EXPORT_EMPTY_SQUARE);
+		}
+	}
+}
+
+static bool grow_plys(export_job *job) {
+	if (job->n_plys + 1 < job->plys_allocated) {
+		return true;
+	}
+	int new_allocated = job->plys_allocated + MOVES_LIST_ALLOC_PAGE_SIZE;
+	export_position *positions = realloc(job->positions, new_allocated * sizeof(export_position));
+	if (positions == NULL) {
+		perror("Realloc failed!!");
+		return false;
+	}
+	job->positions = positions;
+	int (*moves)[4] = realloc(job->moves, new_allocated * sizeof(*moves));
+	if (moves == NULL) {
+		perror("Realloc failed!!");
+		return false;
+	}
+	job->moves = moves;
+	job->plys_allocated = new_allocated;
+	return true;
+}
+
+/* Plays the game on main_game, as the SAN scanner needs it to know whose turn it is */
+static int replay_game(const char *pgn_path, int game_num, export_job *job) {
+	gchar *contents;
+	gsize len;
+	GError *error = NULL;
+	if (!g_file_get_contents(pgn_path, &contents, &len, &error)) {
+		fprintf(stderr, "Error opening file '%s': %s\n", pgn_path, error->message);
+		g_error_free(error);
+		return -1;
+	}
+	init_game_position(main_game);
+
+	pgn_token tokens[EXPORT_TOKEN_BATCH];
+	size_t pos = 0;
+	size_t n_tokens;
+	int games_counter = 0;
+	bool inside_tags = false;
+	bool found_my_game = false;
+	bool done = false;
+	int ret = 0;
+
+	while (!done && (n_tokens = pgn_tokenize(contents, len, &pos, tokens, EXPORT_TOKEN_BATCH)) > 0) {
+		for (size_t k = 0; k < n_tokens && !done; k++) {
+			pgn_token *token = &tokens[k];
+			if (token->kind == MATCHED_TAG) {
+				if (!inside_tags) {
+					if (found_my_game) {
+						done = true;
+						break;
+					}
+					inside_tags = true;
+					games_counter++;
+					found_my_game = games_counter == game_num;
+				}
+				continue;
+			}
+			inside_tags = false;
+			if (!found_my_game) {
+				continue;
+			}
+			if (token->kind == MATCHED_END_TOKEN) {
+				done = true;
+				break;
+			}
+
+			int piece_type;
+			char move_string[5];
+			int move[4];
+			pgn_token_move(token, main_game->whose_turn, &piece_type, move_string);
+			if (!resolve_move(main_game, piece_type, move_string, move)) {
+				fprintf(stderr, "Could not resolve move %c%s\n", type_to_char(piece_type), move_string);
+				ret = -1;
+				done = true;
+				break;
+			}
+			if (!grow_plys(job)) {
+				ret = -1;
+				done = true;
+				break;
+			}
+			snapshot_position(main_game, &job->positions[job->n_plys]);
+			memcpy(job->moves[job->n_plys], move, sizeof(move));
+			job->n_plys++;
+
+			if (token->promo) {
+				main_game->promo_type = char_to_type(main_game->whose_turn, token->promo);
+			}
+			char san[SAN_MOVE_SIZE];
+			move_piece(main_game->squares[move[0]][move[1]].piece, move[2], move[3], 0, AUTO_SOURCE_NO_ANIM, san, main_game, true);
+		}
+	}
+	g_free(contents);
+	if (ret) {
+		return ret;
+	}
+
+	if (!found_my_game) {
+		fprintf(stderr, "Failed to find game number '%d' in database '%s'\n", game_num, pgn_path);
+		return -1;
+	}
+	if (!grow_plys(job)) {
+		return -1;
+	}
+	snapshot_position(main_game, &job->positions[job->n_plys]);
+	return 0;
+}
+
+static double **plots_new(void) {
+	double **plots = malloc(ANIM_SIZE * sizeof(double *));
+	for (int i = 0; i < ANIM_SIZE; i++) {
+		plots[i] = malloc(2 * sizeof(double));
+	}
+	return plots;
+}
+
+static void plots_free(double **plots) {
+	for (int i = 0; i < ANIM_SIZE; i++) {
+		free(plots[i]);
+	}
+	free(plots);
+}
+
+static int plot_ply(export_job *job, int ply, double **plots) {
+	int *move = job->moves[ply];
+	int mover = job->positions[ply].squares[move[0] * 8 + move[1]];
+	double o_xy[2];
+	double n_xy[2];
+	loc_to_xy(move[0], move[1], o_xy, job->size, job->size);
+	loc_to_xy(move[2], move[3], n_xy, job->size, job->size);
+	return plot_move_path(mover, o_xy, n_xy, job->size, job->size, plots);
+}
+
+/* One frame per step of each move's animation, minus the end points which
+ * are the still frames shown between moves */
+static bool build_frames(export_job *job) {
+	double **plots = plots_new();
+	int allocated = 1 + job->n_plys * 24;
+	job->frames = malloc(allocated * sizeof(export_frame));
+	if (job->frames == NULL) {
+		perror("Malloc failed!!");
+		plots_free(plots);
+		return false;
+	}
+	job->n_frames = 0;
+	job->frames[job->n_frames++] = (export_frame) {-1, -1};
+
+	for (int ply = 0; ply < job->n_plys; ply++) {
+		int n_plots = plot_ply(job, ply, plots);
+		if (job->n_frames + n_plots > allocated) {
+			allocated += n_plots + job->n_plys * 24;
+			export_frame *frames = realloc(job->frames, allocated * sizeof(export_frame));
+			if (frames == NULL) {
+				perror("Realloc failed!!");
+				plots_free(plots);
+				return false;
+			}
+			job->frames = frames;
+		}
+		for (int step = 1; step < n_plots - 1; step++) {
+			job->frames[job->n_frames++] = (export_frame) {ply, step};
+		}
+		job->frames[job->n_frames++] = (export_frame) {ply, -1};
+	}
+	plots_free(plots);
+	return true;
+}
+
+static unsigned int frame_delay(export_job *job, int index) {
+	if (index == job->n_frames - 1) {
+		return EXPORT_FINAL_DELAY_MS;
+	}
+	return job->frames[index].step == -1 ? job->hold_delay : EXPORT_STEP_DELAY_MS;
+}
+
+static void render_frame(export_job *job, int index, cairo_surface_t *surface, double **plots) {
+	export_frame *frame = &job->frames[index];
+	int size = job->size;
+	export_position *position;
+	int skip_square = -1;
+
+	if (frame->ply == -1) {
+		position = &job->positions[0];
+	} else if (frame->step == -1) {
+		position = &job->positions[frame->ply + 1];
+	} else {
+		position = &job->positions[frame->ply];
+		skip_square = job->moves[frame->ply][0] * 8 + job->moves[frame->ply][1];
+	}
+
+	cairo_t *cr = cairo_create(surface);
+	cairo_set_source_surface(cr, board_layer, 0.0f, 0.0f);
+	cairo_paint(cr);
+	cairo_set_source_surface(cr, coordinates_layer, 0.0f, 0.0f);
+	cairo_paint(cr);
+
+	double xy[2];
+	for (int square = 0; square < 64; square++) {
+		int piece_type = position->squares[square];
+		if (piece_type == EXPORT_EMPTY_SQUARE || square == skip_square) {
+			continue;
+		}
+		loc_to_xy(square / 8, square % 8, xy, size, size);
+		apply_surface_at(cr, piece_surfaces[piece_type], xy[0] - size / 16.0f, xy[1] - size / 16.0f, size / 8.0f, size / 8.0f);
+	}
+
+	if (skip_square != -1) {
+		// the moving piece is drawn last so it passes over the others
+		plot_ply(job, frame->ply, plots);
+		double *at = plots[frame->step];
+		apply_surface_at(cr, piece_surfaces[position->squares[skip_square]], at[0] - size / 16.0f, at[1] - size / 16.0f, size / 8.0f, size / 8.0f);
+	}
+	cairo_destroy(cr);
+}
+
+static cairo_status_t png_buff_write(void *closure, const unsigned char *data, unsigned int length) {
+	png_buff *pb = closure;
+	if (pb->len + length > pb->alloc) {
+		size_t new_alloc = pb->alloc ? pb->alloc : 65536;
+		while (pb->len + length > new_alloc) {
+			new_alloc *= 2;
+		}
+		unsigned char *temp = realloc(pb->data, new_alloc);
+		if (!temp) {
+			perror("Realloc failed!!");
+			return CAIRO_STATUS_NO_MEMORY;
+		}
+		pb->data = temp;
+		pb->alloc = new_alloc;
+	}
+	memcpy(pb->data + pb->len, data, length);
+	pb->len += length;
+	return CAIRO_STATUS_SUCCESS;
+}
+
+/* Pool task rendering and encoding one frame into its slot */
+static void export_frame_task(void *data, task_group *group) {
+	export_slot *slot = data;
+	export_job *job = slot->job;
+
+	int scratch = task_pool_worker_index();
+	if (scratch < 0) {
+		scratch = job->n_scratch - 1;
+	}
+	if (job->surfaces[scratch] == NULL) {
+		job->surfaces[scratch] = cairo_image_surface_create(CAIRO_FORMAT_RGB24, job->size, job->size);
+		job->plots[scratch] = plots_new();
+	}
+
+	// The writer is done with this slot's previous frame, nobody else touches it
+	render_frame(job, slot->index, job->surfaces[scratch], job->plots[scratch]);
+	slot->png.len = 0;
+	cairo_status_t status = cairo_surface_write_to_png_stream(job->surfaces[scratch], png_buff_write, &slot->png);
+
+	pthread_mutex_lock(&job->lock);
+	if (status != CAIRO_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to encode frame %d: %s\n", slot->index, cairo_status_to_string(status));
+		job->failed = true;
+	}
+	slot->ready = true;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void submit_frame(export_job *job, task_group *group, int index) {
+	export_slot *slot = &job->slots[index % job->window];
+	slot->job = job;
+	slot->index = index;
+	task_pool_submit(group, TASK_PRIORITY_NORMAL, export_frame_task, slot);
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+	p[0] = (unsigned char) (v >> 24);
+	p[1] = (unsigned char) (v >> 16);
+	p[2] = (unsigned char) (v >> 8);
+	p[3] = (unsigned char) v;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void init_crc_table(void) {
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++) {
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		}
+		crc_table[n] = c;
+	}
+}
+
+static uint32_t update_crc(uint32_t crc, const unsigned char *buf, size_t len) {
+	for (size_t n = 0; n < len; n++) {
+		crc = crc_table[(crc ^ buf[n]) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+/* Writes a chunk whose data is prefix followed by data, so IDAT payloads
+ * can become fdAT chunks without copying them */
+static void apng_write_chunk(apng_encoder *enc, const char chunk_type[4], const unsigned char *prefix, uint32_t prefix_len,
+                             const unsigned char *data, uint32_t len) {
+	unsigned char header[8];
+	put_u32(header, prefix_len + len);
+	memcpy(header + 4, chunk_type, 4);
+	uint32_t crc = update_crc(0xffffffffu, header + 4, 4);
+	crc = update_crc(crc, prefix, prefix_len);
+	crc = update_crc(crc, data, len);
+	unsigned char footer[4];
+	put_u32(footer, crc ^ 0xffffffffu);
+
+	fwrite(header, 1, 8, enc->out);
+	if (prefix_len) {
+		fwrite(prefix, 1, prefix_len, enc->out);
+	}
+	if (len) {
+		fwrite(data, 1, len, enc->out);
+	}
+	fwrite(footer, 1, 4, enc->out);
+}
+
+static void apng_write_frame_control(apng_encoder *enc, unsigned int delay_ms) {
+	unsigned char fctl[26];
+	put_u32(fctl, enc->sequence++);
+	put_u32(fctl + 4, enc->width);
+	put_u32(fctl + 8, enc->height);
+	put_u32(fctl + 12, 0);
+	put_u32(fctl + 16, 0);
+	fctl[20] = (unsigned char) (delay_ms >> 8);
+	fctl[21] = (unsigned char) delay_ms;
+	fctl[22] = 1000 >> 8;
+	fctl[23] = 1000 & 0xff;
+	fctl[24] = 0; // APNG_DISPOSE_OP_NONE
+	fctl[25] = 0; // APNG_BLEND_OP_SOURCE
+	apng_write_chunk(enc, "fcTL", NULL, 0, fctl, sizeof(fctl));
+}
+
+/* Streams one PNG as the next animation frame: the first frame's IDAT is the
+ * default image, later ones are rewritten as sequenced fdAT chunks */
+static bool apng_add_frame(apng_encoder *enc, png_buff *png, unsigned int delay_ms) {
+	static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	if (png->len < 8 || memcmp(png->data, signature, 8) != 0) {
+		fprintf(stderr, "Not a PNG frame\n");
+		return false;
+	}
+
+	bool frame_control_written = false;
+	size_t offset = 8;
+	while (offset + 12 <= png->len) {
+		uint32_t len = get_u32(png->data + offset);
+		const char *chunk_type = (const char *) png->data + offset + 4;
+		unsigned char *chunk_data = png->data + offset + 8;
+		if (offset + 12 + len > png->len) {
+			fprintf(stderr, "Truncated PNG frame\n");
+			return false;
+		}
+
+		if (!memcmp(chunk_type, "IHDR", 4) && !enc->frames_written) {
+			enc->width = get_u32(chunk_data);
+			enc->height = get_u32(chunk_data + 4);
+			fwrite(signature, 1, 8, enc->out);
+			fwrite(png->data + offset, 1, 12 + len, enc->out);
+
+			unsigned char actl[8];
+			put_u32(actl, enc->n_frames);
+			put_u32(actl + 4, 0); // loop forever
+			apng_write_chunk(enc, "acTL", NULL, 0, actl, sizeof(actl));
+		} else if (!memcmp(chunk_type, "IDAT", 4)) {
+			if (!frame_control_written) {
+				apng_write_frame_control(enc, delay_ms);
+				frame_control_written = true;
+			}
+			if (!enc->frames_written) {
+				fwrite(png->data + offset, 1, 12 + len, enc->out);
+			} else {
+				unsigned char sequence[4];
+				put_u32(sequence, enc->sequence++);
+				apng_write_chunk(enc, "fdAT", sequence, 4, chunk_data, len);
+			}
+		}
+		offset += 12 + len;
+	}
+
+	enc->frames_written++;
+	return !ferror(enc->out);
+}
+
+static bool write_frame_file(const char *prefix, int index, png_buff *png) {
+	char *file_path = g_strdup_printf("%s%05d.png", prefix, index);
+	FILE *f = fopen(file_path, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Error opening file '%s': %s\n", file_path, strerror(errno));
+		g_free(file_path);
+		return false;
+	}
+	bool ok = fwrite(png->data, 1, png->len, f) == png->len;
+	ok = !fclose(f) && ok;
+	g_free(file_path);
+	return ok;
+}
+
+static void free_job(export_job *job) {
+	if (job->slots) {
+		for (int i = 0; i < job->window; i++) {
+			free(job->slots[i].png.data);
+		}
+	}
+	free(job->slots);
+	for (int i = 0; i < job->n_scratch; i++) {
+		if (job->surfaces[i] != NULL) {
+			cairo_surface_destroy(job->surfaces[i]);
+			plots_free(job->plots[i]);
+		}
+	}
+	free(job->surfaces);
+	free(job->plots);
+	free(job->frames);
+	free(job->moves);
+	free(job->positions);
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->cond);
+}
+
+int export_game(const char *pgn_path, int game_num, const char *out_path, int size, unsigned int hold_delay) {
+	if (size < EXPORT_MIN_SIZE || size > EXPORT_MAX_SIZE) {
+		fprintf(stderr, "Export size %d out of range\n", size);
+		return 1;
+	}
+	export_job job;
+	memset(&job, 0, sizeof(job));
+	job.size = size;
+	job.hold_delay = hold_delay;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	if (replay_game(pgn_path, game_num, &job) || !build_frames(&job)) {
+		free_job(&job);
+		return 1;
+	}
+
+	draw_board_surface(size, size);
+	update_pieces_surfaces(size, size);
+
+	bool animated = g_str_has_suffix(out_path, ".png");
+	apng_encoder enc;
+	memset(&enc, 0, sizeof(enc));
+	if (animated) {
+		init_crc_table();
+		enc.n_frames = (uint32_t) job.n_frames;
+		enc.out = fopen(out_path, "wb");
+		if (enc.out == NULL) {
+			fprintf(stderr, "Error opening file '%s': %s\n", out_path, strerror(errno));
+			free_job(&job);
+			return 1;
+		}
+	}
+
+	int n_threads = task_pool_size() > 0 ? task_pool_size() : 1;
+	job.window = n_threads * 2;
+	job.slots = calloc((size_t) job.window, sizeof(export_slot));
+	job.n_scratch = task_pool_size() + 1;
+	job.surfaces = calloc((size_t) job.n_scratch, sizeof(cairo_surface_t *));
+	job.plots = calloc((size_t) job.n_scratch, sizeof(double **));
+	task_group *group = task_group_new();
+
+	struct timeval start, end, diff;
+	gettimeofday(&start, NULL);
+
+	for (int i = 0; i < job.window && i < job.n_frames; i++) {
+		submit_frame(&job, group, i);
+	}
+
+	// Write frames in order as they become ready
+	while (job.next_write < job.n_frames) {
+		export_slot *slot = &job.slots[job.next_write % job.window];
+		pthread_mutex_lock(&job.lock);
+		while (!slot->ready && !job.failed) {
+			pthread_cond_wait(&job.cond, &job.lock);
+		}
+		bool failed = job.failed;
+		pthread_mutex_unlock(&job.lock);
+		if (failed) {
+			break;
+		}
+
+		bool ok = animated ? apng_add_frame(&enc, &slot->png, frame_delay(&job, job.next_write)) :
+		          write_frame_file(out_path, job.next_write, &slot->png);
+
+		pthread_mutex_lock(&job.lock);
+		if (!ok) {
+			fprintf(stderr, "Failed to write frame %d to '%s'\n", job.next_write, out_path);
+			job.failed = true;
+		}
+		slot->ready = false;
+		job.next_write++;
+		pthread_mutex_unlock(&job.lock);
+		if (!ok) {
+			break;
+		}
+		// the slot is free again, give it the next frame
+		if (job.next_write + job.window - 1 < job.n_frames) {
+			submit_frame(&job, group, job.next_write + job.window - 1);
+		}
+	}
+
+	if (job.failed) {
+		task_group_cancel(group);
+	}
+	task_group_wait(group);
+	task_group_free(group);
+
+	if (animated) {
+		if (!job.failed) {
+			apng_write_chunk(&enc, "IEND", NULL, 0, NULL, 0);
+		}
+		if (fclose(enc.out)) {
+			perror("Failed to close animated PNG ");
+			job.failed = true;
+		}
+	}
+
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+	double seconds = diff.tv_sec + diff.tv_usec / 1000000.0;
+	if (!job.failed) {
+		printf("Exported %d frames for %d plys to '%s' in %.2fs: %.1f frames/s on %d threads\n", job.n_frames,
+		       job.n_plys, out_path, seconds, seconds > 0 ? job.n_frames / seconds : 0.0, n_threads);
+	}
+
+	int ret = job.failed ? 1 : 0;
+	free_job(&job);
+	return ret;
+}
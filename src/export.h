@@ -0,0 +1,14 @@
+#ifndef CAIRO_BOARD_EXPORT_H
+#define CAIRO_BOARD_EXPORT_H
+
+// board sizes in pixels export_game() accepts
+#define EXPORT_MIN_SIZE 64
+#define EXPORT_MAX_SIZE 4096
+
+/* Renders game number game_num of the PGN file without a window.
+ * out_path ending in ".png" gives an animated PNG, anything else is used as
+ * a prefix for numbered PNG frames. hold_delay is the pause after each move.
+ * size is between EXPORT_MIN_SIZE and EXPORT_MAX_SIZE */
+int export_game(const char *pgn_path, int game_num, const char *out_path, int size, unsigned int hold_delay);
+
+#endif //CAIRO_BOARD_EXPORT_H
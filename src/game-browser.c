@@ -0,0 +1,577 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gtk/gtk.h>
+
+#include "cairo-board.h"
+#include "game-index.h"
+#include "game-browser.h"
+#include "memory-budget.h"
+#include "task-pool.h"
+#include "time-source.h"
+
+#define GAME_BROWSER_PROGRESS_INTERVAL_US 50000
+
+/* <List model> */
+/* A GtkTreeModel over the game index: rows are only formatted when the
+ * view asks for them, which with fixed height rows is the visible ones.
+ * Sorting reorders an array of game numbers, worked out on the task pool */
+#define TYPE_GAME_LIST_MODEL (game_list_model_get_type())
+#define GAME_LIST_MODEL(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), TYPE_GAME_LIST_MODEL, GameListModel))
+
+typedef struct {
+	GObject parent;
+	game_index *index;
+	uint32_t n_rows;
+	uint32_t *order;  // game of each row, NULL for file order
+	gint stamp;
+	gint sort_column;
+	GtkSortType sort_order;
+	unsigned int sort_serial; // of the last sort asked for
+} GameListModel;
+
+typedef struct {
+	GObjectClass parent_class;
+} GameListModelClass;
+
+typedef struct {
+	GameListModel *model;
+	game_index_column column;
+	bool descending;
+	unsigned int serial;
+	uint32_t *order;
+} sort_job;
+
+static void game_list_model_tree_model_init(GtkTreeModelIface *iface);
+static void game_list_model_sortable_init(GtkTreeSortableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(GameListModel, game_list_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL, game_list_model_tree_model_init)
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_SORTABLE, game_list_model_sortable_init))
+
+// models with a sort order, least recently sorted first, main loop only
+static GList *sorted_models = NULL;
+
+static void set_order(GameListModel *model, uint32_t *order) {
+	if (model->order != NULL) {
+		mem_budget_account(MEM_LISTINGS, -(long) (model->n_rows * sizeof(uint32_t)));
+		free(model->order);
+		sorted_models = g_list_remove(sorted_models, model);
+	}
+	model->order = order;
+	if (order != NULL) {
+		mem_budget_account(MEM_LISTINGS, model->n_rows * sizeof(uint32_t));
+		sorted_models = g_list_append(sorted_models, model);
+	}
+}
+
+static bool drop_oldest_order(void);
+
+static void game_list_model_finalize(GObject *object) {
+	GameListModel *model = GAME_LIST_MODEL(object);
+	set_order(model, NULL);
+	game_index_close(model->index);
+	G_OBJECT_CLASS(game_list_model_parent_class)->finalize(object);
+}
+
+static void game_list_model_class_init(GameListModelClass *class) {
+	G_OBJECT_CLASS(class)->finalize = game_list_model_finalize;
+	mem_budget_set_evictor(MEM_LISTINGS, drop_oldest_order);
+}
+
+static void game_list_model_init(GameListModel *model) {
+	model->stamp = (gint) g_random_int();
+	model->sort_column = GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID;
+	model->sort_order = GTK_SORT_ASCENDING;
+}
+
+/* Takes over index */
+static GameListModel *game_list_model_new(game_index *index) {
+	GameListModel *model = g_object_new(TYPE_GAME_LIST_MODEL, NULL);
+	model->index = index;
+	model->n_rows = game_index_games(index);
+	return model;
+}
+
+static uint32_t row_game(GameListModel *model, uint32_t row) {
+	return model->order != NULL ? model->order[row] : row;
+}
+
+/* Runs with the GDK lock held. Tells the view where each row went, as
+ * a GtkListStore being sorted would. order is NULL for file order */
+static void reorder_rows(GameListModel *model, uint32_t *order) {
+	uint32_t n = model->n_rows;
+	uint32_t *old_rows = malloc((n + 1) * sizeof(uint32_t));
+	for (uint32_t row = 0; row < n; row++) {
+		old_rows[row_game(model, row)] = row;
+	}
+	gint *new_order = malloc((n + 1) * sizeof(gint));
+	for (uint32_t row = 0; row < n; row++) {
+		new_order[row] = (gint) old_rows[order != NULL ? order[row] : row];
+	}
+	free(old_rows);
+
+	set_order(model, order);
+	// iters are row numbers, they now point at other games
+	model->stamp++;
+	GtkTreePath *path = gtk_tree_path_new();
+	gtk_tree_model_rows_reordered(GTK_TREE_MODEL(model), path, NULL, new_order);
+	gtk_tree_path_free(path);
+	free(new_order);
+}
+
+/* MEM_LISTINGS evictor: the least recently sorted list goes back to file
+ * order, the header showing it unsorted */
+static bool drop_oldest_order(void) {
+	if (sorted_models == NULL) {
+		return false;
+	}
+	GameListModel *model = sorted_models->data;
+	debug("Dropping the sort order of %u games to fit the memory budget\n", model->n_rows);
+	reorder_rows(model, NULL);
+	// a sort still running would bring it back
+	model->sort_serial++;
+	model->sort_column = GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID;
+	model->sort_order = GTK_SORT_ASCENDING;
+	gtk_tree_sortable_sort_column_changed(GTK_TREE_SORTABLE(model));
+	return true;
+}
+
+static gboolean set_row(GameListModel *model, GtkTreeIter *iter, uint32_t row) {
+	if (row >= model->n_rows) {
+		iter->stamp = 0;
+		return FALSE;
+	}
+	iter->stamp = model->stamp;
+	iter->user_data = GUINT_TO_POINTER(row);
+	return TRUE;
+}
+
+static GtkTreeModelFlags model_get_flags(GtkTreeModel *tree_model) {
+	return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint model_get_n_columns(GtkTreeModel *tree_model) {
+	return GAME_INDEX_N_COLUMNS;
+}
+
+static GType model_get_column_type(GtkTreeModel *tree_model, gint column) {
+	return column == GAME_INDEX_NUMBER ? G_TYPE_UINT : G_TYPE_STRING;
+}
+
+static gboolean model_get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreePath *path) {
+	if (gtk_tree_path_get_depth(path) != 1) {
+		return FALSE;
+	}
+	return set_row(GAME_LIST_MODEL(tree_model), iter, (uint32_t) gtk_tree_path_get_indices(path)[0]);
+}
+
+static GtkTreePath *model_get_path(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+	return gtk_tree_path_new_from_indices((gint) GPOINTER_TO_UINT(iter->user_data), -1);
+}
+
+static void model_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column, GValue *value) {
+	GameListModel *model = GAME_LIST_MODEL(tree_model);
+	uint32_t game = row_game(model, GPOINTER_TO_UINT(iter->user_data));
+
+	g_value_init(value, model_get_column_type(tree_model, column));
+	if (column == GAME_INDEX_NUMBER) {
+		// as taken by -gamenum and load_game()
+		g_value_set_uint(value, game + 1);
+		return;
+	}
+	char text[256];
+	game_index_format(model->index, game, column, text, sizeof(text));
+	g_value_set_string(value, text);
+}
+
+static gboolean model_iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+	return set_row(GAME_LIST_MODEL(tree_model), iter, GPOINTER_TO_UINT(iter->user_data) + 1);
+}
+
+static gboolean model_iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent) {
+	if (parent != NULL) {
+		iter->stamp = 0;
+		return FALSE;
+	}
+	return set_row(GAME_LIST_MODEL(tree_model), iter, 0);
+}
+
+static gboolean model_iter_has_child(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+	return FALSE;
+}
+
+static gint model_iter_n_children(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+	return iter == NULL ? (gint) GAME_LIST_MODEL(tree_model)->n_rows : 0;
+}
+
+static gboolean model_iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent, gint n) {
+	if (parent != NULL || n < 0) {
+		iter->stamp = 0;
+		return FALSE;
+	}
+	return set_row(GAME_LIST_MODEL(tree_model), iter, (uint32_t) n);
+}
+
+static gboolean model_iter_parent(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *child) {
+	iter->stamp = 0;
+	return FALSE;
+}
+
+static void game_list_model_tree_model_init(GtkTreeModelIface *iface) {
+	iface->get_flags = model_get_flags;
+	iface->get_n_columns = model_get_n_columns;
+	iface->get_column_type = model_get_column_type;
+	iface->get_iter = model_get_iter;
+	iface->get_path = model_get_path;
+	iface->get_value = model_get_value;
+	iface->iter_next = model_iter_next;
+	iface->iter_children = model_iter_children;
+	iface->iter_has_child = model_iter_has_child;
+	iface->iter_n_children = model_iter_n_children;
+	iface->iter_nth_child = model_iter_nth_child;
+	iface->iter_parent = model_iter_parent;
+}
+
+/* Runs with the GDK lock held */
+static gboolean apply_sort(gpointer data) {
+	sort_job *job = data;
+	GameListModel *model = job->model;
+
+	if (job->serial == model->sort_serial) {
+		reorder_rows(model, job->order);
+		job->order = NULL;
+		mem_budget_enforce(MEM_LISTINGS);
+	}
+
+	free(job->order);
+	g_object_unref(model);
+	free(job);
+	return FALSE;
+}
+
+static void sort_function(void *data, task_group *group) {
+	sort_job *job = data;
+	job->order = game_index_sort(job->model->index, job->column, job->descending);
+	gdk_threads_add_idle(apply_sort, job);
+}
+
+static task_group *sort_group(void) {
+	static task_group *group = NULL;
+	if (group == NULL) {
+		group = task_group_new();
+	}
+	return group;
+}
+
+static gboolean sortable_get_sort_column_id(GtkTreeSortable *sortable, gint *sort_column_id, GtkSortType *order) {
+	GameListModel *model = GAME_LIST_MODEL(sortable);
+	if (sort_column_id != NULL) {
+		*sort_column_id = model->sort_column;
+	}
+	if (order != NULL) {
+		*order = model->sort_order;
+	}
+	return model->sort_column != GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID &&
+	       model->sort_column != GTK_TREE_SORTABLE_DEFAULT_SORT_COLUMN_ID;
+}
+
+/* The header shows the new order straight away, the rows follow once
+ * the sort is done. A sort asked for meanwhile supersedes it */
+static void sortable_set_sort_column_id(GtkTreeSortable *sortable, gint sort_column_id, GtkSortType order) {
+	GameListModel *model = GAME_LIST_MODEL(sortable);
+	if (model->sort_column == sort_column_id && model->sort_order == order) {
+		return;
+	}
+	model->sort_column = sort_column_id;
+	model->sort_order = order;
+	gtk_tree_sortable_sort_column_changed(sortable);
+
+	sort_job *job = calloc(1, sizeof(sort_job));
+	job->model = g_object_ref(model);
+	job->column = sort_column_id >= 0 && sort_column_id < GAME_INDEX_N_COLUMNS ? sort_column_id : GAME_INDEX_NUMBER;
+	job->descending = order == GTK_SORT_DESCENDING;
+	job->serial = ++model->sort_serial;
+	task_pool_submit(sort_group(), TASK_PRIORITY_HIGH, sort_function, job);
+}
+
+static void sortable_set_sort_func(GtkTreeSortable *sortable, gint sort_column_id, GtkTreeIterCompareFunc func,
+                                   gpointer data, GDestroyNotify destroy) {
+	fprintf(stderr, "The game list only sorts by its own columns\n");
+}
+
+static void sortable_set_default_sort_func(GtkTreeSortable *sortable, GtkTreeIterCompareFunc func, gpointer data,
+                                           GDestroyNotify destroy) {
+	fprintf(stderr, "The game list only sorts by its own columns\n");
+}
+
+static gboolean sortable_has_default_sort_func(GtkTreeSortable *sortable) {
+	return FALSE;
+}
+
+static void game_list_model_sortable_init(GtkTreeSortableIface *iface) {
+	iface->get_sort_column_id = sortable_get_sort_column_id;
+	iface->set_sort_column_id = sortable_set_sort_column_id;
+	iface->set_sort_func = sortable_set_sort_func;
+	iface->set_default_sort_func = sortable_set_default_sort_func;
+	iface->has_default_sort_func = sortable_has_default_sort_func;
+}
+/* </List model> */
+
+/* <Browser window> */
+typedef struct {
+	char pgn_path[PATH_MAX];
+	GtkWidget *window;
+	GtkWidget *view;
+	GtkWidget *progress_bar;
+	bool closed;
+	int refs;
+
+	// indexing, worker side
+	int64_t last_report;
+	game_index *index;
+
+	// handed over to the main loop, under progress_lock
+	pthread_mutex_t progress_lock;
+	size_t bytes_done;
+	size_t bytes_total;
+	uint32_t n_games;
+	bool progress_queued;
+} game_browser;
+
+static game_browser *browser = NULL; // main loop only, the window open if any
+
+static const char *column_titles[GAME_INDEX_N_COLUMNS] = {
+		[GAME_INDEX_NUMBER] = "#",
+		[GAME_INDEX_WHITE] = "White",
+		[GAME_INDEX_WHITE_ELO] = "Elo",
+		[GAME_INDEX_BLACK] = "Black",
+		[GAME_INDEX_BLACK_ELO] = "Elo",
+		[GAME_INDEX_RESULT] = "Result",
+		[GAME_INDEX_ECO] = "ECO",
+		[GAME_INDEX_DATE] = "Date"
+};
+
+// in characters
+static const int column_widths[GAME_INDEX_N_COLUMNS] = {
+		[GAME_INDEX_NUMBER] = 8,
+		[GAME_INDEX_WHITE] = 24,
+		[GAME_INDEX_WHITE_ELO] = 5,
+		[GAME_INDEX_BLACK] = 24,
+		[GAME_INDEX_BLACK_ELO] = 5,
+		[GAME_INDEX_RESULT] = 7,
+		[GAME_INDEX_ECO] = 4,
+		[GAME_INDEX_DATE] = 10
+};
+
+static void browser_unref(game_browser *b) {
+	if (__sync_sub_and_fetch(&b->refs, 1) == 0) {
+		pthread_mutex_destroy(&b->progress_lock);
+		game_index_close(b->index);
+		free(b);
+	}
+}
+
+static bool browser_closed(game_browser *b) {
+	return __atomic_load_n(&b->closed, __ATOMIC_ACQUIRE);
+}
+
+/* Runs with the GDK lock held */
+static gboolean report_index_progress(gpointer data) {
+	game_browser *b = data;
+
+	pthread_mutex_lock(&b->progress_lock);
+	size_t bytes_done = b->bytes_done;
+	size_t bytes_total = b->bytes_total;
+	uint32_t n_games = b->n_games;
+	b->progress_queued = false;
+	pthread_mutex_unlock(&b->progress_lock);
+
+	if (!browser_closed(b)) {
+		char text[128];
+		snprintf(text, sizeof(text), "Indexing: %.1f of %.1f MB, %u games",
+		         bytes_done / 1048576.0, bytes_total / 1048576.0, n_games);
+		gtk_progress_bar_set_text(GTK_PROGRESS_BAR(b->progress_bar), text);
+		gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(b->progress_bar),
+		                              bytes_total ? (double) bytes_done / (double) bytes_total : 0);
+	}
+	browser_unref(b);
+	return FALSE;
+}
+
+static bool on_index_progress(size_t bytes_done, size_t bytes_total, uint32_t n_games, void *data) {
+	game_browser *b = data;
+	if (browser_closed(b)) {
+		return false;
+	}
+
+	int64_t now = time_now_us();
+	if (now - b->last_report < GAME_BROWSER_PROGRESS_INTERVAL_US) {
+		return true;
+	}
+	b->last_report = now;
+
+	pthread_mutex_lock(&b->progress_lock);
+	b->bytes_done = bytes_done;
+	b->bytes_total = bytes_total;
+	b->n_games = n_games;
+	bool queue = !b->progress_queued;
+	b->progress_queued = true;
+	pthread_mutex_unlock(&b->progress_lock);
+
+	if (queue) {
+		__sync_fetch_and_add(&b->refs, 1);
+		gdk_threads_add_idle(report_index_progress, b);
+	}
+	return true;
+}
+
+/* Runs with the GDK lock held */
+static gboolean index_ready(gpointer data) {
+	game_browser *b = data;
+
+	if (!browser_closed(b)) {
+		char *name = g_path_get_basename(b->pgn_path);
+		char title[PATH_MAX + 64];
+		if (b->index != NULL) {
+			snprintf(title, sizeof(title), "%s - %u games", name, game_index_games(b->index));
+			GameListModel *model = game_list_model_new(b->index);
+			b->index = NULL;
+			gtk_tree_view_set_model(GTK_TREE_VIEW(b->view), GTK_TREE_MODEL(model));
+			g_object_unref(model);
+			gtk_widget_hide(b->progress_bar);
+		}
+		else {
+			snprintf(title, sizeof(title), "%s - could not be indexed", name);
+			gtk_progress_bar_set_text(GTK_PROGRESS_BAR(b->progress_bar), "Could not index the file");
+		}
+		gtk_window_set_title(GTK_WINDOW(b->window), title);
+		g_free(name);
+	}
+	browser_unref(b);
+	return FALSE;
+}
+
+static void index_function(void *data, task_group *group) {
+	game_browser *b = data;
+	b->index = game_index_open_current(b->pgn_path, true, on_index_progress, b);
+	gdk_threads_add_idle(index_ready, b);
+}
+
+static task_group *index_group(void) {
+	static task_group *group = NULL;
+	if (group == NULL) {
+		group = task_group_new();
+	}
+	return group;
+}
+
+typedef struct {
+	char pgn_path[PATH_MAX];
+	unsigned int game_num;
+} browser_load;
+
+static gboolean load_selected_game(gpointer data) {
+	browser_load *load = data;
+	// load_game takes the GDK lock itself
+	load_game(load->pgn_path, (int) load->game_num, NULL, NULL);
+	free(load);
+	return FALSE;
+}
+
+static void on_row_activated(GtkTreeView *view, GtkTreePath *path, GtkTreeViewColumn *column, gpointer data) {
+	game_browser *b = data;
+	GtkTreeModel *model = gtk_tree_view_get_model(view);
+	GtkTreeIter iter;
+	if (model == NULL || !gtk_tree_model_get_iter(model, &iter, path)) {
+		return;
+	}
+	browser_load *load = calloc(1, sizeof(browser_load));
+	snprintf(load->pgn_path, sizeof(load->pgn_path), "%s", b->pgn_path);
+	gtk_tree_model_get(model, &iter, GAME_INDEX_NUMBER, &load->game_num, -1);
+	// the board is rebuilt outside of the signal handler
+	g_idle_add(load_selected_game, load);
+}
+
+static void on_browser_destroy(GtkWidget *widget, gpointer data) {
+	game_browser *b = data;
+	// stops the indexing if it is still going
+	__atomic_store_n(&b->closed, true, __ATOMIC_RELEASE);
+	if (browser == b) {
+		browser = NULL;
+	}
+	browser_unref(b);
+}
+
+static GtkWidget *game_list_view_new(void) {
+	GtkWidget *view = gtk_tree_view_new();
+	PangoLayout *layout = gtk_widget_create_pango_layout(view, "0");
+	int char_width;
+	pango_layout_get_pixel_size(layout, &char_width, NULL);
+	g_object_unref(layout);
+
+	for (int c = 0; c < GAME_INDEX_N_COLUMNS; c++) {
+		GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+		g_object_set(renderer, "ellipsize", PANGO_ELLIPSIZE_END, NULL);
+		GtkTreeViewColumn *column = gtk_tree_view_column_new_with_attributes(column_titles[c], renderer, "text", c, NULL);
+		// fixed sizes spare the view from measuring millions of rows
+		gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+		gtk_tree_view_column_set_fixed_width(column, (column_widths[c] + 2) * char_width);
+		gtk_tree_view_column_set_resizable(column, TRUE);
+		gtk_tree_view_column_set_sort_column_id(column, c);
+		gtk_tree_view_append_column(GTK_TREE_VIEW(view), column);
+	}
+	gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(view), TRUE);
+	gtk_tree_view_set_enable_search(GTK_TREE_VIEW(view), FALSE);
+	return view;
+}
+
+/* Lists the games of a PGN file, double click to load one. The index is
+ * kept next to the file and built on the task pool when missing or stale,
+ * the file itself is never read into memory */
+void game_browser_open(const char *pgn_path) {
+	if (browser != NULL) {
+		if (!strcmp(browser->pgn_path, pgn_path)) {
+			gtk_window_present(GTK_WINDOW(browser->window));
+			return;
+		}
+		gtk_widget_destroy(browser->window);
+	}
+
+	game_browser *b = calloc(1, sizeof(game_browser));
+	snprintf(b->pgn_path, sizeof(b->pgn_path), "%s", pgn_path);
+	pthread_mutex_init(&b->progress_lock, NULL);
+	b->refs = 2; // the window and the indexing
+
+	b->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	char *name = g_path_get_basename(pgn_path);
+	gtk_window_set_title(GTK_WINDOW(b->window), name);
+	g_free(name);
+	gtk_window_set_default_size(GTK_WINDOW(b->window), 800, 600);
+	gtk_window_set_transient_for(GTK_WINDOW(b->window), GTK_WINDOW(main_window));
+	gtk_window_set_destroy_with_parent(GTK_WINDOW(b->window), TRUE);
+	g_signal_connect(b->window, "destroy", G_CALLBACK(on_browser_destroy), b);
+
+	b->progress_bar = gtk_progress_bar_new();
+	gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(b->progress_bar), TRUE);
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(b->progress_bar), "Opening the game index");
+
+	b->view = game_list_view_new();
+	g_signal_connect(b->view, "row-activated", G_CALLBACK(on_row_activated), b);
+
+	GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled), GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	gtk_container_add(GTK_CONTAINER(scrolled), b->view);
+
+	GtkWidget *v_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+	gtk_box_pack_start(GTK_BOX(v_box), b->progress_bar, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(v_box), scrolled, TRUE, TRUE, 0);
+	gtk_container_add(GTK_CONTAINER(b->window), v_box);
+	gtk_widget_show_all(b->window);
+
+	browser = b;
+	task_pool_submit(index_group(), TASK_PRIORITY_NORMAL, index_function, b);
+}
+/* </Browser window> */
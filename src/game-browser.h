@@ -0,0 +1,6 @@
+#ifndef CAIRO_BOARD_GAME_BROWSER_H
+#define CAIRO_BOARD_GAME_BROWSER_H
+
+void game_browser_open(const char *pgn_path);
+
+#endif //CAIRO_BOARD_GAME_BROWSER_H
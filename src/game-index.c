@@ -0,0 +1,573 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <gtk/gtk.h>
+
+#include "san_scanner.h"
+#include "pgn-tokenizer.h"
+#include "game-index.h"
+
+#define GAME_INDEX_MAGIC "CBGI"
+#define GAME_INDEX_VERSION 1
+#define GAME_INDEX_TOKEN_BATCH 256
+
+// token offsets are 32 bits, the scan moves its base along before they wrap
+#define GAME_INDEX_REBASE (1UL << 30)
+
+#define GAME_INDEX_LIST_ROWS 20
+
+/* On disk: header, one record per game, the name table sorted by name id
+ * then the names themselves, NUL terminated. The file is mapped, not read */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint32_t n_games;
+	uint32_t n_names;
+	uint64_t text_size;
+} game_index_header;
+
+typedef struct {
+	uint32_t text;  // offset of the name in the text
+	uint32_t rank;  // position of the name in alphabetical order
+} game_index_name_entry;
+
+struct game_index {
+	GMappedFile *mapped;
+	const game_index_header *header;
+	const game_index_record *records;
+	const game_index_name_entry *names;
+	const char *text;
+};
+
+static const char *column_names[GAME_INDEX_N_COLUMNS] = {
+		[GAME_INDEX_NUMBER] = "number",
+		[GAME_INDEX_WHITE] = "white",
+		[GAME_INDEX_WHITE_ELO] = "whiteelo",
+		[GAME_INDEX_BLACK] = "black",
+		[GAME_INDEX_BLACK_ELO] = "blackelo",
+		[GAME_INDEX_RESULT] = "result",
+		[GAME_INDEX_ECO] = "eco",
+		[GAME_INDEX_DATE] = "date"
+};
+
+static const char *result_strings[] = {"*", "1-0", "0-1", "1/2-1/2"};
+
+/* <Index building> */
+typedef struct {
+	FILE *out;
+	GHashTable *name_ids; // name -> id + 1
+	GPtrArray *names;     // by id, owned by name_ids
+	uint64_t text_size;
+	game_index_record record;
+	bool in_game;
+	bool inside_tags;
+	uint32_t n_games;
+	bool ok;
+} index_builder;
+
+static uint32_t name_id(index_builder *builder, const char *name) {
+	gpointer id = g_hash_table_lookup(builder->name_ids, name);
+	if (id != NULL) {
+		return GPOINTER_TO_UINT(id) - 1;
+	}
+	char *copy = g_strdup(name);
+	g_hash_table_insert(builder->name_ids, copy, GUINT_TO_POINTER(builder->names->len + 1));
+	g_ptr_array_add(builder->names, copy);
+	builder->text_size += strlen(copy) + 1;
+	return builder->names->len - 1;
+}
+
+static game_result parse_result(const char *s, size_t len) {
+	for (int result = GAME_RESULT_WHITE_WINS; result <= GAME_RESULT_DRAW; result++) {
+		if (len == strlen(result_strings[result]) && !strncmp(s, result_strings[result], len)) {
+			return result;
+		}
+	}
+	return GAME_RESULT_UNKNOWN;
+}
+
+/* "1997.05.11", question marks for what is unknown */
+static uint32_t parse_date(const char *s) {
+	unsigned int year = 0, month = 0, day = 0;
+	sscanf(s, "%4u.%2u.%2u", &year, &month, &day);
+	return year * 10000 + (month <= 12 ? month : 0) * 100 + (day <= 31 ? day : 0);
+}
+
+static uint16_t parse_eco(const char *s) {
+	if (s[0] < 'A' || s[0] > 'E' || s[1] < '0' || s[1] > '9' || s[2] < '0' || s[2] > '9') {
+		return 0;
+	}
+	return (uint16_t) (1 + 100 * (s[0] - 'A') + 10 * (s[1] - '0') + (s[2] - '0'));
+}
+
+static uint16_t parse_elo(const char *s) {
+	int elo = atoi(s);
+	return (uint16_t) (elo < 0 ? 0 : elo > UINT16_MAX ? UINT16_MAX : elo);
+}
+
+static void builder_start_game(index_builder *builder, uint64_t offset) {
+	memset(&builder->record, 0, sizeof(builder->record));
+	builder->record.offset = offset;
+	builder->in_game = true;
+}
+
+static void builder_end_game(index_builder *builder) {
+	if (builder->ok && fwrite(&builder->record, sizeof(game_index_record), 1, builder->out) != 1) {
+		builder->ok = false;
+	}
+	builder->n_games++;
+	builder->in_game = false;
+}
+
+static void builder_tag(index_builder *builder, const char *buf, const pgn_token *token) {
+	char value[256];
+	game_index_record *record = &builder->record;
+	pgn_token_tag_value(buf, token, value, sizeof(value));
+
+	if (pgn_token_tag_is(buf, token, "White")) {
+		record->white = name_id(builder, value);
+	}
+	else if (pgn_token_tag_is(buf, token, "Black")) {
+		record->black = name_id(builder, value);
+	}
+	else if (pgn_token_tag_is(buf, token, "WhiteElo")) {
+		record->white_elo = parse_elo(value);
+	}
+	else if (pgn_token_tag_is(buf, token, "BlackElo")) {
+		record->black_elo = parse_elo(value);
+	}
+	else if (pgn_token_tag_is(buf, token, "Result")) {
+		record->result = parse_result(value, strlen(value));
+	}
+	else if (pgn_token_tag_is(buf, token, "ECO")) {
+		record->eco = parse_eco(value);
+	}
+	else if (pgn_token_tag_is(buf, token, "Date")) {
+		record->date = parse_date(value);
+	}
+}
+
+/* Games are cut where pgn_replay() cuts them, so that the numbers match
+ * the ones load_game() takes. Only tags are looked at, moves are skipped */
+static bool scan_games(index_builder *builder, const char *buf, size_t len,
+                       game_index_progress_function progress, void *data) {
+	pgn_token tokens[GAME_INDEX_TOKEN_BATCH];
+	size_t base = 0;
+	size_t pos = 0;
+	size_t n_tokens;
+	while ((n_tokens = pgn_tokenize(buf + base, len - base, &pos, tokens, GAME_INDEX_TOKEN_BATCH)) > 0) {
+		for (size_t k = 0; k < n_tokens; k++) {
+			const pgn_token *token = &tokens[k];
+			switch (token->kind) {
+				case MATCHED_TAG:
+					if (!builder->inside_tags) {
+						if (builder->in_game) {
+							builder_end_game(builder);
+						}
+						builder_start_game(builder, base + token->offset);
+						builder->inside_tags = true;
+					}
+					builder_tag(builder, buf + base, token);
+					break;
+				case MATCHED_MOVE:
+					builder->inside_tags = false;
+					if (!builder->in_game) {
+						builder_start_game(builder, base + token->offset);
+					}
+					break;
+				case MATCHED_END_TOKEN:
+					builder->inside_tags = false;
+					if (builder->in_game) {
+						if (builder->record.result == GAME_RESULT_UNKNOWN) {
+							builder->record.result = parse_result(buf + base + token->offset, token->len);
+						}
+						builder_end_game(builder);
+					}
+					break;
+				default:
+					break;
+			}
+		}
+		if (progress != NULL && !progress(base + pos, len, builder->n_games, data)) {
+			return false;
+		}
+		if (pos > GAME_INDEX_REBASE) {
+			base += pos;
+			pos = 0;
+		}
+	}
+	if (builder->in_game) {
+		builder_end_game(builder);
+	}
+	return true;
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b) {
+	return g_utf8_collate(*(const char **) a, *(const char **) b);
+}
+
+static bool write_names(index_builder *builder) {
+	uint32_t n_names = builder->names->len;
+	game_index_name_entry *entries = calloc(n_names + 1, sizeof(game_index_name_entry));
+
+	uint32_t text = 0;
+	for (uint32_t i = 0; i < n_names; i++) {
+		entries[i].text = text;
+		text += (uint32_t) strlen(builder->names->pdata[i]) + 1;
+	}
+	// ranks let the sort compare names as numbers
+	GPtrArray *sorted = g_ptr_array_sized_new(n_names);
+	for (uint32_t i = 0; i < n_names; i++) {
+		g_ptr_array_add(sorted, builder->names->pdata[i]);
+	}
+	g_ptr_array_sort(sorted, compare_names);
+	for (uint32_t rank = 0; rank < n_names; rank++) {
+		uint32_t id = GPOINTER_TO_UINT(g_hash_table_lookup(builder->name_ids, sorted->pdata[rank])) - 1;
+		entries[id].rank = rank;
+	}
+	g_ptr_array_free(sorted, TRUE);
+
+	bool ok = fwrite(entries, sizeof(game_index_name_entry), n_names, builder->out) == n_names;
+	for (uint32_t i = 0; ok && i < n_names; i++) {
+		const char *name = builder->names->pdata[i];
+		ok = fwrite(name, strlen(name) + 1, 1, builder->out) == 1;
+	}
+	free(entries);
+	return ok;
+}
+
+/* Scans the tags of every game of the PGN file and writes them with the
+ * offset of each game. Records are written as the file is read, only the
+ * distinct player names are kept in memory */
+int game_index_build(const char *pgn_path, const char *index_path, game_index_progress_function progress, void *data) {
+	struct stat source;
+	GError *error = NULL;
+	GMappedFile *mapped = g_mapped_file_new(pgn_path, FALSE, &error);
+	if (mapped == NULL || stat(pgn_path, &source)) {
+		fprintf(stderr, "Error opening file '%s': %s\n", pgn_path, error ? error->message : strerror(errno));
+		g_clear_error(&error);
+		if (mapped != NULL) {
+			g_mapped_file_unref(mapped);
+		}
+		return -1;
+	}
+
+	gchar *tmp_path = g_strconcat(index_path, ".tmp", NULL);
+	FILE *out = fopen(tmp_path, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "Error opening file '%s': %s\n", tmp_path, strerror(errno));
+		g_mapped_file_unref(mapped);
+		g_free(tmp_path);
+		return -1;
+	}
+
+	index_builder builder;
+	memset(&builder, 0, sizeof(builder));
+	builder.out = out;
+	builder.name_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	builder.names = g_ptr_array_new();
+	builder.ok = true;
+	name_id(&builder, ""); // id 0, for games without the tag
+
+	game_index_header header;
+	memset(&header, 0, sizeof(header));
+	builder.ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+	bool finished = scan_games(&builder, g_mapped_file_get_contents(mapped), g_mapped_file_get_length(mapped),
+	                           progress, data);
+	g_mapped_file_unref(mapped);
+
+	if (finished && builder.ok) {
+		builder.ok = write_names(&builder);
+	}
+	if (finished && builder.ok) {
+		memcpy(header.magic, GAME_INDEX_MAGIC, 4);
+		header.version = GAME_INDEX_VERSION;
+		header.source_size = (uint64_t) source.st_size;
+		header.source_mtime = (int64_t) source.st_mtime;
+		header.n_games = builder.n_games;
+		header.n_names = builder.names->len;
+		header.text_size = builder.text_size;
+		builder.ok = !fseek(out, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1, out) == 1;
+	}
+	g_ptr_array_free(builder.names, TRUE);
+	g_hash_table_destroy(builder.name_ids);
+
+	if (fclose(out) || !builder.ok || !finished) {
+		if (finished) {
+			fprintf(stderr, "Error writing file '%s': %s\n", tmp_path, strerror(errno));
+		}
+		unlink(tmp_path);
+		g_free(tmp_path);
+		return -1;
+	}
+	int ret = rename(tmp_path, index_path);
+	if (ret) {
+		fprintf(stderr, "Error renaming '%s': %s\n", tmp_path, strerror(errno));
+	}
+	g_free(tmp_path);
+	return ret;
+}
+/* </Index building> */
+
+/* <Index queries> */
+game_index *game_index_open(const char *index_path) {
+	GMappedFile *mapped = g_mapped_file_new(index_path, FALSE, NULL);
+	if (mapped == NULL) {
+		return NULL;
+	}
+	const char *contents = g_mapped_file_get_contents(mapped);
+	size_t len = g_mapped_file_get_length(mapped);
+	const game_index_header *header = (const game_index_header *) contents;
+
+	if (len < sizeof(game_index_header) || memcmp(header->magic, GAME_INDEX_MAGIC, 4) ||
+	    header->version != GAME_INDEX_VERSION || header->text_size > len ||
+	    len != sizeof(game_index_header) + header->n_games * sizeof(game_index_record) +
+	           header->n_names * sizeof(game_index_name_entry) + header->text_size) {
+		fprintf(stderr, "'%s' is not a game index\n", index_path);
+		g_mapped_file_unref(mapped);
+		return NULL;
+	}
+
+	// names are few, each is checked once; record name ids are clamped where used
+	const game_index_name_entry *names = (const game_index_name_entry *) (contents + sizeof(game_index_header) +
+	                                                                      header->n_games * sizeof(game_index_record));
+	const char *text = (const char *) (names + header->n_names);
+	bool valid = header->n_names > 0 && header->text_size > 0 && text[header->text_size - 1] == '\0';
+	for (uint32_t i = 0; valid && i < header->n_names; i++) {
+		valid = names[i].text < header->text_size && names[i].rank < header->n_names;
+	}
+	if (!valid) {
+		fprintf(stderr, "'%s' is a damaged game index\n", index_path);
+		g_mapped_file_unref(mapped);
+		return NULL;
+	}
+
+	game_index *index = calloc(1, sizeof(game_index));
+	index->mapped = mapped;
+	index->header = header;
+	index->records = (const game_index_record *) (contents + sizeof(game_index_header));
+	index->names = (const game_index_name_entry *) (index->records + header->n_games);
+	index->text = (const char *) (index->names + header->n_names);
+	return index;
+}
+
+void game_index_close(game_index *index) {
+	if (index == NULL) {
+		return;
+	}
+	g_mapped_file_unref(index->mapped);
+	free(index);
+}
+
+static bool is_index_current(const char *pgn_path, const game_index *index) {
+	struct stat source;
+	return !stat(pgn_path, &source) &&
+	       index->header->source_size == (uint64_t) source.st_size &&
+	       index->header->source_mtime == (int64_t) source.st_mtime;
+}
+
+/* The index next to pgn_path, (re)built first when missing or stale if
+ * build is true. NULL if there is none or building it failed */
+game_index *game_index_open_current(const char *pgn_path, bool build, game_index_progress_function progress, void *data) {
+	gchar *index_path = g_strconcat(pgn_path, GAME_INDEX_SUFFIX, NULL);
+	game_index *index = game_index_open(index_path);
+	if (index != NULL && !is_index_current(pgn_path, index)) {
+		game_index_close(index);
+		index = NULL;
+	}
+	if (index == NULL && build && !game_index_build(pgn_path, index_path, progress, data)) {
+		index = game_index_open(index_path);
+	}
+	g_free(index_path);
+	return index;
+}
+
+uint32_t game_index_games(const game_index *index) {
+	return index->header->n_games;
+}
+
+const game_index_record *game_index_record_at(const game_index *index, uint32_t game) {
+	return &index->records[game];
+}
+
+const char *game_index_name(const game_index *index, uint32_t name) {
+	return name < index->header->n_names ? index->text + index->names[name].text : "";
+}
+
+void game_index_format(const game_index *index, uint32_t game, game_index_column column, char *buf, size_t size) {
+	const game_index_record *record = &index->records[game];
+	buf[0] = '\0';
+	switch (column) {
+		case GAME_INDEX_NUMBER:
+			snprintf(buf, size, "%u", game + 1);
+			break;
+		case GAME_INDEX_WHITE:
+			g_strlcpy(buf, game_index_name(index, record->white), size);
+			break;
+		case GAME_INDEX_BLACK:
+			g_strlcpy(buf, game_index_name(index, record->black), size);
+			break;
+		case GAME_INDEX_WHITE_ELO:
+			if (record->white_elo) {
+				snprintf(buf, size, "%u", record->white_elo);
+			}
+			break;
+		case GAME_INDEX_BLACK_ELO:
+			if (record->black_elo) {
+				snprintf(buf, size, "%u", record->black_elo);
+			}
+			break;
+		case GAME_INDEX_RESULT:
+			g_strlcpy(buf, result_strings[record->result <= GAME_RESULT_DRAW ? record->result : 0], size);
+			break;
+		case GAME_INDEX_ECO:
+			if (record->eco) {
+				snprintf(buf, size, "%c%02u", 'A' + (record->eco - 1) / 100, (record->eco - 1) % 100);
+			}
+			break;
+		case GAME_INDEX_DATE:
+			if (record->date) {
+				snprintf(buf, size, "%04u.%02u.%02u", record->date / 10000, record->date / 100 % 100, record->date % 100);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+int game_index_parse_column(const char *name, game_index_column *column) {
+	for (int i = 0; i < GAME_INDEX_N_COLUMNS; i++) {
+		if (!g_ascii_strcasecmp(name, column_names[i])) {
+			*column = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static uint32_t sort_key(const game_index *index, uint32_t game, game_index_column column) {
+	const game_index_record *record = &index->records[game];
+	switch (column) {
+		case GAME_INDEX_WHITE:
+			return record->white < index->header->n_names ? index->names[record->white].rank : 0;
+		case GAME_INDEX_BLACK:
+			return record->black < index->header->n_names ? index->names[record->black].rank : 0;
+		case GAME_INDEX_WHITE_ELO:
+			return record->white_elo;
+		case GAME_INDEX_BLACK_ELO:
+			return record->black_elo;
+		case GAME_INDEX_RESULT:
+			return record->result;
+		case GAME_INDEX_ECO:
+			return record->eco;
+		case GAME_INDEX_DATE:
+			return record->date;
+		default:
+			return game;
+	}
+}
+
+/* Games in the order of column, ties in file order. Keys and game numbers
+ * are packed in 64 bits and radix sorted on the key half, a byte a pass,
+ * which stays linear for millions of games. The array must be freed */
+uint32_t *game_index_sort(const game_index *index, game_index_column column, bool descending) {
+	uint32_t n = index->header->n_games;
+	if (n == 0) {
+		return malloc(sizeof(uint32_t));
+	}
+	uint64_t *items = malloc((n + 1) * sizeof(uint64_t));
+	uint64_t *scratch = malloc((n + 1) * sizeof(uint64_t));
+
+	for (uint32_t game = 0; game < n; game++) {
+		uint32_t key = sort_key(index, game, column);
+		items[game] = (uint64_t) (descending ? ~key : key) << 32 | game;
+	}
+
+	for (int shift = 32; shift < 64; shift += 8) {
+		size_t counts[257];
+		memset(counts, 0, sizeof(counts));
+		for (uint32_t i = 0; i < n; i++) {
+			counts[((items[i] >> shift) & 0xff) + 1]++;
+		}
+		// a byte every key shares needs no pass
+		if (counts[((items[0] >> shift) & 0xff) + 1] == n) {
+			continue;
+		}
+		for (int b = 1; b < 257; b++) {
+			counts[b] += counts[b - 1];
+		}
+		for (uint32_t i = 0; i < n; i++) {
+			scratch[counts[(items[i] >> shift) & 0xff]++] = items[i];
+		}
+		uint64_t *swap = items;
+		items = scratch;
+		scratch = swap;
+	}
+
+	uint32_t *order = malloc((n + 1) * sizeof(uint32_t));
+	for (uint32_t i = 0; i < n; i++) {
+		order[i] = (uint32_t) items[i];
+	}
+	free(items);
+	free(scratch);
+	return order;
+}
+
+/* Prints the first games of pgn_path in the order of spec, a column name
+ * with a leading '-' for descending order, (re)building the index next to
+ * the file when missing or stale */
+int game_index_list(const char *pgn_path, const char *spec) {
+	game_index_column column;
+	bool descending = spec[0] == '-';
+	if (game_index_parse_column(descending ? spec + 1 : spec, &column)) {
+		fprintf(stderr, "Invalid column '%s', expected one of:", spec);
+		for (int i = 0; i < GAME_INDEX_N_COLUMNS; i++) {
+			fprintf(stderr, " %s", column_names[i]);
+		}
+		fprintf(stderr, ", with a leading '-' for descending order\n");
+		return -1;
+	}
+
+	struct timeval start, end, diff;
+	gettimeofday(&start, NULL);
+	game_index *index = game_index_open_current(pgn_path, false, NULL, NULL);
+	if (index == NULL) {
+		printf("Indexing games of '%s'...\n", pgn_path);
+		index = game_index_open_current(pgn_path, true, NULL, NULL);
+		if (index == NULL) {
+			return -1;
+		}
+		gettimeofday(&end, NULL);
+		timersub(&end, &start, &diff);
+		printf("Indexed %u games in %ld.%03lds\n", game_index_games(index), diff.tv_sec, diff.tv_usec / 1000);
+	}
+
+	gettimeofday(&start, NULL);
+	uint32_t *order = game_index_sort(index, column, descending);
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+
+	uint32_t n = game_index_games(index);
+	for (uint32_t i = 0; i < n && i < GAME_INDEX_LIST_ROWS; i++) {
+		char fields[GAME_INDEX_N_COLUMNS][64];
+		for (int c = 0; c < GAME_INDEX_N_COLUMNS; c++) {
+			game_index_format(index, order[i], c, fields[c], sizeof(fields[c]));
+		}
+		printf("%s\t%s (%s) - %s (%s)\t%s\t%s\t%s\n", fields[GAME_INDEX_NUMBER],
+		       fields[GAME_INDEX_WHITE], fields[GAME_INDEX_WHITE_ELO], fields[GAME_INDEX_BLACK],
+		       fields[GAME_INDEX_BLACK_ELO], fields[GAME_INDEX_RESULT], fields[GAME_INDEX_ECO], fields[GAME_INDEX_DATE]);
+	}
+	printf("%u games sorted by %s in %.3fms\n", n, spec, diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0);
+
+	free(order);
+	game_index_close(index);
+	return 0;
+}
+/* </Index queries> */
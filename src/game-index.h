@@ -0,0 +1,61 @@
+#ifndef CAIRO_BOARD_GAME_INDEX_H
+#define CAIRO_BOARD_GAME_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define GAME_INDEX_SUFFIX ".gidx"
+
+typedef enum {
+	GAME_INDEX_NUMBER = 0,
+	GAME_INDEX_WHITE,
+	GAME_INDEX_WHITE_ELO,
+	GAME_INDEX_BLACK,
+	GAME_INDEX_BLACK_ELO,
+	GAME_INDEX_RESULT,
+	GAME_INDEX_ECO,
+	GAME_INDEX_DATE,
+	GAME_INDEX_N_COLUMNS
+} game_index_column;
+
+typedef enum {
+	GAME_RESULT_UNKNOWN = 0,
+	GAME_RESULT_WHITE_WINS,
+	GAME_RESULT_BLACK_WINS,
+	GAME_RESULT_DRAW
+} game_result;
+
+/* One per game, in file order. Names are indices in the name table */
+typedef struct {
+	uint64_t offset;    // of the first tag, or of the first move without tags
+	uint32_t white;
+	uint32_t black;
+	uint32_t date;      // YYYYMMDD, unknown parts as 0
+	uint16_t white_elo;
+	uint16_t black_elo;
+	uint16_t eco;       // 0 if none, else 1 + 100 * letter + number: A00 is 1, E99 is 500
+	uint8_t result;     // game_result
+	uint8_t reserved[5];
+} game_index_record;
+
+typedef struct game_index game_index;
+
+/* Called between batches of tokens while indexing, return false to stop */
+typedef bool (*game_index_progress_function)(size_t bytes_done, size_t bytes_total, uint32_t n_games, void *data);
+
+int game_index_build(const char *pgn_path, const char *index_path, game_index_progress_function progress, void *data);
+game_index *game_index_open(const char *index_path);
+game_index *game_index_open_current(const char *pgn_path, bool build, game_index_progress_function progress, void *data);
+void game_index_close(game_index *index);
+
+uint32_t game_index_games(const game_index *index);
+const game_index_record *game_index_record_at(const game_index *index, uint32_t game);
+const char *game_index_name(const game_index *index, uint32_t name);
+void game_index_format(const game_index *index, uint32_t game, game_index_column column, char *buf, size_t size);
+int game_index_parse_column(const char *name, game_index_column *column);
+uint32_t *game_index_sort(const game_index *index, game_index_column column, bool descending);
+
+int game_index_list(const char *pgn_path, const char *spec);
+
+#endif //CAIRO_BOARD_GAME_INDEX_H
@@ -8,6 +8,9 @@
 #include "chess-backend.h"
 #include "drawing-backend.h"
 #include "netstuff.h"
+#include "ics-console.h"
+#include "ics-queue.h"
+#include "position-snapshot.h"
 
 /* How much data we read from ICS at once
  * Try smaller values to test the stitching mechanism */
@@ -108,23 +111,26 @@ char first_board_chunk[256]; // board is about 150 chars on average so 256 is sa
 
 static char last_board_chars[72];
 
+/* Against the last position published, the board may be changing on the main loop */
 bool check_board12_game_consistency() {
 	int i, j;
 	unsigned short board_char_index = 0;
+	position_snapshot snapshot;
+	position_snapshot_read(&snapshot);
 	for (j = 7; j > -1; j--) {
 		for (i = 0; i < 8; i++) {
-			chess_piece *piece = main_game->squares[i][j].piece;
+			int type = snapshot.squares[i][j];
 			char bc = last_board_chars[board_char_index++];
 			if (bc == '-') {
-				if (piece != NULL && !piece->dead) {
+				if (type != SNAPSHOT_EMPTY_SQUARE) {
 					printf("[!!] Board12 and game are inconsistent!\nlast_board_chars: %s\n", last_board_chars);
-					printf("Unexpected piece at '%c%d' type: %c\n", ('a' + i), j + 1, type_to_fen_char(piece->type));
+					printf("Unexpected piece at '%c%d' type: %c\n", ('a' + i), j + 1, type_to_fen_char(type));
 					return false;
 				}
-			} else if (piece == NULL || piece->dead || bc != type_to_fen_char(piece->type)) {
+			} else if (type == SNAPSHOT_EMPTY_SQUARE || bc != type_to_fen_char(type)) {
 				printf("[!!] Board12 and game are inconsistent!\nlast_board_chars: %s\n", last_board_chars);
 				printf("Unexpected type or missing piece at '%c%d' expected %c but got %c\n", ('a' + i), j + 1, bc,
-				       piece == NULL ? '0' : type_to_fen_char(piece->type));
+				       type == SNAPSHOT_EMPTY_SQUARE ? '0' : type_to_fen_char(type));
 				return false;
 			}
 		}
@@ -997,8 +1003,11 @@ void toggle_echo(int on_off) {
 	}
 }
 
-int scan_append_ply(char *ply) {
-	san_scanner__scan_string(ply);
+/* Runs in the main loop, where main_game changes: a ply of a move list
+ * queued by scan_append_ply(). The SAN scanner is used there too */
+static gboolean append_ply_idle(gpointer data) {
+	char *ply = data;
+	san_scanner_feed(ply, (int) strlen(ply));
 	if (san_scanner_lex() != -1) {
 		playing = 1;
 		int resolved = resolve_move(main_game, type, currentMoveString, resolved_move);
@@ -1034,6 +1043,48 @@ int scan_append_ply(char *ply) {
 	} else {
 		fprintf(stderr, "san_scanner_lex returned -1\n");
 	}
+	free(ply);
+	return FALSE;
+}
+
+/* From the parser thread: the ply is resolved and played in the main loop,
+ * in order with the moves and the end of the list queued after it */
+int scan_append_ply(char *ply) {
+	g_idle_add(append_ply_idle, strdup(ply));
+	return FALSE;
+}
+
+typedef struct {
+	int parsed_plys;
+	bool start_clock;
+} move_list_end;
+
+/* Runs in the main loop once every ply of the list is on the board */
+static gboolean finish_move_list_idle(gpointer data) {
+	move_list_end *end = data;
+
+	refresh_moves_list_view(main_list);
+	gdk_threads_enter();
+	draw_pieces_surface(old_wi, old_hi);
+	init_dragging_background(old_wi, old_hi);
+	init_highlight_under_surface(old_wi, old_hi);
+//	init_highlight_over_surface(old_wi, old_hi);
+
+	// highlight last move
+	if (end->parsed_plys > 0 && highlight_last_move) {
+		highlight_move(resolved_move[0], resolved_move[1], resolved_move[2], resolved_move[3], old_wi, old_hi);
+	}
+	if (end->parsed_plys > 0 && is_king_checked(main_game, main_game->whose_turn)) {
+		warn_check(old_wi, old_hi);
+	}
+
+	gtk_widget_queue_draw(GTK_WIDGET(board));
+	gdk_threads_leave();
+	if (end->start_clock) {
+		start_one_clock(main_clock, (main_game->whose_turn));
+	}
+	start_uci_analysis();
+	free(end);
 	return FALSE;
 }
 
@@ -1114,6 +1165,12 @@ void parse_ics_buffer(void) {
 	static char *buff;
 	static int current_buff_alloc = 0;
 
+	/* Unparsed server output for the console: tokens are appended at post_len,
+	 * their total length never exceeds the scanned length */
+	static char *post_buff;
+	static int post_buff_alloc = 0;
+	size_t post_len = 0;
+
 	memset(raw_buff, 0, ICS_BUFF_SIZE);
 
 	// read at most ICS_BUFF_SIZE bytes from the ICS pipe
@@ -1228,10 +1285,18 @@ void parse_ics_buffer(void) {
 		chopped_len = 0;
 	}
 
-	char *post_buff = calloc(current_buff_alloc-chopped_len+1, sizeof(char));
+	if (post_buff_alloc < current_buff_alloc-chopped_len+1) {
+		char *temp = realloc(post_buff, current_buff_alloc-chopped_len+1);
+		if (!temp) {
+			perror("Realloc failed!!");
+			exit(1);
+		}
+		post_buff = temp;
+		post_buff_alloc = current_buff_alloc-chopped_len+1;
+	}
 
 
-	ics_scanner__scan_bytes(buff, current_buff_alloc-chopped_len);
+	ics_scanner_feed(buff, current_buff_alloc-chopped_len);
 	i = 0;
 	while (i > -1) {
 
@@ -1253,7 +1318,11 @@ void parse_ics_buffer(void) {
 			case GAME_END:
 			case FOLLOWING:
 			default:
-				strcat(post_buff, ics_scanner_text);
+				// skip the NUL padding at the end of the scanned bytes
+				if (ics_scanner_text[0] != '\0') {
+					memcpy(post_buff + post_len, ics_scanner_text, ics_scanner_leng);
+					post_len += ics_scanner_leng;
+				}
 				break;
 		}
 
@@ -1558,34 +1627,21 @@ void parse_ics_buffer(void) {
 					parse_move_list_full_move(ics_scanner_text);
 				}
 				break;
-			case MOVE_LIST_END:
+			case MOVE_LIST_END: {
 				got_header = 0;
 				requested_moves = 0;
 				finished_parsing_moves = 1;
 
-				refresh_moves_list_view(main_list);
-				gdk_threads_enter();
-				draw_pieces_surface(old_wi, old_hi);
-				init_dragging_background(old_wi, old_hi);
-				init_highlight_under_surface(old_wi, old_hi);
-//				init_highlight_over_surface(old_wi, old_hi);
-
-				// highlight last move
-				if (parsed_plys > 0 && highlight_last_move) {
-					highlight_move(resolved_move[0], resolved_move[1], resolved_move[2], resolved_move[3], old_wi, old_hi);
-				}
-				if (parsed_plys > 0 && is_king_checked(main_game, main_game->whose_turn)) {
-					warn_check(old_wi, old_hi);
-				}
-
-				gtk_widget_queue_draw(GTK_WIDGET(board));
-				gdk_threads_leave();
-				if (parsed_plys > 1 && !clock_started) {
+				move_list_end *end = malloc(sizeof(move_list_end));
+				end->parsed_plys = parsed_plys;
+				end->start_clock = parsed_plys > 1 && !clock_started;
+				if (end->start_clock) {
 					clock_started = 1;
-					start_one_clock(main_clock, (main_game->whose_turn));
 				}
-				start_uci_analysis();
+				// after the plys queued by scan_append_ply()
+				g_idle_add(finish_move_list_idle, end);
 				break;
+			}
 			case GAME_RESUME: {
 				debug("Found GAME_RESUME message: '%s'\n", ics_scanner_text);
 				char wn[128], bn[128];
@@ -1653,11 +1709,11 @@ void parse_ics_buffer(void) {
 		}
 	}
 
-	if (strlen(post_buff) != 1 || post_buff[0] != '\n') {
-		fprintf(stdout, "%s", post_buff);
+	if (post_len != 1 || post_buff[0] != '\n') {
+		fwrite(post_buff, sizeof(char), post_len, stdout);
 		fflush(stdout);
+		ics_console_append(post_buff, post_len);
 	}
-	free(post_buff);
 
 
 	return;
@@ -1666,9 +1722,7 @@ void parse_ics_buffer(void) {
 void *read_message_function(void *ptr) {
 	int *socket = (int *) (ptr);
 
-	while (!read_write_ics_fd(STDIN_FILENO, ics_data_pipe[1], *socket)) {
-		usleep(10000);
-	}
+	while (!read_write_ics_fd(STDIN_FILENO, ics_data_pipe[1], *socket));
 
 	fprintf(stdout, "[read ics thread] - Closing ICS reader\n");
 	return 0;
@@ -1695,6 +1749,9 @@ int init_ics() {
 		perror("Pipe creation failed");
 		return 1;
 	}
+	if (!ics_queue_init()) {
+		return 1;
+	}
 	pthread_create(&ics_reader_thread, NULL, read_message_function, (void*)(&ics_fd));
 	pthread_create(&ics_buff_parser_thread, NULL, parse_ics_function, (void*)(&ics_fd));
 	return 0;
@@ -1704,6 +1761,10 @@ void cleanup_ics() {
 	if (ics_reader_thread != NULL) {
 		pthread_cancel(ics_reader_thread);
 		pthread_join(ics_reader_thread, NULL);
+		if (debug_flag) {
+			ics_queue_print_stats(stdout);
+		}
+		ics_queue_clear();
 	}
 	if (ics_buff_parser_thread != NULL) {
 		pthread_cancel(ics_buff_parser_thread);
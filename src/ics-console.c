@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <gdk/gdkkeysyms.h>
+
+#include "cairo-board.h"
+#include "ics-console.h"
+#include "memory-budget.h"
+
+#define CONSOLE_BUFFER_MAX_LINES 2048
+#define CONSOLE_PENDING_MAX (1 << 20)
+#define CONSOLE_HISTORY_SIZE 64
+
+/* Append-only byte buffer: text is copied at the write offset (len),
+ * storage only grows geometrically so appending is linear overall */
+typedef struct {
+	char *data;
+	size_t len;
+	size_t alloc;
+} console_buff;
+
+static GtkWidget *console_vbox;
+static GtkWidget *console_view;
+static GtkTextBuffer *console_view_buffer;
+static GtkWidget *console_entry;
+static GtkWidget *console_scroll_lock;
+static size_t console_text_size = 0;
+
+/* pending holds text appended by the ICS parser thread since the last flush,
+ * flushing swaps it with spare so the lock is never held while GTK works */
+static console_buff pending_buffs[2];
+static console_buff *pending = &pending_buffs[0];
+static console_buff *spare = &pending_buffs[1];
+static bool flush_scheduled = false;
+static pthread_mutex_t mutex_pending = PTHREAD_MUTEX_INITIALIZER;
+
+/* ring of previously entered commands, history_pos is the browsing index */
+static char *history[CONSOLE_HISTORY_SIZE];
+static int history_count = 0;
+static int history_head = 0;
+static int history_pos = 0;
+
+static void console_buff_append(console_buff *cb, const char *text, size_t len) {
+	if (cb->len + len + 1 > cb->alloc) {
+		size_t new_alloc = cb->alloc ? cb->alloc : 4096;
+		while (cb->len + len + 1 > new_alloc) {
+			new_alloc *= 2;
+		}
+		char *temp = realloc(cb->data, new_alloc);
+		if (!temp) {
+			perror("Realloc failed!!");
+			return;
+		}
+		cb->data = temp;
+		cb->alloc = new_alloc;
+	}
+	memcpy(cb->data + cb->len, text, len);
+	cb->len += len;
+	cb->data[cb->len] = '\0';
+}
+
+/* GtkTextBuffer only accepts UTF-8, FICS occasionally sends latin-1 */
+static void sanitise_utf8(char *text, size_t len) {
+	const gchar *end;
+	char *start = text;
+	while (!g_utf8_validate(start, text + len - start, &end)) {
+		*((char *) end) = '?';
+		start = (char *) end + 1;
+	}
+}
+
+static void update_console_usage(void) {
+	size_t text_size = (size_t) gtk_text_buffer_get_char_count(console_view_buffer);
+	mem_budget_account(MEM_CONSOLE, (long) text_size - (long) console_text_size);
+	console_text_size = text_size;
+}
+
+/* MEM_CONSOLE evictor: drops the oldest half of the scroll-back */
+static bool evict_console_lines(void) {
+	int line_count = gtk_text_buffer_get_line_count(console_view_buffer);
+	if (line_count < 2) {
+		return false;
+	}
+	GtkTextIter start, end;
+	gtk_text_buffer_get_start_iter(console_view_buffer, &start);
+	gtk_text_buffer_get_iter_at_line(console_view_buffer, &end, line_count / 2);
+	gtk_text_buffer_delete(console_view_buffer, &start, &end);
+	update_console_usage();
+	return true;
+}
+
+static void flush_console(void) {
+	pthread_mutex_lock(&mutex_pending);
+	console_buff *to_flush = pending;
+	pending = spare;
+	spare = to_flush;
+	flush_scheduled = false;
+	pthread_mutex_unlock(&mutex_pending);
+
+	if (!to_flush->len) {
+		return;
+	}
+
+	sanitise_utf8(to_flush->data, to_flush->len);
+
+	GtkTextMark *end_mark = gtk_text_buffer_get_mark(console_view_buffer, "end_bookmark");
+	GtkTextIter mark_it;
+	gtk_text_buffer_get_iter_at_mark(console_view_buffer, &mark_it, end_mark);
+	gtk_text_buffer_insert(console_view_buffer, &mark_it, to_flush->data, (gint) to_flush->len);
+
+	// spare is reused, keep its storage
+	to_flush->len = 0;
+
+	/* Count lines to check we're not full */
+	int line_count = gtk_text_buffer_get_line_count(console_view_buffer);
+	if (line_count > CONSOLE_BUFFER_MAX_LINES) {
+		GtkTextIter start, end;
+		gtk_text_buffer_get_start_iter(console_view_buffer, &start);
+		gtk_text_buffer_get_iter_at_line(console_view_buffer, &end, line_count - CONSOLE_BUFFER_MAX_LINES);
+		gtk_text_buffer_delete(console_view_buffer, &start, &end);
+	}
+
+	update_console_usage();
+	mem_budget_enforce(MEM_CONSOLE);
+
+	if (!gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(console_scroll_lock))) {
+		/* autoscroll to the end by making our end mark visible */
+		gtk_text_view_scroll_to_mark(GTK_TEXT_VIEW(console_view), end_mark, 0, 0, 0, 0);
+	}
+}
+
+static gboolean flush_console_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer user_data) {
+	flush_console();
+	return G_SOURCE_REMOVE;
+}
+
+/* Runs in the main loop: defer the actual flush to the next frame so that
+ * everything parsed in between ends up in a single buffer insertion */
+static gboolean schedule_console_flush(gpointer data) {
+	if (console_view == NULL) {
+		return FALSE;
+	}
+	if (gtk_widget_get_mapped(console_view)) {
+		gtk_widget_add_tick_callback(console_view, flush_console_tick, NULL, NULL);
+	}
+	else {
+		// no frames are coming for a hidden view, flush now
+		flush_console();
+	}
+	return FALSE;
+}
+
+/* Queue text for the console, may be called from any thread */
+void ics_console_append(const char *text, size_t len) {
+	if (!len) {
+		return;
+	}
+
+	bool needs_schedule = false;
+
+	pthread_mutex_lock(&mutex_pending);
+	if (console_view == NULL) {
+		pthread_mutex_unlock(&mutex_pending);
+		return;
+	}
+	if (pending->len + len > CONSOLE_PENDING_MAX) {
+		// the main loop is not keeping up, drop the oldest pending text
+		debug("Console pending buffer full, dropping %zu bytes\n", pending->len);
+		pending->len = 0;
+	}
+	console_buff_append(pending, text, len);
+	if (!flush_scheduled) {
+		flush_scheduled = true;
+		needs_schedule = true;
+	}
+	pthread_mutex_unlock(&mutex_pending);
+
+	if (needs_schedule) {
+		gdk_threads_add_idle(schedule_console_flush, NULL);
+	}
+}
+
+static void history_push(const char *command) {
+	int last = (history_head + CONSOLE_HISTORY_SIZE - 1) % CONSOLE_HISTORY_SIZE;
+	if (history_count && !strcmp(history[last], command)) {
+		// don't record repeated commands
+		return;
+	}
+	free(history[history_head]);
+	history[history_head] = strdup(command);
+	history_head = (history_head + 1) % CONSOLE_HISTORY_SIZE;
+	if (history_count < CONSOLE_HISTORY_SIZE) {
+		history_count++;
+	}
+}
+
+/* offset 1 is the most recent command */
+static const char *history_get(int offset) {
+	return history[(history_head + CONSOLE_HISTORY_SIZE - offset) % CONSOLE_HISTORY_SIZE];
+}
+
+static gboolean console_entry_callback(GtkWidget *entry, gpointer data) {
+	const char *text = gtk_entry_get_text(GTK_ENTRY(entry));
+	size_t length = strlen(text);
+	if (length > 0) {
+		history_push(text);
+
+		char *command = calloc(length + 2, sizeof(char));
+		sprintf(command, "%s\n", text);
+		send_to_ics(command);
+		free(command);
+
+		// echo is off on the server side, show what was sent
+		ics_console_append("fics% ", 6);
+		ics_console_append(text, length);
+		ics_console_append("\n", 1);
+
+		gtk_entry_set_text(GTK_ENTRY(entry), "");
+	}
+	history_pos = 0;
+	return FALSE;
+}
+
+static gboolean console_entry_key_press(GtkWidget *entry, GdkEventKey *event, gpointer data) {
+	switch (event->keyval) {
+		case GDK_KEY_Up:
+			if (history_pos < history_count) {
+				history_pos++;
+				gtk_entry_set_text(GTK_ENTRY(entry), history_get(history_pos));
+				gtk_editable_set_position(GTK_EDITABLE(entry), -1);
+			}
+			return TRUE;
+		case GDK_KEY_Down:
+			if (history_pos > 1) {
+				history_pos--;
+				gtk_entry_set_text(GTK_ENTRY(entry), history_get(history_pos));
+				gtk_editable_set_position(GTK_EDITABLE(entry), -1);
+			}
+			else {
+				history_pos = 0;
+				gtk_entry_set_text(GTK_ENTRY(entry), "");
+			}
+			return TRUE;
+		default:
+			break;
+	}
+	return FALSE;
+}
+
+GtkWidget *create_ics_console(void) {
+	console_view = gtk_text_view_new();
+	gtk_text_view_set_editable(GTK_TEXT_VIEW(console_view), FALSE);
+	gtk_text_view_set_cursor_visible(GTK_TEXT_VIEW(console_view), FALSE);
+	gtk_text_view_set_wrap_mode(GTK_TEXT_VIEW(console_view), GTK_WRAP_WORD_CHAR);
+	gtk_text_view_set_monospace(GTK_TEXT_VIEW(console_view), TRUE);
+	gtk_text_view_set_left_margin(GTK_TEXT_VIEW(console_view), 10);
+	gtk_text_view_set_right_margin(GTK_TEXT_VIEW(console_view), 10);
+	add_class(console_view, "ics-console");
+
+	console_view_buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(console_view));
+
+	GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window), GTK_POLICY_AUTOMATIC, GTK_POLICY_ALWAYS);
+	gtk_container_add(GTK_CONTAINER(scrolled_window), console_view);
+
+	/* create the end mark */
+	GtkTextIter end_iter;
+	gtk_text_buffer_get_end_iter(console_view_buffer, &end_iter);
+	gtk_text_buffer_create_mark(console_view_buffer, "end_bookmark", &end_iter, 0);
+	mem_budget_set_evictor(MEM_CONSOLE, evict_console_lines);
+
+	GtkWidget *entry_label = gtk_label_new("fics%");
+
+	console_entry = gtk_entry_new();
+	gtk_entry_set_max_length(GTK_ENTRY(console_entry), 400);
+	g_signal_connect(console_entry, "activate", G_CALLBACK(console_entry_callback), NULL);
+	g_signal_connect(console_entry, "key-press-event", G_CALLBACK(console_entry_key_press), NULL);
+
+	/* Scroll lock button */
+	console_scroll_lock = gtk_toggle_button_new();
+	GtkWidget *button_image = gtk_image_new_from_icon_name("go-bottom", GTK_ICON_SIZE_MENU);
+	gtk_button_set_image(GTK_BUTTON(console_scroll_lock), button_image);
+	gtk_button_set_relief(GTK_BUTTON(console_scroll_lock), GTK_RELIEF_NONE);
+	gtk_button_set_focus_on_click(GTK_BUTTON(console_scroll_lock), FALSE);
+	gtk_widget_set_tooltip_text(console_scroll_lock, "Lock scrolling");
+
+	GtkWidget *entry_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+	add_class(entry_hbox, "text-input-wrapper");
+	gtk_box_pack_start(GTK_BOX(entry_hbox), entry_label, FALSE, FALSE, 5);
+	gtk_box_pack_start(GTK_BOX(entry_hbox), console_entry, TRUE, TRUE, 0);
+	gtk_box_pack_start(GTK_BOX(entry_hbox), console_scroll_lock, FALSE, FALSE, 0);
+
+	console_vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+	gtk_box_pack_start(GTK_BOX(console_vbox), scrolled_window, TRUE, TRUE, 0);
+	gtk_box_pack_start(GTK_BOX(console_vbox), entry_hbox, FALSE, FALSE, 0);
+
+	return console_vbox;
+}
+
+void free_ics_console(void) {
+	pthread_mutex_lock(&mutex_pending);
+	console_view = NULL;
+	for (int i = 0; i < 2; i++) {
+		free(pending_buffs[i].data);
+		pending_buffs[i].data = NULL;
+		pending_buffs[i].len = pending_buffs[i].alloc = 0;
+	}
+	pthread_mutex_unlock(&mutex_pending);
+
+	mem_budget_set_evictor(MEM_CONSOLE, NULL);
+	mem_budget_account(MEM_CONSOLE, -(long) console_text_size);
+	console_text_size = 0;
+
+	for (int i = 0; i < CONSOLE_HISTORY_SIZE; i++) {
+		free(history[i]);
+		history[i] = NULL;
+	}
+	history_count = 0;
+}
@@ -0,0 +1,10 @@
+#ifndef CAIRO_BOARD_ICS_CONSOLE_H
+#define CAIRO_BOARD_ICS_CONSOLE_H
+
+#include <gtk/gtk.h>
+
+GtkWidget *create_ics_console(void);
+void ics_console_append(const char *text, size_t len);
+void free_ics_console(void);
+
+#endif //CAIRO_BOARD_ICS_CONSOLE_H
@@ -0,0 +1,250 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ics-queue.h"
+#include "time-source.h"
+
+extern int debug_flag;
+#ifndef debug
+#define debug(format, ...) if (debug_flag) fprintf(stdout, "%s:%d " format, __FUNCTION__, __LINE__, ##__VA_ARGS__)
+#endif
+
+/* Anything waiting longer than that gets logged in debug mode */
+#define SLOW_COMMAND_US 50000
+
+typedef struct queued_command {
+	char *text;
+	int64_t queued_at;
+	struct queued_command *next;
+} queued_command;
+
+typedef struct {
+	queued_command *head;
+	queued_command *tail;
+} command_list;
+
+typedef struct {
+	long sent;
+	int64_t total_us;
+	int64_t max_us;
+} latency_stats;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static command_list queues[ICS_PRIORITY_COUNT];
+static latency_stats stats[ICS_PRIORITY_COUNT];
+static int wake_pipe[2] = {-1, -1};
+
+static const char *priority_names[] = {"move", "game", "bulk"};
+
+/* Commands about the game in progress that are not moves */
+static const char *game_commands[] = {
+		"flag", "draw", "abort", "adjourn", "resign", "takeback", "moretime", "pause", "unpause",
+		"accept", "decline", "withdraw", "rematch", NULL
+};
+
+/* <called with the queue lock held> */
+static void list_append(command_list *list, queued_command *command) {
+	if (list->tail) {
+		list->tail->next = command;
+	}
+	else {
+		list->head = command;
+	}
+	list->tail = command;
+}
+
+static queued_command *list_take(command_list *list) {
+	queued_command *command = list->head;
+	if (command) {
+		list->head = command->next;
+		if (!list->head) {
+			list->tail = NULL;
+		}
+	}
+	return command;
+}
+/* </called with the queue lock held> */
+
+static bool is_file(char c) {
+	return c >= 'a' && c <= 'h';
+}
+
+static bool is_rank(char c) {
+	return c >= '1' && c <= '8';
+}
+
+/* Coordinate (e2e4, e7e8=q) or SAN (Nxf3, exd5, e8=Q+, O-O) of length len */
+static bool looks_like_move(const char *word, size_t len) {
+	if ((len == 3 && !strncasecmp(word, "O-O", 3)) || (len == 5 && !strncasecmp(word, "O-O-O", 5))) {
+		return true;
+	}
+
+	size_t i = 0;
+	// coordinates
+	if (len >= 4 && is_file(word[0]) && is_rank(word[1]) && is_file(word[2]) && is_rank(word[3])) {
+		i = 4;
+	}
+	// SAN, the destination square is the last square before any promotion
+	else {
+		if (i < len && strchr("KQRBN", word[i])) {
+			i++;
+		}
+		size_t square = len;
+		for (size_t k = i; k + 1 < len; k++) {
+			if (is_file(word[k]) && is_rank(word[k + 1])) {
+				square = k;
+			}
+		}
+		if (square == len) {
+			return false;
+		}
+		for (; i < square; i++) {
+			if (!is_file(word[i]) && !is_rank(word[i]) && word[i] != 'x') {
+				return false;
+			}
+		}
+		i = square + 2;
+	}
+
+	if (i < len && word[i] == '=') {
+		i++;
+	}
+	if (i < len && strchr("QRBNqrbn", word[i])) {
+		i++;
+	}
+	if (i < len && (word[i] == '+' || word[i] == '#')) {
+		i++;
+	}
+	return i == len;
+}
+
+/* Moves are single words: "e2e4" is a move, "tell 1 e2e4" isn't */
+ics_priority ics_command_priority(const char *command) {
+	while (*command == ' ' || *command == '\t') {
+		command++;
+	}
+	size_t len = strcspn(command, " \t\r\n");
+	const char *rest = command + len;
+	while (*rest && isspace(*rest)) {
+		rest++;
+	}
+
+	if (len > 0 && !*rest && looks_like_move(command, len)) {
+		return ICS_PRIORITY_MOVE;
+	}
+	for (int i = 0; game_commands[i]; i++) {
+		if (strlen(game_commands[i]) == len && !strncmp(command, game_commands[i], len)) {
+			return ICS_PRIORITY_GAME;
+		}
+	}
+	return ICS_PRIORITY_BULK;
+}
+
+/* The write end never blocks: a full pipe already means the reader has
+ * something to wake up for */
+bool ics_queue_init(void) {
+	if (wake_pipe[0] >= 0) {
+		return true;
+	}
+	if (pipe(wake_pipe)) {
+		perror("Pipe creation failed");
+		return false;
+	}
+	fcntl(wake_pipe[0], F_SETFL, fcntl(wake_pipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl(wake_pipe[1], F_SETFL, fcntl(wake_pipe[1], F_GETFL) | O_NONBLOCK);
+	return true;
+}
+
+/* Becomes readable whenever commands are queued, the reader drains it before
+ * popping them */
+int ics_queue_wake_fd(void) {
+	return wake_pipe[0];
+}
+
+/* Takes a copy of command, which may hold several lines */
+void ics_queue_push(const char *command, ics_priority priority) {
+	queued_command *queued = malloc(sizeof(queued_command));
+	if (!queued) {
+		perror(NULL);
+		return;
+	}
+	queued->text = strdup(command);
+	queued->queued_at = time_now_us();
+	queued->next = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	list_append(&queues[priority], queued);
+	pthread_mutex_unlock(&queue_lock);
+
+	if (wake_pipe[1] >= 0 && write(wake_pipe[1], "", 1) < 0) {
+		// EAGAIN: the pipe is full of wake ups already
+	}
+}
+
+/* Returns the oldest command of the most urgent non empty priority, to be
+ * freed by the caller, or NULL when everything has been sent */
+char *ics_queue_pop(ics_priority *priority, int64_t *queued_at) {
+	char drain[64];
+	while (wake_pipe[0] >= 0 && read(wake_pipe[0], drain, sizeof(drain)) > 0);
+
+	char *text = NULL;
+	pthread_mutex_lock(&queue_lock);
+	for (int p = 0; p < ICS_PRIORITY_COUNT; p++) {
+		queued_command *command = list_take(&queues[p]);
+		if (command) {
+			text = command->text;
+			*priority = (ics_priority) p;
+			*queued_at = command->queued_at;
+			free(command);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return text;
+}
+
+/* Records how long a command waited, from ics_queue_push() till its last
+ * byte was handed to the socket */
+void ics_queue_sent(ics_priority priority, int64_t queued_at) {
+	int64_t waited = time_now_us() - queued_at;
+
+	pthread_mutex_lock(&queue_lock);
+	latency_stats *s = &stats[priority];
+	s->sent++;
+	s->total_us += waited;
+	if (waited > s->max_us) {
+		s->max_us = waited;
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	if (waited > SLOW_COMMAND_US) {
+		debug("ICS %s command waited %.1fms in the queue\n", priority_names[priority], waited / 1000.0);
+	}
+}
+
+/* Drops whatever was not sent, e.g. when the connection closes */
+void ics_queue_clear(void) {
+	pthread_mutex_lock(&queue_lock);
+	for (int p = 0; p < ICS_PRIORITY_COUNT; p++) {
+		queued_command *command;
+		while ((command = list_take(&queues[p]))) {
+			free(command->text);
+			free(command);
+		}
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void ics_queue_print_stats(FILE *out) {
+	pthread_mutex_lock(&queue_lock);
+	for (int p = 0; p < ICS_PRIORITY_COUNT; p++) {
+		latency_stats *s = &stats[p];
+		fprintf(out, "ICS %s queue: %ld sent, mean latency %.2fms, max %.2fms\n", priority_names[p], s->sent,
+		        s->sent ? s->total_us / 1000.0 / s->sent : 0.0, s->max_us / 1000.0);
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
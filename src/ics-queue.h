@@ -0,0 +1,27 @@
+#ifndef CAIRO_BOARD_ICS_QUEUE_H
+#define CAIRO_BOARD_ICS_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Outgoing ICS commands are written by the ICS reader thread, most urgent
+ * first. Within a priority they keep the order they were queued in */
+typedef enum {
+	ICS_PRIORITY_MOVE = 0, // moves and premoves
+	ICS_PRIORITY_GAME,     // clock and offers: flag, draw, abort, accept...
+	ICS_PRIORITY_BULK,     // chat, channels, settings and everything else
+	ICS_PRIORITY_COUNT
+} ics_priority;
+
+ics_priority ics_command_priority(const char *command);
+
+void ics_queue_push(const char *command, ics_priority priority);
+char *ics_queue_pop(ics_priority *priority, int64_t *queued_at);
+void ics_queue_sent(ics_priority priority, int64_t queued_at);
+bool ics_queue_init(void);
+int ics_queue_wake_fd(void);
+void ics_queue_clear(void);
+void ics_queue_print_stats(FILE *out);
+
+#endif //CAIRO_BOARD_ICS_QUEUE_H
@@ -8,7 +8,8 @@ int ics_scanner_lex(void);
 void ics_scanner_restart (FILE *input_file);
 
 extern int ics_scanner_leng;
-YY_BUFFER_STATE ics_scanner__scan_bytes(const char *bytes, int len);
+void ics_scanner_feed(const char *bytes, int len);
+void ics_scanner_print_stats(void);
 
 enum _ics_match_type {
 	EOF_TYPE = -1,
@@ -0,0 +1,731 @@
+#include <gtk/gtk.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ipc-server.h"
+#include "chess-backend.h"
+#include "clocks.h"
+#include "analysis_panel.h"
+#include "memory-budget.h"
+#include "drawing-backend.h"
+#include "position-snapshot.h"
+#include "pgn-loader.h"
+#include "game-browser.h"
+
+#define IPC_MAX_CLIENTS 16
+#define IPC_LINE_SIZE 512
+// what a subscriber that stopped reading may cost us before lines get dropped
+#define IPC_CLIENT_QUEUE_MAX (64 * 1024)
+#define IPC_PENDING_MAX (64 * 1024)
+
+/* A connected subscriber. Everything here is only touched by the server thread */
+typedef struct {
+	int fd;
+	unsigned long id;
+	char in[IPC_LINE_SIZE];
+	size_t in_len;
+	char *out;
+	size_t out_len;
+	size_t out_sent;
+} ipc_client;
+
+/* A command that has to run in the main loop, the reply is routed back
+ * to the client through pending_replies */
+typedef struct {
+	unsigned long client_id;
+	char file_path[PATH_MAX];
+	int game_num;
+	int move[4];
+	char promotion; // 'Q', 'R', 'B' or 'N'
+	bool on;
+} ipc_command;
+
+typedef struct {
+	unsigned long client_id;
+	char line[IPC_LINE_SIZE];
+} ipc_reply;
+
+extern GtkWidget *board;
+extern chess_game *main_game;
+extern chess_clock *main_clock;
+
+static char socket_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static int listen_fd = -1;
+static int wake_pipe[2] = {-1, -1};
+static pthread_t ipc_thread;
+static bool ipc_running = false;
+
+static ipc_client clients[IPC_MAX_CLIENTS];
+static int n_clients = 0;
+static unsigned long next_client_id = 1;
+
+/* Filled by the UI thread, drained by the server thread */
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static char pending[IPC_PENDING_MAX];
+static size_t pending_len = 0;
+static unsigned long pending_dropped = 0;
+static char last_line[IPC_LINE_SIZE];
+static GSList *pending_replies = NULL;
+// per thread: plys appended by other threads meanwhile, e.g. from ICS, still go out
+static __thread bool replaying = false;
+
+static void client_queue(ipc_client *client, const char *data, size_t len);
+
+static void wake_server(void) {
+	char c = 0;
+	// non blocking: if the pipe is full the server is already going to wake up
+	if (write(wake_pipe[1], &c, 1) < 0 && errno != EAGAIN) {
+		perror("IPC wake");
+	}
+}
+
+static size_t count_lines(const char *buf, size_t len) {
+	size_t n = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (buf[i] == '\n') {
+			n++;
+		}
+	}
+	return n;
+}
+
+static void json_escape(const char *in, char *out, size_t size) {
+	size_t j = 0;
+	for (size_t i = 0; in[i] != '\0' && j + 2 < size; i++) {
+		if (in[i] == '"' || in[i] == '\\') {
+			out[j++] = '\\';
+		}
+		if ((unsigned char) in[i] >= 0x20) {
+			out[j++] = in[i];
+		}
+	}
+	out[j] = '\0';
+}
+
+/* Never blocks on subscribers: the line is left for the server thread */
+static void publish_line(const char *line, int len) {
+	pthread_mutex_lock(&pending_lock);
+	if (pending_len + len > IPC_PENDING_MAX) {
+		// server thread starved: every line carries the full FEN so older ones can go
+		pending_dropped += count_lines(pending, pending_len);
+		pending_len = 0;
+	}
+	memcpy(pending + pending_len, line, (size_t) len);
+	pending_len += len;
+	memcpy(last_line, line, (size_t) len + 1);
+	pthread_mutex_unlock(&pending_lock);
+
+	wake_server();
+}
+
+/* Called from plys_list_append_ply, i.e. with the position already updated */
+void ipc_publish_ply(ply *new_ply) {
+	if (!ipc_running || replaying) {
+		return;
+	}
+
+	position_snapshot snapshot;
+	position_snapshot_read(&snapshot);
+	const char *fen = snapshot.fen;
+
+	char uci[8];
+	sprintf(uci, "%c%c%c%c", 'a' + new_ply->old_col, '1' + new_ply->old_row, 'a' + new_ply->new_col, '1' + new_ply->new_row);
+	int moved = snapshot.squares[new_ply->new_col][new_ply->new_row];
+	if (strchr(new_ply->san_string, '=') != NULL && moved != SNAPSHOT_EMPTY_SQUARE) {
+		uci[4] = (char) (type_to_char(moved) + 32);
+		uci[5] = '\0';
+	}
+
+	char san[64];
+	json_escape(new_ply->san_string, san, sizeof(san));
+
+	char score[32], eval[64];
+	get_analysis_score(0, score, sizeof(score));
+	json_escape(score, eval, sizeof(eval));
+
+	long wtime = 0, btime = 0;
+	if (main_clock != NULL) {
+		wtime = get_remaining_time(main_clock, 0);
+		btime = get_remaining_time(main_clock, 1);
+	}
+
+	char line[IPC_LINE_SIZE];
+	int len = snprintf(line, sizeof(line),
+	                   "{\"type\":\"move\",\"ply\":%d,\"san\":\"%s\",\"uci\":\"%s\",\"fen\":\"%s\",\"wtime\":%ld,\"btime\":%ld,\"eval\":\"%s\"}\n",
+	                   new_ply->ply_number, san, uci, fen, wtime, btime, eval);
+	if (len < 0 || len >= (int) sizeof(line)) {
+		fprintf(stderr, "IPC: move line too long, not published\n");
+		return;
+	}
+	publish_line(line, len);
+}
+
+/* Around moves played in bulk such as a loaded game: subscribers get one
+ * position line at the end instead of a line per ply. Only the plys
+ * appended by the calling thread are held back */
+void ipc_begin_replay(void) {
+	replaying = true;
+}
+
+void ipc_end_replay(int n_plys) {
+	replaying = false;
+	if (!ipc_running) {
+		return;
+	}
+
+	position_snapshot snapshot;
+	position_snapshot_read(&snapshot);
+
+	long wtime = 0, btime = 0;
+	if (main_clock != NULL) {
+		wtime = get_remaining_time(main_clock, 0);
+		btime = get_remaining_time(main_clock, 1);
+	}
+
+	char line[IPC_LINE_SIZE];
+	int len = snprintf(line, sizeof(line), "{\"type\":\"position\",\"ply\":%d,\"fen\":\"%s\",\"wtime\":%ld,\"btime\":%ld}\n",
+	                   n_plys, snapshot.fen, wtime, btime);
+	if (len < 0 || len >= (int) sizeof(line)) {
+		fprintf(stderr, "IPC: position line too long, not published\n");
+		return;
+	}
+	publish_line(line, len);
+}
+
+static void post_reply(unsigned long client_id, const char *cmd, const char *error) {
+	ipc_reply *reply = malloc(sizeof(ipc_reply));
+	reply->client_id = client_id;
+	if (error == NULL) {
+		snprintf(reply->line, sizeof(reply->line), "{\"type\":\"ok\",\"cmd\":\"%s\"}\n", cmd);
+	}
+	else {
+		snprintf(reply->line, sizeof(reply->line), "{\"type\":\"error\",\"cmd\":\"%s\",\"message\":\"%s\"}\n", cmd, error);
+	}
+
+	pthread_mutex_lock(&pending_lock);
+	pending_replies = g_slist_append(pending_replies, reply);
+	pthread_mutex_unlock(&pending_lock);
+
+	wake_server();
+}
+
+/* <main loop side of the commands> */
+static void ipc_game_loaded(const char *error, void *data) {
+	ipc_command *command = (ipc_command *) data;
+	post_reply(command->client_id, "load", error);
+	free(command);
+}
+
+static gboolean ipc_load_idle(gpointer data) {
+	ipc_command *command = (ipc_command *) data;
+	// load_game takes the GDK lock itself, the reply goes once the game is on the board
+	load_game(command->file_path, command->game_num, ipc_game_loaded, command);
+	return FALSE;
+}
+
+static gboolean ipc_cancel_idle(gpointer data) {
+	ipc_command *command = (ipc_command *) data;
+	post_reply(command->client_id, "cancel", pgn_load_cancel() ? NULL : "no game being loaded");
+	free(command);
+	return FALSE;
+}
+
+/* Runs with the GDK lock held */
+static gboolean ipc_browse_idle(gpointer data) {
+	ipc_command *command = (ipc_command *) data;
+	game_browser_open(command->file_path);
+	post_reply(command->client_id, "browse", NULL);
+	free(command);
+	return FALSE;
+}
+
+/* Runs with the GDK lock held */
+static gboolean ipc_flip_idle(gpointer data) {
+	ipc_command *command = (ipc_command *) data;
+	g_signal_emit_by_name(board, "flip-board");
+	post_reply(command->client_id, "flip", NULL);
+	free(command);
+	return FALSE;
+}
+
+/* Runs with the GDK lock held, like a click on the board */
+static gboolean ipc_move_idle(gpointer data) {
+	ipc_command *command = (ipc_command *) data;
+	chess_piece *piece = main_game->squares[command->move[0]][command->move[1]].piece;
+
+	if (piece == NULL || piece->colour != main_game->whose_turn || !can_i_move_piece(piece)) {
+		post_reply(command->client_id, "move", "no piece to move on that square");
+	}
+	else if (!is_move_legal(main_game, piece, command->move[2], command->move[3])) {
+		post_reply(command->client_id, "move", "illegal move");
+	}
+	else {
+		// never the promotion popup, a script can't answer it
+		preset_promotion_type = char_to_type(main_game->whose_turn, command->promotion);
+		auto_move(piece, command->move[2], command->move[3], 1, MANUAL_SOURCE, false);
+		preset_promotion_type = -1;
+		post_reply(command->client_id, "move", NULL);
+	}
+	free(command);
+	return FALSE;
+}
+/* Runs with the GDK lock held */
+static gboolean ipc_attacks_idle(gpointer data) {
+	ipc_command *command = (ipc_command *) data;
+	set_attack_overlay(command->on);
+	post_reply(command->client_id, "attacks", NULL);
+	free(command);
+	return FALSE;
+}
+/* </main loop side of the commands> */
+
+static bool parse_square(const char *s, int *col, int *row) {
+	if (s[0] < 'a' || s[0] > 'h' || s[1] < '1' || s[1] > '8') {
+		return false;
+	}
+	*col = s[0] - 'a';
+	*row = s[1] - '1';
+	return true;
+}
+
+/* Server thread: validates what it can right away, anything touching the
+ * game is handed over to the main loop */
+static void handle_command(ipc_client *client, char *line) {
+	char *save;
+	char *cmd = strtok_r(line, " \t\r", &save);
+	if (cmd == NULL) {
+		return;
+	}
+	char *arg = strtok_r(NULL, " \t\r", &save);
+
+	if (!strcmp(cmd, "observe")) {
+		if (arg == NULL || atoi(arg) <= 0) {
+			post_reply(client->id, "observe", "usage: observe GAME_NUMBER");
+		}
+		else if (!ics_mode) {
+			post_reply(client->id, "observe", "not connected to an ICS");
+		}
+		else {
+			char ics_command[64];
+			snprintf(ics_command, sizeof(ics_command), "observe %d\n", atoi(arg));
+			send_to_ics(ics_command);
+			post_reply(client->id, "observe", NULL);
+		}
+	}
+	else if (!strcmp(cmd, "load")) {
+		if (arg == NULL) {
+			post_reply(client->id, "load", "usage: load PGN_FILE [GAME_NUMBER]");
+			return;
+		}
+		char *num = strtok_r(NULL, " \t\r", &save);
+		ipc_command *command = calloc(1, sizeof(ipc_command));
+		command->client_id = client->id;
+		snprintf(command->file_path, sizeof(command->file_path), "%s", arg);
+		command->game_num = num != NULL ? atoi(num) : 1;
+		g_idle_add(ipc_load_idle, command);
+	}
+	else if (!strcmp(cmd, "browse")) {
+		if (arg == NULL) {
+			post_reply(client->id, "browse", "usage: browse PGN_FILE");
+			return;
+		}
+		ipc_command *command = calloc(1, sizeof(ipc_command));
+		command->client_id = client->id;
+		snprintf(command->file_path, sizeof(command->file_path), "%s", arg);
+		gdk_threads_add_idle(ipc_browse_idle, command);
+	}
+	else if (!strcmp(cmd, "cancel")) {
+		ipc_command *command = calloc(1, sizeof(ipc_command));
+		command->client_id = client->id;
+		g_idle_add(ipc_cancel_idle, command);
+	}
+	else if (!strcmp(cmd, "flip")) {
+		ipc_command *command = calloc(1, sizeof(ipc_command));
+		command->client_id = client->id;
+		gdk_threads_add_idle(ipc_flip_idle, command);
+	}
+	else if (!strcmp(cmd, "move")) {
+		int move[4];
+		// the promotion suffix is optional, a queen by default
+		char promotion = arg != NULL && strlen(arg) == 5 ? (char) toupper((unsigned char) arg[4]) : 'Q';
+		if (arg == NULL || strlen(arg) < 4 || strlen(arg) > 5 || !strchr("QRBN", promotion)
+		    || !parse_square(arg, &move[0], &move[1]) || !parse_square(arg + 2, &move[2], &move[3])) {
+			post_reply(client->id, "move", "usage: move e2e4 or e7e8q");
+			return;
+		}
+		ipc_command *command = calloc(1, sizeof(ipc_command));
+		command->client_id = client->id;
+		memcpy(command->move, move, sizeof(move));
+		command->promotion = promotion;
+		gdk_threads_add_idle(ipc_move_idle, command);
+	}
+	else if (!strcmp(cmd, "attacks")) {
+		if (arg == NULL || (strcmp(arg, "on") && strcmp(arg, "off"))) {
+			post_reply(client->id, "attacks", "usage: attacks on|off");
+			return;
+		}
+		ipc_command *command = calloc(1, sizeof(ipc_command));
+		command->client_id = client->id;
+		command->on = !strcmp(arg, "on");
+		gdk_threads_add_idle(ipc_attacks_idle, command);
+	}
+	else if (!strcmp(cmd, "memory")) {
+		char report[1024];
+		int len = mem_budget_report_json(report, sizeof(report));
+		if (len > 0 && len < (int) sizeof(report)) {
+			client_queue(client, report, (size_t) len);
+		}
+	}
+	else {
+		post_reply(client->id, "unknown", "commands are: observe, load, cancel, browse, flip, move, attacks, memory");
+	}
+}
+
+/* <server thread> */
+static int set_non_blocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("IPC fcntl");
+		return -1;
+	}
+	return 0;
+}
+
+static void client_append(ipc_client *client, const char *data, size_t len) {
+	memcpy(client->out + client->out_len, data, len);
+	client->out_len += len;
+}
+
+/* Queues whole lines for the client. A client too slow to keep up loses
+ * the unsent backlog (the line being written excepted), gets told how many
+ * lines were dropped and resyncs from the FEN of the newest one */
+static void client_queue(ipc_client *client, const char *data, size_t len) {
+	// compact what's already been sent
+	bool mid_line = client->out_sent > 0 && client->out[client->out_sent - 1] != '\n';
+	if (client->out_sent > 0) {
+		memmove(client->out, client->out + client->out_sent, client->out_len - client->out_sent);
+		client->out_len -= client->out_sent;
+		client->out_sent = 0;
+	}
+
+	if (client->out_len + len <= IPC_CLIENT_QUEUE_MAX) {
+		client_append(client, data, len);
+		return;
+	}
+
+	size_t keep = 0;
+	if (mid_line) {
+		char *end = memchr(client->out, '\n', client->out_len);
+		keep = end != NULL ? (size_t) (end - client->out) + 1 : client->out_len;
+	}
+	size_t dropped = count_lines(client->out + keep, client->out_len - keep);
+	client->out_len = keep;
+
+	// newest line only
+	const char *newest = data;
+	size_t newest_len = len;
+	if (len > 1) {
+		const char *prev_end = NULL;
+		for (const char *p = data + len - 2; p >= data; p--) {
+			if (*p == '\n') {
+				prev_end = p;
+				break;
+			}
+		}
+		if (prev_end != NULL) {
+			dropped += count_lines(data, (size_t) (prev_end - data) + 1);
+			newest = prev_end + 1;
+			newest_len = len - (size_t) (newest - data);
+		}
+	}
+
+	char notice[64];
+	int notice_len = snprintf(notice, sizeof(notice), "{\"type\":\"dropped\",\"count\":%zu}\n", dropped);
+	client_append(client, notice, (size_t) notice_len);
+	client_append(client, newest, newest_len);
+}
+
+static void close_client(int index) {
+	debug("IPC client %lu disconnected\n", clients[index].id);
+	close(clients[index].fd);
+	free(clients[index].out);
+	clients[index] = clients[--n_clients];
+}
+
+static void accept_client(void) {
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			perror("IPC accept");
+		}
+		return;
+	}
+	if (n_clients == IPC_MAX_CLIENTS) {
+		static const char full[] = "{\"type\":\"error\",\"message\":\"too many clients\"}\n";
+		send(fd, full, sizeof(full) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(fd);
+		return;
+	}
+	if (set_non_blocking(fd)) {
+		close(fd);
+		return;
+	}
+
+	ipc_client *client = &clients[n_clients++];
+	memset(client, 0, sizeof(ipc_client));
+	client->fd = fd;
+	client->id = next_client_id++;
+	// one spare line for the dropped notice
+	client->out = malloc(IPC_CLIENT_QUEUE_MAX + IPC_LINE_SIZE + 64);
+	debug("IPC client %lu connected\n", client->id);
+
+	// bring the newcomer up to date with the current position
+	char line[IPC_LINE_SIZE];
+	pthread_mutex_lock(&pending_lock);
+	memcpy(line, last_line, sizeof(line));
+	pthread_mutex_unlock(&pending_lock);
+	if (line[0] != '\0') {
+		client_queue(client, line, strlen(line));
+	}
+}
+
+/* Returns false when the client went away */
+static bool read_client(ipc_client *client) {
+	ssize_t n = recv(client->fd, client->in + client->in_len, sizeof(client->in) - client->in_len - 1, 0);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		return false;
+	}
+	if (n < 0) {
+		return true;
+	}
+	client->in_len += n;
+	client->in[client->in_len] = '\0';
+
+	char *start = client->in;
+	char *end;
+	while ((end = strchr(start, '\n')) != NULL) {
+		*end = '\0';
+		handle_command(client, start);
+		start = end + 1;
+	}
+	client->in_len -= start - client->in;
+	memmove(client->in, start, client->in_len);
+
+	if (client->in_len == sizeof(client->in) - 1) {
+		// no sane command is this long
+		client->in_len = 0;
+		post_reply(client->id, "unknown", "line too long");
+	}
+	return true;
+}
+
+static bool write_client(ipc_client *client) {
+	while (client->out_sent < client->out_len) {
+		ssize_t n = send(client->fd, client->out + client->out_sent, client->out_len - client->out_sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				return true;
+			}
+			return false;
+		}
+		client->out_sent += n;
+	}
+	client->out_len = client->out_sent = 0;
+	return true;
+}
+
+static void dispatch_pending(void) {
+	char lines[IPC_PENDING_MAX];
+	size_t len;
+	unsigned long dropped;
+	GSList *replies;
+
+	pthread_mutex_lock(&pending_lock);
+	len = pending_len;
+	memcpy(lines, pending, len);
+	pending_len = 0;
+	dropped = pending_dropped;
+	pending_dropped = 0;
+	replies = pending_replies;
+	pending_replies = NULL;
+	pthread_mutex_unlock(&pending_lock);
+
+	for (int i = 0; i < n_clients; i++) {
+		if (dropped) {
+			char notice[64];
+			int notice_len = snprintf(notice, sizeof(notice), "{\"type\":\"dropped\",\"count\":%lu}\n", dropped);
+			client_queue(&clients[i], notice, (size_t) notice_len);
+		}
+		if (len > 0) {
+			client_queue(&clients[i], lines, len);
+		}
+	}
+
+	for (GSList *r = replies; r != NULL; r = r->next) {
+		ipc_reply *reply = (ipc_reply *) r->data;
+		for (int i = 0; i < n_clients; i++) {
+			if (clients[i].id == reply->client_id) {
+				client_queue(&clients[i], reply->line, strlen(reply->line));
+				break;
+			}
+		}
+	}
+	g_slist_free_full(replies, free);
+}
+
+static void *ipc_server_function(void *arg) {
+	struct pollfd fds[IPC_MAX_CLIENTS + 2];
+
+	for (;;) {
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = wake_pipe[0];
+		fds[1].events = POLLIN;
+		for (int i = 0; i < n_clients; i++) {
+			fds[i + 2].fd = clients[i].fd;
+			fds[i + 2].events = POLLIN | (clients[i].out_len > clients[i].out_sent ? POLLOUT : 0);
+			fds[i + 2].revents = 0;
+		}
+		int polled = n_clients;
+
+		if (poll(fds, (nfds_t) polled + 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("IPC poll");
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			char drain[64];
+			while (read(wake_pipe[0], drain, sizeof(drain)) > 0);
+			if (!ipc_running) {
+				break;
+			}
+		}
+
+		// iterate backwards as close_client moves the last client in the freed slot
+		for (int i = polled - 1; i >= 0; i--) {
+			short revents = fds[i + 2].revents;
+			bool alive = true;
+			if (revents & (POLLERR | POLLNVAL)) {
+				alive = false;
+			}
+			if (alive && (revents & (POLLIN | POLLHUP))) {
+				alive = read_client(&clients[i]);
+			}
+			if (alive && (revents & POLLOUT)) {
+				alive = write_client(&clients[i]);
+			}
+			if (!alive) {
+				close_client(i);
+			}
+		}
+
+		dispatch_pending();
+
+		if (fds[0].revents & POLLIN) {
+			accept_client();
+		}
+
+		// try to send right away, poll() catches up with the rest
+		for (int i = n_clients - 1; i >= 0; i--) {
+			if (clients[i].out_len > clients[i].out_sent && !write_client(&clients[i])) {
+				close_client(i);
+			}
+		}
+	}
+
+	while (n_clients > 0) {
+		close_client(n_clients - 1);
+	}
+	return NULL;
+}
+/* </server thread> */
+
+/* Listens on a unix socket for overlays and scripts: every ply of the main
+ * game is streamed as one JSON line (a loaded game as one position line),
+ * and observe/load/cancel/browse/flip/move commands are accepted one per line */
+int init_ipc_server(const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "IPC socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	strcpy(socket_path, path);
+
+	if (pipe(wake_pipe)) {
+		perror("IPC pipe");
+		return -1;
+	}
+	set_non_blocking(wake_pipe[0]);
+	set_non_blocking(wake_pipe[1]);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("IPC socket");
+		goto fail_pipe;
+	}
+	// left over by a previous run that didn't exit cleanly
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		perror("IPC bind");
+		goto fail_socket;
+	}
+	if (listen(listen_fd, 4) || set_non_blocking(listen_fd)) {
+		perror("IPC listen");
+		goto fail_bound;
+	}
+
+	ipc_running = true;
+	if (pthread_create(&ipc_thread, NULL, ipc_server_function, NULL)) {
+		perror("IPC thread");
+		ipc_running = false;
+		goto fail_bound;
+	}
+	debug("IPC server listening on %s\n", path);
+	return 0;
+
+fail_bound:
+	unlink(path);
+fail_socket:
+	close(listen_fd);
+	listen_fd = -1;
+fail_pipe:
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+	return -1;
+}
+
+void cleanup_ipc_server(void) {
+	if (!ipc_running) {
+		return;
+	}
+	ipc_running = false;
+	wake_server();
+	pthread_join(ipc_thread, NULL);
+
+	close(listen_fd);
+	unlink(socket_path);
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+
+	pthread_mutex_lock(&pending_lock);
+	g_slist_free_full(pending_replies, free);
+	pending_replies = NULL;
+	pthread_mutex_unlock(&pending_lock);
+}
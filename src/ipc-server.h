@@ -0,0 +1,12 @@
+#ifndef CAIRO_BOARD_IPC_SERVER_H
+#define CAIRO_BOARD_IPC_SERVER_H
+
+#include "cairo-board.h"
+
+int init_ipc_server(const char *socket_path);
+void ipc_publish_ply(ply *new_ply);
+void ipc_begin_replay(void);
+void ipc_end_replay(int n_plys);
+void cleanup_ipc_server(void);
+
+#endif //CAIRO_BOARD_IPC_SERVER_H
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 #include <librsvg/rsvg.h>
 #include <sys/time.h>
 #include <execinfo.h>
@@ -28,6 +29,23 @@
 #include "analysis_panel.h"
 #include "test.h"
 #include "ics-adapter.h"
+#include "ics-console.h"
+#include "export.h"
+#include "ipc-server.h"
+#include "memory-budget.h"
+#include "task-pool.h"
+#include "material-index.h"
+#include "pattern-search.h"
+#include "eco-search.h"
+#include "pgn-tokenizer.h"
+#include "time-source.h"
+#include "move-entry.h"
+#include "ics-queue.h"
+#include "attack-map.h"
+#include "position-snapshot.h"
+#include "pgn-loader.h"
+#include "game-index.h"
+#include "game-browser.h"
 
 /* check that C's multibyte output is supported for use with figurine characters */
 #ifndef __STDC_ISO_10646__
@@ -66,6 +84,14 @@ void sig_handler(int sig) {
 	}
 }
 
+static gboolean on_memory_report_signal(gpointer data) {
+	mem_budget_report(stdout);
+	if (alloc_stats_enabled()) {
+		alloc_stats_report(stdout);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
 /* <Options variables> */
 gboolean debug_flag = FALSE;
 gboolean ics_mode = FALSE;
@@ -74,8 +100,11 @@ bool guest_mode = false;
 gboolean use_fig = FALSE;
 gboolean show_last_move = FALSE;
 gboolean always_promote_to_queen = FALSE;
+int preset_promotion_type = -1; // promotion already chosen for the next manual move, e.g. typed in
 gboolean highlight_moves = FALSE;
 bool highlight_last_move = true;
+gboolean show_attacks = FALSE; // attack map overlay
+gboolean browse_games = FALSE; // list the games of the -load file instead of playing them
 
 gboolean test_first_player = FALSE;
 
@@ -105,6 +134,22 @@ bool ics_port_specified = false;
 bool load_file_specified = false;
 bool ics_handle1_specified = false;
 bool ics_handle2_specified = false;
+bool latency_bench_specified = false;
+bool latency_bench_click = false;
+static char *engine_paths[MAX_UCI_ENGINES];
+static int engine_path_count = 0;
+static char *export_path = NULL;
+static char *ipc_path = NULL;
+static size_t memory_budget_kb = 16 * 1024;
+static char *pgn_check_dir = NULL;
+static char *material_query_spec = NULL;
+static char *pattern_search_spec = NULL;
+static char *list_games_spec = NULL;
+static int clock_check_games = 0;
+static char *render_check_dir = NULL;
+static gboolean render_record = FALSE;
+static char *round_trip_dir = NULL;
+static int export_size = 480;
 /* </Options variables> */
 
 bool delay_from_promotion = false;
@@ -704,6 +749,21 @@ bool can_i_move_piece(chess_piece *piece) {
 	}
 }
 
+/* To be called by the thread changing main_game once the position is
+ * complete: other threads read it from the snapshot, never from main_game */
+void main_game_changed(void) {
+	position_snapshot_publish(main_game);
+	attack_map_update();
+}
+
+/* Promotion of a pawn of a game other than main_game, as logical_promote()
+ * does for main_game but without its shared state */
+static void promote_in_game(chess_game *game, chess_piece *pawn, int promo_type) {
+	toggle_piece(game, pawn);
+	pawn->type = colorise_type(promo_type, pawn->colour);
+	toggle_piece(game, pawn);
+}
+
 int move_piece(chess_piece *piece, int col, int row, int check_legality, int move_source, char san_move[SAN_MOVE_SIZE], chess_game *game, bool only_logical) {
 
 	// Determine whether proposed move is legal
@@ -848,18 +908,24 @@ int move_piece(chess_piece *piece, int col, int row, int check_legality, int mov
 		// handle special promotion move
 		// NOTE: no need to reset 50 counter as done already
 		if (was_promotion) {
-			to_promote = piece;
+			if (game == main_game) {
+				to_promote = piece;
+			}
 			if (move_source == MANUAL_SOURCE || move_source == PRE_MOVE) {
-				if (!always_promote_to_queen) {
+				if (!always_promote_to_queen && preset_promotion_type < 0) {
 					get_int_from_popup();
 					delay_from_promotion = true;
 				} else {
+					int promo_type = preset_promotion_type < 0 ? W_QUEEN : preset_promotion_type;
+					char promo_string[3] = {'=', type_to_char(promo_type), '\0'};
 					delay_from_promotion = false;
-					strcat(move_in_san, "=Q");
-					choose_promote(1, false, only_logical, ocol, orow, col, row);
+					strcat(move_in_san, promo_string);
+					choose_promote(promo_type, false, only_logical, ocol, orow, col, row);
 				}
 			} else {
-				delay_from_promotion = false; // this means we can print the move when we return from this
+				if (game == main_game) {
+					delay_from_promotion = false; // this means we can print the move when we return from this
+				}
 				char promo_string[8];
 				memset(promo_string, 0, 8);
 				if (use_fig) {
@@ -870,12 +936,16 @@ int move_piece(chess_piece *piece, int col, int row, int check_legality, int mov
 				}
 				strcat(move_in_san, promo_string);
 
-				if (move_source == AUTO_SOURCE_NO_ANIM) {
+				if (game != main_game) {
+					// games nobody sees are promoted in place, leaving the promotion state alone
+					promote_in_game(game, piece, game->promo_type);
+				}
+				else if (move_source == AUTO_SOURCE_NO_ANIM) {
 					choose_promote(game->promo_type, false, only_logical, ocol, orow, col, row);
 					// If animating, handle promotion at end of the animation (because it's prettier!)
 				}
 			}
-		} else {
+		} else if (game == main_game) {
 			delay_from_promotion = false;
 		}
 
@@ -994,11 +1064,6 @@ int move_piece(chess_piece *piece, int col, int row, int check_legality, int mov
 			game->current_hash ^= zobrist_keys_en_passant[col];
 		}
 
-		// Reset fifty move counter
-		if (reset_fifty_counter) {
-			game->fifty_move_counter = 100;
-		}
-
 		// Increase full move number
 		if (game->whose_turn) {
 			game->current_move_number++;
@@ -1007,13 +1072,22 @@ int move_piece(chess_piece *piece, int col, int row, int check_legality, int mov
 		// Swap turns
 		game->whose_turn = !game->whose_turn;
 
-		// Decrement fifty move counter
+		// Decrement fifty move counter, the plys left before a draw can be claimed
 		game->fifty_move_counter--;
 
+		// Reset fifty move counter, after the decrement so that 100 more plys are needed
+		if (reset_fifty_counter) {
+			game->fifty_move_counter = 100;
+		}
+
 		game->current_hash ^= zobrist_keys_blacks_turn;
 
 		persist_hash(game);
 
+		if (game == main_game) {
+			main_game_changed();
+		}
+
 		return was_castle | piece_taken | was_en_passant | was_promotion;
 	}
 	else {
@@ -1195,21 +1269,14 @@ char theme_dir[] = "themes/commons/";
 //char theme_dir[] = "themes/eyes/";
 //char theme_dir[] = "themes/fantasy/";
 
-static int load_piecesSvg() {
+/* Loads the 12 piece SVGs from dir, e.g. "themes/eyes/", in place of the
+ * current ones */
+int load_pieces_theme(const char *dir) {
 	int i;
 
 	// relative or absolute
 	char file_path[256];
 
-	// get length of prefix
-	int prefix_len = strlen(theme_dir);
-
-	// prepare for strcat
-	memset(file_path, 0 , sizeof(file_path));
-
-	// append prefix
-	strcat(file_path, theme_dir);
-
 	// these must follow the order defined in the header
 	char *suffixes[12] = {
 		"wk.svg", 
@@ -1227,14 +1294,45 @@ static int load_piecesSvg() {
 	};
 
 	for (i=0; i<12; i++) {
-		strcat(file_path, suffixes[i]);
-		piecesSvg[i] = rsvg_handle_new_from_file (file_path, NULL);
-		memset(file_path+prefix_len, 0, sizeof(file_path)-prefix_len);
+		snprintf(file_path, sizeof(file_path), "%s%s", dir, suffixes[i]);
+		RsvgHandle *handle = rsvg_handle_new_from_file(file_path, NULL);
+		if (handle == NULL) {
+			fprintf(stderr, "Failed to load piece '%s'\n", file_path);
+			return 1;
+		}
+		if (piecesSvg[i] != NULL) {
+			g_object_unref(piecesSvg[i]);
+		}
+		piecesSvg[i] = handle;
 	}
 
+	/* Get the pieces SVG dimensions for rendering */
+	RsvgDimensionData g_DimensionData;
+	rsvg_handle_get_dimensions (piecesSvg[B_QUEEN], &g_DimensionData);
+	svg_w = 1.0f / (8.0f * (double) g_DimensionData.width);
+	svg_h = 1.0f / (8.0f * (double) g_DimensionData.height);
+
 	return 0;
 }
 
+/* Highlights are tints of the board colours */
+void compute_highlight_colours(void) {
+	highlight_selected_r = 1;
+	highlight_selected_g = (dg + lg) / 3.0;
+	highlight_selected_b = (db + lb) / 3.0;
+	highlight_selected_a = 0.3;
+
+	highlight_move_r = (dr + lr) / 3.0;
+	highlight_move_g = 1;
+	highlight_move_b = (db + lb) / 3.0;
+	highlight_move_a = 0.3;
+
+	highlight_pre_move_r = 1;
+	highlight_pre_move_g = (dg + lg) / 3.0;
+	highlight_pre_move_b = (db + lb) / 3.0;
+	highlight_pre_move_a = 0.6;
+}
+
 static int init_pieces(chess_game *game) {
 	unsigned int i, j;
 
@@ -1300,13 +1398,19 @@ static int init_pieces(chess_game *game) {
 	return 0;
 }
 
+/* Logical reset only, also used when there is no window */
+void init_game_position(chess_game *game) {
+	game->current_move_number = 1;
+	memset(game->moves_list, 0, strlen(game->moves_list));
+	game->moves_list[0] = '\0';
+	game->ply_num = 1;
+	init_zobrist_hash_history(game);
+	init_pieces(game);
+}
+
 static void reset_game(bool lock_threads) {
-	main_game->current_move_number = 1;
-	memset(main_game->moves_list, 0, strlen(main_game->moves_list));
-	main_game->moves_list[0] = '\0';
-	main_game->ply_num = 1;
-	init_zobrist_hash_history(main_game);
-	init_pieces(main_game);
+	init_game_position(main_game);
+	main_game_changed();
 	if (main_list != NULL) {
 		plys_list_free(main_list);
 	}
@@ -1328,10 +1432,11 @@ static void spawn_mover(void) {
 	pthread_create(&move_event_processor_thread, NULL, process_moves, NULL);
 }
 
+/* Queues s for the ICS reader thread to write, moves ahead of offers and
+ * offers ahead of chat and everything else */
 void send_to_ics(char *s) {
 	if (ics_mode) {
-		size_t len = strlen(s);
-		send_to_fics(s, &len);
+		ics_queue_push(s, ics_command_priority(s));
 	}
 	else {
 		debug("Would send to ICS %s", s);
@@ -1429,87 +1534,174 @@ int open_file(const char *name) {
 		fprintf(stderr, "Error opening file '%s': %s\n", name, strerror(errno));
 		return 1;
 	}
-	san_scanner_in = f;
-	san_scanner_restart(san_scanner_in);
+	san_scanner_feed_file(f);
 
 	return 0;
 }
 
-void load_game(const char* file_path, int game_num) {
+/* What load_game() was asked for, until the loader is done with it */
+typedef struct {
+	void (*loaded)(const char *error, void *data);
+	void *data;
+} load_request;
 
-	if (open_file(file_path)) {
-		return;
-	}
+// title shown before the first load in progress, put back if it fails
+static char title_before_load[512];
 
-	int i = 0;
-	int games_counter = 0;
+static void on_load_progress(const char *file_path, size_t bytes_done, size_t bytes_total, unsigned int n_games, void *data) {
+	char text[512];
+	char *name = g_path_get_basename(file_path);
+	snprintf(text, sizeof(text), "Loading %s\n%.1f of %.1f MB, %u games\n(click to cancel)",
+	         name, bytes_done / 1048576.0, bytes_total / 1048576.0, n_games);
+	g_free(name);
 
-	gboolean inside_tags = FALSE;
-	gboolean found_my_game = FALSE;
-	gboolean failed = TRUE;
+	gdk_threads_enter();
+	gtk_label_set_text(GTK_LABEL(moves_list_title_label), text);
+	gdk_threads_leave();
+}
 
-	gboolean blacks_ply = 0;
+static void show_loaded_game(const pgn_loaded_game *loaded) {
+	reset_game(true);
+	strncpy(main_game->white_name, loaded->white_name, sizeof(main_game->white_name) - 1);
+	strncpy(main_game->black_name, loaded->black_name, sizeof(main_game->black_name) - 1);
+	strncpy(main_game->white_rating, loaded->white_rating, sizeof(main_game->white_rating) - 1);
+	strncpy(main_game->black_rating, loaded->black_rating, sizeof(main_game->black_rating) - 1);
 
-	while (i != -1) {
-		i = san_scanner_lex();
+	// the moves were resolved by the loader, they only need playing
+	ipc_begin_replay();
+	for (int i = 0; i < loaded->n_plys; i++) {
+		const int *move = loaded->plys[i].move;
+		char san[SAN_MOVE_SIZE];
+		main_game->promo_type = loaded->plys[i].promo_type;
+		move_piece(main_game->squares[move[0]][move[1]].piece, move[2], move[3], 0, AUTO_SOURCE_NO_ANIM, san, main_game, false);
+		plys_list_append_ply(main_list, ply_new(move[0], move[1], move[2], move[3], NULL, san));
+	}
+	ipc_end_replay(main_list->last_ply);
 
-		if (i == 2) {
-			if (!inside_tags) {
-				if (found_my_game) {
-					break;
-				}
-				inside_tags = TRUE;
-				games_counter++;
-				debug("Found game %d\n", game_num);
-				if (games_counter == game_num) {
-					found_my_game = TRUE;
-					failed = FALSE;
-					debug("Found game %d\n", game_num);
-				}
-			}
-			while (i == 2) {
-				i = san_scanner_lex();
-			}
+	refresh_moves_list_view(main_list);
+	gdk_threads_enter();
+	set_header_label(main_game->white_name, main_game->black_name, main_game->white_rating, main_game->black_rating);
+	assign_surfaces();
+	draw_pieces_surface(old_wi, old_hi);
+	init_dragging_background(old_wi, old_hi);
+	init_highlight_under_surface(old_wi, old_hi);
+	gtk_widget_queue_draw(board);
+	gdk_threads_leave();
+}
+
+static void on_game_loaded(const pgn_loaded_game *loaded, void *data) {
+	load_request *request = data;
+	char error[128];
+
+	switch (loaded->status) {
+		case PGN_LOAD_OK:
+			debug("Successfully parsed game number '%d' in database '%s'\n", loaded->game_num, loaded->file_path);
+			show_loaded_game(loaded);
+			break;
+		case PGN_LOAD_NOT_FOUND:
+			snprintf(error, sizeof(error), "no game number %d, the file has %u games", loaded->game_num, loaded->n_games);
+			break;
+		case PGN_LOAD_BAD_MOVE:
+			snprintf(error, sizeof(error), "could not resolve a move of game number %d", loaded->game_num);
+			break;
+		case PGN_LOAD_NO_FILE:
+			snprintf(error, sizeof(error), "could not open the file");
+			break;
+		case PGN_LOAD_CANCELLED:
+			snprintf(error, sizeof(error), "cancelled");
+			break;
+	}
+	if (loaded->status != PGN_LOAD_OK) {
+		fprintf(stderr, "Failed to load game number '%d' in database '%s': %s\n", loaded->game_num, loaded->file_path, error);
+		// a newer load owns the title
+		if (!pgn_load_running()) {
+			gdk_threads_enter();
+			gtk_label_set_text(GTK_LABEL(moves_list_title_label), title_before_load);
+			gdk_threads_leave();
 		}
-		if (i != -1) {
-			if (inside_tags) {
-				inside_tags = FALSE;
-				if (found_my_game) {
-					gdk_threads_enter();
-					set_header_label(main_game->white_name, main_game->black_name, main_game->white_rating, main_game->black_rating);
-					gdk_threads_leave();
-					if (main_list != NULL) {
-						plys_list_free(main_list);
-					}
-					main_list = plys_list_new();
-				}
+	}
+
+	if (request->loaded != NULL) {
+		request->loaded(loaded->status == PGN_LOAD_OK ? NULL : error, request->data);
+	}
+	free(request);
+}
+
+/* Clicking the title cancels a load in progress */
+static gboolean on_title_clicked(GtkWidget *widget, GdkEventButton *event, gpointer data) {
+	return pgn_load_cancel();
+}
+
+/* Returns straight away, the file is scanned on the task pool with the
+ * progress shown in the title. The board changes once the game is found,
+ * then loaded is called with NULL, or with why the game could not be shown.
+ * Starting a load cancels the one in progress */
+void load_game(const char* file_path, int game_num, void (*loaded)(const char *error, void *data), void *data) {
+	load_request *request = calloc(1, sizeof(load_request));
+	request->loaded = loaded;
+	request->data = data;
+
+	gdk_threads_enter();
+	if (!pgn_load_running()) {
+		snprintf(title_before_load, sizeof(title_before_load), "%s", gtk_label_get_text(GTK_LABEL(moves_list_title_label)));
+	}
+	gdk_threads_leave();
+
+	pgn_load_start(file_path, game_num, on_load_progress, on_game_loaded, request);
+}
+
+#define OPENING_LINE_TOKENS 64
+
+/* Sets the board to an opening line such as "1.e4 c5 2.Nf3 d6", from an idle callback */
+static gboolean load_opening_line(gpointer data) {
+	char *line = data;
+	reset_game(true);
+
+	pgn_token tokens[OPENING_LINE_TOKENS];
+	size_t len = strlen(line);
+	size_t pos = 0;
+	size_t n_tokens;
+	bool failed = false;
+	ipc_begin_replay();
+	while (!failed && (n_tokens = pgn_tokenize(line, len, &pos, tokens, OPENING_LINE_TOKENS)) > 0) {
+		for (size_t k = 0; k < n_tokens; k++) {
+			if (tokens[k].kind != MATCHED_MOVE) {
+				continue;
 			}
-			if (found_my_game) {
-				debug("raw move %c%s - whose_turn %d\n", type_to_char(type), currentMoveString, blacks_ply);
-				type = colorise_type(type, blacks_ply);
-				int resolved = resolve_move(main_game, type, currentMoveString, resolved_move);
-				if (resolved) {
-					debug("move resolved to %c%d-%c%d\n", resolved_move[0]+'a', resolved_move[1]+1, resolved_move[2]+'a', resolved_move[3]+1);
-					char san[SAN_MOVE_SIZE];
-					move_piece(main_game->squares[resolved_move[0]][resolved_move[1]].piece, resolved_move[2], resolved_move[3], 0, AUTO_SOURCE_NO_ANIM, san, main_game, false);
-					plys_list_append_ply(main_list, ply_new(resolved_move[0], resolved_move[1], resolved_move[2], resolved_move[3], NULL, san));
-					blacks_ply = ! blacks_ply;
-				}
-				else {
-					fprintf(stderr, "Could not resolve move !\n");
-					failed = TRUE;
-					break;
-				}
+			int piece_type;
+			char move_string[5];
+			int move[4];
+			pgn_token_move(&tokens[k], main_game->whose_turn, &piece_type, move_string);
+			if (!resolve_move(main_game, piece_type, move_string, move)) {
+				fprintf(stderr, "Could not resolve move %c%s of '%s'\n", type_to_char(piece_type), move_string, line);
+				failed = true;
+				break;
 			}
+			char san[SAN_MOVE_SIZE];
+			move_piece(main_game->squares[move[0]][move[1]].piece, move[2], move[3], 0, AUTO_SOURCE_NO_ANIM, san, main_game, false);
+			append_san_move(main_game, san);
+			plys_list_append_ply(main_list, ply_new(move[0], move[1], move[2], move[3], NULL, san));
 		}
 	}
-	if (!failed) {
-		debug("Successfully parsed game number '%d' in database '%s'\n", game_num, file_path);
-		refresh_moves_list_view(main_list);
-	}
-	else {
-		fprintf(stderr, "Failed to load/parse game number '%d' in database '%s'\n", game_num, file_path);
-	}
+	ipc_end_replay(main_list->last_ply);
+
+	refresh_moves_list_view(main_list);
+	gdk_threads_enter();
+	assign_surfaces();
+	draw_pieces_surface(old_wi, old_hi);
+	init_dragging_background(old_wi, old_hi);
+	init_highlight_under_surface(old_wi, old_hi);
+	update_eco_tag(false);
+	gtk_widget_queue_draw(board);
+	gdk_threads_leave();
+
+	free(line);
+	return FALSE;
+}
+
+static void on_opening_selected(const char *san_line) {
+	// the board is rebuilt outside of the signal handler, like load_game()
+	g_idle_add(load_opening_line, strdup(san_line));
 }
 
 /* replays from scratch the plys in list on the passed squares and pieces.
@@ -1518,19 +1710,14 @@ int replay_moves_list_from_scratch(plys_list *list, chess_square sq[8][8], chess
 	return 0;
 }
 
-struct timeval wait_until_time;
+static int64_t wait_until_time = 0;
 
 gboolean auto_play_one_move(gpointer data) {
 
 	static int waiting = 0;
 
-	struct timeval current_time;
-	gettimeofday(&current_time, NULL);
-	if (wait_until_time.tv_sec > current_time.tv_sec) {
-		return TRUE;
-	}
-	else if (wait_until_time.tv_sec == current_time.tv_sec &&
-			wait_until_time.tv_usec > current_time.tv_usec) {
+	int64_t current_time = time_now_us();
+	if (wait_until_time > current_time) {
 		return TRUE;
 	}
 
@@ -1564,8 +1751,7 @@ gboolean auto_play_one_move(gpointer data) {
 			}
 			end_game();
 			waiting = 1;
-			wait_until_time.tv_sec = current_time.tv_sec + auto_play_delay / 1000;
-			wait_until_time.tv_usec = current_time.tv_usec + (auto_play_delay * 1000) % 1000000;
+			wait_until_time = current_time + (int64_t) auto_play_delay * 1000;
 			return TRUE;
 		}
 
@@ -1608,7 +1794,7 @@ gboolean auto_play_one_ics_move(gpointer data) {
 	char lm[MOVE_BUFF_SIZE];
 
 	get_last_move(lm);
-	san_scanner__scan_string(lm);
+	san_scanner_feed(lm, (int) strlen(lm));
 
 	if (san_scanner_lex() != -1) {
 		playing = true;
@@ -1653,7 +1839,7 @@ gboolean auto_play_one_crafty_move(gpointer data) {
 	char lm[MOVE_BUFF_SIZE];
 
 	get_last_move(lm);
-	san_scanner__scan_string(lm);
+	san_scanner_feed(lm, (int) strlen(lm));
 	i = san_scanner_lex();
 
 	if ( i != -1) {
@@ -1898,8 +2084,23 @@ gint cleanup(gpointer ignored) {
 	pthread_join(move_event_processor_thread, NULL);
 	if (ics_mode) {
 		cleanup_ics();
+		free_ics_console();
+	}
+
+	if (debug_flag) {
+		if (ics_mode) {
+			ics_scanner_print_stats();
+		}
+		san_scanner_print_stats();
+		position_snapshot_print_stats(stdout);
+		mem_budget_report(stdout);
+	}
+	if (alloc_stats_enabled()) {
+		alloc_stats_report(stdout);
 	}
 
+	cleanup_ipc_server();
+	cleanup_task_pool();
 	cleanup_uci();
 	cleanup_mutexes();
 
@@ -1917,13 +2118,15 @@ wint_t type_to_unicode_char(int type) {
 /* <Moves List data structures utilities> */
 ply *ply_new(int oc, int or, int nc, int nr, chess_piece *taken, const char *san) {
 	ply *new;
-	new = malloc(sizeof(ply));
+	new = tracked_malloc(ALLOC_PLYS, sizeof(ply));
 	new->old_col = oc;
 	new->old_row = or;
 	new->new_col = nc;
 	new->new_row = nr;
 	new->piece_taken = taken;
 	strncpy(new->san_string, san, 15);
+	new->san_string[15] = '\0';
+	mem_budget_account(MEM_GAME_HISTORY, sizeof(ply));
 	return new;
 }
 
@@ -1941,12 +2144,13 @@ plys_list *plys_list_new(void) {
 	
 	plys_list *new;
 
-	new = malloc(sizeof(plys_list));
-	new->plys = calloc(MOVES_LIST_ALLOC_PAGE_SIZE, sizeof(ply*));
+	new = tracked_malloc(ALLOC_PLYS, sizeof(plys_list));
+	new->plys = tracked_calloc(ALLOC_PLYS, MOVES_LIST_ALLOC_PAGE_SIZE, sizeof(ply*));
 
 	new->last_ply = 0;
 	new->viewed_ply = 0;
 	new->plys_allocated = MOVES_LIST_ALLOC_PAGE_SIZE;
+	mem_budget_account(MEM_GAME_HISTORY, sizeof(plys_list) + MOVES_LIST_ALLOC_PAGE_SIZE * sizeof(ply*));
 
 	return new;
 }
@@ -1956,14 +2160,15 @@ void plys_list_grow(plys_list *list) {
 	debug("Growing Moves List!!\n");
 
 	/* grow the allocated memory */
-	list->plys = realloc(list->plys, 
-			sizeof(ply) * (MOVES_LIST_ALLOC_PAGE_SIZE + list->plys_allocated) );
+	list->plys = tracked_realloc(ALLOC_PLYS, list->plys, 
+			sizeof(ply*) * (MOVES_LIST_ALLOC_PAGE_SIZE + list->plys_allocated) );
 
 	/* initialising newly allocated memory to 0 */
-	memset(list->plys+(list->plys_allocated), 0, sizeof(ply)*MOVES_LIST_ALLOC_PAGE_SIZE);
+	memset(list->plys+(list->plys_allocated), 0, sizeof(ply*)*MOVES_LIST_ALLOC_PAGE_SIZE);
 
 	/* updating allocated counter */
 	list->plys_allocated += MOVES_LIST_ALLOC_PAGE_SIZE;
+	mem_budget_account(MEM_GAME_HISTORY, MOVES_LIST_ALLOC_PAGE_SIZE * sizeof(ply*));
 }
 
 void plys_list_append_ply(plys_list *list, ply *to_append) {
@@ -1971,10 +2176,35 @@ void plys_list_append_ply(plys_list *list, ply *to_append) {
 		plys_list_grow(list);
 	}
 
-	/* sets the half move number */
-	to_append->ply_number = list->last_ply + 1;
+	/* sets the half move number, the first plys may have been trimmed */
+	to_append->ply_number = list->last_ply > 0 ? list->plys[list->last_ply - 1]->ply_number + 1 : 1;
 
 	list->plys[list->last_ply++] = to_append;
+
+	if (list == main_list) {
+		ipc_publish_ply(to_append);
+		mem_budget_enforce(MEM_GAME_HISTORY);
+	}
+}
+
+/* MEM_GAME_HISTORY evictor: drops the older half of the moves list,
+ * whole moves so it still starts with White's. The game itself, its
+ * SAN moves included, is kept */
+static bool trim_main_list(void) {
+	int drop = main_list != NULL ? (main_list->last_ply / 2) & ~1 : 0;
+	if (drop == 0) {
+		return false;
+	}
+	debug("Trimming %d plys off the moves list to fit the memory budget\n", drop);
+	for (int i = 0; i < drop; i++) {
+		tracked_free(ALLOC_PLYS, main_list->plys[i]);
+	}
+	main_list->last_ply -= drop;
+	memmove(main_list->plys, main_list->plys + drop, (main_list->last_ply + 1) * sizeof(ply*));
+	memset(main_list->plys + main_list->last_ply + 1, 0, drop * sizeof(ply*));
+	main_list->viewed_ply = main_list->viewed_ply > drop ? main_list->viewed_ply - drop : 0;
+	mem_budget_account(MEM_GAME_HISTORY, -(long) (drop * sizeof(ply)));
+	return true;
 }
 
 void plys_list_print(plys_list *list) {
@@ -1989,11 +2219,12 @@ void plys_list_print(plys_list *list) {
 void plys_list_free(plys_list *to_destroy) {
 	int i = 0;
 	while(to_destroy->plys[i] != NULL) {
-		free(to_destroy->plys[i]);
+		tracked_free(ALLOC_PLYS, to_destroy->plys[i]);
 		i++;
 	}
-	free(to_destroy->plys);
-	free(to_destroy);
+	mem_budget_account(MEM_GAME_HISTORY, -(long) (i * sizeof(ply) + sizeof(plys_list) + to_destroy->plys_allocated * sizeof(ply*)));
+	tracked_free(ALLOC_PLYS, to_destroy->plys);
+	tracked_free(ALLOC_PLYS, to_destroy);
 }
 /* </Moves List data structures utilities> */
 
@@ -2180,9 +2411,15 @@ int compile_eco(void) {
 		if (fgets(full_description, ECO_LINE_MAX, f)) {
 			full_description[strlen(full_description) - 1] = 0;
 //			printf("Full_description '%s'\n", full_description);
-			g_hash_table_insert(eco_full, strdup(san_key), strdup(full_description));
+			char *key = strdup(san_key);
+			char *description = strdup(full_description);
+			g_hash_table_insert(eco_full, key, description);
+			mem_budget_account(MEM_CACHES, (long) (strlen(san_key) + strlen(full_description) + 2));
+			eco_search_add(key, description);
 		}
 	}
+	fclose(f);
+	mem_budget_enforce(MEM_CACHES);
 
 	return 0;
 }
@@ -2216,10 +2453,17 @@ static void get_theme_colours(GtkWidget *widget) {
 }
 
 static gboolean spawn_uci_engine_idle(gpointer data) {
-	debug("Spawning UCI engine...\n");
-	bool brainfish = *(bool*)data;
-	spawn_uci_engine(brainfish);
-	debug("Spawned UCI engine [OK]\n");
+	if (!engine_path_count) {
+		//TODO: can we discover these from $PATH?
+		engine_paths[engine_path_count++] = "/usr/bin/stockfish";
+	}
+	for (int i = 0; i < engine_path_count; i++) {
+		debug("Spawning UCI engine %s...\n", engine_paths[i]);
+		if (spawn_uci_engine(engine_paths[i]) < 0) {
+			continue;
+		}
+		debug("Spawned UCI engine [OK]\n");
+	}
 	if (!ics_mode) {
 		debug("Starting new UCI game...\n");
 //		start_new_uci_game(60, ENGINE_WHITE);
@@ -2230,6 +2474,16 @@ static gboolean spawn_uci_engine_idle(gpointer data) {
 	return FALSE;
 }
 
+/* Common exit of the options that run without a window */
+static int finish_headless(int ret) {
+	if (alloc_stats_enabled()) {
+		alloc_stats_report(stdout);
+	}
+	cleanup_task_pool();
+	game_free(main_game);
+	return ret;
+}
+
 int main (int argc, char **argv) {
 
 	int c;
@@ -2253,6 +2507,23 @@ int main (int argc, char **argv) {
 			{"load",       required_argument, 0,                   LOAD_FILE_ARG},
 			{"gamenum",    required_argument, 0,                   LOAD_GAME_NUM_ARG},
 			{"delay",      required_argument, 0,                   AUTO_PLAY_DELAY_ARG},
+			{"latency",    required_argument, 0,                   LATENCY_BENCH_ARG},
+			{"engine",     required_argument, 0,                   ENGINE_PATH_ARG},
+			{"export",     required_argument, 0,                   EXPORT_ARG},
+			{"exportsize", required_argument, 0,                   EXPORT_SIZE_ARG},
+			{"ipc",        required_argument, 0,                   IPC_PATH_ARG},
+			{"membudget",  required_argument, 0,                   MEM_BUDGET_ARG},
+			{"pgncheck",   required_argument, 0,                   PGN_CHECK_ARG},
+			{"material",   required_argument, 0,                   MATERIAL_QUERY_ARG},
+			{"pattern",    required_argument, 0,                   PATTERN_SEARCH_ARG},
+			{"clockcheck", required_argument, 0,                   CLOCK_CHECK_ARG},
+			{"rendercheck", required_argument, 0,                  RENDER_CHECK_ARG},
+			{"renderrecord", no_argument,     &render_record,      TRUE},
+			{"roundtrip",  required_argument, 0,                   ROUND_TRIP_ARG},
+			{"allocstats", no_argument,       0,                   ALLOC_STATS_ARG},
+			{"attacks",    no_argument,       &show_attacks,       TRUE},
+			{"browse",     no_argument,       &browse_games,       TRUE},
+			{"listgames",  required_argument, 0,                   LIST_GAMES_ARG},
 			{0,            0,                 0,                   0}
 	};
 
@@ -2314,6 +2585,75 @@ int main (int argc, char **argv) {
 			case AUTO_PLAY_DELAY_ARG:
 				auto_play_delay = atoi(optarg);
 				break;
+			case LATENCY_BENCH_ARG:
+				// "drag" (default) or "click" for click-to-move
+				latency_bench_specified = true;
+				latency_bench_click = !strcmp(optarg, "click");
+				break;
+			case ENGINE_PATH_ARG:
+				// repeat to analyse with several engines side by side, the first one is played against
+				if (engine_path_count < MAX_UCI_ENGINES) {
+					engine_paths[engine_path_count++] = optarg;
+				} else {
+					fprintf(stderr, "Too many engines, ignoring '%s'\n", optarg);
+				}
+				break;
+			case EXPORT_ARG:
+				// with -load: "game.png" for an animated PNG, otherwise a prefix for numbered frames
+				export_path = optarg;
+				break;
+			case EXPORT_SIZE_ARG: {
+				// in pixels, the board is drawn and animated at that size
+				char *end;
+				long size = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || size < EXPORT_MIN_SIZE || size > EXPORT_MAX_SIZE) {
+					fprintf(stderr, "Invalid export size '%s', expected %d to %d pixels\n", optarg, EXPORT_MIN_SIZE,
+					        EXPORT_MAX_SIZE);
+					return 1;
+				}
+				export_size = (int) size;
+				break;
+			}
+			case IPC_PATH_ARG:
+				// unix socket streaming the moves to overlays and scripts
+				ipc_path = optarg;
+				break;
+			case MEM_BUDGET_ARG:
+				// in kB, shared between channels, console, game history, caches and listings. 0 for no caps
+				memory_budget_kb = (size_t) atol(optarg);
+				break;
+			case PGN_CHECK_ARG:
+				// directory of PGN files to cross-check the tokenizer against the SAN scanner
+				pgn_check_dir = optarg;
+				break;
+			case MATERIAL_QUERY_ARG:
+				// with -load: games reaching e.g. "KRPvKR", with either colour
+				material_query_spec = optarg;
+				break;
+			case PATTERN_SEARCH_ARG:
+				// with -load: positions matching e.g. "Nd5 -pce kg8", see position_pattern_parse()
+				pattern_search_spec = optarg;
+				break;
+			case CLOCK_CHECK_ARG:
+				// number of games played on a virtual time clock, see test_clocks_virtual_time()
+				clock_check_games = atoi(optarg);
+				break;
+			case RENDER_CHECK_ARG:
+				// directory of golden board images, see test_render_golden()
+				render_check_dir = optarg;
+				break;
+			case ROUND_TRIP_ARG:
+				// directory of PGN files replayed move by move, see test_pgn_round_trip()
+				round_trip_dir = optarg;
+				break;
+			case ALLOC_STATS_ARG:
+				// counts allocations by subsystem, reported on SIGUSR1 and after the checks
+				alloc_stats_enable();
+				break;
+			case LIST_GAMES_ARG:
+				// with -load: first games sorted by a column, e.g. "white" or "-date", see game_index_list()
+				list_games_spec = optarg;
+				break;
 
 			default:
 				break;
@@ -2321,21 +2661,11 @@ int main (int argc, char **argv) {
 		}
 	}
 
-	// Compute highlight colours
-	highlight_selected_r = 1;
-	highlight_selected_g = (dg + lg) / 3.0;
-	highlight_selected_b = (db + lb) / 3.0;
-	highlight_selected_a = 0.3;
+	mem_budget_init(memory_budget_kb);
+	mem_budget_set_evictor(MEM_GAME_HISTORY, trim_main_list);
 
-	highlight_move_r = (dr + lr) / 3.0;
-	highlight_move_g = 1;
-	highlight_move_b = (db + lb) / 3.0;
-	highlight_move_a = 0.3;
-
-	highlight_pre_move_r = 1;
-	highlight_pre_move_g = (dg + lg) / 3.0;
-	highlight_pre_move_b = (db + lb) / 3.0;
-	highlight_pre_move_a = 0.6;
+	// Compute highlight colours
+	compute_highlight_colours();
 
 	debug("Debug info enabled\n");
 	if (ics_mode) {
@@ -2400,16 +2730,73 @@ int main (int argc, char **argv) {
 
 	init_anims_map();
 
+	if (load_pieces_theme(theme_dir)) {
+		return 1;
+	}
+
+	main_game = game_new(ALLOC_GAMES);
+
+	/* Shared workers for batch and background jobs, one per CPU */
+	init_task_pool(0);
+
+	if (pgn_check_dir != NULL) {
+		return finish_headless(test_pgn_tokenizer(pgn_check_dir) != 0);
+	}
+
+	if (clock_check_games > 0) {
+		return finish_headless(test_clocks_virtual_time(clock_check_games) != 0);
+	}
+
+	if (round_trip_dir != NULL) {
+		return finish_headless(test_pgn_round_trip(round_trip_dir) != 0);
+	}
+
+	if (render_check_dir != NULL) {
+		if (!render_record && !test_render_has_golden(render_check_dir)) {
+			printf("No golden images in '%s', record them with -renderrecord\n", render_check_dir);
+			return finish_headless(TEST_SKIPPED);
+		}
+		return finish_headless(test_render_golden(render_check_dir, render_record) != 0);
+	}
+
+	if (material_query_spec != NULL) {
+		if (!load_file_specified) {
+			fprintf(stderr, "-material needs a PGN file to -load\n");
+			return 1;
+		}
+		return finish_headless(material_query(file_to_load, material_query_spec) != 0);
+	}
+
+	if (pattern_search_spec != NULL) {
+		if (!load_file_specified) {
+			fprintf(stderr, "-pattern needs a PGN file to -load\n");
+			return 1;
+		}
+		return finish_headless(pattern_search(file_to_load, pattern_search_spec) != 0);
+	}
+
+	if (list_games_spec != NULL) {
+		if (!load_file_specified) {
+			fprintf(stderr, "-listgames needs a PGN file to -load\n");
+			return 1;
+		}
+		return finish_headless(game_index_list(file_to_load, list_games_spec) != 0);
+	}
+
+	if (export_path != NULL) {
+		if (!load_file_specified) {
+			fprintf(stderr, "-export needs a PGN file to -load\n");
+			return 1;
+		}
+		return finish_headless(export_game(file_to_load, game_to_load, export_path, export_size, auto_play_delay));
+	}
+
 	/* Initilialise threading stuff */
 	gdk_threads_init();
 	gdk_threads_enter();
 
 	gtk_init(&argc, &argv);
 
-	load_piecesSvg();
-
-	main_game = game_new();
-
 	main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	g_signal_connect(main_window, "map-event", G_CALLBACK(get_theme_colours), NULL);
 
@@ -2469,6 +2856,7 @@ int main (int argc, char **argv) {
 	gtk_container_add (GTK_CONTAINER (align), moves_list_title_label);
 	gtk_container_add (GTK_CONTAINER (label_frame), align);
 	gtk_container_add (GTK_CONTAINER (label_frame_event_box), label_frame);
+	g_signal_connect(label_frame_event_box, "button-press-event", G_CALLBACK(on_title_clicked), NULL);
 
 	/* controls for displayed ply */
 //	play_pause_button = gtk_button_new();
@@ -2537,6 +2925,10 @@ int main (int argc, char **argv) {
 	GtkWidget *moves_v_box = gtk_vbox_new(FALSE, 0);
 	gtk_box_pack_start(GTK_BOX(moves_v_box), label_frame_event_box, FALSE, FALSE, 0);
 	gtk_box_pack_start(GTK_BOX(moves_v_box), controls_h_box, FALSE, FALSE, 0);
+	if (!ics_mode) {
+		gtk_box_pack_start(GTK_BOX(moves_v_box), eco_search_entry_new(on_opening_selected), FALSE, FALSE, 0);
+	}
+	gtk_box_pack_start(GTK_BOX(moves_v_box), move_entry_new(), FALSE, FALSE, 0);
 	gtk_box_pack_start(GTK_BOX(moves_v_box), scrolled_window, TRUE, TRUE, 0);
 	gtk_box_pack_end(GTK_BOX(moves_v_box), opening_code_frame_event_box, FALSE, FALSE, 0);
 	gtk_widget_set_size_request(moves_v_box, 350, -1);
@@ -2592,9 +2984,7 @@ int main (int argc, char **argv) {
 	                1, // guint width
 	                1); // guint height
 
-	/* Channels Hashmap: we use this to quickly map a channel number to its index */
-	channel_map = g_hash_table_new(g_int_hash, g_int_equal);
-	reverse_channel_map = g_hash_table_new(g_direct_hash, g_direct_equal);
+	init_channels();
 
 	/* Create empty notebook */
 	channels_notebook = gtk_notebook_new();
@@ -2602,6 +2992,11 @@ int main (int argc, char **argv) {
 	gtk_notebook_set_scrollable(GTK_NOTEBOOK(channels_notebook), TRUE);
 	//gtk_notebook_popup_enable(GTK_NOTEBOOK(channels_notebook));
 
+	/* The ICS console is always the first tab */
+	if (ics_mode) {
+		gtk_notebook_append_page(GTK_NOTEBOOK(channels_notebook), create_ics_console(), gtk_label_new("Console"));
+	}
+
 	GtkWidget *collapsible_analysis = gtk_expander_new_with_mnemonic("Computer _Analysis");
 	gtk_container_add(GTK_CONTAINER(collapsible_analysis), create_analysis_panel());
 	gtk_expander_set_expanded(GTK_EXPANDER(collapsible_analysis), true);
@@ -2647,24 +3042,26 @@ int main (int argc, char **argv) {
 	g_signal_connect (G_OBJECT(board), "got-uci-move", G_CALLBACK(on_get_uci_move), NULL);
 	g_signal_connect (G_OBJECT(board), "flip-board", G_CALLBACK(on_flip_board), NULL);
 
-	/* Get the pieces SVG dimensions for rendering */
-	RsvgDimensionData g_DimensionData;
-	rsvg_handle_get_dimensions (piecesSvg[B_QUEEN], &g_DimensionData);
-	svg_w = 1.0f / (8.0f * (double) g_DimensionData.width);
-	svg_h = 1.0f / (8.0f * (double) g_DimensionData.height);
-
 	set_moveit_flag(false);
 	set_running_flag(true);
 	set_more_events_flag(false);
 
+	if (show_attacks) {
+		set_attack_overlay(true);
+	}
 	reset_game(false);
 
 	gtk_widget_show_all(main_window);
 
 	// only show this when we have tabs to show
-	gtk_widget_hide(channels_notebook);
+	if (!ics_mode) {
+		gtk_widget_hide(channels_notebook);
+	}
 
-	if (load_file_specified) {
+	if (load_file_specified && browse_games) {
+		game_browser_open(file_to_load);
+	}
+	else if (load_file_specified) {
 		if (!open_file(file_to_load)) {
 			auto_play_timer = g_timeout_add(auto_play_delay, auto_play_one_move, board);
 		}
@@ -2674,8 +3071,14 @@ int main (int argc, char **argv) {
 		init_ics();
 	}
 
-	bool brainfish = false;
-	g_idle_add(spawn_uci_engine_idle, &brainfish);
+	if (ipc_path != NULL) {
+		init_ipc_server(ipc_path);
+	}
+
+	// kill -USR1 prints how much memory each subsystem holds
+	g_unix_signal_add(SIGUSR1, on_memory_report_signal, NULL);
+
+	g_idle_add(spawn_uci_engine_idle, NULL);
 
 	spawn_mover();
 
@@ -2687,6 +3090,10 @@ int main (int argc, char **argv) {
 //	start_new_uci_game();
 	///////////////////////
 
+	if (latency_bench_specified) {
+		test_input_latency(latency_bench_click);
+	}
+
 
 	FT_Error error = FT_Init_FreeType(&library);
 	FT_Face sevenSegmentFTFace;
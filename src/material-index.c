@@ -0,0 +1,405 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <gtk/gtk.h>
+
+#include "cairo-board.h"
+#include "chess-backend.h"
+#include "pgn-replay.h"
+#include "material-index.h"
+
+#define MATERIAL_INDEX_MAGIC "CBMI"
+#define MATERIAL_INDEX_VERSION 1
+#define MATERIAL_INDEX_SUFFIX ".midx"
+
+/* On disk: header, entries sorted by signature, then the postings of each
+ * entry, in game order */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint32_t n_games;
+	uint32_t n_signatures;
+} material_index_header;
+
+typedef struct {
+	material_signature signature;
+	uint32_t n_postings;
+	uint64_t first_posting;
+} material_index_entry;
+
+struct material_index {
+	FILE *file;
+	material_index_header header;
+	material_index_entry *entries;
+	long postings_start;
+};
+
+/* pawns, knights, bishops, rooks, queens */
+static const int side_shifts[5] = {0, 4, 7, 10, 13};
+static const int side_max[5] = {15, 7, 7, 7, 7};
+static const char side_letters[5] = {'P', 'N', 'B', 'R', 'Q'};
+
+static uint32_t pack_side(const int counts[5]) {
+	uint32_t packed = 0;
+	for (int i = 0; i < 5; i++) {
+		int count = counts[i] > side_max[i] ? side_max[i] : counts[i];
+		packed |= (uint32_t) count << side_shifts[i];
+	}
+	return packed;
+}
+
+static void unpack_side(uint32_t packed, int counts[5]) {
+	for (int i = 0; i < 5; i++) {
+		counts[i] = (int) ((packed >> side_shifts[i]) & (uint32_t) side_max[i]);
+	}
+}
+
+material_signature material_signature_of(chess_game *game) {
+	int alive[12];
+	count_alive_pieces_by_type(alive, game->white_set, game->black_set);
+	int white[5] = {alive[W_PAWN], alive[W_KNIGHT], alive[W_BISHOP], alive[W_ROOK], alive[W_QUEEN]};
+	int black[5] = {alive[B_PAWN], alive[B_KNIGHT], alive[B_BISHOP], alive[B_ROOK], alive[B_QUEEN]};
+	return pack_side(white) | pack_side(black) << 16;
+}
+
+material_signature material_signature_swap(material_signature signature) {
+	return signature >> 16 | signature << 16;
+}
+
+/* "KRPvKR", "KRP-KR" or "KRPKR": white first, each side starting with its king */
+int material_signature_parse(const char *spec, material_signature *signature) {
+	int counts[2][5];
+	memset(counts, 0, sizeof(counts));
+	int side = -1;
+
+	for (const char *c = spec; *c; c++) {
+		if (*c == 'K') {
+			if (++side > 1) {
+				return -1;
+			}
+			continue;
+		}
+		if (*c == 'v' || *c == '-' || *c == ' ') {
+			continue;
+		}
+		const char *letter = memchr(side_letters, *c, sizeof(side_letters));
+		if (letter == NULL || side < 0) {
+			return -1;
+		}
+		counts[side][letter - side_letters]++;
+	}
+	if (side != 1) {
+		return -1;
+	}
+	*signature = pack_side(counts[0]) | pack_side(counts[1]) << 16;
+	return 0;
+}
+
+void material_signature_format(material_signature signature, char *buf, size_t size) {
+	char spec[64];
+	int len = 0;
+	for (int side = 0; side < 2; side++) {
+		int counts[5];
+		unpack_side(side ? signature >> 16 : signature & 0xffff, counts);
+		if (side) {
+			spec[len++] = 'v';
+		}
+		spec[len++] = 'K';
+		for (int i = 4; i >= 0; i--) {
+			for (int j = 0; j < counts[i]; j++) {
+				spec[len++] = side_letters[i];
+			}
+		}
+	}
+	spec[len] = '\0';
+	g_strlcpy(buf, spec, size);
+}
+
+/* <Index building> */
+typedef struct {
+	GHashTable *postings; // signature -> GArray of material_posting
+	material_signature seen[64];
+	int n_seen;
+	uint32_t n_games;
+} material_builder;
+
+static bool builder_game_start(unsigned int game_index, size_t offset, void *data) {
+	material_builder *builder = data;
+	builder->n_seen = 0;
+	builder->n_games = game_index + 1;
+	return true;
+}
+
+static bool builder_position(chess_game *game, unsigned int game_index, int ply, void *data) {
+	material_builder *builder = data;
+	material_signature signature = material_signature_of(game);
+
+	// material only changes on captures and promotions
+	if (builder->n_seen > 0 && builder->seen[builder->n_seen - 1] == signature) {
+		return true;
+	}
+	for (int i = 0; i < builder->n_seen; i++) {
+		if (builder->seen[i] == signature) {
+			return true;
+		}
+	}
+	if (builder->n_seen < 64) {
+		builder->seen[builder->n_seen++] = signature;
+	}
+
+	GArray *postings = g_hash_table_lookup(builder->postings, GUINT_TO_POINTER(signature));
+	if (postings == NULL) {
+		postings = g_array_new(FALSE, FALSE, sizeof(material_posting));
+		g_hash_table_insert(builder->postings, GUINT_TO_POINTER(signature), postings);
+	}
+	material_posting posting = {game_index, (uint32_t) ply};
+	g_array_append_val(postings, posting);
+	return true;
+}
+
+static void free_postings(gpointer data) {
+	g_array_free(data, TRUE);
+}
+
+static gint compare_signatures(gconstpointer a, gconstpointer b) {
+	material_signature sa = GPOINTER_TO_UINT(*(gconstpointer *) a);
+	material_signature sb = GPOINTER_TO_UINT(*(gconstpointer *) b);
+	return sa < sb ? -1 : sa > sb;
+}
+
+static int write_index(material_builder *builder, struct stat *source, const char *index_path) {
+	gchar *tmp_path = g_strconcat(index_path, ".tmp", NULL);
+	FILE *out = fopen(tmp_path, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "Error opening file '%s': %s\n", tmp_path, strerror(errno));
+		g_free(tmp_path);
+		return -1;
+	}
+
+	GPtrArray *keys = g_ptr_array_new();
+	GHashTableIter iter;
+	gpointer key;
+	g_hash_table_iter_init(&iter, builder->postings);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		g_ptr_array_add(keys, key);
+	}
+	g_ptr_array_sort(keys, compare_signatures);
+
+	material_index_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MATERIAL_INDEX_MAGIC, 4);
+	header.version = MATERIAL_INDEX_VERSION;
+	header.source_size = (uint64_t) source->st_size;
+	header.source_mtime = (int64_t) source->st_mtime;
+	header.n_games = builder->n_games;
+	header.n_signatures = keys->len;
+	bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+	uint64_t first_posting = 0;
+	for (guint i = 0; ok && i < keys->len; i++) {
+		GArray *postings = g_hash_table_lookup(builder->postings, keys->pdata[i]);
+		material_index_entry entry = {GPOINTER_TO_UINT(keys->pdata[i]), postings->len, first_posting};
+		ok = fwrite(&entry, sizeof(entry), 1, out) == 1;
+		first_posting += postings->len;
+	}
+	for (guint i = 0; ok && i < keys->len; i++) {
+		GArray *postings = g_hash_table_lookup(builder->postings, keys->pdata[i]);
+		ok = fwrite(postings->data, sizeof(material_posting), postings->len, out) == postings->len;
+	}
+	g_ptr_array_free(keys, TRUE);
+
+	if (fclose(out) || !ok) {
+		fprintf(stderr, "Error writing file '%s': %s\n", tmp_path, strerror(errno));
+		unlink(tmp_path);
+		g_free(tmp_path);
+		return -1;
+	}
+	int ret = rename(tmp_path, index_path);
+	if (ret) {
+		fprintf(stderr, "Error renaming '%s': %s\n", tmp_path, strerror(errno));
+	}
+	g_free(tmp_path);
+	return ret;
+}
+
+/* Replays every game of the PGN file once and stores, for each material
+ * signature, the games reaching it and the first ply they do */
+int material_index_build(const char *pgn_path, const char *index_path) {
+	struct stat source;
+	GError *error = NULL;
+	GMappedFile *mapped = g_mapped_file_new(pgn_path, FALSE, &error);
+	if (mapped == NULL || stat(pgn_path, &source)) {
+		fprintf(stderr, "Error opening file '%s': %s\n", pgn_path, error ? error->message : strerror(errno));
+		g_clear_error(&error);
+		if (mapped != NULL) {
+			g_mapped_file_unref(mapped);
+		}
+		return -1;
+	}
+
+	material_builder builder;
+	memset(&builder, 0, sizeof(builder));
+	builder.postings = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free_postings);
+
+	pgn_replay_callbacks callbacks = {
+			.game_start = builder_game_start,
+			.position = builder_position,
+	};
+	chess_game *game = game_new(ALLOC_GAMES);
+	pgn_replay(g_mapped_file_get_contents(mapped), g_mapped_file_get_length(mapped), game, &callbacks, &builder);
+	game_free(game);
+	g_mapped_file_unref(mapped);
+
+	int ret = write_index(&builder, &source, index_path);
+	g_hash_table_destroy(builder.postings);
+	return ret;
+}
+/* </Index building> */
+
+/* <Index queries> */
+material_index *material_index_open(const char *index_path) {
+	FILE *file = fopen(index_path, "rb");
+	if (file == NULL) {
+		return NULL;
+	}
+	material_index *index = calloc(1, sizeof(material_index));
+	index->file = file;
+	if (fread(&index->header, sizeof(material_index_header), 1, file) != 1 ||
+	    memcmp(index->header.magic, MATERIAL_INDEX_MAGIC, 4) ||
+	    index->header.version != MATERIAL_INDEX_VERSION) {
+		fprintf(stderr, "'%s' is not a material index\n", index_path);
+		material_index_close(index);
+		return NULL;
+	}
+	index->entries = malloc(index->header.n_signatures * sizeof(material_index_entry) + 1);
+	if (fread(index->entries, sizeof(material_index_entry), index->header.n_signatures, file) != index->header.n_signatures) {
+		fprintf(stderr, "Truncated material index '%s'\n", index_path);
+		material_index_close(index);
+		return NULL;
+	}
+	index->postings_start = ftell(file);
+	return index;
+}
+
+void material_index_close(material_index *index) {
+	if (index == NULL) {
+		return;
+	}
+	fclose(index->file);
+	free(index->entries);
+	free(index);
+}
+
+uint32_t material_index_games(material_index *index) {
+	return index->header.n_games;
+}
+
+static int compare_entry(const void *key, const void *member) {
+	material_signature signature = *(const material_signature *) key;
+	const material_index_entry *entry = member;
+	return signature < entry->signature ? -1 : signature > entry->signature;
+}
+
+/* Binary search of the signature then one read of its postings.
+ * *postings must be freed */
+size_t material_index_query(material_index *index, material_signature signature, material_posting **postings) {
+	*postings = NULL;
+	material_index_entry *entry = bsearch(&signature, index->entries, index->header.n_signatures,
+	                                      sizeof(material_index_entry), compare_entry);
+	if (entry == NULL) {
+		return 0;
+	}
+	*postings = malloc(entry->n_postings * sizeof(material_posting));
+	if (fseek(index->file, index->postings_start + (long) (entry->first_posting * sizeof(material_posting)), SEEK_SET) ||
+	    fread(*postings, sizeof(material_posting), entry->n_postings, index->file) != entry->n_postings) {
+		fprintf(stderr, "Error reading material index: %s\n", strerror(errno));
+		free(*postings);
+		*postings = NULL;
+		return 0;
+	}
+	return entry->n_postings;
+}
+
+static bool is_index_current(const char *pgn_path, material_index *index) {
+	struct stat source;
+	return !stat(pgn_path, &source) &&
+	       index->header.source_size == (uint64_t) source.st_size &&
+	       index->header.source_mtime == (int64_t) source.st_mtime;
+}
+
+static material_index *open_current_index(const char *pgn_path, const char *index_path) {
+	material_index *index = material_index_open(index_path);
+	if (index != NULL && is_index_current(pgn_path, index)) {
+		return index;
+	}
+	material_index_close(index);
+
+	printf("Indexing material of '%s'...\n", pgn_path);
+	struct timeval start, end, diff;
+	gettimeofday(&start, NULL);
+	if (material_index_build(pgn_path, index_path)) {
+		return NULL;
+	}
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+	index = material_index_open(index_path);
+	if (index != NULL) {
+		printf("Indexed %u games in %ld.%03lds\n", material_index_games(index), diff.tv_sec, diff.tv_usec / 1000);
+	}
+	return index;
+}
+
+static void print_postings(material_signature signature, material_posting *postings, size_t n) {
+	char spec[64];
+	material_signature_format(signature, spec, sizeof(spec));
+	for (size_t i = 0; i < n; i++) {
+		// game numbers as taken by -gamenum
+		printf("game %u ply %u %s\n", postings[i].game + 1, postings[i].ply, spec);
+	}
+}
+
+/* Lists the games of pgn_path reaching the material of spec with either
+ * colour, (re)building the index next to the file when missing or stale */
+int material_query(const char *pgn_path, const char *spec) {
+	material_signature signature;
+	if (material_signature_parse(spec, &signature)) {
+		fprintf(stderr, "Invalid material '%s', expected e.g. KRPvKR\n", spec);
+		return -1;
+	}
+
+	gchar *index_path = g_strconcat(pgn_path, MATERIAL_INDEX_SUFFIX, NULL);
+	material_index *index = open_current_index(pgn_path, index_path);
+	g_free(index_path);
+	if (index == NULL) {
+		return -1;
+	}
+
+	struct timeval start, end, diff;
+	gettimeofday(&start, NULL);
+	material_posting *postings, *swapped_postings = NULL;
+	size_t n = material_index_query(index, signature, &postings);
+	size_t n_swapped = 0;
+	material_signature swapped = material_signature_swap(signature);
+	if (swapped != signature) {
+		n_swapped = material_index_query(index, swapped, &swapped_postings);
+	}
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+
+	print_postings(signature, postings, n);
+	print_postings(swapped, swapped_postings, n_swapped);
+	printf("%zu of %u games in %.3fms\n", n + n_swapped, material_index_games(index),
+	       diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0);
+
+	free(postings);
+	free(swapped_postings);
+	material_index_close(index);
+	return 0;
+}
+/* </Index queries> */
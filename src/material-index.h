@@ -0,0 +1,36 @@
+#ifndef CAIRO_BOARD_MATERIAL_INDEX_H
+#define CAIRO_BOARD_MATERIAL_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cairo-board.h"
+
+/* Piece counts of both sides packed in 32 bits, white in the low half:
+ * pawns in 4 bits then knights, bishops, rooks and queens in 3 bits each.
+ * Counts above 7 (promotion orgies) are clamped */
+typedef uint32_t material_signature;
+
+/* First ply of a game (numbered from 0) with a given signature */
+typedef struct {
+	uint32_t game;
+	uint32_t ply;
+} material_posting;
+
+typedef struct material_index material_index;
+
+material_signature material_signature_of(chess_game *game);
+material_signature material_signature_swap(material_signature signature);
+int material_signature_parse(const char *spec, material_signature *signature);
+void material_signature_format(material_signature signature, char *buf, size_t size);
+
+int material_index_build(const char *pgn_path, const char *index_path);
+material_index *material_index_open(const char *index_path);
+void material_index_close(material_index *index);
+uint32_t material_index_games(material_index *index);
+size_t material_index_query(material_index *index, material_signature signature, material_posting **postings);
+
+int material_query(const char *pgn_path, const char *spec);
+
+#endif //CAIRO_BOARD_MATERIAL_INDEX_H
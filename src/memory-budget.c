@@ -0,0 +1,164 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory-budget.h"
+
+/* Share of the total budget given to each subsystem, in percent. With
+ * the default 16 MB the caches hold the ECO table and its search index
+ * (about 3.6 MB) and the listings the sort order of 1.4M games; the text
+ * views trim themselves by line count well before their shares */
+static const int budget_shares[MEM_SUBSYSTEMS] = {
+		[MEM_CHANNELS] = 20,
+		[MEM_CONSOLE] = 10,
+		[MEM_GAME_HISTORY] = 5,
+		[MEM_CACHES] = 30,
+		[MEM_LISTINGS] = 35
+};
+
+static const char *subsystem_names[MEM_SUBSYSTEMS] = {
+		[MEM_CHANNELS] = "channels",
+		[MEM_CONSOLE] = "console",
+		[MEM_GAME_HISTORY] = "game_history",
+		[MEM_CACHES] = "caches",
+		[MEM_LISTINGS] = "listings"
+};
+
+typedef struct {
+	size_t usage;
+	size_t peak;
+	size_t cap; // 0 means unlimited
+	unsigned long evictions;
+	bool warned;
+	mem_evict_function evict;
+} mem_account;
+
+static mem_account accounts[MEM_SUBSYSTEMS];
+static pthread_mutex_t accounts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Splits total_kb between the subsystems, 0 disables all caps */
+void mem_budget_init(size_t total_kb) {
+	pthread_mutex_lock(&accounts_lock);
+	for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+		accounts[i].cap = total_kb * 1024 / 100 * budget_shares[i];
+	}
+	pthread_mutex_unlock(&accounts_lock);
+}
+
+/* May be called from any thread, bytes is negative when memory is released */
+void mem_budget_account(mem_subsystem subsystem, long bytes) {
+	pthread_mutex_lock(&accounts_lock);
+	mem_account *account = &accounts[subsystem];
+	if (bytes < 0 && (size_t) -bytes > account->usage) {
+		account->usage = 0;
+	}
+	else {
+		account->usage += bytes;
+	}
+	if (account->usage > account->peak) {
+		account->peak = account->usage;
+	}
+	pthread_mutex_unlock(&accounts_lock);
+}
+
+size_t mem_budget_usage(mem_subsystem subsystem) {
+	pthread_mutex_lock(&accounts_lock);
+	size_t usage = accounts[subsystem].usage;
+	pthread_mutex_unlock(&accounts_lock);
+	return usage;
+}
+
+void mem_budget_set_cap(mem_subsystem subsystem, size_t bytes) {
+	pthread_mutex_lock(&accounts_lock);
+	accounts[subsystem].cap = bytes;
+	pthread_mutex_unlock(&accounts_lock);
+}
+
+bool mem_budget_over_cap(mem_subsystem subsystem) {
+	pthread_mutex_lock(&accounts_lock);
+	bool over = accounts[subsystem].cap && accounts[subsystem].usage > accounts[subsystem].cap;
+	pthread_mutex_unlock(&accounts_lock);
+	return over;
+}
+
+void mem_budget_set_evictor(mem_subsystem subsystem, mem_evict_function evict) {
+	pthread_mutex_lock(&accounts_lock);
+	accounts[subsystem].evict = evict;
+	pthread_mutex_unlock(&accounts_lock);
+}
+
+/* Evicts least recently used entries until the subsystem fits its cap.
+ * Runs the evictor unlocked: it is expected to account what it frees.
+ * Subsystems that can't evict only get a warning the first time */
+void mem_budget_enforce(mem_subsystem subsystem) {
+	pthread_mutex_lock(&accounts_lock);
+	mem_evict_function evict = accounts[subsystem].evict;
+	pthread_mutex_unlock(&accounts_lock);
+
+	while (mem_budget_over_cap(subsystem)) {
+		if (evict == NULL || !evict()) {
+			pthread_mutex_lock(&accounts_lock);
+			if (!accounts[subsystem].warned) {
+				accounts[subsystem].warned = true;
+				fprintf(stderr, "Memory budget: %s uses %zu bytes, over its %zu bytes cap\n",
+				        subsystem_names[subsystem], accounts[subsystem].usage, accounts[subsystem].cap);
+			}
+			pthread_mutex_unlock(&accounts_lock);
+			return;
+		}
+		pthread_mutex_lock(&accounts_lock);
+		accounts[subsystem].evictions++;
+		pthread_mutex_unlock(&accounts_lock);
+	}
+}
+
+/* Resident set size of the whole process from /proc, in kB */
+static long resident_kb(void) {
+	FILE *status = fopen("/proc/self/status", "r");
+	if (status == NULL) {
+		return -1;
+	}
+	char line[256];
+	long rss = -1;
+	while (fgets(line, sizeof(line), status)) {
+		if (!strncmp(line, "VmRSS:", 6)) {
+			rss = atol(line + 6);
+			break;
+		}
+	}
+	fclose(status);
+	return rss;
+}
+
+void mem_budget_report(FILE *out) {
+	mem_account snapshot[MEM_SUBSYSTEMS];
+	pthread_mutex_lock(&accounts_lock);
+	memcpy(snapshot, accounts, sizeof(snapshot));
+	pthread_mutex_unlock(&accounts_lock);
+
+	fprintf(out, "Memory usage (resident %ld kB):\n", resident_kb());
+	fprintf(out, "%-14s %12s %12s %12s %10s\n", "subsystem", "bytes", "peak", "cap", "evictions");
+	for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+		fprintf(out, "%-14s %12zu %12zu %12zu %10lu\n", subsystem_names[i],
+		        snapshot[i].usage, snapshot[i].peak, snapshot[i].cap, snapshot[i].evictions);
+	}
+	fflush(out);
+}
+
+/* Same as above as a single JSON line, returns its length */
+int mem_budget_report_json(char *buf, size_t size) {
+	mem_account snapshot[MEM_SUBSYSTEMS];
+	pthread_mutex_lock(&accounts_lock);
+	memcpy(snapshot, accounts, sizeof(snapshot));
+	pthread_mutex_unlock(&accounts_lock);
+
+	int len = snprintf(buf, size, "{\"type\":\"memory\",\"resident_kb\":%ld", resident_kb());
+	for (int i = 0; i < MEM_SUBSYSTEMS && len < (int) size; i++) {
+		len += snprintf(buf + len, size - len, ",\"%s\":{\"bytes\":%zu,\"peak\":%zu,\"cap\":%zu,\"evictions\":%lu}",
+		                subsystem_names[i], snapshot[i].usage, snapshot[i].peak, snapshot[i].cap, snapshot[i].evictions);
+	}
+	if (len < (int) size) {
+		len += snprintf(buf + len, size - len, "}\n");
+	}
+	return len;
+}
@@ -0,0 +1,30 @@
+#ifndef CAIRO_BOARD_MEMORY_BUDGET_H
+#define CAIRO_BOARD_MEMORY_BUDGET_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef enum {
+	MEM_CHANNELS = 0,
+	MEM_CONSOLE,
+	MEM_GAME_HISTORY,
+	MEM_CACHES,
+	MEM_LISTINGS,
+	MEM_SUBSYSTEMS
+} mem_subsystem;
+
+/* Frees the least recently used entry of a subsystem,
+ * returns false when there is nothing left to evict */
+typedef bool (*mem_evict_function)(void);
+
+void mem_budget_init(size_t total_kb);
+void mem_budget_account(mem_subsystem subsystem, long bytes);
+size_t mem_budget_usage(mem_subsystem subsystem);
+void mem_budget_set_cap(mem_subsystem subsystem, size_t bytes);
+bool mem_budget_over_cap(mem_subsystem subsystem);
+void mem_budget_set_evictor(mem_subsystem subsystem, mem_evict_function evict);
+void mem_budget_enforce(mem_subsystem subsystem);
+void mem_budget_report(FILE *out);
+int mem_budget_report_json(char *buf, size_t size);
+
+#endif //CAIRO_BOARD_MEMORY_BUDGET_H
@@ -0,0 +1,615 @@
+/* Stand-in UCI engine for benchmarking the UCI adapter without a real engine.
+ *
+ * It answers the handshake and, from "go" until "stop" or the limits of the
+ * go command (movetime, depth, or a share of wtime/btime), writes info lines
+ * at a fixed rate: either replayed from a file of recorded engine output or
+ * synthesised with legal principal variations of a chosen length from the
+ * current position. On quit it writes the number of searches and info
+ * lines sent, to compare with the lines cairo-board counted with -debug.
+ *
+ * Options, also read from the environment because cairo-board starts
+ * engines without arguments:
+ *   --rate N       info lines per second, 0 for as fast as possible (MOCK_UCI_RATE, default 1000)
+ *   --pv N         moves per synthesised PV (MOCK_UCI_PV, default 12)
+ *   --pv-every N   new PV every N lines, the others repeat it (MOCK_UCI_PV_EVERY, default 1)
+ *   --replay FILE  replay the info lines of FILE in a loop (MOCK_UCI_REPLAY)
+ *   --stats FILE   append the totals to FILE instead of stderr, which cairo-board
+ *                  doesn't read (MOCK_UCI_STATS)
+ */
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MOCK_LINE_MAX 8192
+#define MOCK_MAX_MOVES 256
+#define MOCK_MAX_PV 128
+#define MOCK_BATCH_MAX 1024
+// synthesised lines per depth reported
+#define MOCK_LINES_PER_DEPTH 64
+// of the remaining clock time spent on a move when the go command has no movestogo
+#define MOCK_MOVES_TO_GO 30
+
+static long rate = 1000;
+static int pv_length = 12;
+static long pv_every = 1;
+static const char *replay_path = NULL;
+static const char *stats_path = NULL;
+
+static char **replay_lines = NULL;
+static size_t n_replay_lines = 0;
+
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t search_thread;
+static bool searching = false;
+static volatile bool stop_requested = false;
+// totals of the searches finished, under output_lock
+static unsigned long n_searches = 0;
+static unsigned long long total_sent = 0;
+
+/* From the go command, 0 for no limit: then only stop ends the search */
+typedef struct {
+	int64_t movetime_us;
+	int depth;
+} search_limits;
+
+static search_limits limits; // of the search running, written before it starts
+
+/* <Board> squares are 0 (a1) to 63 (h8), pieces are FEN letters */
+typedef struct {
+	char squares[64];
+	bool black_to_move;
+	int en_passant; // square a pawn can take on, -1 if none
+} mock_board;
+
+static mock_board position;
+
+static const int knight_steps[8][2] = {{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}};
+static const int king_steps[8][2] = {{1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}};
+static const int rook_steps[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+static const int bishop_steps[4][2] = {{1, 1}, {-1, 1}, {-1, -1}, {1, -1}};
+
+static inline bool is_white(char piece) {
+	return piece >= 'A' && piece <= 'Z';
+}
+
+static inline bool is_own(const mock_board *board, char piece) {
+	return piece != '.' && is_white(piece) != board->black_to_move;
+}
+
+static inline int square_at(int col, int row) {
+	return col < 0 || col > 7 || row < 0 || row > 7 ? -1 : row * 8 + col;
+}
+
+static void board_from_fen(mock_board *board, const char *fen) {
+	memset(board->squares, '.', 64);
+	int col = 0, row = 7;
+	const char *c = fen;
+	for (; *c && *c != ' '; c++) {
+		if (*c == '/') {
+			col = 0;
+			row--;
+		}
+		else if (isdigit((unsigned char) *c)) {
+			col += *c - '0';
+		}
+		else if (square_at(col, row) >= 0) {
+			board->squares[square_at(col, row)] = *c;
+			col++;
+		}
+	}
+	while (*c == ' ') {
+		c++;
+	}
+	board->black_to_move = *c == 'b';
+	// skip the side and castling fields
+	for (int field = 0; field < 2 && *c; field++) {
+		while (*c && *c != ' ') {
+			c++;
+		}
+		while (*c == ' ') {
+			c++;
+		}
+	}
+	board->en_passant = c[0] >= 'a' && c[0] <= 'h' && c[1] >= '1' && c[1] <= '8' ? square_at(c[0] - 'a', c[1] - '1') : -1;
+}
+
+static bool is_attacked(const mock_board *board, int square, bool by_white) {
+	int col = square % 8, row = square / 8;
+	char pawn = by_white ? 'P' : 'p', knight = by_white ? 'N' : 'n', king = by_white ? 'K' : 'k';
+	char bishop = by_white ? 'B' : 'b', rook = by_white ? 'R' : 'r', queen = by_white ? 'Q' : 'q';
+
+	int pawn_row = by_white ? row - 1 : row + 1;
+	for (int dc = -1; dc <= 1; dc += 2) {
+		int from = square_at(col + dc, pawn_row);
+		if (from >= 0 && board->squares[from] == pawn) {
+			return true;
+		}
+	}
+	for (int i = 0; i < 8; i++) {
+		int from = square_at(col + knight_steps[i][0], row + knight_steps[i][1]);
+		if (from >= 0 && board->squares[from] == knight) {
+			return true;
+		}
+		from = square_at(col + king_steps[i][0], row + king_steps[i][1]);
+		if (from >= 0 && board->squares[from] == king) {
+			return true;
+		}
+	}
+	for (int i = 0; i < 4; i++) {
+		for (int step = 1; ; step++) {
+			int from = square_at(col + rook_steps[i][0] * step, row + rook_steps[i][1] * step);
+			if (from < 0) {
+				break;
+			}
+			char piece = board->squares[from];
+			if (piece == rook || piece == queen) {
+				return true;
+			}
+			if (piece != '.') {
+				break;
+			}
+		}
+		for (int step = 1; ; step++) {
+			int from = square_at(col + bishop_steps[i][0] * step, row + bishop_steps[i][1] * step);
+			if (from < 0) {
+				break;
+			}
+			char piece = board->squares[from];
+			if (piece == bishop || piece == queen) {
+				return true;
+			}
+			if (piece != '.') {
+				break;
+			}
+		}
+	}
+	return false;
+}
+
+/* Plays a move in UCI notation, e.g. "e2e4" or "e7e8q" */
+static void board_play(mock_board *board, const char *move) {
+	int from = square_at(move[0] - 'a', move[1] - '1');
+	int to = square_at(move[2] - 'a', move[3] - '1');
+	if (from < 0 || to < 0) {
+		return;
+	}
+	char piece = board->squares[from];
+	char kind = (char) tolower(piece);
+
+	if (kind == 'p' && to == board->en_passant && board->squares[to] == '.') {
+		board->squares[square_at(to % 8, from / 8)] = '.';
+	}
+	if (kind == 'k' && abs(to % 8 - from % 8) == 2) {
+		int rook_from = to % 8 == 6 ? from + 3 : from - 4;
+		int rook_to = to % 8 == 6 ? from + 1 : from - 1;
+		board->squares[rook_to] = board->squares[rook_from];
+		board->squares[rook_from] = '.';
+	}
+	board->en_passant = kind == 'p' && abs(to - from) == 16 ? (from + to) / 2 : -1;
+	if (kind == 'p' && move[4] != '\0' && move[4] != ' ') {
+		piece = is_white(piece) ? (char) toupper(move[4]) : (char) tolower(move[4]);
+	}
+	board->squares[to] = piece;
+	board->squares[from] = '.';
+	board->black_to_move = !board->black_to_move;
+}
+
+static int add_move(const mock_board *board, char moves[][6], int n, int from, int to, char promo) {
+	if (n == MOCK_MAX_MOVES || tolower(board->squares[to]) == 'k') {
+		return n;
+	}
+	char *move = moves[n];
+	move[0] = (char) ('a' + from % 8);
+	move[1] = (char) ('1' + from / 8);
+	move[2] = (char) ('a' + to % 8);
+	move[3] = (char) ('1' + to / 8);
+	move[4] = promo;
+	move[5] = '\0';
+	return n + 1;
+}
+
+/* Whether our king is safe after the move */
+static bool is_legal(const mock_board *board, const char *move) {
+	mock_board after = *board;
+	board_play(&after, move);
+	char king = board->black_to_move ? 'k' : 'K';
+	const char *square = memchr(after.squares, king, 64);
+	return square == NULL || !is_attacked(&after, (int) (square - after.squares), board->black_to_move);
+}
+
+static int add_slides(const mock_board *board, char moves[][6], int n, int from, const int steps[][2], int n_steps, int max_step) {
+	for (int i = 0; i < n_steps; i++) {
+		for (int step = 1; step <= max_step; step++) {
+			int to = square_at(from % 8 + steps[i][0] * step, from / 8 + steps[i][1] * step);
+			if (to < 0 || is_own(board, board->squares[to])) {
+				break;
+			}
+			n = add_move(board, moves, n, from, to, '\0');
+			if (board->squares[to] != '.') {
+				break;
+			}
+		}
+	}
+	return n;
+}
+
+/* Pseudo legal moves, castling aside, see is_legal() */
+static int generate_moves(const mock_board *board, char moves[][6]) {
+	int n = 0;
+	int forward = board->black_to_move ? -1 : 1;
+	int start_row = board->black_to_move ? 6 : 1;
+	int last_row = board->black_to_move ? 0 : 7;
+
+	for (int from = 0; from < 64; from++) {
+		char piece = board->squares[from];
+		if (!is_own(board, piece)) {
+			continue;
+		}
+		int col = from % 8, row = from / 8;
+		switch (tolower(piece)) {
+			case 'p': {
+				int to = square_at(col, row + forward);
+				if (to >= 0 && board->squares[to] == '.') {
+					n = add_move(board, moves, n, from, to, to / 8 == last_row ? 'q' : '\0');
+					int double_push = square_at(col, row + 2 * forward);
+					if (row == start_row && board->squares[double_push] == '.') {
+						n = add_move(board, moves, n, from, double_push, '\0');
+					}
+				}
+				for (int dc = -1; dc <= 1; dc += 2) {
+					to = square_at(col + dc, row + forward);
+					if (to >= 0 && ((board->squares[to] != '.' && !is_own(board, board->squares[to])) || to == board->en_passant)) {
+						n = add_move(board, moves, n, from, to, to / 8 == last_row ? 'q' : '\0');
+					}
+				}
+				break;
+			}
+			case 'n':
+				n = add_slides(board, moves, n, from, knight_steps, 8, 1);
+				break;
+			case 'b':
+				n = add_slides(board, moves, n, from, bishop_steps, 4, 7);
+				break;
+			case 'r':
+				n = add_slides(board, moves, n, from, rook_steps, 4, 7);
+				break;
+			case 'q':
+				n = add_slides(board, moves, n, from, rook_steps, 4, 7);
+				n = add_slides(board, moves, n, from, bishop_steps, 4, 7);
+				break;
+			case 'k':
+				n = add_slides(board, moves, n, from, king_steps, 8, 1);
+				break;
+			default:
+				break;
+		}
+	}
+	return n;
+}
+/* </Board> */
+
+static uint32_t random_state = 2463534242u;
+
+static uint32_t next_random(void) {
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+/* Random walk of legal moves from the searched position */
+static void synthesise_pv(const mock_board *root, char *pv, size_t size) {
+	mock_board board = *root;
+	char moves[MOCK_MAX_MOVES][6];
+	size_t len = 0;
+	pv[0] = '\0';
+	for (int ply = 0; ply < pv_length; ply++) {
+		int n = generate_moves(&board, moves);
+		// only the picked move is checked, illegal picks are dropped until one fits
+		const char *move = NULL;
+		while (n > 0) {
+			int pick = (int) (next_random() % (uint32_t) n);
+			if (is_legal(&board, moves[pick])) {
+				move = moves[pick];
+				break;
+			}
+			memcpy(moves[pick], moves[--n], sizeof(moves[pick]));
+		}
+		if (move == NULL) {
+			break;
+		}
+		int written = snprintf(pv + len, size - len, "%s%s", ply ? " " : "", move);
+		if (written < 0 || (size_t) written >= size - len) {
+			break;
+		}
+		len += (size_t) written;
+		board_play(&board, move);
+	}
+}
+
+static void write_output(const char *text) {
+	pthread_mutex_lock(&output_lock);
+	fputs(text, stdout);
+	fflush(stdout);
+	pthread_mutex_unlock(&output_lock);
+}
+
+static int64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *search_function(void *data) {
+	const search_limits *search = data;
+	mock_board root = position;
+	char pv[MOCK_LINE_MAX / 2];
+	char first_move[6] = "0000";
+	char *batch = malloc(MOCK_BATCH_MAX * MOCK_LINE_MAX);
+	uint64_t sent = 0;
+	int64_t start = now_us();
+	size_t replay_index = 0;
+
+	uint64_t max_lines = search->depth > 0 ? (uint64_t) search->depth * MOCK_LINES_PER_DEPTH : UINT64_MAX;
+
+	pv[0] = '\0';
+	while (!stop_requested && sent < max_lines) {
+		int64_t elapsed = now_us() - start;
+		if (search->movetime_us > 0 && elapsed >= search->movetime_us) {
+			break;
+		}
+		uint64_t due = rate > 0 ? (uint64_t) (elapsed * rate / 1000000) : sent + MOCK_BATCH_MAX;
+		if (due > max_lines) {
+			due = max_lines;
+		}
+		if (due <= sent) {
+			usleep(500);
+			continue;
+		}
+		if (due - sent > MOCK_BATCH_MAX) {
+			due = sent + MOCK_BATCH_MAX;
+		}
+
+		size_t len = 0;
+		for (; sent < due; sent++) {
+			if (n_replay_lines > 0) {
+				const char *line = replay_lines[replay_index++ % n_replay_lines];
+				len += (size_t) snprintf(batch + len, MOCK_LINE_MAX, "%s\n", line);
+				const char *line_pv = strstr(line, " pv ");
+				if (line_pv != NULL) {
+					sscanf(line_pv + 4, "%5s", first_move);
+				}
+				continue;
+			}
+			if (sent % (uint64_t) pv_every == 0) {
+				synthesise_pv(&root, pv, sizeof(pv));
+				sscanf(pv, "%5s", first_move);
+			}
+			int depth = 1 + (int) (sent / MOCK_LINES_PER_DEPTH);
+			long elapsed_ms = (long) (elapsed / 1000);
+			uint64_t nodes = (sent + 1) * 1000;
+			len += (size_t) snprintf(batch + len, MOCK_LINE_MAX,
+			                         "info depth %d seldepth %d multipv 1 score cp %d nodes %llu nps %llu time %ld pv %s\n",
+			                         depth, depth + 4, (int) (next_random() % 200) - 100, (unsigned long long) nodes,
+			                         (unsigned long long) (elapsed_ms > 0 ? nodes * 1000 / (uint64_t) elapsed_ms : nodes),
+			                         elapsed_ms, pv);
+		}
+		pthread_mutex_lock(&output_lock);
+		fwrite(batch, 1, len, stdout);
+		fflush(stdout);
+		pthread_mutex_unlock(&output_lock);
+	}
+
+	char done[32];
+	snprintf(done, sizeof(done), "bestmove %s\n", first_move);
+	pthread_mutex_lock(&output_lock);
+	fputs(done, stdout);
+	fflush(stdout);
+	n_searches++;
+	total_sent += sent;
+	pthread_mutex_unlock(&output_lock);
+	free(batch);
+	return NULL;
+}
+
+static void stop_search(void) {
+	pthread_mutex_lock(&search_lock);
+	if (searching) {
+		stop_requested = true;
+		pthread_join(search_thread, NULL);
+		searching = false;
+	}
+	pthread_mutex_unlock(&search_lock);
+}
+
+static long go_argument(const char *args, const char *name) {
+	size_t len = strlen(name);
+	for (const char *found = strstr(args, name); found != NULL; found = strstr(found + len, name)) {
+		bool word = (found == args || found[-1] == ' ') && found[len] == ' ';
+		if (word) {
+			return atol(found + len + 1);
+		}
+	}
+	return 0;
+}
+
+/* "go infinite" and "go ponder" run until stop, as do searches without
+ * limits. On the clock a move gets its share of the time left plus the
+ * increment */
+static void parse_go(const char *args, search_limits *search) {
+	memset(search, 0, sizeof(*search));
+	if (strstr(args, "infinite") != NULL || strstr(args, "ponder") != NULL) {
+		return;
+	}
+	search->depth = (int) go_argument(args, "depth");
+	long movetime = go_argument(args, "movetime");
+	long time_left = go_argument(args, position.black_to_move ? "btime" : "wtime");
+	if (movetime <= 0 && time_left > 0) {
+		long moves_to_go = go_argument(args, "movestogo");
+		long increment = go_argument(args, position.black_to_move ? "binc" : "winc");
+		movetime = time_left / (moves_to_go > 0 ? moves_to_go : MOCK_MOVES_TO_GO) + increment;
+		if (movetime >= time_left) {
+			movetime = time_left / 2;
+		}
+		if (movetime < 1) {
+			movetime = 1;
+		}
+	}
+	search->movetime_us = (int64_t) movetime * 1000;
+}
+
+static void start_search(const char *args) {
+	stop_search();
+	pthread_mutex_lock(&search_lock);
+	stop_requested = false;
+	parse_go(args, &limits);
+	searching = pthread_create(&search_thread, NULL, search_function, &limits) == 0;
+	pthread_mutex_unlock(&search_lock);
+}
+
+static void set_position(char *args) {
+	char *moves = strstr(args, " moves ");
+	if (moves != NULL) {
+		*moves = '\0';
+		moves += strlen(" moves ");
+	}
+	if (!strncmp(args, "fen ", 4)) {
+		board_from_fen(&position, args + 4);
+	}
+	else {
+		board_from_fen(&position, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+	}
+	char *save = NULL;
+	for (char *move = moves ? strtok_r(moves, " \n", &save) : NULL; move != NULL; move = strtok_r(NULL, " \n", &save)) {
+		board_play(&position, move);
+	}
+}
+
+static int load_replay(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("Failed to open replay file");
+		return -1;
+	}
+	char line[MOCK_LINE_MAX];
+	size_t alloc = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strncmp(line, "info ", 5)) {
+			continue;
+		}
+		if (n_replay_lines == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			replay_lines = realloc(replay_lines, alloc * sizeof(char *));
+		}
+		replay_lines[n_replay_lines++] = strdup(line);
+	}
+	fclose(f);
+	if (n_replay_lines == 0) {
+		fprintf(stderr, "No info lines in '%s'\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static void read_options(int argc, char **argv) {
+	if (getenv("MOCK_UCI_RATE")) {
+		rate = atol(getenv("MOCK_UCI_RATE"));
+	}
+	if (getenv("MOCK_UCI_PV")) {
+		pv_length = atoi(getenv("MOCK_UCI_PV"));
+	}
+	if (getenv("MOCK_UCI_PV_EVERY")) {
+		pv_every = atol(getenv("MOCK_UCI_PV_EVERY"));
+	}
+	replay_path = getenv("MOCK_UCI_REPLAY");
+	stats_path = getenv("MOCK_UCI_STATS");
+
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (!strcmp(argv[i], "--rate")) {
+			rate = atol(argv[i + 1]);
+		}
+		else if (!strcmp(argv[i], "--pv")) {
+			pv_length = atoi(argv[i + 1]);
+		}
+		else if (!strcmp(argv[i], "--pv-every")) {
+			pv_every = atol(argv[i + 1]);
+		}
+		else if (!strcmp(argv[i], "--replay")) {
+			replay_path = argv[i + 1];
+		}
+		else if (!strcmp(argv[i], "--stats")) {
+			stats_path = argv[i + 1];
+		}
+		else {
+			fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+		}
+	}
+	if (pv_length < 1 || pv_length > MOCK_MAX_PV) {
+		pv_length = 12;
+	}
+	if (pv_every < 1) {
+		pv_every = 1;
+	}
+}
+
+static void print_stats(void) {
+	FILE *out = stats_path != NULL ? fopen(stats_path, "a") : stderr;
+	if (out == NULL) {
+		perror("Failed to open stats file");
+		return;
+	}
+	fprintf(out, "Mock UCI engine %d: %llu info lines sent in %lu searches\n", (int) getpid(), total_sent, n_searches);
+	if (out != stderr) {
+		fclose(out);
+	}
+}
+
+int main(int argc, char **argv) {
+	read_options(argc, argv);
+	if (replay_path != NULL && load_replay(replay_path)) {
+		return 1;
+	}
+	random_state ^= (uint32_t) getpid();
+	board_from_fen(&position, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+
+	char line[MOCK_LINE_MAX];
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!strcmp(line, "uci")) {
+			write_output("id name Mock UCI engine\n"
+			             "id author cairo-board\n"
+			             "option name Threads type spin default 1 min 1 max 512\n"
+			             "option name Hash type spin default 16 min 1 max 65536\n"
+			             "option name Ponder type check default false\n"
+			             "uciok\n");
+		}
+		else if (!strcmp(line, "isready")) {
+			write_output("readyok\n");
+		}
+		else if (!strncmp(line, "position ", 9)) {
+			stop_search();
+			set_position(line + 9);
+		}
+		else if (!strncmp(line, "go", 2)) {
+			start_search(line + 2);
+		}
+		else if (!strcmp(line, "stop") || !strcmp(line, "ponderhit")) {
+			stop_search();
+		}
+		else if (!strcmp(line, "quit")) {
+			break;
+		}
+		// ucinewgame, setoption and anything else need no answer
+	}
+	stop_search();
+	print_stats();
+	return 0;
+}
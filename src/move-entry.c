@@ -0,0 +1,330 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gtk/gtk.h>
+
+#include "move-entry.h"
+#include "cairo-board.h"
+#include "chess-backend.h"
+
+extern int debug_flag;
+#ifndef debug
+#define debug(format, ...) if (debug_flag) fprintf(stdout, "%s:%d " format, __FUNCTION__, __LINE__, ##__VA_ARGS__)
+#endif
+
+#define MOVE_ENTRY_MAX_MOVES 256 // 218 is the most legal moves known, promotions count 4 times here
+#define MOVE_ENTRY_MAX_SHOWN 16
+#define MOVE_KEY_SIZE 8
+#define MOVE_ENTRY_AUTO_SUBMIT_LENGTH 2 // "Nf", "e4"
+#define MOVE_ENTRY_COORD_LENGTH 4 // "e2e4"
+
+enum {
+	MOVE_COLUMN_SAN = 0,
+	MOVE_N_COLUMNS
+};
+
+typedef struct {
+	int move[4];
+	int promo_type; // -1 unless promoting
+	char san[SAN_MOVE_SIZE]; // without check marks, they don't help telling moves apart
+	char key[MOVE_KEY_SIZE]; // the SAN without x, = or -, see normalise_move_input()
+	char coord_key[MOVE_KEY_SIZE]; // e2e4, e7e8q
+} move_candidate;
+
+static GtkWidget *move_entry = NULL;
+static bool submit_pending = false; // keys typed until the move is played don't count
+
+/* <Legal moves> */
+static const int promotion_types[] = {W_QUEEN, W_ROOK, W_BISHOP, W_KNIGHT};
+
+/* Drops what people type or not in SAN: captures, checks, annotations,
+ * separators. Castling may be typed with zeros and a piece letter in
+ * lower case, except b which is a file */
+static void normalise_move_input(const char *input, char key[MOVE_KEY_SIZE]) {
+	int len = 0;
+	for (const char *c = input; *c && len < MOVE_KEY_SIZE - 1; c++) {
+		if (strchr(" \t:x+#=-!?", *c)) {
+			continue;
+		}
+		char k = *c;
+		if (k == '0' || k == 'o') {
+			k = 'O';
+		}
+		else if (len == 0 && strchr("nrqk", k)) {
+			k = (char) toupper(k);
+		}
+		key[len++] = k;
+	}
+	key[len] = '\0';
+}
+
+/* Like move_piece() builds it, but disambiguating against the legal moves
+ * only, which is what SAN asks for */
+static void candidate_san(chess_game *game, move_candidate *candidates, int n, move_candidate *candidate) {
+	chess_piece *piece = game->squares[candidate->move[0]][candidate->move[1]].piece;
+	int col = candidate->move[2];
+	int row = candidate->move[3];
+	char *san = candidate->san;
+	int len = 0;
+
+	if ((piece->type == W_KING || piece->type == B_KING) && abs(col - piece->pos.column) == 2) {
+		strcpy(san, col > piece->pos.column ? "O-O" : "O-O-O");
+		return;
+	}
+
+	bool capture = game->squares[col][row].piece != NULL || is_move_en_passant(game, piece, col, row);
+	char ptype = type_to_char(piece->type);
+	if (ptype) {
+		san[len++] = ptype;
+		bool same_col = false, same_row = false, ambiguous = false;
+		for (int i = 0; i < n; i++) {
+			int *other = candidates[i].move;
+			chess_piece *competitor = game->squares[other[0]][other[1]].piece;
+			if (competitor == piece || competitor->type != piece->type || other[2] != col || other[3] != row) {
+				continue;
+			}
+			ambiguous = true;
+			same_col |= other[0] == piece->pos.column;
+			same_row |= other[1] == piece->pos.row;
+		}
+		if (ambiguous && (!same_col || same_row)) {
+			san[len++] = (char) ('a' + piece->pos.column);
+		}
+		if (same_col) {
+			san[len++] = (char) ('1' + piece->pos.row);
+		}
+	}
+	else if (capture) {
+		san[len++] = (char) ('a' + piece->pos.column);
+	}
+	if (capture) {
+		san[len++] = 'x';
+	}
+	san[len++] = (char) ('a' + col);
+	san[len++] = (char) ('1' + row);
+	if (candidate->promo_type >= 0) {
+		san[len++] = '=';
+		san[len++] = type_to_char(candidate->promo_type);
+	}
+	san[len] = '\0';
+}
+
+/* The moves the user may play right now, none when it isn't our turn */
+static int legal_move_candidates(chess_game *game, move_candidate *candidates, int max) {
+	chess_piece *set = game->whose_turn ? game->black_set : game->white_set;
+	int n = 0;
+
+	for (int i = 0; i < 16; i++) {
+		chess_piece *piece = &set[i];
+		if (piece->dead || !can_i_move_piece(piece)) {
+			continue;
+		}
+		int possible_moves[64][2];
+		int count = get_possible_moves(game, piece, possible_moves, 1);
+		for (int j = 0; j < count; j++) {
+			int col = possible_moves[j][0];
+			int row = possible_moves[j][1];
+			if (!is_move_legal(game, piece, col, row)) {
+				continue;
+			}
+			bool promotion = (piece->type == W_PAWN && row == 7) || (piece->type == B_PAWN && row == 0);
+			for (int k = 0; k < (promotion ? 4 : 1) && n < max; k++) {
+				move_candidate *candidate = &candidates[n++];
+				candidate->move[0] = piece->pos.column;
+				candidate->move[1] = piece->pos.row;
+				candidate->move[2] = col;
+				candidate->move[3] = row;
+				candidate->promo_type = promotion ? promotion_types[k] : -1;
+			}
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		move_candidate *candidate = &candidates[i];
+		candidate_san(game, candidates, n, candidate);
+		normalise_move_input(candidate->san, candidate->key);
+		snprintf(candidate->coord_key, MOVE_KEY_SIZE, "%c%c%c%c%c", 'a' + candidate->move[0], '1' + candidate->move[1],
+		         'a' + candidate->move[2], '1' + candidate->move[3],
+		         candidate->promo_type >= 0 ? tolower(type_to_char(candidate->promo_type)) : '\0');
+	}
+	return n;
+}
+
+/* The promotion piece, last in the keys, may be typed in either case */
+static bool key_has_prefix(const char *candidate_key, bool promotion, const char *key) {
+	for (; *key; candidate_key++, key++) {
+		if (*candidate_key == *key) {
+			continue;
+		}
+		if (!promotion || candidate_key[0] == '\0' || candidate_key[1] != '\0' || tolower(*candidate_key) != tolower(*key)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Indexes of the candidates the input is a prefix of, in SAN or in
+ * coordinates. by_san tells whether all of them matched on their SAN */
+static int match_candidates(move_candidate *candidates, int n, const char *key, int *matches, bool *by_san) {
+	int n_matches = 0;
+	*by_san = true;
+	for (int i = 0; i < n; i++) {
+		bool promotion = candidates[i].promo_type >= 0;
+		if (key_has_prefix(candidates[i].key, promotion, key)) {
+			matches[n_matches++] = i;
+		}
+		else if (key_has_prefix(candidates[i].coord_key, promotion, key)) {
+			matches[n_matches++] = i;
+			*by_san = false;
+		}
+	}
+	return n_matches;
+}
+/* </Legal moves> */
+
+/* <Submitting> */
+typedef struct {
+	int move[4];
+	int promo_type;
+} keyboard_move;
+
+/* Runs with the GDK lock held, like a click on the board. The position
+ * may have changed since the move was typed */
+static gboolean keyboard_move_idle(gpointer data) {
+	keyboard_move *typed = (keyboard_move *) data;
+	chess_piece *piece = main_game->squares[typed->move[0]][typed->move[1]].piece;
+
+	if (piece == NULL || piece->colour != main_game->whose_turn || !can_i_move_piece(piece) ||
+	    !is_move_legal(main_game, piece, typed->move[2], typed->move[3])) {
+		debug("Typed move is no longer legal\n");
+		gtk_widget_error_bell(move_entry);
+	}
+	else {
+		preset_promotion_type = typed->promo_type;
+		auto_move(piece, typed->move[2], typed->move[3], 1, MANUAL_SOURCE, false);
+		preset_promotion_type = -1;
+	}
+	gtk_entry_set_text(GTK_ENTRY(move_entry), "");
+	submit_pending = false;
+	free(typed);
+	return FALSE;
+}
+
+/* Deferred: the entry can't be cleared from its own signal handlers */
+static void submit_candidate(move_candidate *candidate) {
+	debug("Submitting typed move %s\n", candidate->san);
+	submit_pending = true;
+	keyboard_move *typed = malloc(sizeof(keyboard_move));
+	memcpy(typed->move, candidate->move, sizeof(typed->move));
+	typed->promo_type = candidate->promo_type;
+	gdk_threads_add_idle(keyboard_move_idle, typed);
+}
+/* </Submitting> */
+
+/* <Entry> */
+static gboolean match_everything(GtkEntryCompletion *completion, const gchar *key, GtkTreeIter *iter, gpointer data) {
+	return TRUE;
+}
+
+/* Lists the moves still matching, and plays the move as soon as only one
+ * is left: "Nf" when Nf3 is the only knight move to the f file. Moves
+ * typed in coordinates wait for the destination square */
+static void on_move_entry_changed(GtkEditable *editable, gpointer data) {
+	GtkListStore *store = GTK_LIST_STORE(data);
+	char key[MOVE_KEY_SIZE];
+	normalise_move_input(gtk_entry_get_text(GTK_ENTRY(editable)), key);
+	gtk_list_store_clear(store);
+	if (!key[0] || submit_pending) {
+		return;
+	}
+
+	move_candidate candidates[MOVE_ENTRY_MAX_MOVES];
+	int matches[MOVE_ENTRY_MAX_MOVES];
+	bool by_san;
+	int n = legal_move_candidates(main_game, candidates, MOVE_ENTRY_MAX_MOVES);
+	int n_matches = match_candidates(candidates, n, key, matches, &by_san);
+
+	if (n_matches == 1 && strlen(key) >= (by_san ? MOVE_ENTRY_AUTO_SUBMIT_LENGTH : MOVE_ENTRY_COORD_LENGTH)) {
+		submit_candidate(&candidates[matches[0]]);
+		return;
+	}
+	for (int i = 0; i < n_matches && i < MOVE_ENTRY_MAX_SHOWN; i++) {
+		GtkTreeIter iter;
+		gtk_list_store_append(store, &iter);
+		gtk_list_store_set(store, &iter, MOVE_COLUMN_SAN, candidates[matches[i]].san, -1);
+	}
+}
+
+/* Plays the move typed in full, or promotes to a queen when only the
+ * promotion piece is missing */
+static void on_move_entry_activate(GtkEntry *entry, gpointer data) {
+	char key[MOVE_KEY_SIZE];
+	normalise_move_input(gtk_entry_get_text(entry), key);
+	if (!key[0] || submit_pending) {
+		return;
+	}
+
+	move_candidate candidates[MOVE_ENTRY_MAX_MOVES];
+	int matches[MOVE_ENTRY_MAX_MOVES];
+	bool by_san;
+	int n = legal_move_candidates(main_game, candidates, MOVE_ENTRY_MAX_MOVES);
+	int n_matches = match_candidates(candidates, n, key, matches, &by_san);
+
+	// the four promotions of a single pawn move
+	bool one_move = n_matches > 0;
+	for (int i = 1; i < n_matches; i++) {
+		one_move &= !memcmp(candidates[matches[i]].move, candidates[matches[0]].move, sizeof(int[4]));
+	}
+	size_t len = strlen(key);
+	for (int i = 0; i < n_matches; i++) {
+		move_candidate *candidate = &candidates[matches[i]];
+		bool promotion = candidate->promo_type >= 0;
+		bool exact = (strlen(candidate->key) == len && key_has_prefix(candidate->key, promotion, key)) ||
+		             (strlen(candidate->coord_key) == len && key_has_prefix(candidate->coord_key, promotion, key));
+		if (exact || (one_move && (!promotion || candidate->promo_type == W_QUEEN))) {
+			submit_candidate(candidate);
+			return;
+		}
+	}
+	gtk_widget_error_bell(GTK_WIDGET(entry));
+}
+
+static gboolean on_move_selected(GtkEntryCompletion *completion, GtkTreeModel *model, GtkTreeIter *iter, gpointer data) {
+	gchar *san;
+	gtk_tree_model_get(model, iter, MOVE_COLUMN_SAN, &san, -1);
+
+	move_candidate candidates[MOVE_ENTRY_MAX_MOVES];
+	int n = legal_move_candidates(main_game, candidates, MOVE_ENTRY_MAX_MOVES);
+	for (int i = 0; i < n && !submit_pending; i++) {
+		if (!strcmp(candidates[i].san, san)) {
+			submit_candidate(&candidates[i]);
+		}
+	}
+	g_free(san);
+	// the entry is cleared once the move is played
+	return TRUE;
+}
+
+GtkWidget *move_entry_new(void) {
+	move_entry = gtk_entry_new();
+	gtk_entry_set_placeholder_text(GTK_ENTRY(move_entry), "Type a move: Nf3, e2e4...");
+
+	GtkListStore *store = gtk_list_store_new(MOVE_N_COLUMNS, G_TYPE_STRING);
+	// connected before the completion's own handler so it sees the new matches
+	g_signal_connect(move_entry, "changed", G_CALLBACK(on_move_entry_changed), store);
+	g_signal_connect(move_entry, "activate", G_CALLBACK(on_move_entry_activate), NULL);
+
+	GtkEntryCompletion *completion = gtk_entry_completion_new();
+	gtk_entry_completion_set_model(completion, GTK_TREE_MODEL(store));
+	gtk_entry_completion_set_text_column(completion, MOVE_COLUMN_SAN);
+	gtk_entry_completion_set_match_func(completion, match_everything, NULL, NULL);
+	gtk_entry_completion_set_minimum_key_length(completion, 1);
+	g_signal_connect(completion, "match-selected", G_CALLBACK(on_move_selected), NULL);
+	gtk_entry_set_completion(GTK_ENTRY(move_entry), completion);
+	g_object_unref(completion);
+	g_object_unref(store);
+
+	return move_entry;
+}
+/* </Entry> */
@@ -0,0 +1,8 @@
+#ifndef CAIRO_BOARD_MOVE_ENTRY_H
+#define CAIRO_BOARD_MOVE_ENTRY_H
+
+#include <gtk/gtk.h>
+
+GtkWidget *move_entry_new(void);
+
+#endif //CAIRO_BOARD_MOVE_ENTRY_H
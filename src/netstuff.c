@@ -12,7 +12,10 @@
 #include <netdb.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include "ics-adapter.h"
+#include "ics-queue.h"
+#include "time-source.h"
 
 #define BSIZE 1024
 
@@ -29,7 +32,7 @@ static size_t codec(char *s, size_t l) {
 	s[l++] = '\x18';
 
 	// get the current timestamp
-	gettimeofday(&tv, NULL);
+	time_now_tv(&tv);
 
 	// add the timestamp the the sent string
 	l += sprintf(&s[l], "%ld", (tv.tv_sec%10000)*1000 + tv.tv_usec/1000);
@@ -104,6 +107,26 @@ void close_tcp(int fd) {
 	close(fd);
 }
 
+/* encode one line, without its '\n', and write it to the socket */
+static void send_line(int fd, const char *line, size_t n) {
+	char ffub[BSIZE+20];
+	size_t k;
+
+	if (n > BSIZE) {
+		fprintf(stderr, "Line too long?!\n");
+		n = BSIZE;
+	}
+
+	// copy passed line
+	memcpy(ffub, line, n);
+
+	// encode string
+	k = codec(ffub, n);
+
+	/* send encoded data to socket */
+	write_to_fd(fd, ffub, k);
+}
+
 void send_to_fics(char *buff, size_t *rd) {
 
 	// static storage duration, no linkage
@@ -113,17 +136,9 @@ void send_to_fics(char *buff, size_t *rd) {
 
 		// search for '\n' character
 		if (buff[i] == '\n') {
-			char ffub[BSIZE+20];
 			size_t k;
 
-			// copy passed buffer till '\n'
-			memcpy(ffub, buff, (size_t) i);
-
-			// encode string
-			k = codec(ffub, i);
-
-			/* send encoded data to socket */
-			write_to_fd(ics_fd, ffub, k);
+			send_line(ics_fd, buff, (size_t) i);
 
 			/* fold back end of buffer to the beginning */
 			for(i++, k = 0; i < *rd; i++, k++) {
@@ -136,6 +151,30 @@ void send_to_fics(char *buff, size_t *rd) {
 	}
 }
 
+/* Writes everything queued through send_to_ics(). The most urgent command is
+ * picked again after each one, so a move queued behind a burst of chat
+ * goes out with the next write */
+static void send_queued_commands(int fd) {
+	ics_priority priority;
+	int64_t queued_at;
+	char *command;
+
+	while ((command = ics_queue_pop(&priority, &queued_at))) {
+		char *line = command;
+		char *end;
+		while ((end = strchr(line, '\n'))) {
+			send_line(fd, line, (size_t) (end - line));
+			line = end + 1;
+		}
+		// commands are full lines, send an unterminated tail anyway
+		if (*line) {
+			send_line(fd, line, strlen(line));
+		}
+		ics_queue_sent(priority, queued_at);
+		free(command);
+	}
+}
+
 /* decode encrypted buff and write it to output_fd */
 static void get_from_fics(int ics_fd, int output_fd, char *buff, size_t *rd) {
 
@@ -178,31 +217,47 @@ static void get_from_fics(int ics_fd, int output_fd, char *buff, size_t *rd) {
 	}
 }
 
-// Please optimise this
 int read_write_ics_fd(int input_fd, int output_fd, int ics_fd) {
 
 	int i;
 
-	/* read and write file descriptor sets */
+	/* read file descriptor set */
 	fd_set r_fds;
-	fd_set w_fds;
+	int wake_fd = ics_queue_wake_fd();
+	int max_fd = input_fd > ics_fd ? input_fd : ics_fd;
 
-	/* reset our file descriptor sets */
+	/* reset our file descriptor set */
 	FD_ZERO(&r_fds);
-	FD_ZERO(&w_fds);
 
-	/* add input_fd to the read fds */
+	/* add input_fd and ics_fd to the read fds */
 	FD_SET(input_fd, &r_fds);
-
-	/* add ics_fd to both read and write fds */
 	FD_SET(ics_fd, &r_fds);
-	FD_SET(ics_fd, &w_fds);
 
-	/* check I/O status of our fds */
-	select(ics_fd+1, &r_fds, &w_fds, NULL, NULL);
+	/* queued commands wake us up through the queue's pipe */
+	if (wake_fd >= 0) {
+		FD_SET(wake_fd, &r_fds);
+		if (wake_fd > max_fd) {
+			max_fd = wake_fd;
+		}
+	}
+
+	/* wait till one of our fds has something for us, writes to the socket
+	 * are blocking anyway */
+	if (select(max_fd+1, &r_fds, NULL, NULL, NULL) < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		perror(NULL);
+		return -1;
+	}
+
+	// send what the rest of the program queued, moves first
+	if (wake_fd >= 0 && FD_ISSET(wake_fd, &r_fds)) {
+		send_queued_commands(ics_fd);
+	}
 
-	// we can read from stdin and write to ics
-	if (FD_ISSET(input_fd, &r_fds) && FD_ISSET(ics_fd, &w_fds)) {
+	// we can read from stdin
+	if (FD_ISSET(input_fd, &r_fds)) {
 		static size_t w_rd = 0;
 		static char buff[BSIZE];
 
@@ -225,8 +280,8 @@ int read_write_ics_fd(int input_fd, int output_fd, int ics_fd) {
 		}
 	}
 
-	// we can read from and write to ics
-	if (FD_ISSET(ics_fd, &r_fds) && FD_ISSET(ics_fd, &w_fds)) {
+	// we can read from ics
+	if (FD_ISSET(ics_fd, &r_fds)) {
 		static int r_rd = 0;
 		static char buff[BSIZE];
 
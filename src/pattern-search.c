@@ -0,0 +1,503 @@
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <gtk/gtk.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PATTERN_X86_SIMD 1
+#endif
+
+#include "cairo-board.h"
+#include "pgn-replay.h"
+#include "task-pool.h"
+#include "pattern-search.h"
+
+#define POSITION_STREAM_MAGIC "CBPS"
+#define POSITION_STREAM_VERSION 1
+#define POSITION_STREAM_SUFFIX ".pstream"
+#define POSITION_BLOCK_LANES 4
+#define SEARCH_CHUNK_BLOCKS 16384
+
+/* Each square holds a 4 bit code, piece type + 1 or 0 when empty. The
+ * stream stores the codes bit sliced: plane k has the squares whose code
+ * has bit k set (a1 is bit 0, h8 bit 63). Positions are grouped by 4 with
+ * each plane's 4 bitboards next to each other, so one AVX2 register holds
+ * the same plane of 4 consecutive positions */
+typedef struct {
+	uint64_t planes[4][POSITION_BLOCK_LANES];
+} position_block;
+
+/* On disk: header, position blocks, then the index of the first position
+ * of each game plus one past the last position */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t n_positions;
+	uint64_t games_offset;
+	uint32_t n_games;
+	uint32_t reserved[5];
+} position_stream_header;
+
+/* <Pattern parsing> */
+static int pattern_code(char c) {
+	if (c == '.') {
+		return PATTERN_EMPTY;
+	}
+	if (c == '*') {
+		return PATTERN_OCCUPIED;
+	}
+	if (!strchr("KQRBNPkqrbnp", c)) {
+		return -1;
+	}
+	return char_to_type(islower(c) ? BLACK : WHITE, (char) toupper(c)) + 1;
+}
+
+/* Space or comma separated constraints, each a piece letter (upper case
+ * white, lower case black, '.' empty, '*' any piece) followed by squares,
+ * files and ranks, e.g. "Nd5", "pce", "R7" or "q" for anywhere. A leading
+ * '-' asks for no such piece there: "Nd5 -pce kg8" */
+int position_pattern_parse(const char *spec, position_pattern *pattern) {
+	memset(pattern, 0, sizeof(position_pattern));
+	gchar **words = g_strsplit_set(spec, " ,", -1);
+	int ret = 0;
+
+	for (gchar **word = words; *word != NULL && !ret; word++) {
+		const char *c = *word;
+		if (!*c) {
+			continue;
+		}
+		if (pattern->n_constraints == PATTERN_MAX_CONSTRAINTS) {
+			fprintf(stderr, "Too many pattern constraints\n");
+			ret = -1;
+			break;
+		}
+		pattern_constraint *constraint = &pattern->constraints[pattern->n_constraints];
+		if (*c == '-') {
+			constraint->negated = true;
+			c++;
+		}
+		constraint->code = pattern_code(*c);
+		if (constraint->code < 0) {
+			fprintf(stderr, "Invalid piece in pattern '%s'\n", *word);
+			ret = -1;
+			break;
+		}
+		c++;
+
+		if (!*c) {
+			constraint->mask = ~0ULL;
+		}
+		while (*c) {
+			if (*c >= 'a' && *c <= 'h' && c[1] >= '1' && c[1] <= '8') {
+				constraint->mask |= 1ULL << ((c[1] - '1') * 8 + (c[0] - 'a'));
+				c += 2;
+			}
+			else if (*c >= 'a' && *c <= 'h') {
+				constraint->mask |= 0x0101010101010101ULL << (*c - 'a');
+				c++;
+			}
+			else if (*c >= '1' && *c <= '8') {
+				constraint->mask |= 0xffULL << ((*c - '1') * 8);
+				c++;
+			}
+			else {
+				fprintf(stderr, "Invalid square in pattern '%s'\n", *word);
+				ret = -1;
+				break;
+			}
+		}
+		pattern->n_constraints++;
+	}
+	g_strfreev(words);
+
+	if (!ret && pattern->n_constraints == 0) {
+		fprintf(stderr, "Empty pattern\n");
+		ret = -1;
+	}
+	return ret;
+}
+/* </Pattern parsing> */
+
+/* <Stream building> */
+typedef struct {
+	FILE *out;
+	position_block block;
+	int lane;
+	uint64_t n_positions;
+	GArray *first_positions;
+	bool failed;
+} stream_builder;
+
+static bool flush_block(stream_builder *builder) {
+	if (!builder->failed && fwrite(&builder->block, sizeof(position_block), 1, builder->out) != 1) {
+		builder->failed = true;
+	}
+	memset(&builder->block, 0, sizeof(position_block));
+	builder->lane = 0;
+	return !builder->failed;
+}
+
+static bool stream_game_start(unsigned int game_index, size_t offset, void *data) {
+	stream_builder *builder = data;
+	g_array_append_val(builder->first_positions, builder->n_positions);
+	return true;
+}
+
+static bool stream_position(chess_game *game, unsigned int game_index, int ply, void *data) {
+	stream_builder *builder = data;
+	for (int col = 0; col < 8; col++) {
+		for (int row = 0; row < 8; row++) {
+			chess_piece *piece = game->squares[col][row].piece;
+			if (piece == NULL) {
+				continue;
+			}
+			unsigned int code = (unsigned int) piece->type + 1;
+			uint64_t bit = 1ULL << (row * 8 + col);
+			for (int k = 0; k < 4; k++) {
+				if (code & (1u << k)) {
+					builder->block.planes[k][builder->lane] |= bit;
+				}
+			}
+		}
+	}
+	builder->n_positions++;
+	if (++builder->lane == POSITION_BLOCK_LANES) {
+		return flush_block(builder);
+	}
+	return true;
+}
+
+/* Replays every game of the PGN file into a stream of 32 byte positions */
+int position_stream_build(const char *pgn_path, const char *stream_path) {
+	struct stat source;
+	GError *error = NULL;
+	GMappedFile *mapped = g_mapped_file_new(pgn_path, FALSE, &error);
+	if (mapped == NULL || stat(pgn_path, &source)) {
+		fprintf(stderr, "Error opening file '%s': %s\n", pgn_path, error ? error->message : strerror(errno));
+		g_clear_error(&error);
+		if (mapped != NULL) {
+			g_mapped_file_unref(mapped);
+		}
+		return -1;
+	}
+
+	gchar *tmp_path = g_strconcat(stream_path, ".tmp", NULL);
+	stream_builder builder;
+	memset(&builder, 0, sizeof(builder));
+	builder.out = fopen(tmp_path, "wb");
+	if (builder.out == NULL) {
+		fprintf(stderr, "Error opening file '%s': %s\n", tmp_path, strerror(errno));
+		g_mapped_file_unref(mapped);
+		g_free(tmp_path);
+		return -1;
+	}
+	builder.first_positions = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+
+	// the header is written last, once the counts are known
+	position_stream_header header;
+	memset(&header, 0, sizeof(header));
+	builder.failed = fwrite(&header, sizeof(header), 1, builder.out) != 1;
+
+	pgn_replay_callbacks callbacks = {
+			.game_start = stream_game_start,
+			.position = stream_position,
+	};
+	chess_game *game = game_new(ALLOC_GAMES);
+	pgn_replay(g_mapped_file_get_contents(mapped), g_mapped_file_get_length(mapped), game, &callbacks, &builder);
+	game_free(game);
+	g_mapped_file_unref(mapped);
+
+	if (builder.lane > 0) {
+		flush_block(&builder);
+	}
+	memcpy(header.magic, POSITION_STREAM_MAGIC, 4);
+	header.version = POSITION_STREAM_VERSION;
+	header.source_size = (uint64_t) source.st_size;
+	header.source_mtime = (int64_t) source.st_mtime;
+	header.n_positions = builder.n_positions;
+	header.n_games = builder.first_positions->len;
+	header.games_offset = sizeof(header) + (builder.n_positions + POSITION_BLOCK_LANES - 1) / POSITION_BLOCK_LANES * sizeof(position_block);
+	g_array_append_val(builder.first_positions, builder.n_positions);
+
+	bool ok = !builder.failed &&
+	          fwrite(builder.first_positions->data, sizeof(uint64_t), builder.first_positions->len, builder.out) == builder.first_positions->len &&
+	          !fseek(builder.out, 0, SEEK_SET) &&
+	          fwrite(&header, sizeof(header), 1, builder.out) == 1;
+	g_array_free(builder.first_positions, TRUE);
+
+	if (fclose(builder.out) || !ok) {
+		fprintf(stderr, "Error writing file '%s': %s\n", tmp_path, strerror(errno));
+		unlink(tmp_path);
+		g_free(tmp_path);
+		return -1;
+	}
+	int ret = rename(tmp_path, stream_path);
+	if (ret) {
+		fprintf(stderr, "Error renaming '%s': %s\n", tmp_path, strerror(errno));
+	}
+	g_free(tmp_path);
+	return ret;
+}
+/* </Stream building> */
+
+/* <Matching> */
+static inline uint64_t piece_board(const position_block *block, int lane, int code) {
+	if (code == PATTERN_OCCUPIED) {
+		return block->planes[0][lane] | block->planes[1][lane] | block->planes[2][lane] | block->planes[3][lane];
+	}
+	uint64_t board = ~0ULL;
+	for (int k = 0; k < 4; k++) {
+		board &= (code >> k & 1) ? block->planes[k][lane] : ~block->planes[k][lane];
+	}
+	return board;
+}
+
+static void match_blocks_scalar(const position_block *blocks, size_t first, size_t n, uint64_t n_positions,
+                                const position_pattern *pattern, GArray *matches) {
+	for (size_t b = first; b < first + n; b++) {
+		for (int lane = 0; lane < POSITION_BLOCK_LANES; lane++) {
+			uint64_t position = b * POSITION_BLOCK_LANES + (uint64_t) lane;
+			if (position >= n_positions) {
+				break;
+			}
+			int c;
+			for (c = 0; c < pattern->n_constraints; c++) {
+				const pattern_constraint *constraint = &pattern->constraints[c];
+				bool present = (piece_board(&blocks[b], lane, constraint->code) & constraint->mask) != 0;
+				if (present == constraint->negated) {
+					break;
+				}
+			}
+			if (c == pattern->n_constraints) {
+				g_array_append_val(matches, position);
+			}
+		}
+	}
+}
+
+#ifdef PATTERN_X86_SIMD
+/* Evaluates every constraint for the 4 positions of a block at once */
+__attribute__((target("avx2")))
+static void match_blocks_avx2(const position_block *blocks, size_t first, size_t n, uint64_t n_positions,
+                              const position_pattern *pattern, GArray *matches) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi64x(-1);
+	__m256i masks[PATTERN_MAX_CONSTRAINTS];
+	// planes are inverted where the code has a 0 bit, so the piece board is their AND
+	__m256i flips[PATTERN_MAX_CONSTRAINTS][4];
+	for (int c = 0; c < pattern->n_constraints; c++) {
+		masks[c] = _mm256_set1_epi64x((long long) pattern->constraints[c].mask);
+		for (int k = 0; k < 4; k++) {
+			flips[c][k] = (pattern->constraints[c].code >> k & 1) ? zero : ones;
+		}
+	}
+
+	for (size_t b = first; b < first + n; b++) {
+		const position_block *block = &blocks[b];
+		__m256i p0 = _mm256_loadu_si256((const __m256i *) block->planes[0]);
+		__m256i p1 = _mm256_loadu_si256((const __m256i *) block->planes[1]);
+		__m256i p2 = _mm256_loadu_si256((const __m256i *) block->planes[2]);
+		__m256i p3 = _mm256_loadu_si256((const __m256i *) block->planes[3]);
+		__m256i keep = ones;
+
+		for (int c = 0; c < pattern->n_constraints; c++) {
+			__m256i board;
+			if (pattern->constraints[c].code == PATTERN_OCCUPIED) {
+				board = _mm256_or_si256(_mm256_or_si256(p0, p1), _mm256_or_si256(p2, p3));
+			}
+			else {
+				board = _mm256_and_si256(_mm256_and_si256(_mm256_xor_si256(p0, flips[c][0]), _mm256_xor_si256(p1, flips[c][1])),
+				                         _mm256_and_si256(_mm256_xor_si256(p2, flips[c][2]), _mm256_xor_si256(p3, flips[c][3])));
+			}
+			__m256i absent = _mm256_cmpeq_epi64(_mm256_and_si256(board, masks[c]), zero);
+			keep = pattern->constraints[c].negated ? _mm256_and_si256(keep, absent) : _mm256_andnot_si256(absent, keep);
+			if (_mm256_testz_si256(keep, keep)) {
+				break;
+			}
+		}
+
+		unsigned int lanes = (unsigned int) _mm256_movemask_pd(_mm256_castsi256_pd(keep));
+		while (lanes) {
+			uint64_t position = b * POSITION_BLOCK_LANES + (uint64_t) __builtin_ctz(lanes);
+			if (position < n_positions) {
+				g_array_append_val(matches, position);
+			}
+			lanes &= lanes - 1;
+		}
+	}
+}
+#endif
+
+static void (*match_blocks)(const position_block *, size_t, size_t, uint64_t, const position_pattern *, GArray *) = match_blocks_scalar;
+static const char *simd_name = "scalar";
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+static void pick_simd_functions(void) {
+#ifdef PATTERN_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		match_blocks = match_blocks_avx2;
+		simd_name = "AVX2";
+	}
+#endif
+}
+
+const char *pattern_search_simd_name(void) {
+	pthread_once(&simd_once, pick_simd_functions);
+	return simd_name;
+}
+
+typedef struct {
+	const position_block *blocks;
+	size_t first_block;
+	size_t n_blocks;
+	uint64_t n_positions;
+	const position_pattern *pattern;
+	GArray *matches;
+} search_chunk;
+
+static void search_chunk_task(void *data, task_group *group) {
+	search_chunk *chunk = data;
+	match_blocks(chunk->blocks, chunk->first_block, chunk->n_blocks, chunk->n_positions, chunk->pattern, chunk->matches);
+}
+
+/* Matches the pattern against every position of the stream, split in
+ * chunks over the task pool. Returns the number of matches, in game order,
+ * or -1. *matches must be freed */
+long pattern_search_stream(const char *stream_path, const position_pattern *pattern, pattern_match **matches, uint64_t *n_positions) {
+	*matches = NULL;
+	GError *error = NULL;
+	GMappedFile *mapped = g_mapped_file_new(stream_path, FALSE, &error);
+	if (mapped == NULL) {
+		fprintf(stderr, "Error opening file '%s': %s\n", stream_path, error->message);
+		g_error_free(error);
+		return -1;
+	}
+	const char *contents = g_mapped_file_get_contents(mapped);
+	size_t length = g_mapped_file_get_length(mapped);
+	const position_stream_header *header = (const position_stream_header *) contents;
+	if (length < sizeof(position_stream_header) || memcmp(header->magic, POSITION_STREAM_MAGIC, 4) ||
+	    header->version != POSITION_STREAM_VERSION ||
+	    header->games_offset + (header->n_games + 1) * sizeof(uint64_t) > length) {
+		fprintf(stderr, "'%s' is not a position stream\n", stream_path);
+		g_mapped_file_unref(mapped);
+		return -1;
+	}
+	pthread_once(&simd_once, pick_simd_functions);
+
+	const position_block *blocks = (const position_block *) (contents + sizeof(position_stream_header));
+	const uint64_t *first_positions = (const uint64_t *) (contents + header->games_offset);
+	size_t n_blocks = (header->n_positions + POSITION_BLOCK_LANES - 1) / POSITION_BLOCK_LANES;
+	size_t n_chunks = (n_blocks + SEARCH_CHUNK_BLOCKS - 1) / SEARCH_CHUNK_BLOCKS;
+	*n_positions = header->n_positions;
+
+	search_chunk *chunks = calloc(n_chunks, sizeof(search_chunk));
+	task_group *group = task_group_new();
+	for (size_t i = 0; i < n_chunks; i++) {
+		chunks[i].blocks = blocks;
+		chunks[i].first_block = i * SEARCH_CHUNK_BLOCKS;
+		chunks[i].n_blocks = MIN(SEARCH_CHUNK_BLOCKS, n_blocks - chunks[i].first_block);
+		chunks[i].n_positions = header->n_positions;
+		chunks[i].pattern = pattern;
+		chunks[i].matches = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+		task_pool_submit(group, TASK_PRIORITY_NORMAL, search_chunk_task, &chunks[i]);
+	}
+	task_group_wait(group);
+	task_group_free(group);
+
+	size_t n_matches = 0;
+	for (size_t i = 0; i < n_chunks; i++) {
+		n_matches += chunks[i].matches->len;
+	}
+	*matches = malloc(n_matches * sizeof(pattern_match) + 1);
+	// chunks are in position order, so the game only moves forward
+	size_t m = 0;
+	uint32_t game = 0;
+	for (size_t i = 0; i < n_chunks; i++) {
+		for (guint j = 0; j < chunks[i].matches->len; j++) {
+			uint64_t position = g_array_index(chunks[i].matches, uint64_t, j);
+			while (game + 1 < header->n_games && first_positions[game + 1] <= position) {
+				game++;
+			}
+			(*matches)[m].game = game;
+			(*matches)[m].ply = (uint32_t) (position - first_positions[game]);
+			m++;
+		}
+		g_array_free(chunks[i].matches, TRUE);
+	}
+	free(chunks);
+	g_mapped_file_unref(mapped);
+	return (long) n_matches;
+}
+/* </Matching> */
+
+static bool is_stream_current(const char *pgn_path, const char *stream_path) {
+	struct stat source;
+	position_stream_header header;
+	FILE *f = fopen(stream_path, "rb");
+	if (f == NULL) {
+		return false;
+	}
+	bool current = fread(&header, sizeof(header), 1, f) == 1 && !stat(pgn_path, &source) &&
+	               !memcmp(header.magic, POSITION_STREAM_MAGIC, 4) &&
+	               header.version == POSITION_STREAM_VERSION &&
+	               header.source_size == (uint64_t) source.st_size &&
+	               header.source_mtime == (int64_t) source.st_mtime;
+	fclose(f);
+	return current;
+}
+
+/* Lists the positions of pgn_path matching the pattern, (re)building the
+ * position stream next to the file when missing or stale */
+int pattern_search(const char *pgn_path, const char *spec) {
+	position_pattern pattern;
+	if (position_pattern_parse(spec, &pattern)) {
+		return -1;
+	}
+
+	struct timeval start, end, diff;
+	gchar *stream_path = g_strconcat(pgn_path, POSITION_STREAM_SUFFIX, NULL);
+	if (!is_stream_current(pgn_path, stream_path)) {
+		printf("Building position stream of '%s'...\n", pgn_path);
+		gettimeofday(&start, NULL);
+		if (position_stream_build(pgn_path, stream_path)) {
+			g_free(stream_path);
+			return -1;
+		}
+		gettimeofday(&end, NULL);
+		timersub(&end, &start, &diff);
+		printf("Built in %ld.%03lds\n", diff.tv_sec, diff.tv_usec / 1000);
+	}
+
+	pattern_match *matches;
+	uint64_t n_positions = 0;
+	gettimeofday(&start, NULL);
+	long n_matches = pattern_search_stream(stream_path, &pattern, &matches, &n_positions);
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+	g_free(stream_path);
+	if (n_matches < 0) {
+		return -1;
+	}
+
+	for (long i = 0; i < n_matches; i++) {
+		// game numbers as taken by -gamenum
+		printf("game %u ply %u\n", matches[i].game + 1, matches[i].ply);
+	}
+	double seconds = diff.tv_sec + diff.tv_usec / 1e6;
+	printf("%ld of %" PRIu64 " positions in %.3fms, %.0f positions/s (%d threads, %s)\n",
+	       n_matches, n_positions, seconds * 1000, seconds > 0 ? n_positions / seconds : 0,
+	       task_pool_size() > 0 ? task_pool_size() : 1, pattern_search_simd_name());
+	free(matches);
+	return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef CAIRO_BOARD_PATTERN_SEARCH_H
+#define CAIRO_BOARD_PATTERN_SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PATTERN_MAX_CONSTRAINTS 32
+
+/* code is a piece type + 1, PATTERN_EMPTY or PATTERN_OCCUPIED.
+ * A constraint holds when one such piece is in mask, or none is if negated */
+#define PATTERN_EMPTY 0
+#define PATTERN_OCCUPIED 13
+
+typedef struct {
+	int code;
+	uint64_t mask;
+	bool negated;
+} pattern_constraint;
+
+typedef struct {
+	pattern_constraint constraints[PATTERN_MAX_CONSTRAINTS];
+	int n_constraints;
+} position_pattern;
+
+/* Game numbered from 0, ply 0 is the initial position */
+typedef struct {
+	uint32_t game;
+	uint32_t ply;
+} pattern_match;
+
+int position_pattern_parse(const char *spec, position_pattern *pattern);
+int position_stream_build(const char *pgn_path, const char *stream_path);
+long pattern_search_stream(const char *stream_path, const position_pattern *pattern, pattern_match **matches, uint64_t *n_positions);
+const char *pattern_search_simd_name(void);
+
+int pattern_search(const char *pgn_path, const char *spec);
+
+#endif //CAIRO_BOARD_PATTERN_SEARCH_H
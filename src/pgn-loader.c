@@ -0,0 +1,253 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gtk/gtk.h>
+
+#include "cairo-board.h"
+#include "chess-backend.h"
+#include "game-index.h"
+#include "pgn-replay.h"
+#include "pgn-loader.h"
+#include "task-pool.h"
+#include "time-source.h"
+
+// how often at most the main loop hears about the scan
+#define PGN_LOAD_PROGRESS_INTERVAL_US 50000
+
+typedef struct {
+	pgn_loaded_game result;
+	unsigned int first_game; // games skipped thanks to the game index
+	GArray *plys;
+	bool target_done;
+	bool cancelled;
+	int refs;
+
+	pgn_load_progress_function progress;
+	pgn_load_done_function done;
+	void *data;
+
+	int64_t last_report;
+	size_t start;
+	size_t bytes_total;
+
+	// handed over to the main loop, under progress_lock
+	pthread_mutex_t progress_lock;
+	size_t bytes_done;
+	unsigned int n_games;
+	bool progress_queued;
+} pgn_load;
+
+static pthread_once_t group_once = PTHREAD_ONCE_INIT;
+static task_group *load_group = NULL;
+static pgn_load *current_load = NULL; // main loop only, the load not finished yet
+
+static void init_load_group(void) {
+	load_group = task_group_new();
+}
+
+static void load_unref(pgn_load *load) {
+	if (__sync_sub_and_fetch(&load->refs, 1) == 0) {
+		pthread_mutex_destroy(&load->progress_lock);
+		g_free(load->result.plys);
+		free(load);
+	}
+}
+
+static bool load_cancelled(pgn_load *load) {
+	return __atomic_load_n(&load->cancelled, __ATOMIC_ACQUIRE);
+}
+
+/* <replay callbacks, on the worker> */
+static bool on_game_start(unsigned int game_index, size_t offset, void *data) {
+	pgn_load *load = data;
+	return (int) (load->first_game + game_index) + 1 == load->result.game_num;
+}
+
+static void on_tag(unsigned int game_index, const char *buf, const pgn_token *token, void *data) {
+	pgn_loaded_game *result = &((pgn_load *) data)->result;
+	if (pgn_token_tag_is(buf, token, "White")) {
+		pgn_token_tag_value(buf, token, result->white_name, sizeof(result->white_name));
+	}
+	else if (pgn_token_tag_is(buf, token, "Black")) {
+		pgn_token_tag_value(buf, token, result->black_name, sizeof(result->black_name));
+	}
+	else if (pgn_token_tag_is(buf, token, "WhiteElo")) {
+		pgn_token_tag_value(buf, token, result->white_rating, sizeof(result->white_rating));
+	}
+	else if (pgn_token_tag_is(buf, token, "BlackElo")) {
+		pgn_token_tag_value(buf, token, result->black_rating, sizeof(result->black_rating));
+	}
+}
+
+static void on_move(unsigned int game_index, int ply, const int move[4], int promo_type, void *data) {
+	pgn_load *load = data;
+	pgn_loaded_ply loaded = {{move[0], move[1], move[2], move[3]}, promo_type};
+	g_array_append_val(load->plys, loaded);
+}
+
+static void on_game_end(unsigned int game_index, int n_plys, bool resolved, void *data) {
+	pgn_load *load = data;
+	load->result.status = resolved ? PGN_LOAD_OK : PGN_LOAD_BAD_MOVE;
+	load->target_done = true;
+}
+
+/* Runs in the main loop */
+static gboolean report_progress(gpointer data) {
+	pgn_load *load = data;
+
+	pthread_mutex_lock(&load->progress_lock);
+	size_t bytes_done = load->bytes_done;
+	unsigned int n_games = load->n_games;
+	load->progress_queued = false;
+	pthread_mutex_unlock(&load->progress_lock);
+
+	if (load == current_load && !load_cancelled(load) && load->progress != NULL) {
+		load->progress(load->result.file_path, bytes_done, load->bytes_total, n_games, load->data);
+	}
+	load_unref(load);
+	return FALSE;
+}
+
+/* Between token batches: stops right after the game asked for, or when
+ * cancelled, and passes on how far the scan went every now and then */
+static bool on_progress(size_t offset, unsigned int n_games, void *data) {
+	pgn_load *load = data;
+	if (load->target_done || load_cancelled(load)) {
+		return false;
+	}
+
+	int64_t now = time_now_us();
+	if (now - load->last_report < PGN_LOAD_PROGRESS_INTERVAL_US) {
+		return true;
+	}
+	load->last_report = now;
+
+	pthread_mutex_lock(&load->progress_lock);
+	load->bytes_done = load->start + offset;
+	load->n_games = load->first_game + n_games;
+	bool queue = !load->progress_queued;
+	load->progress_queued = true;
+	pthread_mutex_unlock(&load->progress_lock);
+
+	if (queue) {
+		__sync_fetch_and_add(&load->refs, 1);
+		g_idle_add(report_progress, load);
+	}
+	return true;
+}
+/* </replay callbacks, on the worker> */
+
+/* Runs in the main loop */
+static gboolean finish_load(gpointer data) {
+	pgn_load *load = data;
+	if (load == current_load) {
+		current_load = NULL;
+	}
+	if (load_cancelled(load)) {
+		load->result.status = PGN_LOAD_CANCELLED;
+	}
+	if (load->done != NULL) {
+		load->done(&load->result, load->data);
+	}
+	load_unref(load);
+	return FALSE;
+}
+
+/* With a current game index the scan starts at the game asked for, and a
+ * game number past the end is known without reading the file. Returns
+ * false when there is nothing to scan */
+static bool skip_to_game(pgn_load *load) {
+	game_index *index = game_index_open_current(load->result.file_path, false, NULL, NULL);
+	if (index == NULL) {
+		return true;
+	}
+	uint32_t n_games = game_index_games(index);
+	bool scan = load->result.game_num >= 1 && (uint32_t) load->result.game_num <= n_games;
+	if (scan) {
+		load->first_game = (unsigned int) load->result.game_num - 1;
+		load->start = game_index_record_at(index, load->first_game)->offset;
+	}
+	else {
+		load->result.n_games = n_games;
+	}
+	game_index_close(index);
+	return scan;
+}
+
+static void load_job(void *data, task_group *group) {
+	pgn_load *load = data;
+	GError *error = NULL;
+
+	GMappedFile *mapped = load_cancelled(load) ? NULL : g_mapped_file_new(load->result.file_path, FALSE, &error);
+	if (mapped == NULL) {
+		if (error != NULL) {
+			fprintf(stderr, "Error opening file '%s': %s\n", load->result.file_path, error->message);
+			g_clear_error(&error);
+			load->result.status = PGN_LOAD_NO_FILE;
+		}
+	}
+	else if (!skip_to_game(load)) {
+		g_mapped_file_unref(mapped);
+	}
+	else {
+		pgn_replay_callbacks callbacks = {
+				.game_start = on_game_start,
+				.tag = on_tag,
+				.move = on_move,
+				.game_end = on_game_end,
+				.progress = on_progress,
+		};
+		load->bytes_total = g_mapped_file_get_length(mapped);
+		chess_game *game = game_new(ALLOC_GAMES);
+		long n_games = pgn_replay(g_mapped_file_get_contents(mapped) + load->start, load->bytes_total - load->start,
+		                          game, &callbacks, load);
+		load->result.n_games = load->first_game + (unsigned int) n_games;
+		game_free(game);
+		g_mapped_file_unref(mapped);
+	}
+
+	load->result.n_plys = (int) load->plys->len;
+	load->result.plys = (pgn_loaded_ply *) g_array_free(load->plys, FALSE);
+	load->plys = NULL;
+	g_idle_add(finish_load, load);
+}
+
+/* From the main loop. Game game_num (counted from 1) of the file is looked
+ * for on the task pool, progress is reported while games before it are
+ * scanned and done is called as soon as its moves are resolved, without
+ * reading the rest of the file. A load still running is cancelled */
+void pgn_load_start(const char *file_path, int game_num, pgn_load_progress_function progress,
+                    pgn_load_done_function done, void *data) {
+	pthread_once(&group_once, init_load_group);
+	pgn_load_cancel();
+
+	pgn_load *load = calloc(1, sizeof(pgn_load));
+	snprintf(load->result.file_path, sizeof(load->result.file_path), "%s", file_path);
+	load->result.game_num = game_num;
+	load->result.status = PGN_LOAD_NOT_FOUND;
+	load->plys = g_array_new(FALSE, FALSE, sizeof(pgn_loaded_ply));
+	load->refs = 1; // dropped by finish_load()
+	load->progress = progress;
+	load->done = done;
+	load->data = data;
+	pthread_mutex_init(&load->progress_lock, NULL);
+
+	current_load = load;
+	task_pool_submit(load_group, TASK_PRIORITY_HIGH, load_job, load);
+}
+
+/* The load in progress stops at the next batch of tokens, its done
+ * callback is still called, with PGN_LOAD_CANCELLED */
+bool pgn_load_cancel(void) {
+	if (current_load == NULL) {
+		return false;
+	}
+	__atomic_store_n(&current_load->cancelled, true, __ATOMIC_RELEASE);
+	current_load = NULL;
+	return true;
+}
+
+bool pgn_load_running(void) {
+	return current_load != NULL;
+}
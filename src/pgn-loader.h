@@ -0,0 +1,45 @@
+#ifndef CAIRO_BOARD_PGN_LOADER_H
+#define CAIRO_BOARD_PGN_LOADER_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+	PGN_LOAD_OK = 0,
+	PGN_LOAD_NOT_FOUND,  // the file has fewer games than asked for
+	PGN_LOAD_BAD_MOVE,   // a move of the game could not be resolved
+	PGN_LOAD_NO_FILE,
+	PGN_LOAD_CANCELLED
+} pgn_load_status;
+
+typedef struct {
+	int move[4];
+	int promo_type;
+} pgn_loaded_ply;
+
+/* Game number game_num of a PGN file, with its moves already resolved */
+typedef struct {
+	char file_path[PATH_MAX];
+	int game_num;
+	pgn_load_status status;
+	unsigned int n_games;  // games scanned before stopping
+	char white_name[256];
+	char black_name[256];
+	char white_rating[32];
+	char black_rating[32];
+	int n_plys;
+	pgn_loaded_ply *plys;
+} pgn_loaded_game;
+
+/* Both run in the main loop, without the GDK lock like load_game() */
+typedef void (*pgn_load_progress_function)(const char *file_path, size_t bytes_done, size_t bytes_total,
+                                           unsigned int n_games, void *data);
+typedef void (*pgn_load_done_function)(const pgn_loaded_game *game, void *data);
+
+void pgn_load_start(const char *file_path, int game_num, pgn_load_progress_function progress,
+                    pgn_load_done_function done, void *data);
+bool pgn_load_cancel(void);
+bool pgn_load_running(void);
+
+#endif //CAIRO_BOARD_PGN_LOADER_H
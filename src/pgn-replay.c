@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cairo-board.h"
+#include "san_scanner.h"
+#include "pgn-tokenizer.h"
+#include "pgn-replay.h"
+
+#define PGN_REPLAY_TOKEN_BATCH 256
+
+// token offsets are 32 bits, the replay moves its base along before they wrap
+#define PGN_REPLAY_REBASE (1UL << 30)
+
+typedef struct {
+	chess_game *game;
+	const pgn_replay_callbacks *callbacks;
+	void *data;
+
+	unsigned int game_index;
+	bool in_game;
+	bool inside_tags;
+	bool wanted;
+	bool skipping;
+	bool resolved;
+	int ply;
+} replay_state;
+
+static void replay_start_game(replay_state *state, size_t offset) {
+	state->in_game = true;
+	state->resolved = true;
+	state->ply = -1;
+	init_game_position(state->game);
+	state->wanted = state->callbacks->game_start == NULL ||
+	                state->callbacks->game_start(state->game_index, offset, state->data);
+	state->skipping = !state->wanted;
+}
+
+static void replay_end_game(replay_state *state) {
+	if (state->callbacks->game_end != NULL && state->wanted) {
+		state->callbacks->game_end(state->game_index, state->ply < 0 ? 0 : state->ply, state->resolved, state->data);
+	}
+	state->game_index++;
+	state->in_game = false;
+}
+
+/* Reports the initial position once the tags are over */
+static void initial_position(replay_state *state) {
+	if (state->ply >= 0) {
+		return;
+	}
+	state->ply = 0;
+	if (!state->skipping && state->callbacks->position != NULL &&
+	    !state->callbacks->position(state->game, state->game_index, 0, state->data)) {
+		state->skipping = true;
+	}
+}
+
+static void replay_move(replay_state *state, const pgn_token *token) {
+	chess_game *game = state->game;
+	int piece_type;
+	char move_string[5];
+	int move[4];
+
+	pgn_token_move(token, game->whose_turn, &piece_type, move_string);
+	if (!resolve_move(game, piece_type, move_string, move)) {
+		fprintf(stderr, "Game %u: could not resolve move %c%s at ply %d\n", state->game_index + 1,
+		        type_to_char(piece_type), move_string, state->ply + 1);
+		state->resolved = false;
+		state->skipping = true;
+		return;
+	}
+	// a bare pawn move to the last rank is a queen
+	game->promo_type = char_to_type(game->whose_turn, token->promo ? token->promo : 'Q');
+
+	char san[SAN_MOVE_SIZE];
+	move_piece(game->squares[move[0]][move[1]].piece, move[2], move[3], 0, AUTO_SOURCE_NO_ANIM, san, game, true);
+	state->ply++;
+	if (state->callbacks->move != NULL) {
+		state->callbacks->move(state->game_index, state->ply, move, game->promo_type, state->data);
+	}
+	if (state->callbacks->position != NULL &&
+	    !state->callbacks->position(game, state->game_index, state->ply, state->data)) {
+		state->skipping = true;
+	}
+}
+
+/* Replays every game of a PGN buffer on game, which is reset for each one.
+ * game must not be main_game, replays of other games share nothing and may
+ * run on any thread. Returns the number of games found, up to where the
+ * progress callback stopped the replay if it did */
+long pgn_replay(const char *buf, size_t len, chess_game *game, const pgn_replay_callbacks *callbacks, void *data) {
+	replay_state state;
+	memset(&state, 0, sizeof(state));
+	state.game = game;
+	state.callbacks = callbacks;
+	state.data = data;
+
+	pgn_token tokens[PGN_REPLAY_TOKEN_BATCH];
+	size_t base = 0;
+	size_t pos = 0;
+	size_t n_tokens;
+	while ((n_tokens = pgn_tokenize(buf + base, len - base, &pos, tokens, PGN_REPLAY_TOKEN_BATCH)) > 0) {
+		for (size_t k = 0; k < n_tokens; k++) {
+			const pgn_token *token = &tokens[k];
+			switch (token->kind) {
+				case MATCHED_TAG:
+					if (!state.inside_tags) {
+						if (state.in_game) {
+							replay_end_game(&state);
+						}
+						replay_start_game(&state, base + token->offset);
+						state.inside_tags = true;
+					}
+					if (!state.skipping && callbacks->tag != NULL) {
+						callbacks->tag(state.game_index, buf + base, token, data);
+					}
+					break;
+				case MATCHED_MOVE:
+					state.inside_tags = false;
+					if (!state.in_game) {
+						// movetext without tags
+						replay_start_game(&state, base + token->offset);
+					}
+					initial_position(&state);
+					if (!state.skipping) {
+						replay_move(&state, token);
+					}
+					break;
+				case MATCHED_END_TOKEN:
+					state.inside_tags = false;
+					if (state.in_game) {
+						initial_position(&state);
+						replay_end_game(&state);
+					}
+					break;
+				default:
+					break;
+			}
+		}
+		if (callbacks->progress != NULL && !callbacks->progress(base + pos, state.game_index, data)) {
+			return state.game_index;
+		}
+		if (pos > PGN_REPLAY_REBASE) {
+			base += pos;
+			pos = 0;
+		}
+	}
+	if (state.in_game) {
+		initial_position(&state);
+		replay_end_game(&state);
+	}
+	return state.game_index;
+}
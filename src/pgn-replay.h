@@ -0,0 +1,28 @@
+#ifndef CAIRO_BOARD_PGN_REPLAY_H
+#define CAIRO_BOARD_PGN_REPLAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cairo-board.h"
+#include "pgn-tokenizer.h"
+
+/* Any callback can be NULL. Games are numbered from 0 in file order */
+typedef struct {
+	// a game starts at byte offset, return false to skip its moves
+	bool (*game_start)(unsigned int game_index, size_t offset, void *data);
+	// token offsets are relative to buf, which moves along in files over a GB
+	void (*tag)(unsigned int game_index, const char *buf, const pgn_token *token, void *data);
+	// called with the initial position (ply 0) then after each ply, return false to skip the rest of the game
+	bool (*position)(chess_game *game, unsigned int game_index, int ply, void *data);
+	// the ply just replayed, promo_type being the piece a promotion would give
+	void (*move)(unsigned int game_index, int ply, const int move[4], int promo_type, void *data);
+	// resolved is false when a move could not be replayed
+	void (*game_end)(unsigned int game_index, int n_plys, bool resolved, void *data);
+	// called between batches of tokens with the bytes and games done so far, return false to stop there
+	bool (*progress)(size_t offset, unsigned int n_games, void *data);
+} pgn_replay_callbacks;
+
+long pgn_replay(const char *buf, size_t len, chess_game *game, const pgn_replay_callbacks *callbacks, void *data);
+
+#endif //CAIRO_BOARD_PGN_REPLAY_H
@@ -0,0 +1,523 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PGN_X86_SIMD 1
+#endif
+
+#include "cairo-board.h"
+#include "san_scanner.h"
+#include "pgn-tokenizer.h"
+
+/* Hand written equivalent of san_scanner.lex for bulk work: no global
+ * state, no per byte rule matching. The bytes between tokens (blanks,
+ * move number dots, check and annotation marks) are skipped 16 or 32 at a
+ * time, tag values and comments are searched the same way. Tokens are
+ * matched with flex's rules: longest match, earliest rule on ties.
+ * Unlike the flex scanner, {comments}, ;comments and (variations) are
+ * skipped rather than scanned for moves */
+
+static inline bool is_piece(char c) {
+	return c == 'R' || c == 'B' || c == 'N' || c == 'Q' || c == 'K' || c == 'P';
+}
+
+static inline bool is_column(char c) {
+	return c >= 'a' && c <= 'h';
+}
+
+static inline bool is_row(char c) {
+	return c >= '1' && c <= '8';
+}
+
+static inline bool is_separator(char c) {
+	return c == 'x' || c == 'X' || c == ':' || c == '-';
+}
+
+static inline bool is_skipped(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '.' || c == '+' || c == '#' || c == '!' || c == '?';
+}
+
+/* <SIMD byte searches> */
+static const char *skip_filler_scalar(const char *p, const char *end) {
+	while (p < end && is_skipped(*p)) {
+		p++;
+	}
+	return p;
+}
+
+static const char *find_byte_scalar(const char *p, const char *end, char c) {
+	while (p < end && *p != c) {
+		p++;
+	}
+	return p;
+}
+
+#ifdef PGN_X86_SIMD
+__attribute__((target("sse2")))
+static const char *skip_filler_sse2(const char *p, const char *end) {
+	const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), lf = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r'), dot = _mm_set1_epi8('.'), plus = _mm_set1_epi8('+');
+	const __m128i hash = _mm_set1_epi8('#'), bang = _mm_set1_epi8('!'), question = _mm_set1_epi8('?');
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		__m128i skipped = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+		                               _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+		skipped = _mm_or_si128(skipped, _mm_or_si128(_mm_cmpeq_epi8(v, dot), _mm_cmpeq_epi8(v, plus)));
+		skipped = _mm_or_si128(skipped, _mm_or_si128(_mm_cmpeq_epi8(v, hash),
+		                                             _mm_or_si128(_mm_cmpeq_epi8(v, bang), _mm_cmpeq_epi8(v, question))));
+		unsigned int mask = ~(unsigned int) _mm_movemask_epi8(skipped) & 0xffffu;
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+	return skip_filler_scalar(p, end);
+}
+
+__attribute__((target("sse2")))
+static const char *find_byte_sse2(const char *p, const char *end, char c) {
+	const __m128i wanted = _mm_set1_epi8(c);
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, wanted));
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+	return find_byte_scalar(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static const char *skip_filler_avx2(const char *p, const char *end) {
+	const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), lf = _mm256_set1_epi8('\n');
+	const __m256i cr = _mm256_set1_epi8('\r'), dot = _mm256_set1_epi8('.'), plus = _mm256_set1_epi8('+');
+	const __m256i hash = _mm256_set1_epi8('#'), bang = _mm256_set1_epi8('!'), question = _mm256_set1_epi8('?');
+	while (end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+		__m256i skipped = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab)),
+		                                  _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+		skipped = _mm256_or_si256(skipped, _mm256_or_si256(_mm256_cmpeq_epi8(v, dot), _mm256_cmpeq_epi8(v, plus)));
+		skipped = _mm256_or_si256(skipped, _mm256_or_si256(_mm256_cmpeq_epi8(v, hash),
+		                                                   _mm256_or_si256(_mm256_cmpeq_epi8(v, bang), _mm256_cmpeq_epi8(v, question))));
+		unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(skipped);
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 32;
+	}
+	return skip_filler_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *find_byte_avx2(const char *p, const char *end, char c) {
+	const __m256i wanted = _mm256_set1_epi8(c);
+	while (end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+		unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, wanted));
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 32;
+	}
+	return find_byte_sse2(p, end, c);
+}
+#endif
+
+static const char *(*skip_filler)(const char *, const char *) = skip_filler_scalar;
+static const char *(*find_byte)(const char *, const char *, char) = find_byte_scalar;
+static const char *simd_name = "scalar";
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+static void pick_simd_functions(void) {
+#ifdef PGN_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		skip_filler = skip_filler_avx2;
+		find_byte = find_byte_avx2;
+		simd_name = "AVX2";
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		skip_filler = skip_filler_sse2;
+		find_byte = find_byte_sse2;
+		simd_name = "SSE2";
+	}
+#endif
+}
+
+const char *pgn_tokenizer_simd_name(void) {
+	pthread_once(&simd_once, pick_simd_functions);
+	return simd_name;
+}
+/* </SIMD byte searches> */
+
+/* (=?\(?{piecechar}\)?)? */
+static size_t match_promotion(const char *p, const char *end, char *promo) {
+	const char *q = p;
+	if (q < end && *q == '=') {
+		q++;
+	}
+	if (q < end && *q == '(') {
+		q++;
+	}
+	if (q < end && is_piece(*q)) {
+		*promo = *q++;
+		if (q < end && *q == ')') {
+			q++;
+		}
+		return (size_t) (q - p);
+	}
+	return 0;
+}
+
+/* The four move rules of the flex scanner, longest wins */
+static size_t match_move(const char *p, const char *end, pgn_token *token) {
+	const char *start = p;
+	char piece = 0;
+	if (p < end && is_piece(*p)) {
+		piece = *p++;
+	}
+
+	size_t best = 0;
+	const char *q;
+	char promo;
+
+	// {column}{row}[xX:-]?{column}{row}: both squares e.g. Nb1d7
+	q = p;
+	if (end - q >= 2 && is_column(q[0]) && is_row(q[1])) {
+		const char *from = q;
+		q += 2;
+		if (q < end && is_separator(*q)) {
+			q++;
+		}
+		if (end - q >= 2 && is_column(q[0]) && is_row(q[1])) {
+			const char *to = q;
+			promo = 0;
+			q += 2;
+			q += match_promotion(q, end, &promo);
+			if ((size_t) (q - start) > best) {
+				best = (size_t) (q - start);
+				token->move[0] = from[0];
+				token->move[1] = from[1];
+				token->move[2] = to[0];
+				token->move[3] = to[1];
+				token->move[4] = '\0';
+				token->promo = promo;
+			}
+		}
+	}
+
+	// {column}[xX:-]?{column}{row}: column disambiguator e.g. Nbd7 or cxb5
+	q = p;
+	if (q < end && is_column(q[0])) {
+		const char *from = q++;
+		if (q < end && is_separator(*q)) {
+			q++;
+		}
+		if (end - q >= 2 && is_column(q[0]) && is_row(q[1])) {
+			const char *to = q;
+			promo = 0;
+			q += 2;
+			q += match_promotion(q, end, &promo);
+			if ((size_t) (q - start) > best) {
+				best = (size_t) (q - start);
+				token->move[0] = from[0];
+				token->move[1] = '1' - 1;
+				token->move[2] = to[0];
+				token->move[3] = to[1];
+				token->move[4] = '\0';
+				token->promo = promo;
+			}
+		}
+	}
+
+	// {row}[xX:-]?{column}{row}: row disambiguator e.g. N1d3
+	q = p;
+	if (q < end && is_row(q[0])) {
+		const char *from = q++;
+		if (q < end && is_separator(*q)) {
+			q++;
+		}
+		if (end - q >= 2 && is_column(q[0]) && is_row(q[1])) {
+			const char *to = q;
+			promo = 0;
+			q += 2;
+			q += match_promotion(q, end, &promo);
+			if ((size_t) (q - start) > best) {
+				best = (size_t) (q - start);
+				token->move[0] = 'a' - 1;
+				token->move[1] = from[0];
+				token->move[2] = to[0];
+				token->move[3] = to[1];
+				token->move[4] = '\0';
+				token->promo = promo;
+			}
+		}
+	}
+
+	// [xX:-]?{column}{row}: e.g. Nc3, e4, Nxf6
+	q = p;
+	if (q < end && is_separator(*q)) {
+		q++;
+	}
+	if (end - q >= 2 && is_column(q[0]) && is_row(q[1])) {
+		const char *to = q;
+		promo = 0;
+		q += 2;
+		q += match_promotion(q, end, &promo);
+		if ((size_t) (q - start) > best) {
+			best = (size_t) (q - start);
+			token->move[0] = to[0];
+			token->move[1] = to[1];
+			token->move[2] = '\0';
+			token->promo = promo;
+		}
+	}
+
+	if (best) {
+		token->kind = MATCHED_MOVE;
+		token->piece = piece;
+		token->castle = 0;
+	}
+	return best;
+}
+
+/* \[[A-Za-z0-9][A-Za-z0-9_+#=-]*[ \t\n]*\"[^"]*\"\] */
+static size_t match_tag(const char *p, const char *end, const char *buf, pgn_token *token) {
+	const char *q = p + 1;
+	if (q >= end || !g_ascii_isalnum(*q)) {
+		return 0;
+	}
+	const char *name = q++;
+	while (q < end && (g_ascii_isalnum(*q) || *q == '_' || *q == '+' || *q == '#' || *q == '=' || *q == '-')) {
+		q++;
+	}
+	size_t name_len = (size_t) (q - name);
+	while (q < end && (*q == ' ' || *q == '\t' || *q == '\n')) {
+		q++;
+	}
+	if (q >= end || *q != '"') {
+		return 0;
+	}
+	const char *value = ++q;
+	q = find_byte(q, end, '"');
+	if (q >= end || q + 1 >= end || q[1] != ']') {
+		return 0;
+	}
+	token->kind = MATCHED_TAG;
+	token->name_len = (unsigned char) (name_len > 255 ? 255 : name_len);
+	token->value_offset = (unsigned int) (value - buf);
+	token->value_len = (unsigned int) (q - value);
+	return (size_t) (q + 2 - p);
+}
+
+/* 00|0-0|oo|OO|o-o|O-O and the queen side equivalents */
+static size_t match_castle(const char *p, const char *end, pgn_token *token) {
+	char c = *p;
+	if (c != '0' && c != 'o' && c != 'O') {
+		return 0;
+	}
+	size_t len = 1;
+	int n = 1;
+	bool dashes = end - p >= 2 && p[1] == '-';
+	while (n < 3) {
+		const char *q = p + len;
+		if (dashes) {
+			if (end - q >= 2 && q[0] == '-' && q[1] == c) {
+				len += 2;
+				n++;
+				continue;
+			}
+		}
+		else if (q < end && *q == c) {
+			len++;
+			n++;
+			continue;
+		}
+		break;
+	}
+	if (n < 2) {
+		return 0;
+	}
+	token->kind = MATCHED_MOVE;
+	token->piece = 'K';
+	token->castle = n == 2 ? 'K' : 'Q';
+	token->promo = 0;
+	token->move[0] = n == 2 ? 'g' : 'c';
+	token->move[1] = '\0';
+	return len;
+}
+
+/* [0-2/]+-[0-2/]+ */
+static size_t match_result(const char *p, const char *end) {
+	const char *q = p;
+	while (q < end && ((*q >= '0' && *q <= '2') || *q == '/')) {
+		q++;
+	}
+	if (q == p || q >= end || *q != '-') {
+		return 0;
+	}
+	const char *second = ++q;
+	while (q < end && ((*q >= '0' && *q <= '2') || *q == '/')) {
+		q++;
+	}
+	return q == second ? 0 : (size_t) (q - p);
+}
+
+/* [0-9]+\. */
+static size_t match_move_number(const char *p, const char *end) {
+	const char *q = p;
+	while (q < end && *q >= '0' && *q <= '9') {
+		q++;
+	}
+	if (q == p || q >= end || *q != '.') {
+		return 0;
+	}
+	return (size_t) (q + 1 - p);
+}
+
+/* Skips a (variation), nested ones included */
+static const char *skip_variation(const char *p, const char *end) {
+	int depth = 0;
+	while (p < end) {
+		if (*p == '(') {
+			depth++;
+		}
+		else if (*p == ')' && --depth == 0) {
+			return p + 1;
+		}
+		else if (*p == '{') {
+			p = find_byte(p, end, '}');
+			continue;
+		}
+		p++;
+	}
+	return end;
+}
+
+/* Scans buf from *pos and stores up to max_tokens tokens. Returns how many
+ * were found, 0 once the end is reached. buf must hold whole games */
+size_t pgn_tokenize(const char *buf, size_t len, size_t *pos, pgn_token *tokens, size_t max_tokens) {
+	pthread_once(&simd_once, pick_simd_functions);
+
+	const char *end = buf + len;
+	const char *p = buf + *pos;
+	size_t n = 0;
+
+	while (n < max_tokens) {
+		p = skip_filler(p, end);
+		if (p >= end) {
+			break;
+		}
+		pgn_token *token = &tokens[n];
+		char c = *p;
+
+		if (c == '[') {
+			size_t matched = match_tag(p, end, buf, token);
+			if (matched) {
+				token->offset = (unsigned int) (p - buf);
+				token->len = (unsigned int) matched;
+				p += matched;
+				n++;
+			}
+			else {
+				p++;
+			}
+			continue;
+		}
+		if (c == '{') {
+			p = find_byte(p, end, '}');
+			p += p < end;
+			continue;
+		}
+		if (c == ';') {
+			p = find_byte(p, end, '\n');
+			continue;
+		}
+		if (c == '(') {
+			p = skip_variation(p, end);
+			continue;
+		}
+		if (c == '*') {
+			const char *q = p + 1;
+			while (q < end && (*q == ' ' || *q == '\t')) {
+				q++;
+			}
+			if (q < end && *q == '\n') {
+				token->kind = MATCHED_END_TOKEN;
+				token->offset = (unsigned int) (p - buf);
+				token->len = (unsigned int) (q + 1 - p);
+				p = q + 1;
+				n++;
+			}
+			else {
+				p++;
+			}
+			continue;
+		}
+
+		// flex rule order: moves, castling, results, move numbers
+		pgn_token castle;
+		size_t move_len = match_move(p, end, token);
+		size_t castle_len = match_castle(p, end, &castle);
+		size_t result_len = match_result(p, end);
+		size_t number_len = match_move_number(p, end);
+
+		if (move_len && move_len >= castle_len && move_len >= result_len && move_len >= number_len) {
+			token->offset = (unsigned int) (p - buf);
+			token->len = (unsigned int) move_len;
+			p += move_len;
+			n++;
+		}
+		else if (castle_len && castle_len >= result_len && castle_len >= number_len) {
+			*token = castle;
+			token->offset = (unsigned int) (p - buf);
+			token->len = (unsigned int) castle_len;
+			p += castle_len;
+			n++;
+		}
+		else if (result_len && result_len >= number_len) {
+			token->kind = MATCHED_END_TOKEN;
+			token->offset = (unsigned int) (p - buf);
+			token->len = (unsigned int) result_len;
+			p += result_len;
+			n++;
+		}
+		else if (number_len) {
+			p += number_len;
+		}
+		else {
+			// like flex's catch-all rule: skip a byte and try again
+			p++;
+		}
+	}
+
+	*pos = (size_t) (p - buf);
+	return n;
+}
+
+/* Piece type and move string as the SAN scanner would have set type and
+ * currentMoveString for this token */
+void pgn_token_move(const pgn_token *token, int whose_turn, int *type, char move[5]) {
+	if (token->castle) {
+		*type = whose_turn ? B_KING : W_KING;
+		move[0] = token->move[0];
+		move[1] = whose_turn ? '8' : '1';
+		move[2] = '\0';
+		return;
+	}
+	*type = token->piece ? char_to_type(whose_turn, token->piece) : (whose_turn ? B_PAWN : W_PAWN);
+	memcpy(move, token->move, 5);
+}
+
+bool pgn_token_tag_is(const char *buf, const pgn_token *token, const char *name) {
+	return strlen(name) == token->name_len && !strncmp(buf + token->offset + 1, name, token->name_len);
+}
+
+void pgn_token_tag_value(const char *buf, const pgn_token *token, char *value, size_t size) {
+	size_t len = token->value_len < size - 1 ? token->value_len : size - 1;
+	memcpy(value, buf + token->value_offset, len);
+	value[len] = '\0';
+}
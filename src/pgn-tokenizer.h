@@ -0,0 +1,31 @@
+#ifndef CAIRO_BOARD_PGN_TOKENIZER_H
+#define CAIRO_BOARD_PGN_TOKENIZER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* One token of a PGN buffer: kind is MATCHED_MOVE, MATCHED_TAG or
+ * MATCHED_END_TOKEN like the values returned by san_scanner_lex().
+ * Offsets are relative to the start of the scanned buffer */
+typedef struct {
+	int kind;
+	unsigned int offset;
+	unsigned int len;
+	// tags
+	unsigned int value_offset;
+	unsigned int value_len;
+	unsigned char name_len;
+	// moves
+	char piece;   // piece letter, 0 for a pawn
+	char castle;  // 'K' or 'Q' for castling, 0 otherwise
+	char promo;   // promotion piece letter or 0
+	char move[5]; // destination and disambiguators, as the SAN scanner's currentMoveString
+} pgn_token;
+
+size_t pgn_tokenize(const char *buf, size_t len, size_t *pos, pgn_token *tokens, size_t max_tokens);
+void pgn_token_move(const pgn_token *token, int whose_turn, int *type, char move[5]);
+bool pgn_token_tag_is(const char *buf, const pgn_token *token, const char *name);
+void pgn_token_tag_value(const char *buf, const pgn_token *token, char *value, size_t size);
+const char *pgn_tokenizer_simd_name(void);
+
+#endif //CAIRO_BOARD_PGN_TOKENIZER_H
@@ -0,0 +1,126 @@
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include "position-snapshot.h"
+#include "chess-backend.h"
+
+#define SNAPSHOT_WORDS ((sizeof(position_snapshot) + sizeof(uint64_t) - 1) / sizeof(uint64_t))
+
+/* The snapshot is copied in and out one word at a time with relaxed atomics,
+ * so that a reader racing with a writer reads stale or mixed words, never
+ * half written ones, and then finds out from the sequence and retries */
+typedef union {
+	position_snapshot snapshot;
+	uint64_t words[SNAPSHOT_WORDS];
+} snapshot_words;
+
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER; // writers only
+static unsigned long sequence = 0; // odd while a new snapshot is being written
+static uint64_t published[SNAPSHOT_WORDS];
+static uint64_t last_version = 0;
+
+static unsigned long n_publishes = 0;
+static unsigned long n_reads = 0;
+static unsigned long n_retries = 0;
+
+/* Called by whichever thread just changed main_game, while it still owns it */
+void position_snapshot_publish(chess_game *game) {
+	snapshot_words copy;
+	memset(&copy, 0, sizeof(copy));
+	position_snapshot *snapshot = &copy.snapshot;
+
+	memcpy(snapshot->white_set, game->white_set, sizeof(snapshot->white_set));
+	memcpy(snapshot->black_set, game->black_set, sizeof(snapshot->black_set));
+	for (int col = 0; col < 8; col++) {
+		for (int row = 0; row < 8; row++) {
+			chess_piece *piece = game->squares[col][row].piece;
+			snapshot->squares[col][row] = (signed char) (piece != NULL ? piece->type : SNAPSHOT_EMPTY_SQUARE);
+		}
+	}
+	memcpy(snapshot->castle_state, game->castle_state, sizeof(snapshot->castle_state));
+	memcpy(snapshot->en_passant, game->en_passant, sizeof(snapshot->en_passant));
+	snapshot->whose_turn = game->whose_turn;
+	snapshot->fifty_move_counter = game->fifty_move_counter;
+	snapshot->current_move_number = game->current_move_number;
+	snapshot->ply_num = game->ply_num;
+	snapshot->current_hash = game->current_hash;
+	memcpy(snapshot->zobrist_hash_history, game->zobrist_hash_history, sizeof(snapshot->zobrist_hash_history));
+	snapshot->hash_history_index = game->hash_history_index;
+	generate_fen(snapshot->fen, game->squares, game->castle_state, game->en_passant, game->whose_turn);
+
+	pthread_mutex_lock(&publish_lock);
+	snapshot->version = ++last_version;
+
+	unsigned long seq = __atomic_load_n(&sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&sequence, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (size_t i = 0; i < SNAPSHOT_WORDS; i++) {
+		__atomic_store_n(&published[i], copy.words[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&sequence, seq + 2, __ATOMIC_RELEASE);
+	__sync_fetch_and_add(&n_publishes, 1);
+	pthread_mutex_unlock(&publish_lock);
+}
+
+/* Lock free, from any thread. Spins only while a publication is under way,
+ * which is a copy of a couple of kilobytes */
+void position_snapshot_read(position_snapshot *snapshot) {
+	snapshot_words copy;
+	for (;;) {
+		unsigned long before = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE);
+		if (!(before & 1)) {
+			for (size_t i = 0; i < SNAPSHOT_WORDS; i++) {
+				copy.words[i] = __atomic_load_n(&published[i], __ATOMIC_RELAXED);
+			}
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&sequence, __ATOMIC_RELAXED) == before) {
+				break;
+			}
+		}
+		__sync_fetch_and_add(&n_retries, 1);
+		sched_yield();
+	}
+	__sync_fetch_and_add(&n_reads, 1);
+	*snapshot = copy.snapshot;
+}
+
+/* Cheap check for a newer position, without copying it */
+uint64_t position_snapshot_version(void) {
+	return __atomic_load_n(&sequence, __ATOMIC_ACQUIRE) / 2;
+}
+
+/* Sets up game as clone_game() would from the game the snapshot was taken of.
+ * Pieces point back to their squares in game */
+void position_snapshot_to_game(const position_snapshot *snapshot, chess_game *game) {
+	for (int col = 0; col < 8; col++) {
+		for (int row = 0; row < 8; row++) {
+			game->squares[col][row].piece = NULL;
+		}
+	}
+	for (int i = 0; i < 16; i++) {
+		game->white_set[i] = snapshot->white_set[i];
+		game->black_set[i] = snapshot->black_set[i];
+		if (!game->white_set[i].dead) {
+			game->squares[game->white_set[i].pos.column][game->white_set[i].pos.row].piece = &game->white_set[i];
+		}
+		if (!game->black_set[i].dead) {
+			game->squares[game->black_set[i].pos.column][game->black_set[i].pos.row].piece = &game->black_set[i];
+		}
+	}
+	memcpy(game->castle_state, snapshot->castle_state, sizeof(game->castle_state));
+	memcpy(game->en_passant, snapshot->en_passant, sizeof(game->en_passant));
+	game->whose_turn = snapshot->whose_turn;
+	game->fifty_move_counter = snapshot->fifty_move_counter;
+	game->current_move_number = snapshot->current_move_number;
+	game->ply_num = snapshot->ply_num;
+	game->current_hash = snapshot->current_hash;
+	memcpy(game->zobrist_hash_history, snapshot->zobrist_hash_history, sizeof(game->zobrist_hash_history));
+	game->hash_history_index = snapshot->hash_history_index;
+}
+
+void position_snapshot_print_stats(FILE *out) {
+	fprintf(out, "Position snapshots: %lu published, %lu read, %lu reads retried\n",
+	        __atomic_load_n(&n_publishes, __ATOMIC_RELAXED), __atomic_load_n(&n_reads, __ATOMIC_RELAXED),
+	        __atomic_load_n(&n_retries, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,37 @@
+#ifndef CAIRO_BOARD_POSITION_SNAPSHOT_H
+#define CAIRO_BOARD_POSITION_SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cairo-board.h"
+
+#define SNAPSHOT_EMPTY_SQUARE (-1)
+
+/* Copy of main_game as it stood after a move, everything a reader on
+ * another thread needs to rebuild the position. Never changed once
+ * published, a new one with the next version replaces it */
+typedef struct {
+	uint64_t version;
+	chess_piece white_set[16];
+	chess_piece black_set[16];
+	signed char squares[8][8]; // piece type by [column][row], SNAPSHOT_EMPTY_SQUARE if none
+	int castle_state[2][2];
+	int en_passant[8];
+	int whose_turn;
+	int fifty_move_counter;
+	unsigned int current_move_number;
+	unsigned int ply_num;
+	uint64_t current_hash;
+	uint64_t zobrist_hash_history[50];
+	int hash_history_index;
+	char fen[128];
+} position_snapshot;
+
+void position_snapshot_publish(chess_game *game);
+void position_snapshot_read(position_snapshot *snapshot);
+uint64_t position_snapshot_version(void);
+void position_snapshot_to_game(const position_snapshot *snapshot, chess_game *game);
+void position_snapshot_print_stats(FILE *out);
+
+#endif //CAIRO_BOARD_POSITION_SNAPSHOT_H
@@ -0,0 +1,136 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include "render-quality.h"
+#include "time-source.h"
+
+extern int debug_flag;
+#ifndef debug
+#define debug(format, ...) if (debug_flag) fprintf(stdout, "%s:%d " format, __FUNCTION__, __LINE__, ##__VA_ARGS__)
+#endif
+
+/* Animation steps are 8ms apart: past 6ms of painting plus lateness per
+ * step the main loop has little left for anything else */
+#define REDUCED_LOAD_US 6000
+#define MINIMAL_LOAD_US 16000
+#define RESTORE_AFTER_US 1500000
+#define REDUCED_BACKLOG 2
+#define MINIMAL_BACKLOG 3
+
+static pthread_mutex_t quality_lock = PTHREAD_MUTEX_INITIALIZER;
+static render_quality level = RENDER_QUALITY_FULL;
+static int64_t load_us = 0; // moving average of frame cost plus lateness
+static int64_t last_pressure = 0;
+
+static const char *level_names[] = {"full", "reduced", "minimal"};
+
+/* <called with the quality lock held> */
+static void set_level(render_quality new_level, const char *why) {
+	if (new_level != level) {
+		debug("Render quality %s -> %s (%s, load %ldus)\n", level_names[level], level_names[new_level], why,
+		      (long) load_us);
+		level = new_level;
+	}
+}
+
+static void degrade_to(render_quality wanted, int64_t now, const char *why) {
+	last_pressure = now;
+	if (wanted > level) {
+		set_level(wanted, why);
+	}
+}
+
+/* One level at a time, each after a quiet period: no slow frame and no
+ * backlog for RESTORE_AFTER_US */
+static void maybe_restore(int64_t now) {
+	if (level == RENDER_QUALITY_FULL || now - last_pressure < RESTORE_AFTER_US) {
+		return;
+	}
+	set_level(level - 1, "quiet");
+	last_pressure = now;
+	// frames are sparse at lower levels, don't judge the next one on stale figures
+	load_us = 0;
+}
+/* </called with the quality lock held> */
+
+/* Reports a painted frame: how long it held the board, and how late its
+ * timer fired compared to when it was due */
+void render_quality_frame(int64_t cost_us, int64_t late_us) {
+	int64_t now = time_now_us();
+	int64_t sample = cost_us + (late_us > 0 ? late_us : 0);
+
+	pthread_mutex_lock(&quality_lock);
+	load_us += (sample - load_us) / 8;
+	if (load_us > MINIMAL_LOAD_US) {
+		degrade_to(RENDER_QUALITY_MINIMAL, now, "slow frames");
+	}
+	else if (load_us > REDUCED_LOAD_US) {
+		degrade_to(RENDER_QUALITY_REDUCED, now, "slow frames");
+	}
+	else if (sample > REDUCED_LOAD_US) {
+		last_pressure = now;
+	}
+	maybe_restore(now);
+	pthread_mutex_unlock(&quality_lock);
+}
+
+/* Reports how many animations are still running when a new move comes in */
+void render_quality_backlog(int pending_animations) {
+	int64_t now = time_now_us();
+
+	pthread_mutex_lock(&quality_lock);
+	if (pending_animations >= MINIMAL_BACKLOG) {
+		degrade_to(RENDER_QUALITY_MINIMAL, now, "moves piling up");
+	}
+	else if (pending_animations >= REDUCED_BACKLOG) {
+		degrade_to(RENDER_QUALITY_REDUCED, now, "moves piling up");
+	}
+	pthread_mutex_unlock(&quality_lock);
+}
+
+render_quality render_quality_level(void) {
+	pthread_mutex_lock(&quality_lock);
+	maybe_restore(time_now_us());
+	render_quality current = level;
+	pthread_mutex_unlock(&quality_lock);
+	return current;
+}
+
+/* Drops steps of an animation path in place, keeping the first and last
+ * points. Returns the new number of plots, 2 meaning a single step */
+int render_quality_thin_path(double **plots, int n_plots) {
+	render_quality current = render_quality_level();
+	if (current == RENDER_QUALITY_FULL || n_plots <= 2) {
+		return n_plots;
+	}
+
+	int stride = current == RENDER_QUALITY_REDUCED ? 2 : n_plots;
+	int kept = 1;
+	for (int i = stride; i < n_plots - 1; i += stride) {
+		plots[kept][0] = plots[i][0];
+		plots[kept][1] = plots[i][1];
+		kept++;
+	}
+	plots[kept][0] = plots[n_plots - 1][0];
+	plots[kept][1] = plots[n_plots - 1][1];
+	return kept + 1;
+}
+
+/* Pause between two frames of a dragged piece, the motion events in
+ * between are dropped */
+int64_t render_quality_drag_interval_us(void) {
+	switch (render_quality_level()) {
+		case RENDER_QUALITY_REDUCED:
+			return 8000;
+		case RENDER_QUALITY_MINIMAL:
+			return 16000;
+		default:
+			return 3000;
+	}
+}
+
+/* Whether the board should be repainted through gtk_widget_queue_draw_area()
+ * so that the damage of several moves ends up in a single frame */
+bool render_quality_coalesce(void) {
+	return render_quality_level() == RENDER_QUALITY_MINIMAL;
+}
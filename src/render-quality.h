@@ -0,0 +1,23 @@
+#ifndef CAIRO_BOARD_RENDER_QUALITY_H
+#define CAIRO_BOARD_RENDER_QUALITY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* How much of the board animation we can afford. Drops as soon as painting
+ * falls behind and climbs back one level at a time once things are quiet */
+typedef enum {
+	RENDER_QUALITY_FULL = 0,
+	RENDER_QUALITY_REDUCED, // every other animation step, fewer drag frames
+	RENDER_QUALITY_MINIMAL  // moves are shown at once and repaints are left to GTK to merge
+} render_quality;
+
+void render_quality_frame(int64_t cost_us, int64_t late_us);
+void render_quality_backlog(int pending_animations);
+render_quality render_quality_level(void);
+
+int render_quality_thin_path(double **plots, int n_plots);
+int64_t render_quality_drag_interval_us(void);
+bool render_quality_coalesce(void);
+
+#endif //CAIRO_BOARD_RENDER_QUALITY_H
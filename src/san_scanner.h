@@ -8,7 +8,9 @@
 int san_scanner_lex(void);
 void san_scanner_restart (FILE *input_file);
 // parser funcs
-YY_BUFFER_STATE san_scanner__scan_string(const char *yy_str);
+void san_scanner_feed(const char *bytes, int len);
+void san_scanner_feed_file(FILE *file);
+void san_scanner_print_stats(void);
 
 int char_to_type(int whose_turn, char);
 char type_to_char(int);
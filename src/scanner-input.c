@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scanner-input.h"
+#include "alloc-stats.h"
+
+void scanner_input_feed(scanner_input *in, const char *data, size_t len) {
+	in->data = data;
+	in->len = len;
+	in->pos = 0;
+
+	in->feeds++;
+	for (size_t i = 0; i < len; i++) {
+		if (data[i] == '\n') {
+			in->lines++;
+		}
+	}
+}
+
+/* YY_INPUT implementation: copy at most max_size pending bytes to buf,
+ * returning 0 (flex's YY_NULL) once the fed data is exhausted */
+int scanner_input_read(scanner_input *in, char *buf, int max_size) {
+	size_t remaining = in->len - in->pos;
+	size_t n = remaining < (size_t) max_size ? remaining : (size_t) max_size;
+	memcpy(buf, in->data + in->pos, n);
+	in->pos += n;
+	return (int) n;
+}
+
+/* NB: in is NULL while a reentrant scanner allocates its own state */
+void *scanner_input_alloc(scanner_input *in, size_t size) {
+	if (in) {
+		in->allocs++;
+	}
+	return tracked_malloc(ALLOC_SCANNERS, size);
+}
+
+void *scanner_input_realloc(scanner_input *in, void *ptr, size_t size) {
+	if (in) {
+		in->allocs++;
+	}
+	return tracked_realloc(ALLOC_SCANNERS, ptr, size);
+}
+
+void scanner_input_free(void *ptr) {
+	tracked_free(ALLOC_SCANNERS, ptr);
+}
+
+void scanner_input_print_stats(const char *name, scanner_input *in) {
+	unsigned long lines = in->lines ? in->lines : 1;
+	fprintf(stdout, "[%s scanner] %lu feeds, %lu lines, %lu allocations (%.4f per line)\n",
+	        name, in->feeds, in->lines, in->allocs, (double) in->allocs / lines);
+}
@@ -0,0 +1,28 @@
+#ifndef CAIRO_BOARD_SCANNER_INPUT_H
+#define CAIRO_BOARD_SCANNER_INPUT_H
+
+#include <stddef.h>
+
+/* Caller-owned input for the flex scanners.
+ * The scanners read through YY_INPUT from the bytes given to *_scanner_feed()
+ * so their internal buffer is allocated once and reused for every feed,
+ * instead of the malloc + copy that *_scan_bytes() does on each call. */
+typedef struct {
+	const char *data;
+	size_t len;
+	size_t pos;
+
+	/* allocation statistics, see scanner_input_print_stats() */
+	unsigned long feeds;
+	unsigned long lines;
+	unsigned long allocs;
+} scanner_input;
+
+void scanner_input_feed(scanner_input *in, const char *data, size_t len);
+int scanner_input_read(scanner_input *in, char *buf, int max_size);
+void *scanner_input_alloc(scanner_input *in, size_t size);
+void *scanner_input_realloc(scanner_input *in, void *ptr, size_t size);
+void scanner_input_free(void *ptr);
+void scanner_input_print_stats(const char *name, scanner_input *in);
+
+#endif //CAIRO_BOARD_SCANNER_INPUT_H
@@ -0,0 +1,373 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "task-pool.h"
+
+#define TASK_DEQUE_INITIAL_SIZE 64
+
+typedef struct {
+	task_function function;
+	void *data;
+	task_group *group;
+} task;
+
+/* The owning worker pushes and pops at the bottom (newest first, cache
+ * friendly), thieves take from the top (oldest, usually the biggest work) */
+typedef struct {
+	task *tasks;
+	int top;
+	int bottom;
+	int alloc;
+} task_deque;
+
+typedef struct {
+	pthread_t thread;
+	int index;
+	pthread_mutex_t lock;
+	task_deque deques[TASK_PRIORITIES];
+} task_worker;
+
+struct task_group {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+	bool cancelled;
+};
+
+static task_worker *workers = NULL;
+static int n_workers = 0;
+// workers asked for by init_task_pool(), started by the first task or task_pool_size()
+static int n_requested = 0;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int current_worker = -1;
+static unsigned int next_victim = 0;
+
+/* queued counts tasks sitting in the deques, idle workers sleep on it */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+static int queued = 0;
+static bool pool_running = false;
+static bool pool_started = false;
+
+/* <deque helpers, called with the worker lock held> */
+static void deque_push(task_deque *deque, task *t) {
+	if (deque->bottom == deque->alloc) {
+		if (deque->top > 0) {
+			memmove(deque->tasks, deque->tasks + deque->top, (deque->bottom - deque->top) * sizeof(task));
+			deque->bottom -= deque->top;
+			deque->top = 0;
+		}
+		else {
+			int new_alloc = deque->alloc ? deque->alloc * 2 : TASK_DEQUE_INITIAL_SIZE;
+			task *temp = realloc(deque->tasks, new_alloc * sizeof(task));
+			if (!temp) {
+				perror("Realloc failed!!");
+				abort();
+			}
+			deque->tasks = temp;
+			deque->alloc = new_alloc;
+		}
+	}
+	deque->tasks[deque->bottom++] = *t;
+}
+
+static bool deque_pop_bottom(task_deque *deque, task *t) {
+	if (deque->top == deque->bottom) {
+		return false;
+	}
+	*t = deque->tasks[--deque->bottom];
+	if (deque->top == deque->bottom) {
+		deque->top = deque->bottom = 0;
+	}
+	return true;
+}
+
+static bool deque_take_top(task_deque *deque, task *t) {
+	if (deque->top == deque->bottom) {
+		return false;
+	}
+	*t = deque->tasks[deque->top++];
+	if (deque->top == deque->bottom) {
+		deque->top = deque->bottom = 0;
+	}
+	return true;
+}
+/* </deque helpers> */
+
+/* Highest priority first: our own work, then anybody else's */
+static bool take_task(int self, task *t) {
+	for (int priority = 0; priority < TASK_PRIORITIES; priority++) {
+		if (self >= 0) {
+			pthread_mutex_lock(&workers[self].lock);
+			bool found = deque_pop_bottom(&workers[self].deques[priority], t);
+			pthread_mutex_unlock(&workers[self].lock);
+			if (found) {
+				goto found;
+			}
+		}
+		int start = self >= 0 ? self + 1 : 0;
+		for (int k = 0; k < n_workers; k++) {
+			int victim = (start + k) % n_workers;
+			if (victim == self) {
+				continue;
+			}
+			pthread_mutex_lock(&workers[victim].lock);
+			bool found = deque_take_top(&workers[victim].deques[priority], t);
+			pthread_mutex_unlock(&workers[victim].lock);
+			if (found) {
+				goto found;
+			}
+		}
+	}
+	return false;
+
+found:
+	pthread_mutex_lock(&idle_lock);
+	queued--;
+	pthread_mutex_unlock(&idle_lock);
+	return true;
+}
+
+static void run_task(task *t) {
+	if (!task_group_is_cancelled(t->group)) {
+		t->function(t->data, t->group);
+	}
+	pthread_mutex_lock(&t->group->lock);
+	if (--t->group->pending == 0) {
+		pthread_cond_broadcast(&t->group->done);
+	}
+	pthread_mutex_unlock(&t->group->lock);
+}
+
+static void *task_worker_function(void *data) {
+	task_worker *worker = data;
+	current_worker = worker->index;
+	task t;
+
+	// n_workers is only known once every worker asked for was tried
+	pthread_mutex_lock(&idle_lock);
+	while (!pool_started) {
+		pthread_cond_wait(&work_available, &idle_lock);
+	}
+	pthread_mutex_unlock(&idle_lock);
+
+	for (;;) {
+		if (take_task(worker->index, &t)) {
+			run_task(&t);
+			continue;
+		}
+		pthread_mutex_lock(&idle_lock);
+		while (queued == 0 && pool_running) {
+			pthread_cond_wait(&work_available, &idle_lock);
+		}
+		// tasks still queued at shutdown are drained first
+		bool finished = queued == 0 && !pool_running;
+		pthread_mutex_unlock(&idle_lock);
+		if (finished) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Once, before the first task: sessions that never use the pool never
+ * start a thread. With fewer workers than asked for the pool makes do,
+ * without any tasks run on the submitting thread */
+static void start_workers(void) {
+	pthread_mutex_lock(&start_lock);
+	int n = n_requested;
+	if (n <= 0) {
+		pthread_mutex_unlock(&start_lock);
+		return;
+	}
+	workers = calloc((size_t) n, sizeof(task_worker));
+	if (workers == NULL) {
+		perror("Failed to allocate task pool workers");
+		pthread_mutex_unlock(&start_lock);
+		return;
+	}
+	pool_running = true;
+	int started = 0;
+	for (; started < n; started++) {
+		workers[started].index = started;
+		pthread_mutex_init(&workers[started].lock, NULL);
+		if (pthread_create(&workers[started].thread, NULL, task_worker_function, &workers[started])) {
+			perror("Failed to start task pool worker");
+			pthread_mutex_destroy(&workers[started].lock);
+			break;
+		}
+	}
+	// only the workers running are stolen from and joined; nothing is queued yet
+	pthread_mutex_lock(&idle_lock);
+	n_workers = started;
+	pool_started = true;
+	pthread_cond_broadcast(&work_available);
+	pthread_mutex_unlock(&idle_lock);
+	if (started == 0) {
+		pool_running = false;
+		free(workers);
+		workers = NULL;
+	}
+	pthread_mutex_unlock(&start_lock);
+}
+
+static void ensure_started(void) {
+	pthread_once(&start_once, start_workers);
+}
+
+/* Sets up n workers, 0 means one per online CPU. They are started with
+ * the first task */
+int init_task_pool(int n) {
+	if (n <= 0) {
+		long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = n_cpus > 0 ? (int) n_cpus : 1;
+	}
+	pthread_mutex_lock(&start_lock);
+	n_requested = n;
+	pthread_mutex_unlock(&start_lock);
+	return 0;
+}
+
+void cleanup_task_pool(void) {
+	pthread_mutex_lock(&start_lock);
+	// a pool not started yet stays so
+	n_requested = 0;
+	if (workers == NULL) {
+		pthread_mutex_unlock(&start_lock);
+		return;
+	}
+	pthread_mutex_lock(&idle_lock);
+	pool_running = false;
+	pthread_cond_broadcast(&work_available);
+	pthread_mutex_unlock(&idle_lock);
+
+	// workers still draining steal from each other, so no lock goes before all are done
+	for (int i = 0; i < n_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	for (int i = 0; i < n_workers; i++) {
+		pthread_mutex_destroy(&workers[i].lock);
+		for (int priority = 0; priority < TASK_PRIORITIES; priority++) {
+			free(workers[i].deques[priority].tasks);
+		}
+	}
+	free(workers);
+	workers = NULL;
+	n_workers = 0;
+	pthread_mutex_unlock(&start_lock);
+}
+
+int task_pool_size(void) {
+	ensure_started();
+	return n_workers;
+}
+
+/* Index of the calling worker, e.g. for per-worker scratch buffers, -1 outside the pool */
+int task_pool_worker_index(void) {
+	return current_worker;
+}
+
+task_group *task_group_new(void) {
+	task_group *group = calloc(1, sizeof(task_group));
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->done, NULL);
+	return group;
+}
+
+/* The group must have been waited on */
+void task_group_free(task_group *group) {
+	pthread_mutex_destroy(&group->lock);
+	pthread_cond_destroy(&group->done);
+	free(group);
+}
+
+/* Tasks submitted from a worker go to its own deque, others are spread
+ * round robin. Without a pool the task runs right away */
+void task_pool_submit(task_group *group, task_priority priority, task_function function, void *data) {
+	task t = {function, data, group};
+
+	pthread_mutex_lock(&group->lock);
+	group->pending++;
+	pthread_mutex_unlock(&group->lock);
+
+	ensure_started();
+	if (n_workers == 0) {
+		run_task(&t);
+		return;
+	}
+
+	int target = current_worker;
+	if (target < 0) {
+		target = (int) (__sync_fetch_and_add(&next_victim, 1) % (unsigned int) n_workers);
+	}
+	pthread_mutex_lock(&workers[target].lock);
+	deque_push(&workers[target].deques[priority], &t);
+	pthread_mutex_unlock(&workers[target].lock);
+
+	pthread_mutex_lock(&idle_lock);
+	queued++;
+	pthread_cond_signal(&work_available);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+/* Queued tasks of the group are skipped, running ones should poll
+ * task_group_is_cancelled() and return early */
+void task_group_cancel(task_group *group) {
+	pthread_mutex_lock(&group->lock);
+	group->cancelled = true;
+	pthread_mutex_unlock(&group->lock);
+}
+
+bool task_group_is_cancelled(task_group *group) {
+	pthread_mutex_lock(&group->lock);
+	bool cancelled = group->cancelled;
+	pthread_mutex_unlock(&group->lock);
+	return cancelled;
+}
+
+/* Blocks until every task of the group has run or been skipped.
+ * A worker waiting on a group keeps running tasks meanwhile so nested
+ * waits can't starve the pool */
+void task_group_wait(task_group *group) {
+	if (current_worker < 0) {
+		pthread_mutex_lock(&group->lock);
+		while (group->pending > 0) {
+			pthread_cond_wait(&group->done, &group->lock);
+		}
+		pthread_mutex_unlock(&group->lock);
+		return;
+	}
+
+	task t;
+	for (;;) {
+		pthread_mutex_lock(&group->lock);
+		int pending = group->pending;
+		pthread_mutex_unlock(&group->lock);
+		if (pending == 0) {
+			return;
+		}
+		if (take_task(current_worker, &t)) {
+			run_task(&t);
+			continue;
+		}
+		// the rest is running elsewhere
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_mutex_lock(&group->lock);
+		if (group->pending > 0) {
+			pthread_cond_timedwait(&group->done, &group->lock, &deadline);
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef CAIRO_BOARD_TASK_POOL_H
+#define CAIRO_BOARD_TASK_POOL_H
+
+#include <stdbool.h>
+
+typedef enum {
+	TASK_PRIORITY_HIGH = 0,
+	TASK_PRIORITY_NORMAL,
+	TASK_PRIORITY_LOW,
+	TASK_PRIORITIES
+} task_priority;
+
+/* Tasks are submitted to a group, which can be waited on or cancelled as a whole */
+typedef struct task_group task_group;
+
+typedef void (*task_function)(void *data, task_group *group);
+
+int init_task_pool(int n_workers);
+void cleanup_task_pool(void);
+int task_pool_size(void);
+int task_pool_worker_index(void);
+
+task_group *task_group_new(void);
+void task_group_free(task_group *group);
+void task_pool_submit(task_group *group, task_priority priority, task_function function, void *data);
+void task_group_cancel(task_group *group);
+bool task_group_is_cancelled(task_group *group);
+void task_group_wait(task_group *group);
+
+#endif //CAIRO_BOARD_TASK_POOL_H
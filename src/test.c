@@ -1,4 +1,7 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
 #include <gtk/gtk.h>
 #include <unistd.h>
 #include <string.h>
@@ -7,6 +10,10 @@
 #include "cairo-board.h"
 #include "chess-backend.h"
 #include "channels.h"
+#include "san_scanner.h"
+#include "pgn-tokenizer.h"
+#include "clocks.h"
+#include "time-source.h"
 
 
 gboolean test_animate_random_step(gpointer data);
@@ -135,3 +142,1092 @@ void test_random_title(void) {
 void test_observe(void) {
 	g_timeout_add(15000, observe_cairo_guest_one, NULL);
 }
+
+/* <Input latency benchmark>
+ * Injects synthetic button/motion events on the board at a fixed rate and
+ * measures the time from each event to the first frame clock tick at which
+ * the result of that event is on screen. */
+
+#define LATENCY_ITERATIONS 100
+#define LATENCY_EVENT_INTERVAL_MS 8
+#define LATENCY_DRAG_STEPS 16
+#define LATENCY_PROBE_TIMEOUT_US 500000
+#define LATENCY_RESET_FRAMES 10
+
+enum _latency_phase {
+	LATENCY_MOUSE_DOWN = 0,
+	LATENCY_DRAGGING,
+	LATENCY_MOUSE_UP,
+	LATENCY_CLICK_MOVE,
+	LATENCY_N_PHASES
+};
+
+static const char *latency_phase_names[LATENCY_N_PHASES] = {
+	"handle_left_mouse_down",
+	"process_moves dragging",
+	"handle_left_mouse_up",
+	"click-to-move (auto_move)"
+};
+
+static struct {
+	bool click_to_move;
+	int iteration;
+	int step;
+	int reset_frames;
+	guint tick_id;
+
+	// the event we're waiting to see on screen
+	bool probing;
+	int probe_phase;
+	gint64 probe_start;
+	int probe_x;
+	int probe_y;
+
+	GArray *samples[LATENCY_N_PHASES];
+	int missed[LATENCY_N_PHASES];
+} latency;
+
+static GdkDevice *latency_pointer(void) {
+	GdkSeat *seat = gdk_display_get_default_seat(gdk_display_get_default());
+	return gdk_seat_get_pointer(seat);
+}
+
+static void inject_button(GdkEventType type, guint button, int x, int y) {
+	GdkEvent *event = gdk_event_new(type);
+	event->button.window = g_object_ref(gtk_widget_get_window(board));
+	event->button.send_event = TRUE;
+	event->button.time = GDK_CURRENT_TIME;
+	event->button.x = x;
+	event->button.y = y;
+	event->button.button = button;
+	event->button.state = (type == GDK_BUTTON_RELEASE) ? GDK_BUTTON1_MASK : 0;
+	gdk_event_set_device(event, latency_pointer());
+	gtk_main_do_event(event);
+	gdk_event_free(event);
+}
+
+static void inject_motion(int x, int y) {
+	GdkEvent *event = gdk_event_new(GDK_MOTION_NOTIFY);
+	event->motion.window = g_object_ref(gtk_widget_get_window(board));
+	event->motion.send_event = TRUE;
+	event->motion.time = GDK_CURRENT_TIME;
+	event->motion.x = x;
+	event->motion.y = y;
+	event->motion.state = GDK_BUTTON1_MASK;
+	gdk_event_set_device(event, latency_pointer());
+	gtk_main_do_event(event);
+	gdk_event_free(event);
+}
+
+static void start_probe(int phase, int x, int y) {
+	latency.probing = true;
+	latency.probe_phase = phase;
+	latency.probe_x = x;
+	latency.probe_y = y;
+}
+
+/* Has the effect of the probed event reached the screen? */
+static bool probe_satisfied(void) {
+	switch (latency.probe_phase) {
+		case LATENCY_MOUSE_DOWN:
+			return is_moveit_flag();
+		case LATENCY_DRAGGING: {
+			double x, y;
+			get_dragging_prev_xy(&x, &y);
+			return !is_more_events_flag() && (int) x == latency.probe_x && (int) y == latency.probe_y;
+		}
+		case LATENCY_MOUSE_UP:
+		case LATENCY_CLICK_MOVE: {
+			chess_piece *piece = main_game->squares[4][3].piece;
+			return !is_moveit_flag() && piece != NULL && piece->type == W_PAWN && get_anim_for_piece(piece) == NULL;
+		}
+		default:
+			return true;
+	}
+}
+
+static gint compare_gint64(gconstpointer a, gconstpointer b) {
+	gint64 va = *(const gint64 *) a;
+	gint64 vb = *(const gint64 *) b;
+	return (va > vb) - (va < vb);
+}
+
+static void print_latency_results(void) {
+	fprintf(stdout, "Input latency over %d %s moves (event -> first frame showing the result):\n",
+	        LATENCY_ITERATIONS, latency.click_to_move ? "click-click" : "drag");
+	for (int i = 0; i < LATENCY_N_PHASES; i++) {
+		GArray *s = latency.samples[i];
+		if (!s->len) {
+			// every probe timed out, or the phase never ran
+			if (latency.missed[i]) {
+				fprintf(stdout, "  %-26s n=0     missed=%d\n", latency_phase_names[i], latency.missed[i]);
+			}
+		}
+		else {
+			g_array_sort(s, compare_gint64);
+			gint64 *v = (gint64 *) s->data;
+			fprintf(stdout, "  %-26s n=%-5u p50=%6.2fms p90=%6.2fms p99=%6.2fms max=%6.2fms missed=%d\n",
+			        latency_phase_names[i], s->len,
+			        v[s->len * 50 / 100] / 1000.0, v[s->len * 90 / 100] / 1000.0,
+			        v[s->len * 99 / 100] / 1000.0, v[s->len - 1] / 1000.0,
+			        latency.missed[i]);
+		}
+		g_array_free(s, TRUE);
+		latency.samples[i] = NULL;
+	}
+	if (alloc_stats_enabled()) {
+		alloc_stats_report(stdout);
+	}
+}
+
+static gboolean latency_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data) {
+	if (latency.probing) {
+		gint64 now = g_get_monotonic_time();
+		if (probe_satisfied()) {
+			gint64 elapsed = now - latency.probe_start;
+			g_array_append_val(latency.samples[latency.probe_phase], elapsed);
+			latency.probing = false;
+		}
+		else if (now - latency.probe_start > LATENCY_PROBE_TIMEOUT_US) {
+			latency.missed[latency.probe_phase]++;
+			latency.probing = false;
+		}
+	}
+	else if (latency.reset_frames > 0) {
+		latency.reset_frames--;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+/* Drives one step of the current iteration, never overlapping probes */
+static gboolean latency_step(gpointer data) {
+	if (latency.probing || latency.reset_frames > 0) {
+		return TRUE;
+	}
+
+	int wi = gtk_widget_get_allocated_width(board);
+	int hi = gtk_widget_get_allocated_height(board);
+	double e2[2], e4[2];
+	loc_to_xy(4, 1, e2, wi, hi);
+	loc_to_xy(4, 3, e4, wi, hi);
+
+	int last_step;
+	if (latency.click_to_move) {
+		last_step = 4;
+		switch (latency.step) {
+			case 0:
+				start_probe(LATENCY_MOUSE_DOWN, (int) e2[0], (int) e2[1]);
+				latency.probe_start = g_get_monotonic_time();
+				inject_button(GDK_BUTTON_PRESS, 1, (int) e2[0], (int) e2[1]);
+				break;
+			case 1:
+				inject_button(GDK_BUTTON_RELEASE, 1, (int) e2[0], (int) e2[1]);
+				break;
+			case 2:
+				start_probe(LATENCY_CLICK_MOVE, (int) e4[0], (int) e4[1]);
+				latency.probe_start = g_get_monotonic_time();
+				inject_button(GDK_BUTTON_PRESS, 1, (int) e4[0], (int) e4[1]);
+				break;
+			case 3:
+				inject_button(GDK_BUTTON_RELEASE, 1, (int) e4[0], (int) e4[1]);
+				break;
+			default:
+				break;
+		}
+	}
+	else {
+		last_step = LATENCY_DRAG_STEPS + 2;
+		if (latency.step == 0) {
+			start_probe(LATENCY_MOUSE_DOWN, (int) e2[0], (int) e2[1]);
+			latency.probe_start = g_get_monotonic_time();
+			inject_button(GDK_BUTTON_PRESS, 1, (int) e2[0], (int) e2[1]);
+		}
+		else if (latency.step <= LATENCY_DRAG_STEPS) {
+			double t = (double) latency.step / LATENCY_DRAG_STEPS;
+			int x = (int) (e2[0] + t * (e4[0] - e2[0]));
+			int y = (int) (e2[1] + t * (e4[1] - e2[1]));
+			start_probe(LATENCY_DRAGGING, x, y);
+			latency.probe_start = g_get_monotonic_time();
+			inject_motion(x, y);
+		}
+		else if (latency.step == LATENCY_DRAG_STEPS + 1) {
+			start_probe(LATENCY_MOUSE_UP, (int) e4[0], (int) e4[1]);
+			latency.probe_start = g_get_monotonic_time();
+			inject_button(GDK_BUTTON_RELEASE, 1, (int) e4[0], (int) e4[1]);
+		}
+	}
+
+	if (latency.step == last_step) {
+		// middle click resets the game and board
+		inject_button(GDK_BUTTON_PRESS, 2, (int) e2[0], (int) e2[1]);
+		latency.reset_frames = LATENCY_RESET_FRAMES;
+		latency.step = 0;
+		latency.iteration++;
+		if (latency.iteration == LATENCY_ITERATIONS) {
+			gtk_widget_remove_tick_callback(board, latency.tick_id);
+			print_latency_results();
+			gtk_main_quit();
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	latency.step++;
+	return TRUE;
+}
+
+static gboolean start_input_latency(gpointer data) {
+	latency.tick_id = gtk_widget_add_tick_callback(board, latency_tick, NULL, NULL);
+	gdk_threads_add_timeout(LATENCY_EVENT_INTERVAL_MS, latency_step, NULL);
+	return FALSE;
+}
+
+void test_input_latency(bool click_to_move) {
+	memset(&latency, 0, sizeof(latency));
+	latency.click_to_move = click_to_move;
+	for (int i = 0; i < LATENCY_N_PHASES; i++) {
+		latency.samples[i] = g_array_sized_new(FALSE, FALSE, sizeof(gint64), LATENCY_ITERATIONS * LATENCY_DRAG_STEPS);
+	}
+	// give the window time to be mapped and painted
+	gdk_threads_add_timeout(1000, start_input_latency, NULL);
+}
+/* </Input latency benchmark> */
+
+/* <PGN tokenizer check> */
+#define PGN_CHECK_BATCH 256
+
+typedef struct {
+	int kind;
+	int type;
+	char move[5];
+} pgn_check_token;
+
+static double elapsed_seconds(struct timeval *start, struct timeval *end) {
+	struct timeval diff;
+	timersub(end, start, &diff);
+	return diff.tv_sec + diff.tv_usec / 1e6;
+}
+
+/* Runs both the flex SAN scanner and the SIMD tokenizer over every *.pgn in
+ * dir, reports the first token they disagree on per file and the throughput
+ * of both. Moves are compared as seen from white, like the scanner does
+ * before the game is replayed. Returns the number of files that differ */
+int test_pgn_tokenizer(const char *dir_path) {
+	GError *error = NULL;
+	GDir *dir = g_dir_open(dir_path, 0, &error);
+	if (dir == NULL) {
+		fprintf(stderr, "Error opening directory '%s': %s\n", dir_path, error->message);
+		g_error_free(error);
+		return -1;
+	}
+
+	printf("PGN tokenizer check using %s\n", pgn_tokenizer_simd_name());
+
+	const gchar *name;
+	int n_files = 0;
+	int n_failed = 0;
+	size_t total_bytes = 0;
+	double flex_time = 0;
+	double simd_time = 0;
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		if (!g_str_has_suffix(name, ".pgn")) {
+			continue;
+		}
+		gchar *path = g_build_filename(dir_path, name, NULL);
+		gchar *contents;
+		gsize len;
+		if (!g_file_get_contents(path, &contents, &len, &error)) {
+			fprintf(stderr, "Error reading '%s': %s\n", path, error->message);
+			g_clear_error(&error);
+			g_free(path);
+			continue;
+		}
+		n_files++;
+		total_bytes += len;
+
+		struct timeval start, end;
+		GArray *expected = g_array_new(FALSE, FALSE, sizeof(pgn_check_token));
+		init_game_position(main_game);
+		gettimeofday(&start, NULL);
+		san_scanner_feed(contents, (int) len);
+		int kind;
+		while ((kind = san_scanner_lex()) != SAN_EOF_TYPE) {
+			pgn_check_token token = {kind, 0, {0}};
+			if (kind == MATCHED_MOVE) {
+				token.type = type;
+				strncpy(token.move, currentMoveString, sizeof(token.move) - 1);
+			}
+			g_array_append_val(expected, token);
+		}
+		gettimeofday(&end, NULL);
+		flex_time += elapsed_seconds(&start, &end);
+
+		GArray *found = g_array_sized_new(FALSE, FALSE, sizeof(pgn_token), expected->len);
+		pgn_token tokens[PGN_CHECK_BATCH];
+		size_t pos = 0;
+		size_t n_tokens;
+		gettimeofday(&start, NULL);
+		while ((n_tokens = pgn_tokenize(contents, len, &pos, tokens, PGN_CHECK_BATCH)) > 0) {
+			g_array_append_vals(found, tokens, (guint) n_tokens);
+		}
+		gettimeofday(&end, NULL);
+		simd_time += elapsed_seconds(&start, &end);
+
+		guint n = MIN(expected->len, found->len);
+		guint k;
+		for (k = 0; k < n; k++) {
+			pgn_check_token *want = &g_array_index(expected, pgn_check_token, k);
+			pgn_token *got = &g_array_index(found, pgn_token, k);
+			if (want->kind != got->kind) {
+				break;
+			}
+			if (want->kind == MATCHED_MOVE) {
+				int got_type;
+				char got_move[5];
+				pgn_token_move(got, WHITE, &got_type, got_move);
+				if (want->type != got_type || strcmp(want->move, got_move)) {
+					break;
+				}
+			}
+		}
+		if (k < n || expected->len != found->len) {
+			n_failed++;
+			printf("%s: token %u differs (scanner %u tokens, tokenizer %u)", name, k, expected->len, found->len);
+			if (k < found->len) {
+				pgn_token *got = &g_array_index(found, pgn_token, k);
+				printf(" at offset %u '%.*s'", got->offset, (int) got->len, contents + got->offset);
+			}
+			printf("\n");
+		}
+		else {
+			debug("%s: %u tokens match\n", name, found->len);
+		}
+
+		g_array_free(expected, TRUE);
+		g_array_free(found, TRUE);
+		g_free(contents);
+		g_free(path);
+	}
+	g_dir_close(dir);
+
+	double mb = total_bytes / (1024.0 * 1024.0);
+	printf("%d files, %.1f MB, %d differ\n", n_files, mb, n_failed);
+	if (flex_time > 0 && simd_time > 0) {
+		printf("flex scanner: %8.1f MB/s\n", mb / flex_time);
+		printf("tokenizer:    %8.1f MB/s (%.1fx)\n", mb / simd_time, flex_time / simd_time);
+	}
+	return n_failed;
+}
+/* </PGN tokenizer check> */
+
+/* <Virtual time clock check> */
+#define CLOCK_CHECK_INITIAL_TIME 60 // seconds
+#define CLOCK_CHECK_TICK 100000 // checks are made every 100ms of virtual time
+#define CLOCK_CHECK_FLAG_MARGIN 250000
+
+static long expected_ms(int64_t us) {
+	return us < 0 ? 0 : (long) (us / 1000);
+}
+
+/* Compares what the clock says against what it should say */
+static int check_clock_state(chess_clock *clock, int64_t expected_us[2], int game, int ply) {
+	int errors = 0;
+	for (int color = 0; color < 2; color++) {
+		long remaining = get_remaining_time(clock, color);
+		if (remaining != expected_ms(expected_us[color])) {
+			printf("game %d ply %d: %s has %ldms left, expected %ldms\n", game, ply,
+			       color ? "black" : "white", remaining, expected_ms(expected_us[color]));
+			errors++;
+		}
+		bool expired = expected_us[color] < -CLOCK_CHECK_FLAG_MARGIN;
+		if (!is_clock_expired(clock, color) != !expired) {
+			printf("game %d ply %d: %s flag %s at %ldms\n", game, ply, color ? "black" : "white",
+			       expired ? "didn't fall" : "fell", (long) (expected_us[color] / 1000));
+			errors++;
+		}
+	}
+	long mine = expected_ms(expected_us[0]);
+	long theirs = expected_ms(expected_us[1]);
+	int low = theirs > 0 && 1000 * mine / theirs < 667;
+	if (am_low_on_time(clock) != low) {
+		printf("game %d ply %d: low on time is %d at %ldms vs %ldms\n", game, ply, !low, mine, theirs);
+		errors++;
+	}
+	return errors;
+}
+
+/* Plays n_games of random think times on a real clock driven by virtual
+ * time, until a flag falls, checking the remaining times, the flag fall and
+ * the low on time warning every 100ms and after every move.
+ * Returns the number of failed checks */
+int test_clocks_virtual_time(int n_games) {
+	long n_checks = 0;
+	int errors = 0;
+	int64_t virtual_elapsed = 0;
+	struct timeval start, end;
+
+	time_source_use_virtual();
+	gettimeofday(&start, NULL);
+	for (int game = 0; game < n_games && errors == 0; game++) {
+		srand((unsigned int) game);
+		chess_clock *clock = clock_new(CLOCK_CHECK_INITIAL_TIME, 0, 1);
+		int64_t expected_us[2] = {CLOCK_CHECK_INITIAL_TIME * 1000000LL, CLOCK_CHECK_INITIAL_TIME * 1000000LL};
+
+		int side = 0;
+		start_one_clock(clock, side);
+		for (int ply = 0; errors == 0; ply++) {
+			// black thinks a bit longer so that flags fall on both sides
+			int64_t think = (rand() % (side ? 3000 : 2500) + 1) * 1000LL;
+			bool flagged = false;
+			for (; think >= CLOCK_CHECK_TICK; think -= CLOCK_CHECK_TICK) {
+				time_source_advance_us(CLOCK_CHECK_TICK);
+				virtual_elapsed += CLOCK_CHECK_TICK;
+				expected_us[side] -= CLOCK_CHECK_TICK;
+				errors += check_clock_state(clock, expected_us, game, ply);
+				n_checks++;
+				if (errors || is_clock_expired(clock, side)) {
+					flagged = true;
+					break;
+				}
+			}
+			if (flagged || errors) {
+				break;
+			}
+			// moves fall between two updates of the runners
+			time_source_advance_us(think);
+			virtual_elapsed += think;
+			expected_us[side] -= think;
+			side = !side;
+			start_one_stop_other_clock(clock, side, false);
+			errors += check_clock_state(clock, expected_us, game, ply);
+			n_checks++;
+		}
+		clock_destroy(clock);
+	}
+	gettimeofday(&end, NULL);
+	time_source_use_real();
+
+	double real_elapsed = elapsed_seconds(&start, &end);
+	printf("%d games, %ld clock checks, %d failed\n", n_games, n_checks, errors);
+	if (real_elapsed > 0) {
+		printf("%.0fs of clock time in %.2fs (%.0fx real time)\n", virtual_elapsed / 1e6, real_elapsed,
+		       virtual_elapsed / 1e6 / real_elapsed);
+	}
+	return errors;
+}
+/* </Virtual time clock check> */
+
+/* <Golden image rendering check> */
+/* Per channel difference ignored, for antialiasing and font hinting */
+#define RENDER_CHECK_CHANNEL_TOLERANCE 3
+/* Pixels over the tolerance allowed per 10000 */
+#define RENDER_CHECK_BAD_PIXELS 10
+
+typedef struct {
+	const char *name;
+	const char *moves; // coordinates, a fifth letter for promotions
+	int pre_move[4];
+	bool flipped;
+} render_check_case;
+
+typedef struct {
+	const char *name;
+	const char *pieces_dir;
+	double dark[3];
+	double light[3];
+} render_check_theme;
+
+static const render_check_case render_cases[] = {
+		{"start",     "",                                             {-1}, false},
+		{"castling",  "e2e4 e7e5 g1f3 b8c6 f1c4 g8f6 e1g1 f8c5",      {-1}, false},
+		{"promotion", "a2a4 b7b5 a4b5 a7a6 b5a6 c8b7 a6b7 b8c6 b7a8q", {-1}, false},
+		{"check",     "e2e4 f7f6 d2d4 e7e6 d1h5",                     {-1}, false},
+		{"premove",   "e2e4",                                         {6, 0, 5, 2}, false},
+		{"flipped",   "e2e4 c7c5 g1f3",                               {-1}, true},
+};
+
+static const render_check_theme render_themes[] = {
+		{"commons", "themes/commons/", {109.0 / 255.0, 129.0 / 255.0, 179.0 / 255.0}, {239.0 / 255.0, 239.0 / 255.0, 239.0 / 255.0}},
+		{"fantasy", "themes/fantasy/", {118.0 / 255.0, 150.0 / 255.0, 86.0 / 255.0}, {238.0 / 255.0, 238.0 / 255.0, 210.0 / 255.0}},
+};
+
+/* 8 doesn't divide 333: squares and pieces land on fractional pixels */
+static const int render_sizes[] = {160, 333, 512};
+
+/* Plays the case's moves without animation and sets up the highlights the
+ * way the board does after a move */
+static int setup_render_case(const render_check_case *rcase, int size) {
+	init_game_position(main_game);
+	reset_highlights();
+	unset_pre_move();
+	set_board_flipped(rcase->flipped);
+	init_highlight_under_surface(size, size);
+
+	const char *m = rcase->moves;
+	int last[4] = {-1, -1, -1, -1};
+	while (*m) {
+		int move[4] = {m[0] - 'a', m[1] - '1', m[2] - 'a', m[3] - '1'};
+		chess_piece *piece = main_game->squares[move[0]][move[1]].piece;
+		if (piece == NULL) {
+			fprintf(stderr, "No piece to move for '%.4s' in case %s\n", m, rcase->name);
+			return 1;
+		}
+		const char *move_text = m;
+		m += 4;
+		if (*m && *m != ' ') {
+			main_game->promo_type = char_to_type(main_game->whose_turn, (char) toupper(*m));
+			m++;
+		}
+		char san[SAN_MOVE_SIZE];
+		if (move_piece(piece, move[2], move[3], 1, AUTO_SOURCE_NO_ANIM, san, main_game, true) < 0) {
+			fprintf(stderr, "Illegal move '%.4s' in case %s\n", move_text, rcase->name);
+			return 1;
+		}
+		memcpy(last, move, sizeof(last));
+		while (*m == ' ') {
+			m++;
+		}
+	}
+
+	if (last[0] >= 0) {
+		highlight_move(last[0], last[1], last[2], last[3], size, size);
+	}
+	if (is_king_checked(main_game, main_game->whose_turn)) {
+		warn_check(size, size);
+	}
+	if (rcase->pre_move[0] >= 0) {
+		set_pre_move((int *) rcase->pre_move);
+	}
+	return 0;
+}
+
+/* Renders through the same full update as the board's draw handler */
+static cairo_surface_t *render_case(int size) {
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, size, size);
+	cairo_t *cr = cairo_create(surface);
+	needs_update = 1;
+	draw_full_update(cr, size, size);
+	cairo_destroy(cr);
+	cairo_surface_flush(surface);
+	return surface;
+}
+
+/* Returns the number of pixels with a channel off by more than the
+ * tolerance, diff gets the per pixel difference for inspection */
+static long compare_surfaces(cairo_surface_t *actual, cairo_surface_t *golden, cairo_surface_t *diff, int *max_delta) {
+	int width = cairo_image_surface_get_width(actual);
+	int height = cairo_image_surface_get_height(actual);
+	int a_stride = cairo_image_surface_get_stride(actual);
+	int g_stride = cairo_image_surface_get_stride(golden);
+	int d_stride = cairo_image_surface_get_stride(diff);
+	unsigned char *a_data = cairo_image_surface_get_data(actual);
+	unsigned char *g_data = cairo_image_surface_get_data(golden);
+	unsigned char *d_data = cairo_image_surface_get_data(diff);
+	long bad = 0;
+
+	*max_delta = 0;
+	for (int y = 0; y < height; y++) {
+		uint32_t *a_row = (uint32_t *) (a_data + y * a_stride);
+		uint32_t *g_row = (uint32_t *) (g_data + y * g_stride);
+		uint32_t *d_row = (uint32_t *) (d_data + y * d_stride);
+		for (int x = 0; x < width; x++) {
+			int pixel_delta = 0;
+			for (int shift = 0; shift < 32; shift += 8) {
+				int delta = abs((int) ((a_row[x] >> shift) & 0xff) - (int) ((g_row[x] >> shift) & 0xff));
+				if (delta > pixel_delta) {
+					pixel_delta = delta;
+				}
+			}
+			if (pixel_delta > *max_delta) {
+				*max_delta = pixel_delta;
+			}
+			if (pixel_delta > RENDER_CHECK_CHANNEL_TOLERANCE) {
+				bad++;
+				d_row[x] = 0xff000000 | (uint32_t) (pixel_delta << 16);
+			}
+			else {
+				d_row[x] = 0xff000000;
+			}
+		}
+	}
+	cairo_surface_mark_dirty(diff);
+	return bad;
+}
+
+/* PNGs without an alpha channel load as RGB24, whose padding byte is left
+ * undefined: compare everything as ARGB32 */
+static cairo_surface_t *read_png_argb32(const char *path) {
+	cairo_surface_t *png = cairo_image_surface_create_from_png(path);
+	if (cairo_surface_status(png) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(png);
+		return NULL;
+	}
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, cairo_image_surface_get_width(png),
+	                                                      cairo_image_surface_get_height(png));
+	cairo_t *cr = cairo_create(surface);
+	cairo_set_source_surface(cr, png, 0, 0);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	cairo_surface_destroy(png);
+	cairo_surface_flush(surface);
+	return surface;
+}
+
+/* Compares the rendering against dir/name.png, or writes it there when
+ * recording. A missing golden image is a failure. Failures leave
+ * name.actual.png and name.diff.png behind */
+static int check_golden(const char *dir, const char *name, cairo_surface_t *actual, bool record, int *recorded) {
+	int size = cairo_image_surface_get_width(actual);
+	gchar *golden_path = g_strdup_printf("%s/%s.png", dir, name);
+	int ret = 0;
+
+	if (!record && !g_file_test(golden_path, G_FILE_TEST_EXISTS)) {
+		printf("%s: FAILED, no golden image '%s'\n", name, golden_path);
+		g_free(golden_path);
+		return 1;
+	}
+	if (record) {
+		if (cairo_surface_write_to_png(actual, golden_path) != CAIRO_STATUS_SUCCESS) {
+			fprintf(stderr, "Failed to write golden image '%s'\n", golden_path);
+			ret = 1;
+		}
+		else {
+			printf("%s: recorded\n", name);
+			(*recorded)++;
+		}
+		g_free(golden_path);
+		return ret;
+	}
+
+	cairo_surface_t *golden = read_png_argb32(golden_path);
+	if (golden == NULL) {
+		fprintf(stderr, "Failed to read golden image '%s'\n", golden_path);
+		ret = 1;
+	}
+	else if (cairo_image_surface_get_width(golden) != size || cairo_image_surface_get_height(golden) != size) {
+		fprintf(stderr, "%s: golden image is %dx%d, expected %dx%d\n", name, cairo_image_surface_get_width(golden),
+		        cairo_image_surface_get_height(golden), size, size);
+		ret = 1;
+	}
+	else {
+		cairo_surface_t *diff = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, size, size);
+		int max_delta;
+		long bad = compare_surfaces(actual, golden, diff, &max_delta);
+		if (bad * 10000 > (long) size * size * RENDER_CHECK_BAD_PIXELS) {
+			printf("%s: FAILED, %ld pixels differ, max channel delta %d\n", name, bad, max_delta);
+			gchar *actual_path = g_strdup_printf("%s/%s.actual.png", dir, name);
+			gchar *diff_path = g_strdup_printf("%s/%s.diff.png", dir, name);
+			cairo_surface_write_to_png(actual, actual_path);
+			cairo_surface_write_to_png(diff, diff_path);
+			g_free(actual_path);
+			g_free(diff_path);
+			ret = 1;
+		}
+		else {
+			debug("%s: ok, %ld pixels differ, max channel delta %d\n", name, bad, max_delta);
+		}
+		cairo_surface_destroy(diff);
+	}
+	cairo_surface_destroy(golden);
+	g_free(golden_path);
+	return ret;
+}
+
+/* Whether dir holds any golden image, leaving out those of failures */
+bool test_render_has_golden(const char *dir_path) {
+	GDir *dir = g_dir_open(dir_path, 0, NULL);
+	if (dir == NULL) {
+		return false;
+	}
+	bool found = false;
+	const gchar *name;
+	while (!found && (name = g_dir_read_name(dir)) != NULL) {
+		found = g_str_has_suffix(name, ".png") && !g_str_has_suffix(name, ".actual.png") &&
+		        !g_str_has_suffix(name, ".diff.png");
+	}
+	g_dir_close(dir);
+	return found;
+}
+
+/* Renders every case with every theme at every size and compares them to
+ * the golden images in dir, or overwrites them when record is set, to
+ * accept a rendering change. Returns the number of failures */
+int test_render_golden(const char *dir, bool record) {
+	double saved_dark[3] = {dr, dg, db};
+	double saved_light[3] = {lr, lg, lb};
+	int n_cases = sizeof(render_cases) / sizeof(render_cases[0]);
+	int n_themes = sizeof(render_themes) / sizeof(render_themes[0]);
+	int n_sizes = sizeof(render_sizes) / sizeof(render_sizes[0]);
+	int failures = 0;
+	int checked = 0;
+	int recorded = 0;
+
+	if (g_mkdir_with_parents(dir, 0755)) {
+		fprintf(stderr, "Error creating directory '%s'\n", dir);
+		return -1;
+	}
+
+	for (int t = 0; t < n_themes; t++) {
+		const render_check_theme *theme = &render_themes[t];
+		if (load_pieces_theme(theme->pieces_dir)) {
+			failures++;
+			continue;
+		}
+		dr = theme->dark[0], dg = theme->dark[1], db = theme->dark[2];
+		lr = theme->light[0], lg = theme->light[1], lb = theme->light[2];
+		compute_highlight_colours();
+		invalidate_board_layer();
+
+		for (int s = 0; s < n_sizes; s++) {
+			for (int c = 0; c < n_cases; c++) {
+				int size = render_sizes[s];
+				char name[64];
+				snprintf(name, sizeof(name), "%s-%s-%d", render_cases[c].name, theme->name, size);
+				if (setup_render_case(&render_cases[c], size)) {
+					failures++;
+					continue;
+				}
+				cairo_surface_t *actual = render_case(size);
+				failures += check_golden(dir, name, actual, record, &recorded);
+				cairo_surface_destroy(actual);
+				checked++;
+			}
+		}
+	}
+
+	dr = saved_dark[0], dg = saved_dark[1], db = saved_dark[2];
+	lr = saved_light[0], lg = saved_light[1], lb = saved_light[2];
+	compute_highlight_colours();
+	init_game_position(main_game);
+	reset_highlights();
+	unset_pre_move();
+	set_board_flipped(false);
+
+	printf("%d renderings, %d recorded, %d failed\n", checked, recorded, failures);
+	return failures;
+}
+/* </Golden image rendering check> */
+
+/* <PGN round trip check> */
+#define ROUND_TRIP_BATCH 256
+
+/* A deliberately naive board, kept apart from the chess backend, to check
+ * the FEN the backend generates at the end of each game */
+typedef struct {
+	char squares[8][8]; // [file][rank], FEN letters or 0
+	bool castle[2][2];  // [colour][0 queen side, 1 king side] like castle_state
+	int en_passant;     // file or -1
+	int half_moves;
+	int full_moves;
+	int whose_turn;
+} reference_board;
+
+typedef struct {
+	long games;
+	long skipped;
+	long plys;
+	int san_errors;
+	int hash_errors;
+	int fen_errors;
+	int resolve_errors;
+} round_trip_stats;
+
+static void reference_init(reference_board *ref) {
+	const char *back_rank = "RNBQKBNR";
+	memset(ref, 0, sizeof(reference_board));
+	for (int file = 0; file < 8; file++) {
+		ref->squares[file][0] = back_rank[file];
+		ref->squares[file][1] = 'P';
+		ref->squares[file][6] = 'p';
+		ref->squares[file][7] = (char) tolower(back_rank[file]);
+	}
+	ref->castle[0][0] = ref->castle[0][1] = ref->castle[1][0] = ref->castle[1][1] = true;
+	ref->en_passant = -1;
+	ref->full_moves = 1;
+}
+
+static void reference_lose_rook(reference_board *ref, int file, int rank) {
+	if (rank == 0 || rank == 7) {
+		if (file == 0) {
+			ref->castle[rank == 7][0] = false;
+		}
+		else if (file == 7) {
+			ref->castle[rank == 7][1] = false;
+		}
+	}
+}
+
+static void reference_move(reference_board *ref, int move[4], char promo) {
+	char piece = ref->squares[move[0]][move[1]];
+	bool capture = ref->squares[move[2]][move[3]] != 0;
+	bool pawn = toupper(piece) == 'P';
+	int colour = islower(piece) ? 1 : 0;
+
+	if (pawn && move[0] != move[2] && !capture) {
+		// en passant, the captured pawn is beside the moving one
+		ref->squares[move[2]][move[1]] = 0;
+		capture = true;
+	}
+	if (toupper(piece) == 'K') {
+		if (move[2] - move[0] == 2) {
+			ref->squares[5][move[1]] = ref->squares[7][move[1]];
+			ref->squares[7][move[1]] = 0;
+		}
+		else if (move[0] - move[2] == 2) {
+			ref->squares[3][move[1]] = ref->squares[0][move[1]];
+			ref->squares[0][move[1]] = 0;
+		}
+		ref->castle[colour][0] = ref->castle[colour][1] = false;
+	}
+	reference_lose_rook(ref, move[0], move[1]);
+	reference_lose_rook(ref, move[2], move[3]);
+
+	ref->squares[move[2]][move[3]] = piece;
+	ref->squares[move[0]][move[1]] = 0;
+	if (pawn && (move[3] == 0 || move[3] == 7)) {
+		char promoted = promo ? promo : 'Q';
+		ref->squares[move[2]][move[3]] = (char) (colour ? tolower(promoted) : toupper(promoted));
+	}
+
+	ref->en_passant = pawn && abs(move[3] - move[1]) == 2 ? move[0] : -1;
+	ref->half_moves = pawn || capture ? 0 : ref->half_moves + 1;
+	if (colour) {
+		ref->full_moves++;
+	}
+	ref->whose_turn = !colour;
+}
+
+static void reference_fen(reference_board *ref, char fen[128]) {
+	int offset = 0;
+	for (int rank = 7; rank >= 0; rank--) {
+		int empty = 0;
+		for (int file = 0; file < 8; file++) {
+			if (ref->squares[file][rank]) {
+				if (empty) {
+					fen[offset++] = (char) ('0' + empty);
+					empty = 0;
+				}
+				fen[offset++] = ref->squares[file][rank];
+			}
+			else {
+				empty++;
+			}
+		}
+		if (empty) {
+			fen[offset++] = (char) ('0' + empty);
+		}
+		fen[offset++] = (char) (rank ? '/' : ' ');
+	}
+	fen[offset++] = (char) (ref->whose_turn ? 'b' : 'w');
+	fen[offset++] = ' ';
+	int castle_start = offset;
+	if (ref->castle[0][1]) fen[offset++] = 'K';
+	if (ref->castle[0][0]) fen[offset++] = 'Q';
+	if (ref->castle[1][1]) fen[offset++] = 'k';
+	if (ref->castle[1][0]) fen[offset++] = 'q';
+	if (offset == castle_start) {
+		fen[offset++] = '-';
+	}
+	fen[offset++] = ' ';
+	if (ref->en_passant >= 0) {
+		fen[offset++] = (char) ('a' + ref->en_passant);
+		fen[offset++] = (char) (ref->whose_turn ? '3' : '6');
+	}
+	else {
+		fen[offset++] = '-';
+	}
+	snprintf(fen + offset, 128 - offset, " %d %d", ref->half_moves, ref->full_moves);
+}
+
+/* The source SAN without annotations, "=" before promotions nor zeros in
+ * castling, which PGN writers don't agree on */
+static void normalise_san(const char *san, size_t len, char *out, size_t size) {
+	size_t k = 0;
+	for (size_t i = 0; i < len && k + 1 < size; i++) {
+		char c = san[i];
+		if (c == '!' || c == '?' || c == '=') {
+			continue;
+		}
+		out[k++] = c == '0' ? 'O' : c;
+	}
+	out[k] = '\0';
+}
+
+/* Replays one ply like load_game() does and checks the SAN the backend
+ * writes for it and its incremental hash. Returns false when the rest of
+ * the game can't be followed */
+static bool round_trip_ply(const char *name, const char *contents, pgn_token *token, reference_board *ref,
+                           round_trip_stats *stats) {
+	int piece_type;
+	char move_string[5];
+	int move[4];
+	pgn_token_move(token, main_game->whose_turn, &piece_type, move_string);
+	if (!resolve_move(main_game, piece_type, move_string, move)) {
+		printf("%s: game %ld, could not resolve '%.*s'\n", name, stats->games, (int) token->len, contents + token->offset);
+		stats->resolve_errors++;
+		return false;
+	}
+
+	main_game->promo_type = token->promo ? char_to_type(main_game->whose_turn, token->promo) :
+	                        colorise_type(W_QUEEN, main_game->whose_turn);
+	char san[SAN_MOVE_SIZE];
+	memset(san, 0, sizeof(san));
+	move_piece(main_game->squares[move[0]][move[1]].piece, move[2], move[3], 0, AUTO_SOURCE_NO_ANIM, san, main_game, true);
+	reference_move(ref, move, token->promo);
+	stats->plys++;
+
+	// check_ending_clause() would also print and offer draws
+	if (is_king_checked(main_game, main_game->whose_turn)) {
+		san[strlen(san)] = (char) (is_check_mate(main_game) ? '#' : '+');
+	}
+	char expected[SAN_MOVE_SIZE * 2];
+	char generated[SAN_MOVE_SIZE * 2];
+	normalise_san(contents + token->offset, token->len, expected, sizeof(expected));
+	normalise_san(san, strlen(san), generated, sizeof(generated));
+	if (strcmp(expected, generated)) {
+		if (!stats->san_errors++ || debug_flag) {
+			printf("%s: game %ld, SAN '%s' regenerated as '%s'\n", name, stats->games, expected, generated);
+		}
+	}
+
+	uint64_t hash = generate_zobrist_hash(main_game);
+	if (hash != main_game->current_hash) {
+		printf("%s: game %ld after '%s', incremental hash %016" PRIx64 " but %016" PRIx64 " from scratch\n", name,
+		       stats->games, expected, main_game->current_hash, hash);
+		stats->hash_errors++;
+		// resynchronise to report the next independent error
+		main_game->current_hash = hash;
+	}
+	return true;
+}
+
+static void round_trip_end_game(const char *name, reference_board *ref, round_trip_stats *stats) {
+	char fen[128];
+	char expected[128];
+	generate_full_fen(fen, main_game->squares, main_game->castle_state, main_game->en_passant, main_game->whose_turn,
+	                  main_game->fifty_move_counter, main_game->current_move_number);
+	reference_fen(ref, expected);
+	if (strcmp(fen, expected)) {
+		printf("%s: game %ld ends on\n  %s\nexpected\n  %s\n", name, stats->games, fen, expected);
+		stats->fen_errors++;
+	}
+}
+
+static void round_trip_file(const char *name, const char *contents, size_t len, round_trip_stats *stats) {
+	pgn_token tokens[ROUND_TRIP_BATCH];
+	reference_board ref;
+	size_t pos = 0;
+	size_t n_tokens;
+	bool in_game = false;
+	bool following = false; // false once a game is skipped or can't be followed
+
+	while ((n_tokens = pgn_tokenize(contents, len, &pos, tokens, ROUND_TRIP_BATCH)) > 0) {
+		for (size_t k = 0; k < n_tokens; k++) {
+			pgn_token *token = &tokens[k];
+			if (token->kind == MATCHED_TAG || (token->kind == MATCHED_MOVE && !in_game)) {
+				if (!in_game) {
+					in_game = true;
+					following = true;
+					stats->games++;
+					init_game_position(main_game);
+					reference_init(&ref);
+				}
+				if (token->kind == MATCHED_TAG) {
+					// only games from the initial position
+					if (pgn_token_tag_is(contents, token, "FEN") && following) {
+						following = false;
+						stats->skipped++;
+					}
+					continue;
+				}
+			}
+			if (token->kind == MATCHED_END_TOKEN) {
+				if (in_game && following) {
+					round_trip_end_game(name, &ref, stats);
+				}
+				in_game = false;
+				continue;
+			}
+			if (following) {
+				following = round_trip_ply(name, contents, token, &ref, stats);
+			}
+		}
+	}
+}
+
+/* Replays every game of every *.pgn in dir through resolve_move() and
+ * move_piece(), comparing the SAN written back with the source, the
+ * incremental hash with one computed from scratch at every ply and the
+ * final FEN with a separate naive replay. Returns the number of errors.
+ * Only the bulk tokenizer path is replayed: load_game() reads moves with
+ * the flex scanner, which test_pgn_tokenizer() checks gives the same tokens */
+int test_pgn_round_trip(const char *dir_path) {
+	GError *error = NULL;
+	GDir *dir = g_dir_open(dir_path, 0, &error);
+	if (dir == NULL) {
+		fprintf(stderr, "Error opening directory '%s': %s\n", dir_path, error->message);
+		g_error_free(error);
+		return -1;
+	}
+
+	gboolean saved_use_fig = use_fig;
+	use_fig = FALSE;
+
+	round_trip_stats total;
+	memset(&total, 0, sizeof(total));
+	int n_files = 0;
+	const gchar *name;
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		if (!g_str_has_suffix(name, ".pgn")) {
+			continue;
+		}
+		gchar *path = g_build_filename(dir_path, name, NULL);
+		gchar *contents;
+		gsize len;
+		if (!g_file_get_contents(path, &contents, &len, &error)) {
+			fprintf(stderr, "Error reading '%s': %s\n", path, error->message);
+			g_clear_error(&error);
+			g_free(path);
+			total.resolve_errors++;
+			continue;
+		}
+		n_files++;
+
+		round_trip_stats stats;
+		memset(&stats, 0, sizeof(stats));
+		struct timeval start, end;
+		gettimeofday(&start, NULL);
+		round_trip_file(name, contents, len, &stats);
+		gettimeofday(&end, NULL);
+		double seconds = elapsed_seconds(&start, &end);
+
+		int errors = stats.san_errors + stats.hash_errors + stats.fen_errors + stats.resolve_errors;
+		printf("%-24s %6ld games %8ld plys %8.3fs %10.0f plys/s  %s\n", name, stats.games, stats.plys, seconds,
+		       seconds > 0 ? stats.plys / seconds : 0.0, errors ? "FAILED" : "ok");
+		if (errors) {
+			printf("  %d SAN, %d hash, %d FEN, %d unresolved\n", stats.san_errors, stats.hash_errors,
+			       stats.fen_errors, stats.resolve_errors);
+		}
+
+		total.games += stats.games;
+		total.skipped += stats.skipped;
+		total.plys += stats.plys;
+		total.san_errors += stats.san_errors;
+		total.hash_errors += stats.hash_errors;
+		total.fen_errors += stats.fen_errors;
+		total.resolve_errors += stats.resolve_errors;
+		g_free(contents);
+		g_free(path);
+	}
+	g_dir_close(dir);
+
+	use_fig = saved_use_fig;
+	init_game_position(main_game);
+
+	int errors = total.san_errors + total.hash_errors + total.fen_errors + total.resolve_errors;
+	printf("%d files, %ld games (%ld from a FEN skipped), %ld plys, %d errors\n", n_files, total.games, total.skipped,
+	       total.plys, errors);
+	return errors;
+}
+/* </PGN round trip check> */
@@ -2,11 +2,20 @@
 #define TEST_H_
 
 
+/* Exit status of a check with nothing to compare against, which ctest
+ * reports as skipped (SKIP_RETURN_CODE) */
+#define TEST_SKIPPED 77
 
 void test_random_animation(void);
 void test_random_flip(void);
 void test_crazy_flip(void);
 void test_random_channel_insert(void);
 void test_random_title(void);
+void test_input_latency(bool click_to_move);
+int test_pgn_tokenizer(const char *dir_path);
+int test_clocks_virtual_time(int n_games);
+bool test_render_has_golden(const char *dir);
+int test_render_golden(const char *dir, bool record);
+int test_pgn_round_trip(const char *dir_path);
 
 #endif /* TEST_H_ */
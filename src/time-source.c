@@ -0,0 +1,84 @@
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "time-source.h"
+
+static pthread_mutex_t time_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t time_advanced = PTHREAD_COND_INITIALIZER;
+
+static volatile bool virtual_time = false;
+static int64_t virtual_now = 0;
+
+static void unlock_time_lock(void *data) {
+	pthread_mutex_unlock(data);
+}
+
+static int64_t real_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t time_now_us(void) {
+	if (!virtual_time) {
+		return real_now_us();
+	}
+	pthread_mutex_lock(&time_lock);
+	int64_t now = virtual_now;
+	pthread_mutex_unlock(&time_lock);
+	return now;
+}
+
+/* A timeval flavour for the clocks which keep their times in timevals */
+void time_now_tv(struct timeval *tv) {
+	int64_t now = time_now_us();
+	tv->tv_sec = (time_t) (now / 1000000);
+	tv->tv_usec = (suseconds_t) (now % 1000000);
+}
+
+void time_sleep_us(int64_t us) {
+	if (!virtual_time) {
+		usleep((useconds_t) us);
+		return;
+	}
+
+	pthread_mutex_lock(&time_lock);
+	int64_t deadline = virtual_now + us;
+	// a cancellation point like usleep() is, for the clock runners
+	pthread_cleanup_push(unlock_time_lock, &time_lock);
+	while (virtual_time && virtual_now < deadline) {
+		pthread_cond_wait(&time_advanced, &time_lock);
+	}
+	pthread_cleanup_pop(1);
+}
+
+/* Freezes time where the monotonic clock is, it then only moves forward
+ * through time_source_advance_us() */
+void time_source_use_virtual(void) {
+	pthread_mutex_lock(&time_lock);
+	if (!virtual_time) {
+		virtual_now = real_now_us();
+		virtual_time = true;
+	}
+	pthread_mutex_unlock(&time_lock);
+}
+
+/* Virtual sleepers return straight away */
+void time_source_use_real(void) {
+	pthread_mutex_lock(&time_lock);
+	virtual_time = false;
+	pthread_cond_broadcast(&time_advanced);
+	pthread_mutex_unlock(&time_lock);
+}
+
+bool time_source_is_virtual(void) {
+	return virtual_time;
+}
+
+void time_source_advance_us(int64_t us) {
+	pthread_mutex_lock(&time_lock);
+	virtual_now += us;
+	pthread_cond_broadcast(&time_advanced);
+	pthread_mutex_unlock(&time_lock);
+}
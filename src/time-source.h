@@ -0,0 +1,22 @@
+#ifndef CAIRO_BOARD_TIME_SOURCE_H
+#define CAIRO_BOARD_TIME_SOURCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/* Time as seen by the clocks, timeseal and the timers driving the board.
+ * By default this is the monotonic clock; a virtual source only moves when
+ * time_source_advance_us() is called, so that time dependent code can be
+ * exercised much faster than real time. Values are only meaningful as
+ * differences and are never 0 */
+int64_t time_now_us(void);
+void time_now_tv(struct timeval *tv);
+void time_sleep_us(int64_t us);
+
+void time_source_use_virtual(void);
+void time_source_use_real(void);
+bool time_source_is_virtual(void);
+void time_source_advance_us(int64_t us);
+
+#endif //CAIRO_BOARD_TIME_SOURCE_H
@@ -2,26 +2,72 @@
 #include <regex.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "chess-backend.h"
 #include "analysis_panel.h"
 #include "uci-adapter.h"
 #include "uci_scanner.h"
+#include "position-snapshot.h"
 
 const static unsigned int STOP_TIMEOUT_SEC = 5;
 const static unsigned int READY_TIMEOUT_SEC = 3;
 
-int uci_scanner__scan_bytes(const char *bytes, int len);
-
-static int uci_in;
-static int uci_out;
-static int uci_err;
-
-static int uci_user_in[2];
-
-static pthread_t uci_read_thread;
-static pthread_t uci_manager_thread;
-
+/* Everything one running engine needs, each engine has its own reader
+ * and manager threads and its own column in the analysis panel */
+typedef struct {
+	int index;
+	int column;
+
+	int uci_in;
+	int uci_out;
+	int uci_err;
+
+	int uci_user_in[2];
+
+	pthread_t uci_read_thread;
+	pthread_t uci_manager_thread;
+
+	void *scanner;
+	scanner_input scanner_input;
+
+	char engine_name[256];
+
+	bool uci_ok;
+	bool uci_ready;
+	bool analysing;
+	bool stop_requested;
+
+	pthread_mutex_t uci_writer_lock;
+	pthread_mutex_t uci_ok_lock;
+	pthread_mutex_t uci_ready_lock;
+	pthread_mutex_t analysing_lock;
+	pthread_mutex_t stop_requested_lock;
+	pthread_mutex_t all_moves_lock;
+
+	unsigned int ply_num;
+	int to_play;
+
+	char all_moves[4 * 8192];
+	char shown_best_line[BUFSIZ];
+	size_t shown_best_line_len;
+	UCI_MODE uci_mode;
+	unsigned int game_time;
+
+	/* pipeline statistics, see print_uci_stats() */
+	unsigned long info_lines;
+	unsigned long best_lines; // converted to SAN and shown
+	gint64 first_info_time;
+	gint64 last_info_time;
+} uci_engine;
+
+/* engines[0] is the primary engine: only that one plays games and drives the
+ * clocks, the others always analyse the same position */
+static uci_engine *engines[MAX_UCI_ENGINES];
+static int n_engines = 0;
+
+/* Shared by all engines, regexec() doesn't modify the compiled patterns */
+static bool regex_compiled = false;
 static regex_t option_matcher;
 static regex_t best_move_ponder_matcher;
 static regex_t best_move_matcher;
@@ -30,33 +76,9 @@ static regex_t info_time_matcher;
 static regex_t info_score_cp_matcher;
 static regex_t info_score_mate_matcher;
 static regex_t info_depth_matcher;
-static regex_t info_selective_depth_matcher;
 static regex_t info_nps_matcher;
 static regex_t info_best_line_matcher;
 
-static char engine_name[256] = "";
-
-static bool uci_ok = 0;
-static bool uci_ready = 0;
-static bool analysing = 0;
-static bool stop_requested = 0;
-
-static pthread_mutex_t uci_writer_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t uci_ok_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t uci_ready_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t analysing_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t stop_requested_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t all_moves_lock = PTHREAD_MUTEX_INITIALIZER;
-
-static unsigned int ply_num;
-static int to_play;
-
-static char all_moves[4 * 8192];
-char shown_best_line[BUFSIZ] = "";
-size_t shown_best_line_len = 0;
-static UCI_MODE uci_mode;
-static unsigned int game_time = 0;
-
 bool play_vs_machine;
 const char START_SEQUENCE[] = "position startpos moves";
 
@@ -69,71 +91,97 @@ const static char START_ANALYSIS_TOKEN[] = "start_analysis";
 // Private prototypes
 static void *parse_uci_function(void *);
 static void *uci_manager_function(void *);
-static void wait_for_engine_ready(void);
-static void best_line_to_san(char line[8192], char san[8192]);
+static void wait_for_engine_ready(uci_engine *engine);
+static void write_to_engine(uci_engine *engine, char *message);
+static void best_line_to_san(char *line, char *san);
+
+static bool is_primary(uci_engine *engine) {
+	return engine->index == 0;
+}
+
+/* Info lines parsed and best lines shown per second. The mock engine
+ * reports the lines it sent itself, the difference is what got lost */
+static void print_uci_stats(uci_engine *engine) {
+	double seconds = (engine->last_info_time - engine->first_info_time) / 1e6;
+	fprintf(stderr, "UCI %s: %lu info lines", engine->engine_name, engine->info_lines);
+	if (seconds > 0) {
+		fprintf(stderr, " in %.1fs (%.0f lines/s), %lu best lines shown (%.0f/s)", seconds,
+		        engine->info_lines / seconds, engine->best_lines, engine->best_lines / seconds);
+	}
+	fprintf(stderr, "\n");
+}
 
 void cleanup_uci() {
-	pthread_mutex_destroy(&uci_writer_lock);
-	pthread_mutex_destroy(&uci_ok_lock);
-	pthread_mutex_destroy(&uci_ready_lock);
-	pthread_mutex_destroy(&analysing_lock);
-	pthread_mutex_destroy(&stop_requested_lock);
-	pthread_mutex_destroy(&all_moves_lock);
+	for (int i = 0; i < n_engines; i++) {
+		uci_engine *engine = engines[i];
+		if (debug_flag) {
+			char name[300];
+			snprintf(name, sizeof(name), "UCI %s", engine->engine_name);
+			scanner_input_print_stats(name, &engine->scanner_input);
+			print_uci_stats(engine);
+		}
+		pthread_mutex_destroy(&engine->uci_writer_lock);
+		pthread_mutex_destroy(&engine->uci_ok_lock);
+		pthread_mutex_destroy(&engine->uci_ready_lock);
+		pthread_mutex_destroy(&engine->analysing_lock);
+		pthread_mutex_destroy(&engine->stop_requested_lock);
+		pthread_mutex_destroy(&engine->all_moves_lock);
+	}
 }
 
-void set_uci_ok(bool val) {
-	pthread_mutex_lock(&uci_ok_lock);
-	uci_ok = val;
-	pthread_mutex_unlock(&uci_ok_lock);
+static void set_uci_ok(uci_engine *engine, bool val) {
+	pthread_mutex_lock(&engine->uci_ok_lock);
+	engine->uci_ok = val;
+	pthread_mutex_unlock(&engine->uci_ok_lock);
 }
 
-bool is_uci_ok() {
+static bool is_uci_ok(uci_engine *engine) {
 	bool val;
-	pthread_mutex_lock(&uci_ok_lock);
-	val = uci_ok;
-	pthread_mutex_unlock(&uci_ok_lock);
+	pthread_mutex_lock(&engine->uci_ok_lock);
+	val = engine->uci_ok;
+	pthread_mutex_unlock(&engine->uci_ok_lock);
 	return val;
 }
 
-void set_uci_ready(bool val) {
-	pthread_mutex_lock(&uci_ready_lock);
-	uci_ready = val;
-	pthread_mutex_unlock(&uci_ready_lock);
+static void set_uci_ready(uci_engine *engine, bool val) {
+	pthread_mutex_lock(&engine->uci_ready_lock);
+	engine->uci_ready = val;
+	pthread_mutex_unlock(&engine->uci_ready_lock);
 }
 
-bool is_uci_ready() {
+static bool is_uci_ready(uci_engine *engine) {
 	bool val;
-	pthread_mutex_lock(&uci_ready_lock);
-	val = uci_ready;
-	pthread_mutex_unlock(&uci_ready_lock);
+	pthread_mutex_lock(&engine->uci_ready_lock);
+	val = engine->uci_ready;
+	pthread_mutex_unlock(&engine->uci_ready_lock);
 	return val;
 }
 
-void set_analysing(bool val) {
-	pthread_mutex_lock(&analysing_lock);
-	analysing = val;
-	pthread_mutex_unlock(&analysing_lock);
+static void set_analysing(uci_engine *engine, bool val) {
+	pthread_mutex_lock(&engine->analysing_lock);
+	engine->analysing = val;
+	pthread_mutex_unlock(&engine->analysing_lock);
 }
 
-bool is_analysing() {
+static bool is_analysing(uci_engine *engine) {
 	bool val;
-	pthread_mutex_lock(&analysing_lock);
-	val = analysing;
-	pthread_mutex_unlock(&analysing_lock);
+	pthread_mutex_lock(&engine->analysing_lock);
+	val = engine->analysing;
+	pthread_mutex_unlock(&engine->analysing_lock);
 	return val;
 }
 
-void set_stop_requested(bool val) {
-	pthread_mutex_lock(&stop_requested_lock);
-	stop_requested = val;
-	pthread_mutex_unlock(&stop_requested_lock);
+static void set_stop_requested(uci_engine *engine, bool val) {
+	pthread_mutex_lock(&engine->stop_requested_lock);
+	engine->stop_requested = val;
+	pthread_mutex_unlock(&engine->stop_requested_lock);
 }
 
-bool is_stop_requested() {
+static bool is_stop_requested(uci_engine *engine) {
 	bool val;
-	pthread_mutex_lock(&stop_requested_lock);
-	val = stop_requested;
-	pthread_mutex_unlock(&stop_requested_lock);
+	pthread_mutex_lock(&engine->stop_requested_lock);
+	val = engine->stop_requested;
+	pthread_mutex_unlock(&engine->stop_requested_lock);
 	return val;
 }
 
@@ -147,7 +195,10 @@ void compile_regex(regex_t* regex, const char *pattern) {
 	}
 }
 
-void init_uci_adapter() {
+static void compile_uci_regexes(void) {
+	if (regex_compiled) {
+		return;
+	}
 	compile_regex(&option_matcher, "option name (.*) type (.*)");
 	compile_regex(&best_move_ponder_matcher, "bestmove (.*) ponder (.*)");
 	compile_regex(&best_move_matcher, "bestmove (.*)");
@@ -160,82 +211,132 @@ void init_uci_adapter() {
 	compile_regex(&info_score_mate_matcher, "score mate (-?[0-9]+)");
 	compile_regex(&info_nps_matcher, " nps ([0-9]+)");
 	compile_regex(&info_best_line_matcher, " pv ([a-h1-8rnbq ]+)");
+	regex_compiled = true;
+}
+
+static void init_uci_adapter(uci_engine *engine) {
+	compile_uci_regexes();
+
+	pthread_mutex_init(&engine->uci_writer_lock, NULL);
+	pthread_mutex_init(&engine->uci_ok_lock, NULL);
+	pthread_mutex_init(&engine->uci_ready_lock, NULL);
+	pthread_mutex_init(&engine->analysing_lock, NULL);
+	pthread_mutex_init(&engine->stop_requested_lock, NULL);
+	pthread_mutex_init(&engine->all_moves_lock, NULL);
 
-	int result = pipe(uci_user_in);
+	engine->scanner = uci_scanner_create(&engine->scanner_input);
+	if (engine->scanner == NULL) {
+		fprintf(stderr, "Failed to create UCI scanner\n");
+		exit(1);
+	}
+
+	int result = pipe(engine->uci_user_in);
 	if (result < 0) {
 		perror("Failed to create UCI manager pipe ");
 		exit(1);
 	}
 
-	pthread_create(&uci_read_thread, NULL, parse_uci_function, NULL);
-	pthread_create(&uci_manager_thread, NULL, uci_manager_function, NULL);
+	pthread_create(&engine->uci_read_thread, NULL, parse_uci_function, engine);
+	pthread_create(&engine->uci_manager_thread, NULL, uci_manager_function, engine);
 }
 
-int spawn_uci_engine(bool brainfish) {
+/* Starts the engine at path and gives it the next analysis panel column.
+ * The first engine spawned is the one games are played against.
+ * NB: takes the GDK lock to add the column, don't call while holding it */
+int spawn_uci_engine(const char *path) {
+	if (n_engines == MAX_UCI_ENGINES) {
+		fprintf(stderr, "Can't run more than %d UCI engines, ignoring '%s'\n", MAX_UCI_ENGINES, path);
+		return -1;
+	}
+
 	GPid child_pid;
 	GError *spawnError = NULL;
 
 	gchar *argv[2];
+	argv[0] = (gchar *) path;
+	argv[1] = NULL;
 
-	//TODO: can we discover these from $PATH?
-	if (brainfish) {
-		argv[0] = "/usr/local/bin/brainfish";
-	} else {
-		argv[0] = "/usr/bin/stockfish";
+	uci_engine *engine = tracked_calloc(ALLOC_UCI, 1, sizeof(uci_engine));
+	if (engine == NULL) {
+		perror("Failed to allocate UCI engine ");
+		return -1;
 	}
-	argv[1] = NULL;
 
 	gboolean ret = g_spawn_async_with_pipes(g_get_home_dir(), argv, NULL, G_SPAWN_DEFAULT, NULL, NULL, &child_pid,
-	                                        &uci_in, &uci_out, &uci_err, &spawnError);
+	                                        &engine->uci_in, &engine->uci_out, &engine->uci_err, &spawnError);
 
 	if (!ret) {
-		g_error("spawn_uci_engine FAILED %s", spawnError->message);
+		fprintf(stderr, "spawn_uci_engine FAILED for '%s': %s\n", path, spawnError->message);
+		g_error_free(spawnError);
+		tracked_free(ALLOC_UCI, engine);
 		return -1;
 	}
 
-	init_uci_adapter();
+	engine->index = n_engines;
+	engine->column = add_analysis_column();
+	engine->uci_mode = ENGINE_ANALYSIS;
+	snprintf(engine->engine_name, sizeof(engine->engine_name), "%s", path);
+	memcpy(engine->all_moves, START_SEQUENCE, sizeof(START_SEQUENCE));
+	engine->ply_num = 1;
+
+	init_uci_adapter(engine);
+	engines[n_engines++] = engine;
 
-	write_to_uci("uci\n");
-	while (!is_uci_ok()) {
+	write_to_engine(engine, "uci\n");
+	while (!is_uci_ok(engine)) {
 		usleep(500);
 	}
-	debug("UCI OK!\n");
-
-	write_to_uci("setoption name Threads value 7\n");
-	write_to_uci("setoption name Hash value 2048\n");
-	write_to_uci("setoption name Ponder value true\n");
-	write_to_uci("setoption name Skill Level value 20\n");
-	if (brainfish) {
+	debug("UCI OK from %s!\n", path);
+
+	// Engines analysing side by side share the machine
+	char threads[64];
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	long engine_threads = cores > 1 ? (cores - 1) / n_engines : 1;
+	snprintf(threads, sizeof(threads), "setoption name Threads value %ld\n", engine_threads > 0 ? engine_threads : 1);
+	write_to_engine(engine, threads);
+	write_to_engine(engine, n_engines > 1 ? "setoption name Hash value 512\n" : "setoption name Hash value 2048\n");
+	write_to_engine(engine, "setoption name Ponder value true\n");
+	write_to_engine(engine, "setoption name Skill Level value 20\n");
+	if (strstr(path, "brainfish") != NULL) {
 		// TODO: check if this needs to be an absolute path
-		write_to_uci("setoption name BookPath value /home/hts/brainfish/Cerebellum_Light.bin\n");
+		write_to_engine(engine, "setoption name BookPath value /home/hts/brainfish/Cerebellum_Light.bin\n");
 	}
-	wait_for_engine_ready();
-	return 0;
+	wait_for_engine_ready(engine);
+	return engine->index;
 }
 
-void start_new_uci_game(unsigned int initial_time, UCI_MODE mode) {
-	debug("Start UCI - game mode: %d\n", mode);
-
-	uci_mode = mode;
-	game_time = initial_time;
+static void start_new_engine_game(uci_engine *engine, unsigned int initial_time, UCI_MODE mode) {
+	engine->uci_mode = mode;
+	engine->game_time = initial_time;
 
-	pthread_mutex_lock(&all_moves_lock);
-	memset(all_moves, 0, 4 * 8192);
-	memcpy(all_moves, START_SEQUENCE, 24);
-	debug("All moves set to: '%s'\n", all_moves);
-	pthread_mutex_unlock(&all_moves_lock);
+	pthread_mutex_lock(&engine->all_moves_lock);
+	memset(engine->all_moves, 0, 4 * 8192);
+	memcpy(engine->all_moves, START_SEQUENCE, 24);
+	debug("All moves set to: '%s'\n", engine->all_moves);
+	pthread_mutex_unlock(&engine->all_moves_lock);
 
-	ply_num = 1;
-	to_play = 0;
+	engine->ply_num = 1;
+	engine->to_play = 0;
 
-	if (write(uci_user_in[1], START_NEW_GAME_COMMAND, sizeof(START_NEW_GAME_COMMAND)) == -1) {
+	if (write(engine->uci_user_in[1], START_NEW_GAME_COMMAND, sizeof(START_NEW_GAME_COMMAND)) == -1) {
 		perror("Failed to start new UCI game via the UCI manager ");
 	}
 }
 
+/* Only the primary engine plays, any others keep analysing the same game */
+void start_new_uci_game(unsigned int initial_time, UCI_MODE mode) {
+	debug("Start UCI - game mode: %d\n", mode);
+
+	for (int i = 0; i < n_engines; i++) {
+		start_new_engine_game(engines[i], initial_time, i == 0 ? mode : ENGINE_ANALYSIS);
+	}
+}
+
 void start_uci_analysis() {
-	if (write(uci_user_in[1], START_ANALYSIS_COMMAND, sizeof(START_ANALYSIS_COMMAND)) == -1) {
-		perror("Failed to start UCI analysis via the UCI manager ");
+	for (int i = 0; i < n_engines; i++) {
+		if (write(engines[i]->uci_user_in[1], START_ANALYSIS_COMMAND, sizeof(START_ANALYSIS_COMMAND)) == -1) {
+			perror("Failed to start UCI analysis via the UCI manager ");
+		}
 	}
 }
 
@@ -245,37 +346,39 @@ void extract_match(char *src, regmatch_t aMatch, char *dest) {
 	dest[len] = '\0';
 }
 
-void append_move(char *new_move, bool lock_threads) {
+static void append_move(uci_engine *engine, char *new_move, bool lock_threads) {
 	debug("append_move: %s\n", new_move);
 
 	size_t newMoveLen = strlen(new_move);
 
-	pthread_mutex_lock(&all_moves_lock);
-	size_t movesLength = strlen(all_moves);
-	all_moves[movesLength] = ' ';
-	memcpy(all_moves + movesLength + 1, new_move, newMoveLen + 1); // includes terminating null
-	pthread_mutex_unlock(&all_moves_lock);
+	pthread_mutex_lock(&engine->all_moves_lock);
+	size_t movesLength = strlen(engine->all_moves);
+	engine->all_moves[movesLength] = ' ';
+	memcpy(engine->all_moves + movesLength + 1, new_move, newMoveLen + 1); // includes terminating null
+	pthread_mutex_unlock(&engine->all_moves_lock);
 
-	to_play = to_play ? 0 : 1;
+	engine->to_play = engine->to_play ? 0 : 1;
 
-	debug("append_move: all_moves '%s'\n", all_moves);
-	if (!ics_mode && !load_file_specified) {
+	debug("append_move: all_moves '%s'\n", engine->all_moves);
+	if (is_primary(engine) && !ics_mode && !load_file_specified) {
 //	if (!ics_mode) {
-		if (ply_num == 1) {
-			start_one_clock(main_clock, to_play);
-		} else if (ply_num > 1) {
-			start_one_stop_other_clock(main_clock, to_play, lock_threads);
+		if (engine->ply_num == 1) {
+			start_one_clock(main_clock, engine->to_play);
+		} else if (engine->ply_num > 1) {
+			start_one_stop_other_clock(main_clock, engine->to_play, lock_threads);
 		}
 	}
 
-	ply_num++;
+	engine->ply_num++;
 }
 
 void user_move_to_uci(char *move, bool analyse) {
 	debug("User move to UCI! '%s'\n", move);
 
 	// Append move
-	append_move(move, false);
+	for (int i = 0; i < n_engines; i++) {
+		append_move(engines[i], move, false);
+	}
 
 	if (analyse) {
 		start_uci_analysis();
@@ -298,27 +401,60 @@ void parse_option(char *optionText) {
 	}
 }
 
-bool handle_move_after_stop() {
-	if (is_stop_requested() && is_analysing()) {
+static bool handle_move_after_stop(uci_engine *engine) {
+	if (is_stop_requested(engine) && is_analysing(engine)) {
 		debug("Skip final best move after stop\n");
-		set_analysing(false);
-		set_stop_requested(false);
+		set_analysing(engine, false);
+		set_stop_requested(engine, false);
 		return true;
 	}
 	return false;
 }
 
-void parse_move(char *moveText) {
+/* A best move from the engine we play against: make it on the board and tell
+ * every other engine about it too */
+static void play_engine_move(uci_engine *engine, char bestMove[6]) {
+	// Append move
+	for (int i = 0; i < n_engines; i++) {
+		append_move(engines[i], bestMove, engines[i] == engine);
+	}
+
+	set_last_move(bestMove);
+	g_signal_emit_by_name(board, "got-uci-move");
+
+	char moves[8192];
+	pthread_mutex_lock(&engine->all_moves_lock);
+	sprintf(moves, "%s\n", engine->all_moves);
+	pthread_mutex_unlock(&engine->all_moves_lock);
+
+	write_to_engine(engine, moves);
+//	write_to_engine(engine, "go ponder\n");
+	write_to_engine(engine, "go infinite\n");
+	set_analysing(engine, true);
+
+	for (int i = 0; i < n_engines; i++) {
+		if (engines[i] != engine && write(engines[i]->uci_user_in[1], START_ANALYSIS_COMMAND, sizeof(START_ANALYSIS_COMMAND)) == -1) {
+			perror("Failed to start UCI analysis via the UCI manager ");
+		}
+	}
+}
+
+static void parse_move(uci_engine *engine, char *moveText) {
 
 	/* Note: UCI uses a weird notation, unlike what the spec says it is not the *long algebraic notation* (LAN) at all...
 	 For example: a Knight to f3 move LAN is Ng1-f3 but we get g1f3
 	 Also, promotions are indicated like such: a7a8q*/
 
-	if (handle_move_after_stop()) {
+	if (handle_move_after_stop(engine)) {
 		return;
 	}
 
-	set_analysing(false);
+	set_analysing(engine, false);
+
+	if (!is_primary(engine)) {
+		// Only analysing, this engine's moves are never played
+		return;
+	}
 
 	regmatch_t pmatch[2];
 	int status = regexec(&best_move_matcher, moveText, 2, pmatch, 0);
@@ -338,34 +474,26 @@ void parse_move(char *moveText) {
 		main_game->promo_type = char_to_type(main_game->whose_turn, (char) (bestMove[4] - 32));
 		debug("Handling promotion from Engine %c -> %d\n", bestMove[4], main_game->promo_type);
 	}
-	// Append move
-	append_move(bestMove, true);
-
-	set_last_move(bestMove);
-	g_signal_emit_by_name(board, "got-uci-move");
 
-	char moves[8192];
-	pthread_mutex_lock(&all_moves_lock);
-	sprintf(moves, "%s\n", all_moves);
-	pthread_mutex_unlock(&all_moves_lock);
-
-	write_to_uci(moves);
-//	write_to_uci("go ponder\n");
-	write_to_uci("go infinite\n");
-	set_analysing(true);
+	play_engine_move(engine, bestMove);
 }
 
-void parse_move_with_ponder(char *moveText) {
+static void parse_move_with_ponder(uci_engine *engine, char *moveText) {
 
 	/* Note: UCI uses a weird notation, unlike what the spec says it is not the *long algebraic notation* (LAN) at all...
 	 For example, for a Knight to f3 move, LAN would be Ng1-f3
 	 Instead we get g1f3 */
 
-	if (handle_move_after_stop()) {
+	if (handle_move_after_stop(engine)) {
 		return;
 	}
 
-	set_analysing(false);
+	set_analysing(engine, false);
+
+	if (!is_primary(engine)) {
+		// Only analysing, this engine's moves are never played
+		return;
+	}
 
 	regmatch_t pmatch[3];
 	int status = regexec(&best_move_ponder_matcher, moveText, 3, pmatch, 0);
@@ -387,27 +515,16 @@ void parse_move_with_ponder(char *moveText) {
 		debug("Handling promotion from Engine %c -> %d\n", bestMove[4], main_game->promo_type);
 	}
 
-	// Append move
-	append_move(bestMove, true);
-
-	set_last_move(bestMove);
-	g_signal_emit_by_name(board, "got-uci-move");
-
-	char moves[8192];
-	pthread_mutex_lock(&all_moves_lock);
-	//	sprintf(moves, "%s %s\n", all_moves, ponderMove);
-	sprintf(moves, "%s\n", all_moves);
-	pthread_mutex_unlock(&all_moves_lock);
-
-	write_to_uci(moves);
-//	write_to_uci("go ponder\n");
-	write_to_uci("go infinite\n");
-	set_analysing(true);
+	play_engine_move(engine, bestMove);
 }
 
-void parse_info(char *info) {
+static void parse_info(uci_engine *engine, char *info) {
+	engine->last_info_time = g_get_monotonic_time();
+	if (engine->info_lines++ == 0) {
+		engine->first_info_time = engine->last_info_time;
+	}
 
-	if (is_stop_requested() && is_analysing()) {
+	if (is_stop_requested(engine) && is_analysing(engine)) {
 //		debug("Skip info while stopping\n");
 		return;
 	}
@@ -439,9 +556,9 @@ void parse_info(char *info) {
 
 	if (score_value[0] != '\0') {
 		int score_int = (int) strtol(score_value, NULL, 10);
-		switch (uci_mode) {
+		switch (engine->uci_mode) {
 			case ENGINE_ANALYSIS:
-				if (to_play) {
+				if (engine->to_play) {
 					score_int =-score_int;
 				}
 				break;
@@ -449,7 +566,7 @@ void parse_info(char *info) {
 				score_int =-score_int;
 				break;
 			case ENGINE_WHITE:
-				if (to_play) {
+				if (engine->to_play) {
 					score_int =-score_int;
 				}
 				break;
@@ -457,8 +574,8 @@ void parse_info(char *info) {
 		char *evaluation;
 		if (score_is_mate) {
 			if (score_int == 0) {
-				snprintf(scoreString, 16, to_play ? "1-0" : "0-1");
-				set_analysis_best_line("");
+				snprintf(scoreString, 16, engine->to_play ? "1-0" : "0-1");
+				set_analysis_best_line(engine->column, "");
 			} else {
 				evaluation = score_int > 0 ? "+ -" : "- +";
 				snprintf(scoreString, 16, "%d", score_int);
@@ -480,7 +597,7 @@ void parse_info(char *info) {
 			}
 			snprintf(scoreString, 16, "%s (%.2f)", evaluation, score_int / 100.0);
 		}
-		set_analysis_score(scoreString);
+		set_analysis_score(engine->column, scoreString);
 	}
 
 	status = regexec(&info_best_line_matcher, info, 2, pmatch, 0);
@@ -491,17 +608,18 @@ void parse_info(char *info) {
 		memset(best_line_san, 0, BUFSIZ);
 
 		extract_match(info, pmatch[1], best_line);
-		best_line_to_san(best_line, best_line_san);
-//		debug("Best line in SAN: '%s'\n", best_line_san);
 
 		size_t best_line_len = strlen(best_line);
-		if (best_line_len > shown_best_line_len || strncmp(best_line, shown_best_line, best_line_len) != 0) {
-//			debug("New best line: '%s' '%s'\n", best_line, shown_best_line);
-			memcpy(shown_best_line, best_line, BUFSIZ);
-			shown_best_line_len = best_line_len;
-			set_analysis_best_line(best_line_san);
+		if (best_line_len > engine->shown_best_line_len || strncmp(best_line, engine->shown_best_line, best_line_len) != 0) {
+//			debug("New best line: '%s' '%s'\n", best_line, engine->shown_best_line);
+			// SAN conversion replays the line on a cloned game, skip it when nothing would change
+			best_line_to_san(best_line, best_line_san);
+			memcpy(engine->shown_best_line, best_line, BUFSIZ);
+			engine->shown_best_line_len = best_line_len;
+			set_analysis_best_line(engine->column, best_line_san);
+			engine->best_lines++;
 //		} else {
-//			debug("best line NOT new: '%s' '%s'\n", best_line, shown_best_line);
+//			debug("best line NOT new: '%s' '%s'\n", best_line, engine->shown_best_line);
 		}
 	}
 
@@ -512,14 +630,14 @@ void parse_info(char *info) {
 	if (!status) {
 		extract_match(info, pmatch[1], depth);
 		snprintf(depthString, 32, "Depth: %s", depth);
-		set_analysis_depth(depthString);
+		set_analysis_depth(engine->column, depthString);
 	}
 	status = regexec(&info_selective_depth_matcher, info, 2, pmatch, 0);
 	if (!status) {
 		char sel_depth[8];
 		extract_match(info, pmatch[1], sel_depth);
 		snprintf(depthString, 32, "Depth: %s/%s", depth, sel_depth);
-		set_analysis_depth(depthString);
+		set_analysis_depth(engine->column, depthString);
 	}
 
 	char npsString[32];
@@ -529,15 +647,18 @@ void parse_info(char *info) {
 		extract_match(info, pmatch[1], nps);
 		int npsInt = (int) strtol(nps, NULL, 10);
 		snprintf(npsString, 32, "%d kN/s", npsInt / 1000);
-		set_analysis_nodes_per_second(npsString);
+		set_analysis_nodes_per_second(engine->column, npsString);
 	}
 
 }
 
-void best_line_to_san(char *line, char *san) {
+static void best_line_to_san(char *line, char *san) {
 
-	chess_game *trans_game = game_new();
-	clone_game(main_game, trans_game);
+	// the UCI reader thread never looks at main_game, which moves under its feet
+	position_snapshot snapshot;
+	position_snapshot_read(&snapshot);
+	chess_game *trans_game = game_new(ALLOC_UCI);
+	position_snapshot_to_game(&snapshot, trans_game);
 
 	if (trans_game->whose_turn) {
 		char move_num[16];
@@ -569,6 +690,7 @@ void best_line_to_san(char *line, char *san) {
 		chess_piece *piece = trans_game->squares[source_col][source_row].piece;
 		if (piece == NULL) {
 			debug("best_line_to_san Ooops no piece here, was game restarted?! %c%d\n", source_col + 'a', source_row + 1);
+			game_free(trans_game);
 			return;
 		}
 
@@ -621,58 +743,59 @@ void best_line_to_san(char *line, char *san) {
 
 }
 
-void parse_uci_buffer(void) {
+static void parse_uci_buffer(uci_engine *engine) {
 
 	char raw_buff[BUFSIZ];
 
 	memset(raw_buff, 0, BUFSIZ);
-	int nread = (int) read(uci_out, &raw_buff, BUFSIZ);
+	int nread = (int) read(engine->uci_out, &raw_buff, BUFSIZ);
 	if (nread < 1) {
 		fprintf(stderr, "ERROR: failed to read data from UCI Engine pipe\n");
 		usleep(1000000);
 		return;
 	}
-	uci_scanner__scan_bytes(raw_buff, nread);
+	uci_scanner_feed(engine->scanner, raw_buff, nread);
 //	debug("Read from UCI '%s'\n", raw_buff);
 	int i = 0;
 	while (i > -1) {
-		i = uci_scanner_lex();
+		i = uci_scanner_lex(engine->scanner);
+		char *text = uci_scanner_get_text(engine->scanner);
 		switch (i) {
 			case UCI_OK: {
-				set_uci_ok(true);
+				set_uci_ok(engine, true);
 				break;
 			}
 			case UCI_READY: {
-				set_uci_ready(true);
+				set_uci_ready(engine, true);
 				break;
 			}
 			case UCI_ID_NAME: {
-				debug("Got UCI Name: %s\n", uci_scanner_text);
-				strcpy(engine_name, uci_scanner_text + 8);
-				set_analysis_engine_name(engine_name);
+				debug("Got UCI Name: %s\n", text);
+				snprintf(engine->engine_name, sizeof(engine->engine_name), "%s", text + 8);
+				set_analysis_engine_name(engine->column, engine->engine_name);
 				break;
 			}
 			case UCI_ID_AUTHOR: {
-				debug("Got UCI Author: %s\n", uci_scanner_text);
+				debug("Got UCI Author: %s\n", text);
 				break;
 			}
 			case UCI_OPTION: {
-				parse_option(uci_scanner_text);
+				parse_option(text);
 				break;
 			}
 			case UCI_BEST_MOVE_NONE:
-				handle_move_after_stop();
+				handle_move_after_stop(engine);
 				break;
 			case UCI_BEST_MOVE_WITH_PONDER: {
-				parse_move_with_ponder(uci_scanner_text);
+				parse_move_with_ponder(engine, text);
 				break;
 			}
 			case UCI_BEST_MOVE: {
-				parse_move(uci_scanner_text);
+				parse_move(engine, text);
 				break;
 			}
 			case UCI_INFO: {
-				parse_info(uci_scanner_text);
+				parse_info(engine, text);
 				break;
 			}
 			case LINE_FEED:
@@ -683,34 +806,41 @@ void parse_uci_buffer(void) {
 	}
 }
 
-void *parse_uci_function(void *ignored) {
-	fprintf(stdout, "[parse UCI thread] - Starting UCI parser\n");
+static void *parse_uci_function(void *data) {
+	uci_engine *engine = data;
+	fprintf(stdout, "[parse UCI thread] - Starting UCI parser for engine %d\n", engine->index);
 
 	while (is_running_flag()) {
-		parse_uci_buffer();
+		parse_uci_buffer(engine);
 	}
 
-	fprintf(stdout, "[parse UCI thread] - Closing UCI parser\n");
+	fprintf(stdout, "[parse UCI thread] - Closing UCI parser for engine %d\n", engine->index);
 	return 0;
 }
 
-void write_to_uci(char *message) {
-	pthread_mutex_lock(&uci_writer_lock);
-	if (write(uci_in, message, strlen(message)) == -1) {
+static void write_to_engine(uci_engine *engine, char *message) {
+	pthread_mutex_lock(&engine->uci_writer_lock);
+	if (write(engine->uci_in, message, strlen(message)) == -1) {
 		perror("Failed to write to UCI engine ");
 	}
-	pthread_mutex_unlock(&uci_writer_lock);
-	debug("Wrote to UCI: '%s'", message);
+	pthread_mutex_unlock(&engine->uci_writer_lock);
+	debug("Wrote to UCI %d: '%s'", engine->index, message);
+}
+
+void write_to_uci(char *message) {
+	for (int i = 0; i < n_engines; i++) {
+		write_to_engine(engines[i], message);
+	}
 }
 
-static void wait_for_engine_ready(void) {
+static void wait_for_engine_ready(uci_engine *engine) {
 	struct timeval start, now, diff;
 
-	set_uci_ready(false);
-	write_to_uci("isready\n");
+	set_uci_ready(engine, false);
+	write_to_engine(engine, "isready\n");
 
 	gettimeofday(&start, NULL);
-	while (!is_uci_ready()) {
+	while (!is_uci_ready(engine)) {
 		usleep(10000);
 		gettimeofday(&now, NULL);
 		timersub(&now, &start, &diff);
@@ -721,82 +851,87 @@ static void wait_for_engine_ready(void) {
 	}
 }
 
-static void stop_and_wait(void) {
+static void stop_and_wait(uci_engine *engine) {
 	struct timeval start, now, diff;
 
-	set_stop_requested(true);
-	write_to_uci("stop\n");
+	set_stop_requested(engine, true);
+	write_to_engine(engine, "stop\n");
 
 	gettimeofday(&start, NULL);
-	while (is_stop_requested()) {
+	while (is_stop_requested(engine)) {
 		usleep(10000);
 		gettimeofday(&now, NULL);
 		timersub(&now, &start, &diff);
 		if (diff.tv_sec > STOP_TIMEOUT_SEC) {
 			printf("Ooops, UCI Engine did not stop in %d seconds will attempt to carry on anyway...\n", STOP_TIMEOUT_SEC);
-			set_analysing(false);
-			set_stop_requested(false);
+			set_analysing(engine, false);
+			set_stop_requested(engine, false);
 			break;
 		}
 	}
 }
 
-static void real_start_uci_analysis() {
+static void real_start_uci_analysis(uci_engine *engine) {
 	debug("Starting UCI analysis from UCI manager\n");
 
 	char moves[8192];
-	if (ply_num == 1) {
+	if (engine->ply_num == 1) {
 		sprintf(moves, "%s\n", "position startpos");
 	} else {
-		pthread_mutex_lock(&all_moves_lock);
-		sprintf(moves, "%s\n", all_moves);
-		pthread_mutex_unlock(&all_moves_lock);
+		pthread_mutex_lock(&engine->all_moves_lock);
+		sprintf(moves, "%s\n", engine->all_moves);
+		pthread_mutex_unlock(&engine->all_moves_lock);
 	}
-	if (is_analysing()) {
-		stop_and_wait();
+	if (is_analysing(engine)) {
+		stop_and_wait(engine);
 	}
-	wait_for_engine_ready();
-	write_to_uci(moves);
+	wait_for_engine_ready(engine);
+	write_to_engine(engine, moves);
 
 	char go[256];
-	if (uci_mode == ENGINE_ANALYSIS) {
+	if (engine->uci_mode == ENGINE_ANALYSIS) {
 		sprintf(go, "go infinite\n");
-		set_analysing(true);
+		set_analysing(engine, true);
 	} else {
 		sprintf(go, "go wtime %ld btime %ld\n", get_remaining_time(main_clock, 0),
 		        get_remaining_time(main_clock, 1));
 	}
-	write_to_uci(go);
+	write_to_engine(engine, go);
 }
 
-static void real_start_uci_game() {
+static void real_start_uci_game(uci_engine *engine) {
 	debug("Starting new game from UCI manager\n");
 
-	if (is_analysing()) {
-		stop_and_wait();
+	if (is_analysing(engine)) {
+		stop_and_wait(engine);
 	}
-	wait_for_engine_ready();
+	wait_for_engine_ready(engine);
+
+	set_analysing(engine, false);
 
-	set_analysing(false);
+	write_to_engine(engine, "ucinewgame\n");
+	wait_for_engine_ready(engine);
 
-	write_to_uci("ucinewgame\n");
-	wait_for_engine_ready();
+	if (!is_primary(engine)) {
+		// Analysis only engine, the primary engine decides who plays
+		return;
+	}
 
 	char go[256];
 	int relation;
-	switch (uci_mode) {
+	switch (engine->uci_mode) {
 		case ENGINE_WHITE:
 			play_vs_machine = true;
 			relation = -1;
-			start_game("You", engine_name, game_time, 0, relation, true);
+			start_game("You", engine->engine_name, engine->game_time, 0, relation, true);
 			// If engine is white, kick it now
 			sprintf(go, "position startpos\ngo wtime %ld btime %ld\n", get_remaining_time(main_clock, 0), get_remaining_time(main_clock, 1));
-			write_to_uci(go);
+			write_to_engine(engine, go);
 			break;
 		case ENGINE_BLACK:
 			play_vs_machine = true;
 			relation = 1;
-			start_game("You", engine_name, game_time, 0, relation, true);
+			start_game("You", engine->engine_name, engine->game_time, 0, relation, true);
 			break;
 		case ENGINE_ANALYSIS:
 			play_vs_machine = false;
@@ -806,11 +941,11 @@ static void real_start_uci_game() {
 	}
 }
 
-void process_uci_actions() {
+static void process_uci_actions(uci_engine *engine) {
 	char raw_buff[BUFSIZ];
 
 	memset(raw_buff, 0, BUFSIZ);
-	int nread = (int) read(uci_user_in[0], &raw_buff, BUFSIZ);
+	int nread = (int) read(engine->uci_user_in[0], &raw_buff, BUFSIZ);
 	if (nread < 1) {
 		perror("Failed to read data from UCI user pipe ");
 		return;
@@ -839,25 +974,26 @@ void process_uci_actions() {
 			analysis_requested = true;
 		} else {
 			if (analysis_requested) {
-				real_start_uci_analysis();
+				real_start_uci_analysis(engine);
 				analysis_requested = false;
 			}
 			if (!strcmp(START_NEW_GAME_TOKEN, token)) {
-				real_start_uci_game();
+				real_start_uci_game(engine);
 			}
 		}
 		token_count++;
 	}
 	if (analysis_requested) {
-		real_start_uci_analysis();
+		real_start_uci_analysis(engine);
 	}
 }
 
-void *uci_manager_function(void *ignored) {
+static void *uci_manager_function(void *data) {
+	uci_engine *engine = data;
 	fprintf(stdout, "[UCI manager thread] - Starting UCI manager\n");
 
 	while (is_running_flag()) {
-		process_uci_actions();
+		process_uci_actions(engine);
 	}
 
 	fprintf(stdout, "[UCI manager thread] - UCI manager terminated\n");
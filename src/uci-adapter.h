@@ -7,8 +7,10 @@ typedef enum {
 	ENGINE_BLACK
 } UCI_MODE;
 
+#define MAX_UCI_ENGINES 4
+
 void cleanup_uci(void);
-int spawn_uci_engine(bool brainfish);
+int spawn_uci_engine(const char *path);
 void write_to_uci(char *message);
 void user_move_to_uci(char *move, bool analyse);
 void start_new_uci_game(unsigned int time, UCI_MODE mode);
@@ -1,19 +1,24 @@
 #ifndef UCI_SCANNER_H_
 #define UCI_SCANNER_H_
 
+#include "scanner-input.h"
+
 #define YY_NO_INPUT
 
-int uci_scanner_lex(void);
-void uci_scanner_restart (FILE *input_file);
+/* The UCI scanner is reentrant, one instance per engine */
+int uci_scanner_lex(void *scanner);
+void uci_scanner_restart(FILE *input_file, void *scanner);
+char *uci_scanner_get_text(void *scanner);
+
+void *uci_scanner_create(scanner_input *input);
+void uci_scanner_destroy(void *scanner);
+void uci_scanner_feed(void *scanner, const char *bytes, int len);
 
 #ifndef YY_TYPEDEF_YY_SIZE_T
 #define YY_TYPEDEF_YY_SIZE_T
 typedef unsigned int yy_size_t;
 #endif
 
-extern int uci_scanner_leng;
-extern char *uci_scanner_text;
-
 enum _uci_match_type {
 	EOF_TYPE = -1,
 	UNMATCHED = 0,